@@ -21,6 +21,13 @@
 TCPSocket::TCPSocket() {
   tcpServer = nullptr;
   tcpClient = WiFiClient();
+  memset(&stats, 0, sizeof (stats));
+  update = nullptr;
+  updateSource = 0;
+  relayHost = nullptr;
+  relayPort = TCPSOCKET_PORT;
+  relayAttempted = false;
+  relayAttempt = 0;
 }
 
 TCPSocket::~TCPSocket() {
@@ -45,6 +52,14 @@ void TCPSocket::init(socket_addr_t _address,
   currentMsgID = 0;
   lastRecvSize = 0;
 
+  memset(&stats, 0, sizeof (stats));
+  update = nullptr;
+  updateSource = 0;
+  relayHost = nullptr;
+  relayPort = TCPSOCKET_PORT;
+  relayAttempted = false;
+  relayAttempt = 0;
+
   recvBufferSize = _recvBufferSize;
   recvBuffer = (uint8_t *)malloc(recvBufferSize);
   partialRecv = false;
@@ -57,7 +72,9 @@ void TCPSocket::init(socket_addr_t _address,
 }
 
 void TCPSocket::setup() {
-  tcpServer->begin();
+  if (!relayHost) {
+    tcpServer->begin();
+  }
 }
 
 boolean TCPSocket::initialized() {
@@ -84,9 +101,48 @@ bool TCPSocket::checkClient() {
   if (tcpClient) {
     return true;
   }
+  if (relayHost) {
+    return connectRelay();
+  }
   tcpClient = tcpServer->available();
   if (tcpClient) {
     DEBUG3_VALUELN("TCPS: Connection from ", tcpClient.remoteIP().toString());
+    stats.connections++;
+
+    /* A header held from a previous client doesn't apply to this one */
+    partialRecv = false;
+  }
+  return tcpClient;
+}
+
+/**
+ * Connect to the relay if the interval since the last attempt has passed,
+ * announcing this socket's address to it
+ *
+ * @return if connected
+ */
+bool TCPSocket::connectRelay() {
+  tcp_socket_hdr_t hdr;
+  unsigned long now = millis();
+
+  if (relayAttempted && now - relayAttempt < RECONNECT_INTERVAL) {
+    return false;
+  }
+  relayAttempted = true;
+  relayAttempt = now;
+
+  if (!tcpClient.connect(relayHost, relayPort, CONNECT_TIMEOUT)) {
+    DEBUG4_VALUELN("TCPS: relay connect failed ", relayHost);
+    return false;
+  }
+  DEBUG3_VALUELN("TCPS: Connected to relay ", relayHost);
+  tcpClient.setNoDelay(true);
+  stats.connections++;
+  partialRecv = false;
+
+  fillHeader(&hdr, SOCKET_ADDR_ANY, 0, TCPSOCKET_FLAG_ANNOUNCE);
+  if (tcpClient.write((uint8_t *)&hdr, sizeof (hdr)) != sizeof (hdr)) {
+    stats.sendErrors++;
   }
   return tcpClient;
 }
@@ -107,6 +163,17 @@ bool TCPSocket::validateHeader(tcp_socket_hdr_t *hdr) {
   return true;
 }
 
+void TCPSocket::fillHeader(tcp_socket_hdr_t *hdr, socket_addr_t address,
+                           byte length, byte flags) {
+  hdr->start = TCPSOCKET_START;
+  hdr->version = TCPSOCKET_VERSION;
+  hdr->ID = currentMsgID++;
+  hdr->length = length;
+  hdr->source = sourceAddress;
+  hdr->address = address;
+  hdr->flags = flags;
+}
+
 /**
  * Transmit a message
  */
@@ -123,19 +190,17 @@ void TCPSocket::sendMsgTo(socket_addr_t address,
 
   unsigned int msg_len = sizeof (tcp_socket_hdr_t) + datalength;
 
-  msg->hdr.start = TCPSOCKET_START;
-  msg->hdr.version = TCPSOCKET_VERSION;
-  msg->hdr.ID = currentMsgID++;
-  msg->hdr.length = datalength;
-  msg->hdr.source = sourceAddress;
-  msg->hdr.address = address;
-  msg->hdr.flags = 0;
+  fillHeader(&msg->hdr, address, datalength, 0);
 
   size_t result = tcpClient.write((uint8_t *)msg, msg_len);
+  stats.bytesSent += result;
   if (result != msg_len) {
     DEBUG3_VALUE("TCPS: under sent ", result);
     DEBUG3_VALUELN("<", msg_len);
+    stats.sendErrors++;
+    return;
   }
+  stats.msgsSent++;
 }
 
 const byte *TCPSocket::getMsg(unsigned int *retlen) {
@@ -157,11 +222,18 @@ const byte *TCPSocket::getMsg(socket_addr_t address, unsigned int *retlen) {
   uint32_t start;
   uint8_t *startbytes;
 
+  size_t updateReceived = 0;
+  tcp_socket_reply_t reply;
+
   if (!checkClient()) {
     /* No currently connected client */
     goto NO_RESULT;
   }
 
+  if (update && update->check(&reply)) {
+    sendUpdateReply(&reply);
+  }
+
   if (partialRecv) {
     /*
      * If the previous getMsg() call got a header but there was insufficient
@@ -173,7 +245,7 @@ const byte *TCPSocket::getMsg(socket_addr_t address, unsigned int *retlen) {
 
 START_VALUE:
   /* Read available data until we run out or find a start value */
-  if (tcpClient.available() < sizeof (tcp_socket_hdr_t)) {
+  if ((size_t)tcpClient.available() < sizeof (tcp_socket_hdr_t)) {
     goto NO_RESULT;
   }
 
@@ -220,7 +292,8 @@ HAVE_HEADER:
     goto ERROR_OUT;
   }
 
-  if (hdr->length > recvBufferSize - sizeof (tcp_socket_hdr_t)) {
+  if (!(hdr->flags & TCPSOCKET_FLAG_UPDATE) &&
+      hdr->length > recvBufferSize - sizeof (tcp_socket_hdr_t)) {
     DEBUG4_VALUELN("TCPS: hdr.len > buf sz ", hdr->length);
     goto ERROR_OUT;
   }
@@ -239,6 +312,23 @@ HAVE_HEADER:
 
   partialRecv = false;
 
+  if (hdr->flags & TCPSOCKET_FLAG_ANNOUNCE) {
+    /* Only of use to a relay */
+    for (byte i = 0; i < hdr->length; i++) {
+      tcpClient.read();
+    }
+    goto START_VALUE;
+  }
+
+  if (hdr->flags & TCPSOCKET_FLAG_UPDATE) {
+    /* Handle every update frame that has arrived, up to the limit */
+    updateReceived += receiveUpdate(hdr);
+    if (updateReceived < MAX_UPDATE_RECEIVE) {
+      goto START_VALUE;
+    }
+    goto NO_RESULT;
+  }
+
   /* Read the message data */
   result = tcpClient.read(msg->data, hdr->length);
   if (result != hdr->length) {
@@ -247,6 +337,9 @@ HAVE_HEADER:
     goto ERROR_OUT;
   }
 
+  stats.bytesReceived += sizeof (tcp_socket_hdr_t) + result;
+  stats.msgsReceived++;
+
   DEBUG5_VALUE("TCPS: data len=", result);
   DEBUG5_COMMAND(
           print_hex_buffer((const char *)msg->data, hdr->length);
@@ -261,14 +354,70 @@ HAVE_HEADER:
 
   DEBUG5_VALUE("TCPS: address mismatch: ", address);
   DEBUG5_VALUELN("!=", hdr->address);
+  goto NO_RESULT;
 
 ERROR_OUT:
+  stats.recvErrors++;
 
 NO_RESULT:
   *retlen = 0;
   return nullptr;
 }
 
+/**
+ * Read an update frame's data and pass it to the update handler, sending back
+ * any reply.  The frame is dropped if updates aren't being taken.
+ *
+ * @return Bytes of the frame read
+ */
+size_t TCPSocket::receiveUpdate(tcp_socket_hdr_t *hdr) {
+  int result;
+  tcp_socket_reply_t reply;
+
+  if (!update) {
+    DEBUG4_PRINTLN("TCPS: update frame dropped");
+    for (byte i = 0; i < hdr->length; i++) {
+      tcpClient.read();
+    }
+    return sizeof (tcp_socket_hdr_t) + hdr->length;
+  }
+
+  result = tcpClient.read(update->buffer(), hdr->length);
+  if (result != hdr->length) {
+    /* The update notices the frame missing from its sequence */
+    DEBUG4_VALUE("TCPS: update recv < hdr.len", result);
+    DEBUG4_VALUELN("<", hdr->length);
+    stats.recvErrors++;
+    return sizeof (tcp_socket_hdr_t) + hdr->length;
+  }
+  stats.bytesReceived += sizeof (tcp_socket_hdr_t) + result;
+
+  updateSource = hdr->source;
+  if (update->frame(hdr->flags, hdr->ID, hdr->length, &reply)) {
+    sendUpdateReply(&reply);
+  }
+  return sizeof (tcp_socket_hdr_t) + hdr->length;
+}
+
+void TCPSocket::sendUpdateReply(const tcp_socket_reply_t *reply) {
+  struct __attribute__((__packed__)) {
+    tcp_socket_hdr_t   hdr;
+    tcp_socket_reply_t reply;
+  } msg;
+
+  fillHeader(&msg.hdr, updateSource, sizeof (msg.reply),
+             TCPSOCKET_FLAG_UPDATE | TCPSOCKET_UPDATE_ACK);
+  msg.reply = *reply;
+
+  size_t result = tcpClient.write((uint8_t *)&msg, sizeof (msg));
+  stats.bytesSent += result;
+  if (result != sizeof (msg)) {
+    DEBUG3_VALUE("TCPS: update reply under sent ", result);
+    DEBUG3_VALUELN("<", sizeof (msg));
+    stats.sendErrors++;
+  }
+}
+
 byte TCPSocket::getLength() {
   return lastRecvSize;
 }
@@ -289,6 +438,20 @@ bool TCPSocket::connected() {
   return checkClient();
 }
 
+const tcp_socket_stats_t *TCPSocket::getStats() {
+  return &stats;
+}
+
+void TCPSocket::useUpdates(TCPSocketFrameHandler *_update) {
+  update = _update;
+}
+
+void TCPSocket::connectTo(const char *_host, uint16_t _port) {
+  relayHost = _host;
+  relayPort = _port;
+  relayAttempted = false;
+}
+
 void TCPSocket::printHeader(tcp_socket_hdr_t *hdr, bool dump) {
   DEBUG3_HEXVAL("TCPS: hdr start:", hdr->start);
   DEBUG3_VALUE(" ver:", hdr->version);
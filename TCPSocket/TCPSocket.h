@@ -7,6 +7,13 @@
  * https://github.com/AMPWorks/ArduinoLibs/blob/master/Socket/Socket.h)
  *
  * This is for compatibility with existing code that uses the Socket API.
+ *
+ * Firmware updates can also be taken over the connection, in frames that
+ * getMsg() passes to a TCPSocketFrameHandler rather than returns.  See
+ * TCPSocketUpdate, which takes them with WiFiBase's OTAReceiver.
+ *
+ * Rather than accepting a connection the socket can connect out to a
+ * TCPSocketRelay, which passes messages between all the nodes connected to it.
  */
 
 #ifndef TCPSOCKET_H
@@ -24,11 +31,57 @@ typedef struct __attribute__((__packed__)) {
   byte          version;     // 1B
   byte          ID;          // 1B
   byte          length;      // 1B
-  byte          flags;       // 1B
+  byte          flags;       // 1B, TCPSOCKET_FLAG_*
   socket_addr_t source;      // 2B
   socket_addr_t address;     // 2B
 } tcp_socket_hdr_t;  // Total: 12B
 
+/* Names the source to a relay as the socket connects, carrying no message */
+#define TCPSOCKET_FLAG_ANNOUNCE 0x20
+
+#define TCPSOCKET_FLAG_UPDATE 0x80  // The frame is part of an update
+#define TCPSOCKET_FLAG_MORE   0x40  // The message continues in the next frame
+#define TCPSOCKET_UPDATE_MASK 0x0F  // The update message, tcp_socket_update_t
+
+typedef enum {
+  TCPSOCKET_UPDATE_START = 1,  // ota_header_t, from the sender
+  TCPSOCKET_UPDATE_DATA,       // The payload, from the sender
+  TCPSOCKET_UPDATE_ACK,        // tcp_socket_reply_t, from the node
+} tcp_socket_update_t;
+
+/* Reply sent back in an UPDATE_ACK, laid out as WiFiBase's ota_reply_t */
+typedef struct __attribute__((__packed__)) {
+  uint32_t magic;
+  uint8_t  status;
+  uint8_t  error;
+  uint8_t  reserved[2];
+  uint32_t offset;
+} tcp_socket_reply_t;  // Total: 12B
+
+/*
+ * Takes the frames of an update from a TCPSocket
+ */
+class TCPSocketFrameHandler {
+  public:
+    virtual ~TCPSocketFrameHandler() {}
+
+    /* Where the TCPSocket reads a frame's data, holding at least 255 bytes */
+    virtual uint8_t *buffer() = 0;
+
+    /*
+     * Handle a frame whose data is in the buffer
+     * @return true if the reply is to be sent back
+     */
+    virtual bool frame(uint8_t flags, uint8_t id, uint8_t length,
+                       tcp_socket_reply_t *reply) = 0;
+
+    /*
+     * Called on each getMsg(), such as to give up on a quiet sender
+     * @return true if the reply is to be sent back
+     */
+    virtual bool check(tcp_socket_reply_t *reply) = 0;
+};
+
 typedef struct {
   tcp_socket_hdr_t hdr;
   byte             data[];
@@ -40,6 +93,17 @@ typedef struct {
 
 #define TCPSOCKET_PORT 4081
 
+/* Running totals, which can be registered with WiFiBase's /metrics */
+typedef struct {
+  uint32_t connections;
+  uint32_t msgsSent;
+  uint32_t msgsReceived;
+  uint32_t bytesSent;
+  uint32_t bytesReceived;
+  uint32_t sendErrors;
+  uint32_t recvErrors;
+} tcp_socket_stats_t;
+
 
 class TCPSocket : public Socket {
 
@@ -73,6 +137,24 @@ public:
   socket_addr_t destFromData(void *data);
 
   bool connected();
+  const tcp_socket_stats_t *getStats();
+
+  /*
+   * Pass update frames to the handler, and send back its replies.  All update
+   * frames that have arrived are handled on each getMsg() call, up to
+   * MAX_UPDATE_RECEIVE bytes.
+   */
+  void useUpdates(TCPSocketFrameHandler *update);
+
+  /*
+   * Connect to a relay instead of accepting a connection, reconnecting at
+   * most every RECONNECT_INTERVAL.  Must be called before setup().  Each
+   * attempt blocks getMsg() or sendMsgTo() for up to CONNECT_TIMEOUT, and the
+   * host should be an IP address as a name is resolved with a blocking lookup.
+   */
+  static const unsigned long RECONNECT_INTERVAL = 5 * 1000;
+  static const int32_t CONNECT_TIMEOUT = 250;  // ms
+  void connectTo(const char *_host, uint16_t _port = TCPSOCKET_PORT);
 
 private:
   WiFiServer *tcpServer;
@@ -85,8 +167,24 @@ private:
   byte lastRecvSize;
   bool partialRecv;
 
+  tcp_socket_stats_t stats;
+
+  static const size_t MAX_UPDATE_RECEIVE = 16 * 1024;
+  TCPSocketFrameHandler *update;
+  socket_addr_t updateSource;
+
+  const char *relayHost;
+  uint16_t relayPort;
+  bool relayAttempted;
+  unsigned long relayAttempt;
+
   bool checkClient();
+  bool connectRelay();
   bool validateHeader(tcp_socket_hdr_t *hdr);
+  void fillHeader(tcp_socket_hdr_t *hdr, socket_addr_t address,
+                  byte length, byte flags);
+  size_t receiveUpdate(tcp_socket_hdr_t *hdr);
+  void sendUpdateReply(const tcp_socket_reply_t *reply);
   void printHeader(tcp_socket_hdr_t *hdr, bool dump = false);
 };
 
@@ -0,0 +1,348 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ */
+
+#include <WiFi.h>
+#include <WiFiServer.h>
+
+#ifdef DEBUG_LEVEL_TCPSOCKET
+  #define DEBUG_LEVEL DEBUG_LEVEL_TCPSOCKET
+#endif
+#ifndef DEBUG_LEVEL
+  #define DEBUG_LEVEL DEBUG_HIGH
+#endif
+#include <Debug.h>
+
+#include "TCPSocketRelay.h"
+
+TCPSocketRelay::TCPSocketRelay(uint16_t port) {
+  _server = new WiFiServer(port, MAX_CLIENTS);
+  for (uint8_t i = 0; i < NUM_LINKS; i++) {
+    _links[i].buffer = nullptr;
+    _links[i].used = 0;
+  }
+  _numRoutes = 0;
+  _uplinkHost = nullptr;
+  _uplinkPort = TCPSOCKET_PORT;
+  _uplinkAttempted = false;
+  _uplinkAttempt = 0;
+  memset(&_stats, 0, sizeof (_stats));
+}
+
+TCPSocketRelay::~TCPSocketRelay() {
+  for (uint8_t i = 0; i < NUM_LINKS; i++) {
+    _close(i);
+  }
+  _server->stop();
+  delete _server;
+}
+
+void TCPSocketRelay::setup() {
+  _server->begin();
+}
+
+void TCPSocketRelay::useUplink(const char *host, uint16_t port) {
+  _uplinkHost = host;
+  _uplinkPort = port;
+  _uplinkAttempted = false;
+}
+
+void TCPSocketRelay::handle() {
+  _accept();
+  _checkUplink();
+
+  for (uint8_t i = 0; i < NUM_LINKS; i++) {
+    _receive(i);
+  }
+}
+
+uint8_t TCPSocketRelay::clients() {
+  uint8_t count = 0;
+  for (uint8_t i = 0; i < MAX_CLIENTS; i++) {
+    if (_links[i].buffer) {
+      count++;
+    }
+  }
+  return count;
+}
+
+uint8_t TCPSocketRelay::routes() {
+  return _numRoutes;
+}
+
+bool TCPSocketRelay::uplinkConnected() {
+  return (_links[UPLINK].buffer != nullptr);
+}
+
+const tcp_relay_stats_t *TCPSocketRelay::getStats() {
+  return &_stats;
+}
+
+/**
+ * Take a connection on a link
+ * @return false if its buffer couldn't be allocated
+ */
+bool TCPSocketRelay::_open(uint8_t index, WiFiClient client) {
+  tcp_relay_link_t *link = &_links[index];
+
+  link->buffer = (uint8_t *)malloc(BUFFER_SIZE);
+  if (!link->buffer) {
+    DEBUG_ERR("TCPR: alloc failure");
+    client.stop();
+    return false;
+  }
+  link->client = client;
+  link->client.setNoDelay(true);
+  link->used = 0;
+  return true;
+}
+
+void TCPSocketRelay::_close(uint8_t index) {
+  tcp_relay_link_t *link = &_links[index];
+
+  if (!link->buffer) {
+    return;
+  }
+  link->client.stop();
+  free(link->buffer);
+  link->buffer = nullptr;
+  link->used = 0;
+  _forget(index);
+}
+
+void TCPSocketRelay::_accept() {
+  WiFiClient client;
+
+  while ((client = _server->available())) {
+    uint8_t index = 0;
+    while (index < MAX_CLIENTS && _links[index].buffer) {
+      index++;
+    }
+    if (index == MAX_CLIENTS) {
+      DEBUG3_PRINTLN("TCPR: too many clients");
+      client.stop();
+      _stats.refused++;
+      continue;
+    }
+
+    if (_open(index, client)) {
+      DEBUG3_VALUE("TCPR: client ", index);
+      DEBUG3_VALUELN(" from ", client.remoteIP().toString());
+      _stats.connections++;
+    }
+  }
+}
+
+/**
+ * Connect to the parent once the retry interval has passed since the last
+ * attempt, and announce the local addresses to it
+ */
+void TCPSocketRelay::_checkUplink() {
+  tcp_relay_link_t *link = &_links[UPLINK];
+
+  if (!_uplinkHost) {
+    return;
+  }
+  if (link->buffer) {
+    if (link->client.connected()) {
+      return;
+    }
+    DEBUG3_PRINTLN("TCPR: uplink lost");
+    _close(UPLINK);
+  }
+
+  unsigned long now = millis();
+  if (_uplinkAttempted && now - _uplinkAttempt < UPLINK_RETRY) {
+    return;
+  }
+  _uplinkAttempted = true;
+  _uplinkAttempt = now;
+
+  WiFiClient client;
+  if (!client.connect(_uplinkHost, _uplinkPort, CONNECT_TIMEOUT) ||
+      !_open(UPLINK, client)) {
+    DEBUG4_VALUELN("TCPR: uplink failed ", _uplinkHost);
+    return;
+  }
+  DEBUG3_VALUELN("TCPR: uplink to ", _uplinkHost);
+  _stats.uplinkConnects++;
+
+  for (uint8_t i = 0; i < _numRoutes; i++) {
+    _announce(_routes[i].address);
+  }
+}
+
+/**
+ * Read what has arrived on a link and forward each complete frame from the
+ * buffer, keeping any remainder for the next call
+ */
+void TCPSocketRelay::_receive(uint8_t index) {
+  tcp_relay_link_t *link = &_links[index];
+
+  if (!link->buffer) {
+    return;
+  }
+  if (!link->client.connected()) {
+    DEBUG3_VALUELN("TCPR: closed ", index);
+    _close(index);
+    return;
+  }
+
+  int available = link->client.available();
+  if (available <= 0) {
+    return;
+  }
+  size_t space = BUFFER_SIZE - link->used;
+  int result = link->client.read(link->buffer + link->used,
+                                 ((size_t)available < space) ? available : space);
+  if (result <= 0) {
+    return;
+  }
+  link->used += result;
+
+  size_t offset = 0;
+  while (link->used - offset >= sizeof (tcp_socket_hdr_t)) {
+    tcp_socket_hdr_t *hdr = (tcp_socket_hdr_t *)(link->buffer + offset);
+    if (hdr->start != TCPSOCKET_START || hdr->version != TCPSOCKET_VERSION) {
+      /* Look for the start of a frame at the next byte */
+      _stats.recvErrors++;
+      offset++;
+      continue;
+    }
+
+    size_t size = sizeof (tcp_socket_hdr_t) + hdr->length;
+    if (link->used - offset < size) {
+      break;
+    }
+    _route(index, link->buffer + offset, size);
+    offset += size;
+  }
+
+  link->used -= offset;
+  memmove(link->buffer, link->buffer + offset, link->used);
+}
+
+void TCPSocketRelay::_route(uint8_t from, const uint8_t *frame, size_t size) {
+  const tcp_socket_hdr_t *hdr = (const tcp_socket_hdr_t *)frame;
+
+  _learn(hdr->source, from);
+
+  if (hdr->flags & TCPSOCKET_FLAG_ANNOUNCE) {
+    /* Only the parent needs to hear of local addresses */
+    if (from != UPLINK && _links[UPLINK].buffer) {
+      _send(UPLINK, frame, size);
+    }
+    return;
+  }
+
+  uint8_t to = (hdr->address == SOCKET_ADDR_ANY) ? LINK_NONE :
+               _lookup(hdr->address);
+  if (to == from) {
+    _stats.framesDropped++;
+    return;
+  }
+
+  _stats.framesRelayed++;
+  if (to != LINK_NONE) {
+    _send(to, frame, size);
+  } else if (hdr->address != SOCKET_ADDR_ANY && from != UPLINK &&
+             _links[UPLINK].buffer) {
+    /* The parent routes destinations not known here */
+    _send(UPLINK, frame, size);
+  } else {
+    if (hdr->address != SOCKET_ADDR_ANY) {
+      _stats.framesFlooded++;
+    }
+    _flood(from, frame, size);
+  }
+}
+
+void TCPSocketRelay::_flood(uint8_t from, const uint8_t *frame, size_t size) {
+  for (uint8_t i = 0; i < NUM_LINKS; i++) {
+    if (i != from && _links[i].buffer) {
+      _send(i, frame, size);
+    }
+  }
+}
+
+void TCPSocketRelay::_send(uint8_t to, const uint8_t *frame, size_t size) {
+  size_t result = _links[to].client.write(frame, size);
+  _stats.bytesRelayed += result;
+  if (result != size) {
+    DEBUG3_VALUE("TCPR: under sent ", result);
+    DEBUG3_VALUELN("<", size);
+    _stats.sendErrors++;
+    _close(to);
+  }
+}
+
+void TCPSocketRelay::_announce(socket_addr_t address) {
+  tcp_socket_hdr_t hdr;
+
+  if (!_links[UPLINK].buffer || _lookup(address) == UPLINK) {
+    return;
+  }
+  hdr.start = TCPSOCKET_START;
+  hdr.version = TCPSOCKET_VERSION;
+  hdr.ID = 0;
+  hdr.length = 0;
+  hdr.flags = TCPSOCKET_FLAG_ANNOUNCE;
+  hdr.source = address;
+  hdr.address = SOCKET_ADDR_ANY;
+  _send(UPLINK, (const uint8_t *)&hdr, sizeof (hdr));
+}
+
+/**
+ * Record the link an address was seen on, replacing the least recently seen
+ * route if the table is full
+ */
+void TCPSocketRelay::_learn(socket_addr_t address, uint8_t link) {
+  unsigned long now = millis();
+  uint8_t index = 0;
+
+  if (address == SOCKET_ADDR_ANY) {
+    return;
+  }
+
+  for (uint8_t i = 0; i < _numRoutes; i++) {
+    if (_routes[i].address == address) {
+      _routes[i].link = link;
+      _routes[i].seen = now;
+      return;
+    }
+    if (now - _routes[i].seen > now - _routes[index].seen) {
+      index = i;
+    }
+  }
+
+  if (_numRoutes < MAX_ROUTES) {
+    index = _numRoutes++;
+  }
+  DEBUG4_VALUE("TCPR: learned ", address);
+  DEBUG4_VALUELN(" on ", link);
+  _routes[index].address = address;
+  _routes[index].link = link;
+  _routes[index].seen = now;
+}
+
+uint8_t TCPSocketRelay::_lookup(socket_addr_t address) {
+  for (uint8_t i = 0; i < _numRoutes; i++) {
+    if (_routes[i].address == address) {
+      return _routes[i].link;
+    }
+  }
+  return LINK_NONE;
+}
+
+/* Drop the routes of a link that has closed */
+void TCPSocketRelay::_forget(uint8_t link) {
+  uint8_t kept = 0;
+  for (uint8_t i = 0; i < _numRoutes; i++) {
+    if (_routes[i].link != link) {
+      _routes[kept++] = _routes[i];
+    }
+  }
+  _numRoutes = kept;
+}
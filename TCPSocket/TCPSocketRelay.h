@@ -0,0 +1,124 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Relays TCPSocket frames between the nodes connected to a hub.
+ *
+ * Design:
+ *   A TCPSocket only talks to the one peer connected to it, so nodes sharing
+ * a hub's access point can't message each other directly.  Instead each node
+ * connects out to the relay, see TCPSocket::connectTo(), and the relay passes
+ * frames between them like a learning switch.  The source of every frame
+ * received is recorded against the link it arrived on, and a frame is sent on
+ * to the link its destination was learned on, or to every other link when
+ * the destination is SOCKET_ADDR_ANY or not yet known.  A node announces
+ * itself as it connects with a TCPSOCKET_FLAG_ANNOUNCE frame, so that it is
+ * known before it has sent anything.
+ *
+ *   Frames are received into a buffer per link and each complete frame is
+ * written on straight from that buffer, header and all, so nothing is copied
+ * or re-serialized and update frames keep the IDs they are sequenced by.
+ *
+ *   The relay can also be connected to a parent, such as the relay of the
+ * network the hub's station joins.  Frames for destinations not known locally
+ * go up to the parent rather than being flooded, frames from the parent are
+ * routed among the local links, and the local addresses are announced to the
+ * parent so that it routes their frames down.  The connection is remade
+ * UPLINK_RETRY after it is lost, each attempt blocking handle() for up to
+ * CONNECT_TIMEOUT.  Relays must only be connected as a tree.
+ *
+ *   Writes block as they do for the TCPSocket, so a node that stops reading
+ * holds up the relay until its connection fails.
+ */
+
+#ifndef TCPSOCKETRELAY_H
+#define TCPSOCKETRELAY_H
+
+#include <WiFiServer.h>
+#include <WiFiClient.h>
+
+#include "TCPSocket.h"
+
+/* Running totals, which can be registered with WiFiBase's /metrics */
+typedef struct {
+  uint32_t connections;
+  uint32_t refused;        // Connections beyond MAX_CLIENTS
+  uint32_t framesRelayed;  // Frames sent on, once however many links they went to
+  uint32_t framesFlooded;  // Sent to every link, the destination not being known
+  uint32_t framesDropped;  // Whose destination is behind the link they came from
+  uint32_t bytesRelayed;   // Written, counting each copy
+  uint32_t recvErrors;     // Bytes skipped to find the start of a frame
+  uint32_t sendErrors;
+  uint32_t uplinkConnects;
+} tcp_relay_stats_t;
+
+typedef struct {
+  WiFiClient client;
+  uint8_t    *buffer;  // Allocated while connected
+  size_t     used;
+} tcp_relay_link_t;
+
+typedef struct {
+  socket_addr_t address;
+  uint8_t       link;
+  unsigned long seen;    // ms, the least recently seen is replaced first
+} tcp_relay_route_t;
+
+class TCPSocketRelay {
+  public:
+    static const uint8_t MAX_CLIENTS = 8;
+    static const uint8_t MAX_ROUTES = 32;
+    static const size_t BUFFER_SIZE = 1024;  // Per link, a few full frames
+    static const unsigned long UPLINK_RETRY = 5 * 1000;
+    static const int32_t CONNECT_TIMEOUT = 250;  // ms, of the uplink
+
+    TCPSocketRelay(uint16_t port = TCPSOCKET_PORT);
+    ~TCPSocketRelay();
+
+    void setup();
+
+    /* Pass frames for unknown destinations to a parent relay */
+    void useUplink(const char *host, uint16_t port = TCPSOCKET_PORT);
+
+    /* Accept, receive and forward whatever has arrived */
+    void handle();
+
+    uint8_t clients();
+    uint8_t routes();
+    bool uplinkConnected();
+    const tcp_relay_stats_t *getStats();
+
+  protected:
+    static const uint8_t UPLINK = MAX_CLIENTS;  // Index of the parent's link
+    static const uint8_t NUM_LINKS = MAX_CLIENTS + 1;
+    static const uint8_t LINK_NONE = (uint8_t)-1;
+
+    WiFiServer *_server;
+    tcp_relay_link_t _links[NUM_LINKS];
+    tcp_relay_route_t _routes[MAX_ROUTES];
+    uint8_t _numRoutes;
+
+    const char *_uplinkHost;
+    uint16_t _uplinkPort;
+    bool _uplinkAttempted;
+    unsigned long _uplinkAttempt;
+
+    tcp_relay_stats_t _stats;
+
+    bool _open(uint8_t index, WiFiClient client);
+    void _close(uint8_t index);
+    void _accept();
+    void _checkUplink();
+    void _receive(uint8_t index);
+    void _route(uint8_t from, const uint8_t *frame, size_t size);
+    void _flood(uint8_t from, const uint8_t *frame, size_t size);
+    void _send(uint8_t to, const uint8_t *frame, size_t size);
+    void _announce(socket_addr_t address);
+
+    void _learn(socket_addr_t address, uint8_t link);
+    uint8_t _lookup(socket_addr_t address);
+    void _forget(uint8_t link);
+};
+
+#endif // TCPSOCKETRELAY_H
@@ -0,0 +1,186 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ */
+
+#include <string.h>
+
+#ifdef ARDUINO
+  #include <Arduino.h>
+#else
+  #include <time.h>
+#endif
+
+#include "TCPSocketUpdate.h"
+
+/* The reply is sent as the ota_reply_t a sender to an OTAServer expects */
+static_assert(sizeof (tcp_socket_reply_t) == sizeof (ota_reply_t),
+              "tcp_socket_reply_t must match ota_reply_t");
+
+TCPSocketUpdate::TCPSocketUpdate(OTAReceiver *receiver) {
+  _receiver = receiver;
+  _headerUsed = 0;
+  _active = false;
+  _nextId = 0;
+  _payloadReceived = 0;
+  _acked = 0;
+  _lastActive = 0;
+  _complete = false;
+  _updates = 0;
+  _failures = 0;
+}
+
+uint8_t *TCPSocketUpdate::buffer() {
+  return _buffer;
+}
+
+bool TCPSocketUpdate::frame(uint8_t flags, uint8_t id, uint8_t length,
+                            tcp_socket_reply_t *reply) {
+  bool more = (flags & TCPSOCKET_FLAG_MORE);
+  _lastActive = _millis();
+
+  switch (flags & TCPSOCKET_UPDATE_MASK) {
+    case TCPSOCKET_UPDATE_START:
+      if (_headerUsed == 0 && _active) {
+        /* The sender is starting over, such as after reconnecting */
+        _receiver->abort(OTA_ERR_INCOMPLETE);
+        _active = false;
+        _failures++;
+      }
+      if (_headerUsed + length > sizeof (_header)) {
+        _headerUsed = 0;
+        _payloadReceived = 0;
+        return _fail(OTA_ERR_PROTOCOL, reply);
+      }
+      memcpy((uint8_t *)&_header + _headerUsed, _buffer, length);
+      _headerUsed += length;
+      _nextId = id + 1;
+      return more ? false : _start(reply);
+
+    case TCPSOCKET_UPDATE_DATA:
+      /* Anything left of an update that already failed is dropped */
+      if (!_active) {
+        return false;
+      }
+      if (id != _nextId++) {
+        return _fail(OTA_ERR_PROTOCOL, reply);
+      }
+      return _data(more, length, reply);
+
+    default:
+      return false;
+  }
+}
+
+bool TCPSocketUpdate::check(tcp_socket_reply_t *reply) {
+  if (_active && _millis() - _lastActive > IDLE_TIMEOUT) {
+    return _fail(OTA_ERR_TIMEOUT, reply);
+  }
+  return false;
+}
+
+bool TCPSocketUpdate::active() {
+  return _active;
+}
+
+bool TCPSocketUpdate::complete() {
+  return _complete;
+}
+
+uint32_t TCPSocketUpdate::updates() {
+  return _updates;
+}
+
+uint32_t TCPSocketUpdate::failures() {
+  return _failures;
+}
+
+/**
+ * Check the header and start receiving the image it describes
+ */
+bool TCPSocketUpdate::_start(tcp_socket_reply_t *reply) {
+  _headerUsed = 0;
+  _payloadReceived = 0;
+
+  if (_header.magic != OTA_MAGIC || _header.version != OTA_VERSION ||
+      _header.type != OTA_TYPE_FULL ||
+      _header.payloadSize != _header.imageSize) {
+    return _fail(OTA_ERR_PROTOCOL, reply);
+  }
+
+  bool resume = (_header.flags & OTA_FLAG_RESUME);
+  if (!_receiver->begin(_header.imageSize, _header.sha256, resume)) {
+    return _fail(_receiver->error(), reply);
+  }
+
+  _active = true;
+  _complete = false;
+  _payloadReceived = _receiver->received();
+  _acked = _payloadReceived;
+  return _reply(OTA_REPLY_READY, OTA_ERR_NONE, reply);
+}
+
+/**
+ * Pass on a frame of the payload, acking every ACK_INTERVAL and finishing
+ * with the frame that ends the message
+ */
+bool TCPSocketUpdate::_data(bool more, uint8_t length,
+                            tcp_socket_reply_t *reply) {
+  uint32_t received = _payloadReceived + length;
+  if (received > _header.payloadSize ||
+      more == (received == _header.payloadSize)) {
+    return _fail(OTA_ERR_PROTOCOL, reply);
+  }
+
+  _receiver->write(_buffer, length);
+  if (_receiver->state() != OTA_RECEIVING) {
+    return _fail(_receiver->error(), reply);
+  }
+  _payloadReceived = received;
+
+  if (!more) {
+    if (!_receiver->finish()) {
+      return _fail(_receiver->error(), reply);
+    }
+    _active = false;
+    _complete = true;
+    _updates++;
+    return _reply(OTA_REPLY_OK, OTA_ERR_NONE, reply);
+  }
+
+  if (_payloadReceived - _acked >= ACK_INTERVAL) {
+    _acked = _payloadReceived;
+    return _reply(OTA_REPLY_READY, OTA_ERR_NONE, reply);
+  }
+  return false;
+}
+
+bool TCPSocketUpdate::_fail(uint8_t error, tcp_socket_reply_t *reply) {
+  if (_receiver->state() == OTA_RECEIVING) {
+    _receiver->abort(error);
+  }
+  _active = false;
+  _failures++;
+  return _reply(OTA_REPLY_ERROR, error, reply);
+}
+
+bool TCPSocketUpdate::_reply(uint8_t status, uint8_t error,
+                             tcp_socket_reply_t *reply) {
+  memset(reply, 0, sizeof (*reply));
+  reply->magic = OTA_MAGIC;
+  reply->status = status;
+  reply->error = error;
+  reply->offset = _payloadReceived;
+  return true;
+}
+
+unsigned long TCPSocketUpdate::_millis() {
+#ifdef ARDUINO
+  return millis();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
@@ -0,0 +1,104 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Receives firmware images carried in TCPSocket frames.
+ *
+ * Design:
+ *   Nodes that only run a TCPSocket take updates over the same connection as
+ * their messages.  Frames with TCPSOCKET_FLAG_UPDATE set belong to an update
+ * and are passed here by the TCPSocket rather than returned from getMsg(),
+ * with the low bits of the flags giving the update message carried.  A
+ * message longer than a frame's one byte length is chunked across frames,
+ * with TCPSOCKET_FLAG_MORE set on all but the last, and the frames of an
+ * update carry consecutive IDs, numbered apart from other messages, so that
+ * any frame lost is noticed.
+ *
+ *   The sender starts with an ota_header_t in an UPDATE_START message, as it
+ * would push to an OTAServer, and is answered with an ota_reply_t in an
+ * UPDATE_ACK.  READY gives the offset to send the payload from, which is
+ * non-zero when OTA_FLAG_RESUME continues an interrupted image.  The payload
+ * follows as a single UPDATE_DATA message, acked READY with the bytes
+ * received every ACK_INTERVAL, and then OK once the image is verified or
+ * ERROR at any point it fails.
+ *
+ *   The sender keeps at most WINDOW bytes beyond the last ack outstanding, so
+ * it never stops to wait for an ack while the node keeps up, yet never runs
+ * far ahead of what the node has taken.  With the TCPSocket handling every
+ * update frame that has arrived on each call, the payload moves at the link
+ * rate however small the frames.
+ *
+ *   The payload is passed to an OTAReceiver, which writes and verifies the
+ * image just as for one pushed to an OTAServer.  Only full images are taken.
+ */
+
+#ifndef TCPSOCKETUPDATE_H
+#define TCPSOCKETUPDATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "TCPSocket.h"
+#include "OTAReceiver.h"
+#include "OTAServer.h"
+
+class TCPSocketUpdate : public TCPSocketFrameHandler {
+  public:
+    static const size_t FRAME_DATA = 255;
+    static const uint32_t ACK_INTERVAL = 4096;
+    static const uint32_t WINDOW = 4 * ACK_INTERVAL;
+    static const unsigned long IDLE_TIMEOUT = 10 * 1000;
+
+    TCPSocketUpdate(OTAReceiver *receiver);
+
+    /* Where the TCPSocket reads an update frame's data */
+    uint8_t *buffer();
+
+    /*
+     * Handle an update frame whose data is in the buffer
+     * @return true if the reply is to be sent back
+     */
+    bool frame(uint8_t flags, uint8_t id, uint8_t length,
+               tcp_socket_reply_t *reply);
+
+    /*
+     * Give up on an update whose sender has gone quiet
+     * @return true if the reply is to be sent back
+     */
+    bool check(tcp_socket_reply_t *reply);
+
+    /* Whether an image is being received */
+    bool active();
+
+    /* An image has been verified and activated, and awaits a restart */
+    bool complete();
+
+    uint32_t updates();
+    uint32_t failures();
+
+  protected:
+    OTAReceiver *_receiver;
+    uint8_t _buffer[FRAME_DATA];
+
+    ota_header_t _header;
+    size_t _headerUsed;
+    bool _active;
+    uint8_t _nextId;
+    uint32_t _payloadReceived;
+    uint32_t _acked;
+
+    unsigned long _lastActive;
+    bool _complete;
+    uint32_t _updates;
+    uint32_t _failures;
+
+    bool _start(tcp_socket_reply_t *reply);
+    bool _data(bool more, uint8_t length, tcp_socket_reply_t *reply);
+    bool _fail(uint8_t error, tcp_socket_reply_t *reply);
+    bool _reply(uint8_t status, uint8_t error, tcp_socket_reply_t *reply);
+
+    static unsigned long _millis();
+};
+
+#endif // TCPSOCKETUPDATE_H
@@ -33,6 +33,9 @@
 #ifndef PORT
   #define PORT TCPSOCKET_PORT
 #endif
+#ifndef RELAY_PORT
+  #define RELAY_PORT (PORT + 1)
+#endif
 
 #define DATA_SIZE 64
 #define SEND_BUFFER_SIZE TCP_BUFFER_TOTAL(DATA_SIZE)
@@ -42,6 +45,23 @@ byte *send_buffer;
 WiFiBase *wfb;
 TCPSocket tcpSocket;
 
+#ifdef SOCKET_UPDATES
+/* Take firmware updates over the socket, see tcpsocketota.py */
+#include <TCPSocketUpdate.h>
+#include <OTAFlash.h>
+#include <OTAProgress.h>
+ESPPartitionFlash updateFlash;
+ESPProgress updateProgress;
+OTAReceiver updateReceiver(&updateFlash);
+TCPSocketUpdate socketUpdate(&updateReceiver);
+#endif
+
+#ifdef RELAY
+/* Relay frames between the nodes that join this hub's access point */
+#include <TCPSocketRelay.h>
+TCPSocketRelay relay(RELAY_PORT);
+#endif
+
 void setup() {
   Serial.begin(115200);
 
@@ -54,6 +74,10 @@ void setup() {
 #ifdef CONFIG_PORTAL
   /* The the WiFiBase to generate an access point hosting a config portal */
   wfb->useConfigPortal(true);
+#endif
+#ifdef RELAY
+  /* Keep the access point up for the nodes while connected upstream */
+  wfb->useConcurrentAccessPoint(true);
 #endif
   while (!wfb->startup()) {
     delay(100);
@@ -62,8 +86,34 @@ void setup() {
   DEBUG1_VALUELN("Listening on port ", PORT);
   tcpSocket.init(ADDRESS, PORT);
   send_buffer = tcpSocket.initBuffer(databuffer, SEND_BUFFER_SIZE);
+#ifdef RELAY_HOST
+  /* Connect out to a hub's relay rather than waiting for a connection */
+  DEBUG1_VALUELN("Connecting to relay ", RELAY_HOST);
+  tcpSocket.connectTo(RELAY_HOST, RELAY_PORT);
+#endif
   tcpSocket.setup();
 
+#ifdef RELAY
+  relay.setup();
+  wfb->registerCounter("tcpsocket_relay_frames_total", "Frames relayed",
+                       &relay.getStats()->framesRelayed);
+#endif
+
+#ifdef SOCKET_UPDATES
+  updateReceiver.useWriter(true);
+  updateReceiver.useProgress(&updateProgress);
+  tcpSocket.useUpdates(&socketUpdate);
+#endif
+
+  /* Report the socket's traffic through WiFiBase's /metrics */
+  const tcp_socket_stats_t *stats = tcpSocket.getStats();
+  wfb->registerCounter("tcpsocket_messages_sent_total", "Messages sent",
+                       &stats->msgsSent);
+  wfb->registerCounter("tcpsocket_messages_received_total", "Messages received",
+                       &stats->msgsReceived);
+  wfb->registerCounter("tcpsocket_errors_total", "Receive errors",
+                       &stats->recvErrors);
+
   DEBUG1_PRINTLN("*** TCPSocketTool initialized ***")
 }
 
@@ -75,6 +125,10 @@ boolean waiting;
 void loop() {
   unsigned long now = millis();
 
+#ifdef RELAY
+  relay.handle();
+#endif
+
   /* Wait until connected */
   if (!tcpSocket.connected()) {
     if (!waiting) {
@@ -105,5 +159,13 @@ void loop() {
     DEBUG_PRINT_END();
   }
 
+#ifdef SOCKET_UPDATES
+  if (socketUpdate.complete()) {
+    DEBUG1_PRINTLN("* Update received, restarting");
+    delay(100);
+    ESP.restart();
+  }
+#endif
+
   delay(10);
 }
\ No newline at end of file
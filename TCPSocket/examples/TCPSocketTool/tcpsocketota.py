@@ -0,0 +1,208 @@
+#!/usr/bin/python
+#
+# Push a firmware image to a node taking updates over its TCPSocket, see
+# TCPSocketUpdate.h
+#
+# Author: Adam Phelps
+# License: MIT
+# Copyright: 2018
+
+import socket
+import struct
+import hashlib
+import argparse
+import select
+import sys
+import time
+
+
+HEADER_FORMAT = "<IBBBBHH"
+HEADER_LEN = 12
+TCPSOCKET_START = 0x54435053
+TCPSOCKET_VERSION = 1
+
+FLAG_UPDATE = 0x80
+FLAG_MORE = 0x40
+UPDATE_START = 1
+UPDATE_DATA = 2
+UPDATE_ACK = 3
+
+FRAME_DATA = 255
+ACK_INTERVAL = 4096
+WINDOW = 4 * ACK_INTERVAL
+
+OTA_MAGIC = 0x4F424657
+OTA_VERSION = 1
+OTA_TYPE_FULL = 0
+OTA_FLAG_RESUME = 0x01
+
+OTA_HEADER_FORMAT = "<IBBBBII32s"
+REPLY_FORMAT = "<IBBBBI"
+REPLY_LEN = 12
+
+REPLY_STATUS = ["READY", "OK", "BUSY", "ERROR"]
+ERRORS = ["none", "too large", "no memory", "flash", "overrun", "incomplete",
+          "hash mismatch", "activate", "protocol", "timeout", "aborted",
+          "base mismatch"]
+
+DEFAULT_IP = "192.168.4.1"
+DEFAULT_PORT = 4081
+SOURCE_ADDRESS = 0x12
+REPLY_TIMEOUT = 10
+RETRY_DELAY = 2
+
+
+def handle_args():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("-a", "--address", dest="address",
+                        help="IP address to connect to", default=DEFAULT_IP)
+
+    parser.add_argument("-p", "--port", dest="port", type=int,
+                        help="Port to connect to",
+                        default=DEFAULT_PORT)
+
+    parser.add_argument("-d", "--dest", dest="dest", type=int,
+                        help="Socket address of the node", default=128)
+
+    parser.add_argument("-r", "--retries", dest="retries", type=int,
+                        help="Times to reconnect and resume after the "
+                        "connection is lost", default=5)
+
+    parser.add_argument("image", help="Firmware image (.bin) to send")
+
+    return parser.parse_args()
+
+
+class Sender:
+    def __init__(self, sock):
+        self.sock = sock
+        self.id = 0
+        self.received = b""
+
+    def send(self, flags, data):
+        self.sock.sendall(struct.pack(HEADER_FORMAT,
+                                      TCPSOCKET_START,
+                                      TCPSOCKET_VERSION,
+                                      self.id & 0xFF,
+                                      len(data),
+                                      FLAG_UPDATE | flags,
+                                      SOURCE_ADDRESS,
+                                      options.dest) + data)
+        self.id += 1
+
+    def reply(self, timeout):
+        """Wait up to the timeout for the node's next reply, or None"""
+        deadline = time.time() + timeout
+        while True:
+            if len(self.received) >= HEADER_LEN:
+                (_, _, _, length, flags, _, _) = \
+                    struct.unpack(HEADER_FORMAT, self.received[:HEADER_LEN])
+                if len(self.received) >= HEADER_LEN + length:
+                    data = self.received[HEADER_LEN:HEADER_LEN + length]
+                    self.received = self.received[HEADER_LEN + length:]
+                    if (flags == FLAG_UPDATE | UPDATE_ACK and
+                            length == REPLY_LEN):
+                        return parse_reply(data)
+                    continue
+
+            wait = max(deadline - time.time(), 0)
+            if not select.select([self.sock], [], [], wait)[0]:
+                return None
+            data = self.sock.recv(4096)
+            if not data:
+                raise IOError("connection closed")
+            self.received += data
+
+
+def parse_reply(data):
+    (magic, status, error, _, _, offset) = struct.unpack(REPLY_FORMAT, data)
+    if magic != OTA_MAGIC:
+        raise IOError("bad reply")
+    return (status, error, offset)
+
+
+def check_reply(reply, expected):
+    if reply is None:
+        raise IOError("no reply")
+    (status, error, offset) = reply
+    if status != expected:
+        name = REPLY_STATUS[status] if status < len(REPLY_STATUS) else status
+        reason = ERRORS[error] if error < len(ERRORS) else error
+        print("\nFailed: %s (%s) after %d bytes" % (name, reason, offset))
+        sys.exit(1)
+
+
+def send_update(image):
+    """Send the image in frames, from where the node says it got to"""
+    sock = socket.create_connection((options.address, options.port))
+    sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    sender = Sender(sock)
+
+    sender.send(UPDATE_START,
+                struct.pack(OTA_HEADER_FORMAT,
+                            OTA_MAGIC,
+                            OTA_VERSION,
+                            OTA_TYPE_FULL,
+                            OTA_FLAG_RESUME,
+                            0,                   # Reserved
+                            len(image),          # Payload size
+                            len(image),          # Image size
+                            hashlib.sha256(image).digest()))
+    reply = sender.reply(REPLY_TIMEOUT)
+    check_reply(reply, REPLY_STATUS.index("READY"))
+
+    offset = acked = reply[2]
+    if offset:
+        print("Resuming from %d bytes" % offset)
+
+    while offset < len(image):
+        data = image[offset:offset + FRAME_DATA]
+
+        # Take any acks that have arrived, waiting only if the window is full
+        while True:
+            full = offset + len(data) - acked > WINDOW
+            reply = sender.reply(REPLY_TIMEOUT if full else 0)
+            if reply is None:
+                if full:
+                    raise IOError("no ack")
+                break
+            check_reply(reply, REPLY_STATUS.index("READY"))
+            acked = reply[2]
+
+        offset += len(data)
+        sender.send(UPDATE_DATA | (FLAG_MORE if offset < len(image) else 0),
+                    data)
+        sys.stdout.write("\r%d%%" % (offset * 100 // len(image)))
+        sys.stdout.flush()
+    print("")
+
+    while True:
+        reply = sender.reply(REPLY_TIMEOUT)
+        if reply is None or reply[0] != REPLY_STATUS.index("READY"):
+            break
+    check_reply(reply, REPLY_STATUS.index("OK"))
+    sock.close()
+
+
+options = handle_args()
+
+with open(options.image, "rb") as f:
+    image = f.read()
+
+print("Sending %d byte image to %s:%d" %
+      (len(image), options.address, options.port))
+
+attempt = 0
+while True:
+    try:
+        send_update(image)
+        break
+    except (IOError, socket.error) as e:
+        attempt += 1
+        if attempt > options.retries:
+            print("\nFailed: %s" % e)
+            sys.exit(1)
+        print("\nConnection lost (%s), retrying" % e)
+        time.sleep(RETRY_DELAY)
+
+print("Image verified, node is restarting")
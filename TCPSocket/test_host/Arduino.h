@@ -0,0 +1,22 @@
+/*
+ * Host stand-in for the Arduino types the TCPSocket uses
+ */
+
+#ifndef ARDUINO_STANDIN_H
+#define ARDUINO_STANDIN_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+static inline unsigned long millis() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+#endif // ARDUINO_STANDIN_H
@@ -0,0 +1,30 @@
+/*
+ * Host stand-in for the Debug library, with all output compiled out
+ */
+
+#ifndef DEBUG_STANDIN_H
+#define DEBUG_STANDIN_H
+
+#define DEBUG_HIGH 5
+
+#define DEBUG_ERR(...)
+#define DEBUG_ENDLN()
+#define DEBUG3_PRINT(...)
+#define DEBUG3_PRINTLN(...)
+#define DEBUG3_VALUE(...)
+#define DEBUG3_VALUELN(...)
+#define DEBUG3_HEXVAL(...)
+#define DEBUG3_HEXVALLN(...)
+#define DEBUG4_PRINT(...)
+#define DEBUG4_PRINTLN(...)
+#define DEBUG4_VALUE(...)
+#define DEBUG4_VALUELN(...)
+#define DEBUG5_PRINT(...)
+#define DEBUG5_PRINTLN(...)
+#define DEBUG5_VALUE(...)
+#define DEBUG5_VALUELN(...)
+#define DEBUG5_HEXVAL(...)
+#define DEBUG5_HEXVALLN(...)
+#define DEBUG5_COMMAND(...)
+
+#endif // DEBUG_STANDIN_H
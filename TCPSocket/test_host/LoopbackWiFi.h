@@ -0,0 +1,186 @@
+/*
+ * Loopback stand-in for the ESP32 WiFiServer and WiFiClient, so that the
+ * TCPSocket runs on the host over real TCP connections.
+ *
+ * Only what the TCPSocket uses is provided.  As with the ESP32 classes a
+ * WiFiClient shares its connection with its copies, reads never block and
+ * writes block until everything is sent.
+ */
+
+#ifndef LOOPBACKWIFI_H
+#define LOOPBACKWIFI_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <memory>
+
+#include "Arduino.h"
+
+class WiFiClient {
+  public:
+    WiFiClient() {}
+    WiFiClient(int fd) : _handle(std::make_shared<Handle>(fd)) {}
+
+    operator bool() { return connected(); }
+
+    bool connected() {
+      if (!_handle || _handle->fd < 0) {
+        return false;
+      }
+      char c;
+      int result = recv(_handle->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+      if (result == 0 ||
+          (result < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+        stop();
+        return false;
+      }
+      return true;
+    }
+
+    int available() {
+      int avail = 0;
+      if (!connected() || ioctl(_handle->fd, FIONREAD, &avail) < 0) {
+        return 0;
+      }
+      return avail;
+    }
+
+    int read() {
+      uint8_t c;
+      return (read(&c, 1) == 1) ? c : -1;
+    }
+
+    int read(uint8_t *buf, size_t size) {
+      if (!_handle || _handle->fd < 0) {
+        return -1;
+      }
+      return recv(_handle->fd, buf, size, MSG_DONTWAIT);
+    }
+
+    size_t write(const uint8_t *buf, size_t size) {
+      size_t sent = 0;
+      while (_handle && _handle->fd >= 0 && sent < size) {
+        ssize_t result = send(_handle->fd, buf + sent, size - sent,
+                              MSG_NOSIGNAL);
+        if (result <= 0) {
+          break;
+        }
+        sent += result;
+      }
+      return sent;
+    }
+
+    void stop() {
+      if (_handle) {
+        _handle->close();
+      }
+    }
+
+    /* Connect to a dotted address, giving up after the timeout in ms */
+    int connect(const char *host, uint16_t port, int32_t timeout = 3000) {
+      struct sockaddr_in addr;
+
+      memset(&addr, 0, sizeof (addr));
+      addr.sin_family = AF_INET;
+      addr.sin_port = htons(port);
+      if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        return 0;
+      }
+      int fd = socket(AF_INET, SOCK_STREAM, 0);
+      int flags = fcntl(fd, F_GETFL, 0);
+      fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+      if (::connect(fd, (struct sockaddr *)&addr, sizeof (addr)) < 0) {
+        struct pollfd pfd = { fd, POLLOUT, 0 };
+        int error = 0;
+        socklen_t len = sizeof (error);
+        if (errno != EINPROGRESS || poll(&pfd, 1, timeout) != 1 ||
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error) {
+          ::close(fd);
+          return 0;
+        }
+      }
+      fcntl(fd, F_SETFL, flags);
+      _handle = std::make_shared<Handle>(fd);
+      return 1;
+    }
+
+    void setNoDelay(bool noDelay) {
+      int on = noDelay ? 1 : 0;
+      if (_handle && _handle->fd >= 0) {
+        setsockopt(_handle->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof (on));
+      }
+    }
+
+  protected:
+    struct Handle {
+      int fd;
+      Handle(int _fd) : fd(_fd) {}
+      ~Handle() { close(); }
+      void close() {
+        if (fd >= 0) {
+          ::close(fd);
+          fd = -1;
+        }
+      }
+    };
+    std::shared_ptr<Handle> _handle;
+};
+
+class WiFiServer {
+  public:
+    WiFiServer(uint16_t port, uint8_t maxClients = 4)
+      : _port(port), _maxClients(maxClients), _fd(-1) {}
+    ~WiFiServer() { stop(); }
+
+    void begin() {
+      struct sockaddr_in addr;
+      int on = 1;
+
+      _fd = socket(AF_INET, SOCK_STREAM, 0);
+      setsockopt(_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on));
+      memset(&addr, 0, sizeof (addr));
+      addr.sin_family = AF_INET;
+      addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      addr.sin_port = htons(_port);
+      if (bind(_fd, (struct sockaddr *)&addr, sizeof (addr)) < 0 ||
+          listen(_fd, _maxClients) < 0) {
+        stop();
+        return;
+      }
+      fcntl(_fd, F_SETFL, fcntl(_fd, F_GETFL) | O_NONBLOCK);
+    }
+
+    WiFiClient available() {
+      if (_fd < 0) {
+        return WiFiClient();
+      }
+      int fd = accept(_fd, nullptr, nullptr);
+      if (fd < 0) {
+        return WiFiClient();
+      }
+      int on = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof (on));
+      return WiFiClient(fd);
+    }
+
+    void stop() {
+      if (_fd >= 0) {
+        close(_fd);
+        _fd = -1;
+      }
+    }
+
+  protected:
+    uint16_t _port;
+    uint8_t _maxClients;
+    int _fd;
+};
+
+#endif // LOOPBACKWIFI_H
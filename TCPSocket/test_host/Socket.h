@@ -0,0 +1,27 @@
+/*
+ * Host stand-in for the Socket API base class, with just what the TCPSocket
+ * uses.  See https://github.com/AMPWorks/ArduinoLibs/blob/master/Socket/Socket.h
+ */
+
+#ifndef SOCKET_STANDIN_H
+#define SOCKET_STANDIN_H
+
+#include "Arduino.h"
+
+typedef uint16_t socket_addr_t;
+
+#define SOCKET_ADDR_ANY 0xFFFF
+#define SOCKET_ADDRESS_MATCH(a, b) \
+  (((a) == (b)) || ((a) == SOCKET_ADDR_ANY) || ((b) == SOCKET_ADDR_ANY))
+
+class Socket {
+  public:
+    virtual ~Socket() {}
+
+  protected:
+    socket_addr_t sourceAddress;
+    byte *send_buffer;
+    uint16_t send_data_size;
+};
+
+#endif // SOCKET_STANDIN_H
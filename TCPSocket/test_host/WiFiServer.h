@@ -0,0 +1,2 @@
+/* Host stand-in, see LoopbackWiFi.h */
+#include "LoopbackWiFi.h"
@@ -0,0 +1,1049 @@
+/**
+ * Host testing of the TCPSocket over loopback connections, see LoopbackWiFi.h
+ *
+ * To run tests with platformio:
+ *   platformio test -e native
+ */
+
+#include <unity.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <atomic>
+#include <thread>
+
+#include "TCPSocket.h"
+#include "TCPSocketUpdate.h"
+#include "TCPSocketRelay.h"
+#include "Sha256.h"
+#include "OTAReceiver.h"
+#include "OTAProgress.h"
+#include "FileFlash.h"
+
+static const uint16_t TEST_PORT = TCPSOCKET_PORT + 10000;
+static const socket_addr_t NODE_ADDRESS = 2;
+static const socket_addr_t SENDER_ADDRESS = 1;
+static const unsigned long REPLY_TIMEOUT_MS = 2000;
+
+static const size_t FRAME_OVERHEAD = sizeof (tcp_socket_hdr_t);
+
+void setUp(void) {}
+void tearDown(void) {}
+
+static double elapsed_ms(struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000.0 +
+         (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+static uint8_t *ota_image(size_t size, uint8_t *sha256) {
+  uint8_t *image = (uint8_t *)malloc(size);
+  srand(47);
+  for (size_t i = 0; i < size; i++) {
+    image[i] = (uint8_t)rand();
+  }
+  Sha256 hash;
+  hash.update(image, size);
+  hash.finish(sha256);
+  return image;
+}
+
+static bool flash_matches(FileFlash *flash, const uint8_t *image, size_t size) {
+  uint8_t *contents = (uint8_t *)malloc(size);
+  bool matches = flash->read(0, contents, size) &&
+                 memcmp(contents, image, size) == 0;
+  free(contents);
+  return matches;
+}
+
+class MemoryProgress : public OTAProgress {
+  public:
+    bool valid = false;
+    ota_progress_t record;
+
+    bool load(ota_progress_t *progress) {
+      if (valid) {
+        *progress = record;
+      }
+      return valid;
+    }
+
+    bool save(const ota_progress_t *progress) {
+      record = *progress;
+      valid = true;
+      return true;
+    }
+
+    void clear() {
+      valid = false;
+    }
+};
+
+static int frame_connect(uint16_t port) {
+  struct sockaddr_in addr;
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  int on = 1;
+
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof (on));
+  memset(&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  if (connect(fd, (struct sockaddr *)&addr, sizeof (addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* Send a frame as another TCPSocket would */
+static void frame_send(int fd, uint8_t id, uint8_t flags, const void *data,
+                       uint8_t length) {
+  uint8_t frame[FRAME_OVERHEAD + 255];
+  tcp_socket_hdr_t *hdr = (tcp_socket_hdr_t *)frame;
+
+  hdr->start = TCPSOCKET_START;
+  hdr->version = TCPSOCKET_VERSION;
+  hdr->ID = id;
+  hdr->length = length;
+  hdr->flags = flags;
+  hdr->source = SENDER_ADDRESS;
+  hdr->address = NODE_ADDRESS;
+  memcpy(frame + FRAME_OVERHEAD, data, length);
+  send(fd, frame, FRAME_OVERHEAD + length, MSG_NOSIGNAL);
+}
+
+static bool recv_all(int fd, void *buf, size_t size, int timeoutMs) {
+  size_t got = 0;
+  while (got < size) {
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    if (poll(&pfd, 1, timeoutMs) <= 0) {
+      return false;
+    }
+    ssize_t result = recv(fd, (uint8_t *)buf + got, size - got, 0);
+    if (result <= 0) {
+      return false;
+    }
+    got += result;
+  }
+  return true;
+}
+
+/**
+ * Wait up to the timeout for the node's next update reply, skipping any
+ * other frames it sends
+ */
+static bool frame_reply(int fd, ota_reply_t *reply, int timeoutMs) {
+  tcp_socket_hdr_t hdr;
+  uint8_t data[255];
+
+  while (recv_all(fd, &hdr, sizeof (hdr), timeoutMs)) {
+    if (!recv_all(fd, data, hdr.length, REPLY_TIMEOUT_MS)) {
+      return false;
+    }
+    if (hdr.flags == (TCPSOCKET_FLAG_UPDATE | TCPSOCKET_UPDATE_ACK) &&
+        hdr.length == sizeof (*reply) && hdr.address == SENDER_ADDRESS) {
+      memcpy(reply, data, sizeof (*reply));
+      return (reply->magic == OTA_MAGIC);
+    }
+  }
+  return false;
+}
+
+static void header_for(ota_header_t *header, const uint8_t *sha256,
+                       uint32_t size, bool resume) {
+  memset(header, 0, sizeof (*header));
+  header->magic = OTA_MAGIC;
+  header->version = OTA_VERSION;
+  header->type = OTA_TYPE_FULL;
+  header->flags = resume ? OTA_FLAG_RESUME : 0;
+  header->payloadSize = size;
+  header->imageSize = size;
+  memcpy(header->sha256, sha256, SHA256_DIGEST_SIZE);
+}
+
+typedef struct {
+  uint16_t port;
+  const uint8_t *image;
+  size_t size;
+  const uint8_t *sha256;
+  bool resume;
+  unsigned long bytesPerSec;  // Of framed bytes on the link, 0 for unlimited
+  size_t killAt;              // Reset the connection after this, 0 for never
+  size_t messageEvery;        // Frames between normal messages, 0 for none
+
+  uint32_t offset;            // From the first reply
+  ota_reply_t result;
+  size_t maxOutstanding;
+  unsigned int acks;
+  unsigned int messages;
+  size_t linkBytes;
+  std::atomic<bool> done;
+} update_sender_t;
+
+static void sender_init(update_sender_t *sender, const uint8_t *image,
+                        size_t size, const uint8_t *sha256) {
+  sender->port = TEST_PORT;
+  sender->image = image;
+  sender->size = size;
+  sender->sha256 = sha256;
+  sender->resume = false;
+  sender->bytesPerSec = 0;
+  sender->killAt = 0;
+  sender->messageEvery = 0;
+  sender->offset = 0;
+  memset(&sender->result, 0, sizeof (sender->result));
+  sender->maxOutstanding = 0;
+  sender->acks = 0;
+  sender->messages = 0;
+  sender->linkBytes = 0;
+  sender->done = false;
+}
+
+/**
+ * Push an image as update frames, keeping at most a window of the payload
+ * beyond the last ack outstanding, and optionally at a limited link rate
+ */
+static void update_sender(update_sender_t *sender) {
+  ota_header_t header;
+  ota_reply_t reply;
+  uint8_t id = 0;
+  struct timespec start;
+
+  int fd = frame_connect(sender->port);
+  header_for(&header, sender->sha256, sender->size, sender->resume);
+  frame_send(fd, id++, TCPSOCKET_FLAG_UPDATE | TCPSOCKET_UPDATE_START,
+             &header, sizeof (header));
+  if (!frame_reply(fd, &sender->result, REPLY_TIMEOUT_MS) ||
+      sender->result.status != OTA_REPLY_READY) {
+    close(fd);
+    sender->done = true;
+    return;
+  }
+
+  sender->offset = sender->result.offset;
+  size_t acked = sender->offset;
+  size_t frames = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (size_t offset = sender->offset; offset < sender->size; ) {
+    uint8_t length = (sender->size - offset < TCPSocketUpdate::FRAME_DATA) ?
+                     sender->size - offset : TCPSocketUpdate::FRAME_DATA;
+
+    /* Take any acks that have arrived, waiting only if the window is full */
+    while (true) {
+      bool full = (offset + length - acked > TCPSocketUpdate::WINDOW);
+      if (!frame_reply(fd, &reply, full ? REPLY_TIMEOUT_MS : 0)) {
+        if (full) {
+          goto DONE;
+        }
+        break;
+      }
+      if (reply.status != OTA_REPLY_READY) {
+        sender->result = reply;
+        goto DONE;
+      }
+      acked = reply.offset;
+      sender->acks++;
+    }
+
+    if (sender->messageEvery && ++frames % sender->messageEvery == 0) {
+      /* Numbered apart from the update's own frames */
+      uint32_t message = sender->messages++;
+      frame_send(fd, (uint8_t)message, 0, &message, sizeof (message));
+      sender->linkBytes += FRAME_OVERHEAD + sizeof (message);
+    }
+
+    bool more = (offset + length < sender->size);
+    frame_send(fd, id++, TCPSOCKET_FLAG_UPDATE | TCPSOCKET_UPDATE_DATA |
+               (more ? TCPSOCKET_FLAG_MORE : 0), sender->image + offset,
+               length);
+    offset += length;
+    sender->linkBytes += FRAME_OVERHEAD + length;
+    if (offset - acked > sender->maxOutstanding) {
+      sender->maxOutstanding = offset - acked;
+    }
+
+    if (sender->killAt && offset >= sender->killAt) {
+      /* Killed, so the connection is reset rather than closed */
+      struct linger linger = { 1, 0 };
+      setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof (linger));
+      goto DONE;
+    }
+
+    /* The link never runs faster than the rate */
+    if (sender->bytesPerSec) {
+      double due = sender->linkBytes * 1000.0 / sender->bytesPerSec;
+      double now = elapsed_ms(&start);
+      if (due > now + 1) {
+        usleep((useconds_t)((due - now) * 1000));
+      }
+    }
+  }
+
+  /* Then the final reply, after any acks still to come */
+  while (frame_reply(fd, &reply, REPLY_TIMEOUT_MS)) {
+    sender->result = reply;
+    if (reply.status != OTA_REPLY_READY) {
+      break;
+    }
+    sender->acks++;
+  }
+
+DONE:
+  close(fd);
+  sender->done = true;
+}
+
+/**
+ * Run the node's loop until the sender is done, with the given time spent
+ * elsewhere in each pass
+ * @return Normal messages returned by getMsg(), counting only those in order
+ */
+static unsigned int node_run(TCPSocket *socket, update_sender_t *sender,
+                             useconds_t loopUs) {
+  unsigned int messages = 0;
+  unsigned int len;
+  struct timespec start;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (!sender->done && elapsed_ms(&start) < 20 * REPLY_TIMEOUT_MS) {
+    const byte *data = socket->getMsg(&len);
+    if (data) {
+      uint32_t message;
+      memcpy(&message, data, sizeof (message));
+      if (len == sizeof (message) && message == messages) {
+        messages++;
+      }
+    }
+    usleep(loopUs);
+  }
+  return messages;
+}
+
+/**
+ * Run the node's loop until it replies to the sender
+ */
+static bool node_reply(TCPSocket *socket, int fd, ota_reply_t *reply) {
+  unsigned int len;
+  struct timespec start;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (elapsed_ms(&start) < REPLY_TIMEOUT_MS) {
+    socket->getMsg(&len);
+    if (frame_reply(fd, reply, 1)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Frame handler with no image behind it, replying with what it was given */
+class CountingHandler : public TCPSocketFrameHandler {
+  public:
+    uint8_t data[255];
+    int frames = 0;
+    int checks = 0;
+
+    uint8_t *buffer() { return data; }
+
+    bool frame(uint8_t flags, uint8_t id, uint8_t length,
+               tcp_socket_reply_t *reply) {
+      frames++;
+      memset(reply, 0, sizeof (*reply));
+      reply->magic = OTA_MAGIC;
+      reply->status = flags & TCPSOCKET_UPDATE_MASK;
+      reply->error = id;
+      reply->offset = length;
+      return true;
+    }
+
+    bool check(tcp_socket_reply_t *reply) {
+      checks++;
+      return false;
+    }
+};
+
+/* Normal messages are returned as before, with or without updates taken */
+void test_messages() {
+  TCPSocket socket(NODE_ADDRESS, TEST_PORT);
+  socket.setup();
+
+  int fd = frame_connect(TEST_PORT);
+  uint32_t message = 0x12345678;
+  frame_send(fd, 7, 0, &message, sizeof (message));
+
+  /* An update frame is dropped when updates aren't taken */
+  uint8_t junk[100];
+  memset(junk, 0xAB, sizeof (junk));
+  frame_send(fd, 8, TCPSOCKET_FLAG_UPDATE | TCPSOCKET_UPDATE_DATA, junk,
+             sizeof (junk));
+  message++;
+  frame_send(fd, 9, 0, &message, sizeof (message));
+
+  unsigned int len;
+  const byte *data = nullptr;
+  uint32_t expected = 0x12345678;
+  for (int tries = 0; tries < 1000 && expected <= message; tries++) {
+    data = socket.getMsg(&len);
+    if (data) {
+      TEST_ASSERT_EQUAL(sizeof (uint32_t), len);
+      TEST_ASSERT_EQUAL_MEMORY(&expected, data, len);
+      TEST_ASSERT_EQUAL(SENDER_ADDRESS, socket.sourceFromData((void *)data));
+      expected++;
+    }
+    usleep(1000);
+  }
+  TEST_ASSERT_EQUAL(message + 1, expected);
+  TEST_ASSERT_EQUAL(2, socket.getStats()->msgsReceived);
+  TEST_ASSERT_EQUAL(0, socket.getStats()->recvErrors);
+
+  /* Update frames go to whatever handler is given */
+  CountingHandler handler;
+  ota_reply_t reply;
+  socket.useUpdates(&handler);
+  frame_send(fd, 10, TCPSOCKET_FLAG_UPDATE | TCPSOCKET_UPDATE_DATA, junk,
+             sizeof (junk));
+  TEST_ASSERT_TRUE(node_reply(&socket, fd, &reply));
+  TEST_ASSERT_EQUAL(1, handler.frames);
+  TEST_ASSERT_GREATER_THAN(0, handler.checks);
+  TEST_ASSERT_EQUAL_MEMORY(junk, handler.data, sizeof (junk));
+  TEST_ASSERT_EQUAL(TCPSOCKET_UPDATE_DATA, reply.status);
+  TEST_ASSERT_EQUAL(10, reply.error);
+  TEST_ASSERT_EQUAL(sizeof (junk), reply.offset);
+  close(fd);
+}
+
+/* An image is streamed into flash, verified and activated */
+void test_update_receive() {
+  const size_t SIZE = 20 * FileFlash::PAGE_SIZE + 1234;
+  uint8_t sha256[SHA256_DIGEST_SIZE];
+  uint8_t *image = ota_image(SIZE, sha256);
+  FileFlash flash(SIZE + FileFlash::PAGE_SIZE);
+  OTAReceiver receiver(&flash);
+  receiver.useWriter(true);
+  TCPSocketUpdate update(&receiver);
+  TCPSocket socket(NODE_ADDRESS, TEST_PORT);
+  socket.useUpdates(&update);
+  socket.setup();
+
+  update_sender_t sender;
+  sender_init(&sender, image, SIZE, sha256);
+  sender.messageEvery = 50;
+  std::thread thread(update_sender, &sender);
+  unsigned int messages = node_run(&socket, &sender, 100);
+  thread.join();
+
+  TEST_ASSERT_EQUAL(OTA_REPLY_OK, sender.result.status);
+  TEST_ASSERT_EQUAL(SIZE, sender.result.offset);
+  TEST_ASSERT_TRUE(flash.activated);
+  TEST_ASSERT_TRUE(flash_matches(&flash, image, SIZE));
+  TEST_ASSERT_TRUE(update.complete());
+  TEST_ASSERT_FALSE(update.active());
+  TEST_ASSERT_EQUAL(1, update.updates());
+
+  /* Acked as it went, never more than the window outstanding */
+  TEST_ASSERT_TRUE(sender.acks >= SIZE / (TCPSocketUpdate::ACK_INTERVAL +
+                                          TCPSocketUpdate::FRAME_DATA));
+  TEST_ASSERT_TRUE(sender.acks <= SIZE / TCPSocketUpdate::ACK_INTERVAL);
+  TEST_ASSERT_TRUE(sender.maxOutstanding <= TCPSocketUpdate::WINDOW);
+
+  /* With the messages between update frames still returned */
+  TEST_ASSERT_TRUE(sender.messages > 0);
+  TEST_ASSERT_EQUAL(sender.messages, messages);
+  free(image);
+}
+
+/* Frames missing or out of place fail the update, as does a bad image */
+void test_update_refused() {
+  const size_t SIZE = 4 * FileFlash::PAGE_SIZE;
+  uint8_t sha256[SHA256_DIGEST_SIZE];
+  uint8_t *image = ota_image(SIZE, sha256);
+  FileFlash flash(SIZE + FileFlash::PAGE_SIZE);
+  OTAReceiver receiver(&flash);
+  TCPSocketUpdate update(&receiver);
+  TCPSocket socket(NODE_ADDRESS, TEST_PORT);
+  socket.useUpdates(&update);
+  socket.setup();
+
+  ota_header_t header;
+  ota_reply_t reply;
+  header_for(&header, sha256, SIZE, false);
+  int fd = frame_connect(TEST_PORT);
+
+  /* The header may itself be chunked */
+  frame_send(fd, 10, TCPSOCKET_FLAG_UPDATE | TCPSOCKET_FLAG_MORE |
+             TCPSOCKET_UPDATE_START, &header, 30);
+  frame_send(fd, 11, TCPSOCKET_FLAG_UPDATE | TCPSOCKET_UPDATE_START,
+             (uint8_t *)&header + 30, sizeof (header) - 30);
+  TEST_ASSERT_TRUE(node_reply(&socket, fd, &reply));
+  TEST_ASSERT_EQUAL(OTA_REPLY_READY, reply.status);
+  TEST_ASSERT_EQUAL(0, reply.offset);
+  TEST_ASSERT_TRUE(update.active());
+
+  /* A frame lost */
+  frame_send(fd, 12, TCPSOCKET_FLAG_UPDATE | TCPSOCKET_FLAG_MORE |
+             TCPSOCKET_UPDATE_DATA, image, 200);
+  frame_send(fd, 14, TCPSOCKET_FLAG_UPDATE | TCPSOCKET_FLAG_MORE |
+             TCPSOCKET_UPDATE_DATA, image + 200, 200);
+  TEST_ASSERT_TRUE(node_reply(&socket, fd, &reply));
+  TEST_ASSERT_EQUAL(OTA_REPLY_ERROR, reply.status);
+  TEST_ASSERT_EQUAL(OTA_ERR_PROTOCOL, reply.error);
+  TEST_ASSERT_EQUAL(200, reply.offset);
+  TEST_ASSERT_FALSE(update.active());
+  TEST_ASSERT_EQUAL(OTA_FAILED, receiver.state());
+
+  /* The payload ending early */
+  frame_send(fd, 20, TCPSOCKET_FLAG_UPDATE | TCPSOCKET_UPDATE_START,
+             &header, sizeof (header));
+  TEST_ASSERT_TRUE(node_reply(&socket, fd, &reply));
+  TEST_ASSERT_EQUAL(OTA_REPLY_READY, reply.status);
+  frame_send(fd, 21, TCPSOCKET_FLAG_UPDATE | TCPSOCKET_UPDATE_DATA,
+             image, 200);
+  TEST_ASSERT_TRUE(node_reply(&socket, fd, &reply));
+  TEST_ASSERT_EQUAL(OTA_REPLY_ERROR, reply.status);
+  TEST_ASSERT_EQUAL(OTA_ERR_PROTOCOL, reply.error);
+
+  /* Images other than full ones */
+  header.type = OTA_TYPE_COMPRESSED;
+  frame_send(fd, 30, TCPSOCKET_FLAG_UPDATE | TCPSOCKET_UPDATE_START,
+             &header, sizeof (header));
+  TEST_ASSERT_TRUE(node_reply(&socket, fd, &reply));
+  TEST_ASSERT_EQUAL(OTA_REPLY_ERROR, reply.status);
+  TEST_ASSERT_EQUAL(OTA_ERR_PROTOCOL, reply.error);
+  close(fd);
+
+  /* A corrupt image is never activated */
+  image[SIZE / 2] ^= 1;
+  update_sender_t sender;
+  sender_init(&sender, image, SIZE, sha256);
+  std::thread thread(update_sender, &sender);
+  node_run(&socket, &sender, 100);
+  thread.join();
+  TEST_ASSERT_EQUAL(OTA_REPLY_ERROR, sender.result.status);
+  TEST_ASSERT_EQUAL(OTA_ERR_HASH, sender.result.error);
+  TEST_ASSERT_FALSE(flash.activated);
+  TEST_ASSERT_FALSE(update.complete());
+  TEST_ASSERT_EQUAL(0, update.updates());
+  TEST_ASSERT_EQUAL(4, update.failures());
+  free(image);
+}
+
+/* A sender killed part way reconnects and sends only the rest */
+void test_update_resume() {
+  const size_t SIZE = 32 * FileFlash::PAGE_SIZE + 555;
+  uint8_t sha256[SHA256_DIGEST_SIZE];
+  uint8_t *image = ota_image(SIZE, sha256);
+  FileFlash flash(SIZE + FileFlash::PAGE_SIZE);
+  MemoryProgress progress;
+  OTAReceiver receiver(&flash);
+  receiver.useWriter(true);
+  receiver.useProgress(&progress);
+  TCPSocketUpdate update(&receiver);
+  TCPSocket socket(NODE_ADDRESS, TEST_PORT);
+  socket.useUpdates(&update);
+  socket.setup();
+
+  const size_t KILLED_AT = SIZE * 7 / 10;
+  update_sender_t first;
+  sender_init(&first, image, SIZE, sha256);
+  first.resume = true;
+  first.killAt = KILLED_AT;
+  std::thread killed(update_sender, &first);
+  node_run(&socket, &first, 100);
+  killed.join();
+  TEST_ASSERT_EQUAL(OTA_REPLY_READY, first.result.status);
+  TEST_ASSERT_EQUAL(0, first.offset);
+
+  /* Let the node take what arrived before the reset */
+  for (int i = 0; i < 100; i++) {
+    unsigned int len;
+    socket.getMsg(&len);
+    usleep(100);
+  }
+  TEST_ASSERT_TRUE(update.active());
+
+  update_sender_t second;
+  sender_init(&second, image, SIZE, sha256);
+  second.resume = true;
+  std::thread resumed(update_sender, &second);
+  node_run(&socket, &second, 100);
+  resumed.join();
+
+  char msg[100];
+  snprintf(msg, sizeof (msg), "Killed at %u of %u bytes, resumed from %u",
+           (unsigned)KILLED_AT, (unsigned)SIZE, (unsigned)second.offset);
+  TEST_MESSAGE(msg);
+  TEST_ASSERT_EQUAL(OTA_REPLY_OK, second.result.status);
+  TEST_ASSERT_TRUE(second.offset > 0);
+  TEST_ASSERT_TRUE(second.offset <= KILLED_AT);
+  TEST_ASSERT_TRUE(flash.activated);
+  TEST_ASSERT_TRUE(flash_matches(&flash, image, SIZE));
+  TEST_ASSERT_EQUAL(1, update.updates());
+  TEST_ASSERT_EQUAL(1, update.failures());
+  TEST_ASSERT_EQUAL(2, socket.getStats()->connections);
+  free(image);
+}
+
+/*
+ * The payload keeps up with the link despite each frame carrying at most
+ * 255 bytes, with the node doing other work between getMsg() calls and
+ * flash erases at twice the link rate
+ */
+void test_update_benchmark() {
+  const size_t SIZE = 64 * FileFlash::PAGE_SIZE;
+  const unsigned long RATE = 1024 * 1024;
+  const useconds_t LOOP_US = 1000;
+  uint8_t sha256[SHA256_DIGEST_SIZE];
+  uint8_t *image = ota_image(SIZE, sha256);
+  FileFlash flash(SIZE + FileFlash::PAGE_SIZE);
+  flash.eraseUs = FileFlash::PAGE_SIZE * 1000000ULL / (2 * RATE);
+  OTAReceiver receiver(&flash);
+  receiver.useWriter(true);
+  TCPSocketUpdate update(&receiver);
+  TCPSocket socket(NODE_ADDRESS, TEST_PORT);
+  socket.useUpdates(&update);
+  socket.setup();
+
+  update_sender_t sender;
+  sender_init(&sender, image, SIZE, sha256);
+  sender.bytesPerSec = RATE;
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  std::thread thread(update_sender, &sender);
+  node_run(&socket, &sender, LOOP_US);
+  double ms = elapsed_ms(&start);
+  thread.join();
+  TEST_ASSERT_EQUAL(OTA_REPLY_OK, sender.result.status);
+  TEST_ASSERT_TRUE(flash_matches(&flash, image, SIZE));
+
+  double payloadRate = SIZE / 1.024 / ms;
+  double linkRate = sender.linkBytes / 1.024 / ms;
+  char msg[200];
+  snprintf(msg, sizeof (msg), "%u KB over a %lu KB/s link with %u ms loop "
+           "passes and %lu KB/s erases: link %.0f KB/s, payload %.0f KB/s, "
+           "frame overhead %.1f%%, %u acks",
+           (unsigned)(SIZE / 1024), RATE / 1024, (unsigned)(LOOP_US / 1000),
+           2 * RATE / 1024, linkRate, payloadRate,
+           100.0 * (sender.linkBytes - SIZE) / sender.linkBytes, sender.acks);
+  TEST_MESSAGE(msg);
+
+  /* Only the frame headers are lost from the link rate */
+  TEST_ASSERT_TRUE(linkRate > RATE / 1024 * 0.85);
+  TEST_ASSERT_TRUE(payloadRate > RATE / 1024 * 0.8);
+  free(image);
+}
+
+/* Build a frame between two addresses, as a TCPSocket would send it */
+static size_t relay_frame(uint8_t *frame, socket_addr_t source,
+                          socket_addr_t address, uint8_t id, uint8_t flags,
+                          const void *data, uint8_t length) {
+  tcp_socket_hdr_t *hdr = (tcp_socket_hdr_t *)frame;
+
+  hdr->start = TCPSOCKET_START;
+  hdr->version = TCPSOCKET_VERSION;
+  hdr->ID = id;
+  hdr->length = length;
+  hdr->flags = flags;
+  hdr->source = source;
+  hdr->address = address;
+  memcpy(frame + FRAME_OVERHEAD, data, length);
+  return FRAME_OVERHEAD + length;
+}
+
+static void relay_announce(int fd, socket_addr_t address) {
+  uint8_t frame[FRAME_OVERHEAD];
+  size_t size = relay_frame(frame, address, SOCKET_ADDR_ANY, 0,
+                            TCPSOCKET_FLAG_ANNOUNCE, nullptr, 0);
+  send(fd, frame, size, MSG_NOSIGNAL);
+}
+
+/* Receive the next frame whole, returning its size or 0 if none arrived */
+static size_t relay_recv(int fd, uint8_t *frame, int timeoutMs) {
+  tcp_socket_hdr_t *hdr = (tcp_socket_hdr_t *)frame;
+  if (!recv_all(fd, hdr, FRAME_OVERHEAD, timeoutMs) ||
+      !recv_all(fd, frame + FRAME_OVERHEAD, hdr->length, REPLY_TIMEOUT_MS)) {
+    return 0;
+  }
+  return FRAME_OVERHEAD + hdr->length;
+}
+
+/* Run relays for a while, as a hub's loop would */
+static void relay_run(TCPSocketRelay *relay, TCPSocketRelay *other = nullptr,
+                      int ms = 20) {
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (elapsed_ms(&start) < ms) {
+    relay->handle();
+    if (other) {
+      other->handle();
+    }
+    usleep(100);
+  }
+}
+
+/* Frames are routed by destination once it's learned, and flooded until then */
+void test_relay_routes() {
+  TCPSocketRelay relay(TEST_PORT);
+  relay.setup();
+  const tcp_relay_stats_t *stats = relay.getStats();
+  uint8_t frame[FRAME_OVERHEAD + 255], got[FRAME_OVERHEAD + 255];
+  uint32_t message = 0x12345678;
+  size_t size;
+
+  int a = frame_connect(TEST_PORT);
+  int b = frame_connect(TEST_PORT);
+  int c = frame_connect(TEST_PORT);
+  relay_announce(a, 1);
+  relay_announce(b, 2);
+  relay_run(&relay);
+  TEST_ASSERT_EQUAL(3, relay.clients());
+  TEST_ASSERT_EQUAL(2, relay.routes());
+
+  /* A known destination gets the frame as it was sent, and no one else */
+  size = relay_frame(frame, 1, 2, 7, 0, &message, sizeof (message));
+  send(a, frame, size, 0);
+  relay_run(&relay);
+  TEST_ASSERT_EQUAL(size, relay_recv(b, got, 100));
+  TEST_ASSERT_EQUAL_MEMORY(frame, got, size);
+  TEST_ASSERT_EQUAL(0, relay_recv(a, got, 0));
+  TEST_ASSERT_EQUAL(0, relay_recv(c, got, 0));
+
+  /* An unknown one is flooded */
+  size = relay_frame(frame, 1, 3, 8, 0, &message, sizeof (message));
+  send(a, frame, size, 0);
+  relay_run(&relay);
+  TEST_ASSERT_EQUAL(size, relay_recv(b, got, 100));
+  TEST_ASSERT_EQUAL(size, relay_recv(c, got, 100));
+  TEST_ASSERT_EQUAL(0, relay_recv(a, got, 0));
+  TEST_ASSERT_EQUAL(1, stats->framesFlooded);
+
+  /* Broadcasts reach everyone else, teaching the relay the sender */
+  size = relay_frame(frame, 3, SOCKET_ADDR_ANY, 1, 0, &message,
+                     sizeof (message));
+  send(c, frame, size, 0);
+  relay_run(&relay);
+  TEST_ASSERT_EQUAL(size, relay_recv(a, got, 100));
+  TEST_ASSERT_EQUAL(size, relay_recv(b, got, 100));
+  TEST_ASSERT_EQUAL(3, relay.routes());
+  size = relay_frame(frame, 1, 3, 9, 0, &message, sizeof (message));
+  send(a, frame, size, 0);
+  relay_run(&relay);
+  TEST_ASSERT_EQUAL(size, relay_recv(c, got, 100));
+  TEST_ASSERT_EQUAL(0, relay_recv(b, got, 0));
+  TEST_ASSERT_EQUAL(1, stats->framesFlooded);
+
+  /* Frames for a destination behind the link they came from are dropped */
+  size = relay_frame(frame, 1, 1, 10, 0, &message, sizeof (message));
+  send(a, frame, size, 0);
+  relay_run(&relay);
+  TEST_ASSERT_EQUAL(0, relay_recv(a, got, 0));
+  TEST_ASSERT_EQUAL(1, stats->framesDropped);
+
+  /* The start of the next frame is found after garbage */
+  const uint8_t junk[5] = { 0x53, 0x50, 1, 2, 3 };
+  send(b, junk, sizeof (junk), 0);
+  size = relay_frame(frame, 2, 1, 3, 0, &message, sizeof (message));
+  send(b, frame, size, 0);
+  relay_run(&relay);
+  TEST_ASSERT_EQUAL(size, relay_recv(a, got, 100));
+  TEST_ASSERT_EQUAL_MEMORY(frame, got, size);
+  TEST_ASSERT_EQUAL(sizeof (junk), stats->recvErrors);
+
+  /* A TCPSocket connected to the relay exchanges messages with the others */
+  TCPSocket node(5, TEST_PORT + 1);
+  node.connectTo("127.0.0.1", TEST_PORT);
+  node.setup();
+  TEST_ASSERT_TRUE(node.connected());
+  relay_run(&relay);
+  TEST_ASSERT_EQUAL(4, relay.routes());
+
+  size = relay_frame(frame, 1, 5, 11, 0, &message, sizeof (message));
+  send(a, frame, size, 0);
+  unsigned int len = 0;
+  const byte *data = nullptr;
+  for (int tries = 0; tries < 100 && !data; tries++) {
+    relay_run(&relay, nullptr, 1);
+    data = node.getMsg(&len);
+  }
+  TEST_ASSERT_NOT_NULL(data);
+  TEST_ASSERT_EQUAL(sizeof (message), len);
+  TEST_ASSERT_EQUAL_MEMORY(&message, data, len);
+  TEST_ASSERT_EQUAL(1, node.sourceFromData((void *)data));
+
+  byte buffer[TCP_BUFFER_TOTAL(16)];
+  byte *send_buffer = node.initBuffer(buffer, sizeof (buffer));
+  memcpy(send_buffer, &message, sizeof (message));
+  node.sendMsgTo(1, send_buffer, sizeof (message));
+  relay_run(&relay);
+  TEST_ASSERT_EQUAL(FRAME_OVERHEAD + sizeof (message), relay_recv(a, got, 100));
+  TEST_ASSERT_EQUAL(5, ((tcp_socket_hdr_t *)got)->source);
+  TEST_ASSERT_EQUAL_MEMORY(&message, got + FRAME_OVERHEAD, sizeof (message));
+  TEST_ASSERT_EQUAL(0, relay_recv(b, got, 0));
+
+  /* An unreachable relay holds up the node for at most the connect timeout */
+  TCPSocket lost(6, TEST_PORT + 2);
+  lost.connectTo("10.255.255.1", TEST_PORT);
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  lost.setup();
+  TEST_ASSERT_NULL(lost.getMsg(&len));
+  TEST_ASSERT_FALSE(lost.connected());
+  TEST_ASSERT_LESS_THAN(TCPSocket::CONNECT_TIMEOUT + 200, elapsed_ms(&start));
+
+  /* Routes through a link are forgotten once it closes */
+  close(b);
+  relay_run(&relay);
+  TEST_ASSERT_EQUAL(3, relay.clients());
+  TEST_ASSERT_EQUAL(3, relay.routes());
+  TEST_ASSERT_EQUAL(4, stats->connections);
+  TEST_ASSERT_EQUAL(0, stats->sendErrors);
+  close(a);
+  close(c);
+}
+
+/* A relay passes what it can't route locally up to its parent */
+void test_relay_uplink() {
+  TCPSocketRelay parent(TEST_PORT + 1);
+  TCPSocketRelay child(TEST_PORT);
+  parent.setup();
+  child.setup();
+  child.useUplink("127.0.0.1", TEST_PORT + 1);
+  uint8_t frame[FRAME_OVERHEAD + 255], got[FRAME_OVERHEAD + 255];
+  uint32_t message = 0x87654321;
+  size_t size;
+
+  int x = frame_connect(TEST_PORT);
+  int y = frame_connect(TEST_PORT + 1);
+  relay_announce(x, 10);
+  relay_announce(y, 20);
+  relay_run(&child, &parent);
+  TEST_ASSERT_TRUE(child.uplinkConnected());
+  TEST_ASSERT_EQUAL(1, child.getStats()->uplinkConnects);
+  TEST_ASSERT_EQUAL(2, parent.clients());
+  TEST_ASSERT_EQUAL(2, parent.routes());
+  TEST_ASSERT_EQUAL(1, child.routes());
+
+  /* Down from the parent to the node behind the child */
+  size = relay_frame(frame, 20, 10, 1, 0, &message, sizeof (message));
+  send(y, frame, size, 0);
+  relay_run(&child, &parent);
+  TEST_ASSERT_EQUAL(size, relay_recv(x, got, 100));
+  TEST_ASSERT_EQUAL_MEMORY(frame, got, size);
+
+  /* Unknown destinations go up rather than being flooded below */
+  size = relay_frame(frame, 10, 30, 2, 0, &message, sizeof (message));
+  send(x, frame, size, 0);
+  relay_run(&child, &parent);
+  TEST_ASSERT_EQUAL(size, relay_recv(y, got, 100));
+  TEST_ASSERT_EQUAL(0, relay_recv(x, got, 0));
+  TEST_ASSERT_EQUAL(0, child.getStats()->framesFlooded);
+  TEST_ASSERT_EQUAL(1, parent.getStats()->framesFlooded);
+
+  /* Broadcasts from below reach the nodes above */
+  size = relay_frame(frame, 10, SOCKET_ADDR_ANY, 3, 0, &message,
+                     sizeof (message));
+  send(x, frame, size, 0);
+  relay_run(&child, &parent);
+  TEST_ASSERT_EQUAL(size, relay_recv(y, got, 100));
+
+  /* Addresses learned before the uplink connects are announced to it */
+  TCPSocketRelay other(TEST_PORT + 2);
+  other.setup();
+  int z = frame_connect(TEST_PORT + 2);
+  relay_announce(z, 40);
+  relay_run(&other);
+  other.useUplink("127.0.0.1", TEST_PORT + 1);
+  relay_run(&other, &parent);
+  TEST_ASSERT_EQUAL(3, parent.routes());
+  size = relay_frame(frame, 20, 40, 4, 0, &message, sizeof (message));
+  send(y, frame, size, 0);
+  relay_run(&other, &parent);
+  TEST_ASSERT_EQUAL(size, relay_recv(z, got, 100));
+  TEST_ASSERT_EQUAL(0, relay_recv(x, got, 0));
+
+  close(x);
+  close(y);
+  close(z);
+}
+
+typedef struct {
+  int fd;
+  socket_addr_t source;
+  unsigned int frames;
+  unsigned int received;
+  unsigned int errors;
+} relay_peer_t;
+
+static void relay_sender(relay_peer_t *peer, socket_addr_t address) {
+  uint8_t frame[FRAME_OVERHEAD + 64];
+  uint8_t data[64];
+  memset(data, 0x5A, sizeof (data));
+  for (unsigned int i = 0; i < peer->frames; i++) {
+    size_t size = relay_frame(frame, peer->source, address, (uint8_t)i, 0,
+                              data, sizeof (data));
+    if (send(peer->fd, frame, size, MSG_NOSIGNAL) != (ssize_t)size) {
+      peer->errors++;
+      return;
+    }
+  }
+}
+
+/* Check each frame arrives once, in order, from the expected sender */
+static void relay_receiver(relay_peer_t *peer, socket_addr_t source) {
+  uint8_t frame[FRAME_OVERHEAD + 255];
+  tcp_socket_hdr_t *hdr = (tcp_socket_hdr_t *)frame;
+  while (peer->received < peer->frames) {
+    if (!relay_recv(peer->fd, frame, REPLY_TIMEOUT_MS)) {
+      peer->errors++;
+      return;
+    }
+    if (hdr->source != source || hdr->ID != (uint8_t)peer->received) {
+      peer->errors++;
+    }
+    peer->received++;
+  }
+}
+
+/* Round trip between two connections, a frame each way, in us */
+static double round_trip_us(int a, int b, int count) {
+  uint8_t frame[FRAME_OVERHEAD + 255];
+  uint32_t message = 0;
+  struct timespec start;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < count; i++) {
+    size_t size = relay_frame(frame, 100, 200, (uint8_t)i, 0, &message,
+                              sizeof (message));
+    send(a, frame, size, 0);
+    if (!relay_recv(b, frame, REPLY_TIMEOUT_MS)) {
+      return -1;
+    }
+    size = relay_frame(frame, 200, 100, (uint8_t)i, 0, &message,
+                       sizeof (message));
+    send(b, frame, size, 0);
+    if (!relay_recv(a, frame, REPLY_TIMEOUT_MS)) {
+      return -1;
+    }
+  }
+  return elapsed_ms(&start) * 1000 / count;
+}
+
+/*
+ * Several pairs of nodes stream frames to each other through the relay at
+ * once, then the latency it adds is measured against a direct connection
+ */
+void test_relay_benchmark() {
+  const int PAIRS = 4;
+  const unsigned int FRAMES = 20000;
+  const int ROUND_TRIPS = 2000;
+  TCPSocketRelay relay(TEST_PORT);
+  relay.setup();
+
+  relay_peer_t senders[PAIRS], receivers[PAIRS];
+  for (int i = 0; i < PAIRS; i++) {
+    senders[i] = { frame_connect(TEST_PORT), (socket_addr_t)(100 + i),
+                   FRAMES, 0, 0 };
+    receivers[i] = { frame_connect(TEST_PORT), (socket_addr_t)(200 + i),
+                     FRAMES, 0, 0 };
+    relay_announce(senders[i].fd, senders[i].source);
+    relay_announce(receivers[i].fd, receivers[i].source);
+  }
+  relay_run(&relay, nullptr, 50);
+  TEST_ASSERT_EQUAL(2 * PAIRS, relay.routes());
+
+  std::atomic<bool> stop(false);
+  std::thread hub([&relay, &stop]() {
+    while (!stop) {
+      relay.handle();
+    }
+  });
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  std::thread threads[2 * PAIRS];
+  for (int i = 0; i < PAIRS; i++) {
+    threads[2 * i] = std::thread(relay_sender, &senders[i],
+                                 receivers[i].source);
+    threads[2 * i + 1] = std::thread(relay_receiver, &receivers[i],
+                                     senders[i].source);
+  }
+  for (int i = 0; i < 2 * PAIRS; i++) {
+    threads[i].join();
+  }
+  double ms = elapsed_ms(&start);
+
+  for (int i = 0; i < PAIRS; i++) {
+    TEST_ASSERT_EQUAL(0, senders[i].errors);
+    TEST_ASSERT_EQUAL(0, receivers[i].errors);
+    TEST_ASSERT_EQUAL(FRAMES, receivers[i].received);
+  }
+  TEST_ASSERT_EQUAL(PAIRS * FRAMES, relay.getStats()->framesRelayed);
+  TEST_ASSERT_EQUAL(0, relay.getStats()->framesFlooded);
+
+  double relayed = round_trip_us(senders[0].fd, receivers[0].fd, ROUND_TRIPS);
+  stop = true;
+  hub.join();
+
+  /* The same exchange over a direct connection */
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  socklen_t len = sizeof (addr);
+  int on = 1;
+  memset(&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  bind(listener, (struct sockaddr *)&addr, sizeof (addr));
+  listen(listener, 1);
+  getsockname(listener, (struct sockaddr *)&addr, &len);
+  int direct = frame_connect(ntohs(addr.sin_port));
+  int peer = accept(listener, nullptr, nullptr);
+  setsockopt(peer, IPPROTO_TCP, TCP_NODELAY, &on, sizeof (on));
+  double baseline = round_trip_us(direct, peer, ROUND_TRIPS);
+  close(direct);
+  close(peer);
+  close(listener);
+
+  double framesPerSec = PAIRS * FRAMES * 1000.0 / ms;
+  char msg[200];
+  snprintf(msg, sizeof (msg), "%d pairs of 64 byte messages: %.0f frames/s, "
+           "%.1f MB/s of payload; round trip %.0f us relayed, %.0f us direct, "
+           "%.0f us added per hop", PAIRS, framesPerSec,
+           framesPerSec * 64 / (1024 * 1024), relayed, baseline,
+           (relayed - baseline) / 2);
+  TEST_MESSAGE(msg);
+
+  TEST_ASSERT_TRUE(relayed > 0 && baseline > 0);
+  TEST_ASSERT_TRUE(framesPerSec > 10000);
+  TEST_ASSERT_TRUE((relayed - baseline) / 2 < 2000);
+
+  for (int i = 0; i < PAIRS; i++) {
+    close(senders[i].fd);
+    close(receivers[i].fd);
+  }
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+
+  RUN_TEST(test_messages);
+  RUN_TEST(test_update_receive);
+  RUN_TEST(test_update_refused);
+  RUN_TEST(test_update_resume);
+  RUN_TEST(test_update_benchmark);
+  RUN_TEST(test_relay_routes);
+  RUN_TEST(test_relay_uplink);
+  RUN_TEST(test_relay_benchmark);
+
+  return UNITY_END();
+}
@@ -0,0 +1,221 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ */
+
+#include <string.h>
+
+#include "DeltaDecoder.h"
+
+DeltaDecoder::DeltaDecoder(OTAFlash *base) {
+  _base = base;
+  _receiver = nullptr;
+  _state = DELTA_PREAMBLE;
+  _op = DELTA_OP_ADD;
+  _fieldUsed = 0;
+  _fieldNeeded = PREAMBLE_SIZE;
+  _baseSize = 0;
+  _offset = 0;
+  _remaining = 0;
+  _hashedSize = 0;
+}
+
+bool DeltaDecoder::begin(OTAReceiver *receiver) {
+  _receiver = receiver;
+  _state = DELTA_PREAMBLE;
+  _fieldUsed = 0;
+  _fieldNeeded = PREAMBLE_SIZE;
+  _remaining = 0;
+  return true;
+}
+
+size_t DeltaDecoder::write(const uint8_t *data, size_t length) {
+  size_t consumed = 0;
+
+  while (consumed < length && _state != DELTA_COPY &&
+         _receiver->state() == OTA_RECEIVING) {
+    switch (_state) {
+      case DELTA_PREAMBLE:
+        consumed += _gather(data + consumed, length - consumed);
+        if (_fieldUsed == _fieldNeeded) {
+          _preamble();
+        }
+        break;
+
+      case DELTA_OP:
+        _op = data[consumed++];
+        if (_op == DELTA_OP_ADD) {
+          _fieldNeeded = 4;
+        } else if (_op == DELTA_OP_COPY) {
+          _fieldNeeded = 8;
+        } else {
+          _fail(OTA_ERR_PROTOCOL);
+          break;
+        }
+        _fieldUsed = 0;
+        _state = DELTA_ARGS;
+        break;
+
+      case DELTA_ARGS:
+        consumed += _gather(data + consumed, length - consumed);
+        if (_fieldUsed == _fieldNeeded) {
+          _args();
+        }
+        break;
+
+      case DELTA_ADD: {
+        size_t n = length - consumed;
+        if (n > _remaining) {
+          n = _remaining;
+        }
+        if (!_receiver->write(data + consumed, n)) {
+          return consumed;
+        }
+        consumed += n;
+        _remaining -= n;
+        if (!_remaining) {
+          _state = DELTA_OP;
+        }
+        break;
+      }
+    }
+  }
+
+  return consumed;
+}
+
+bool DeltaDecoder::busy() {
+  return (_state == DELTA_COPY && _receiver->state() == OTA_RECEIVING);
+}
+
+/**
+ * Copy from the base for a held back COPY
+ */
+size_t DeltaDecoder::pump(size_t limit) {
+  size_t produced = 0;
+
+  while (busy() && produced < limit) {
+    size_t n = _remaining;
+    if (n > COPY_BUFFER) {
+      n = COPY_BUFFER;
+    }
+    if (n > limit - produced) {
+      n = limit - produced;
+    }
+
+    if (!_base->read(_offset, _buffer, n)) {
+      _fail(OTA_ERR_FLASH);
+      break;
+    }
+    if (!_receiver->write(_buffer, n)) {
+      break;
+    }
+
+    _offset += n;
+    _remaining -= n;
+    produced += n;
+    if (!_remaining) {
+      _state = DELTA_OP;
+    }
+  }
+
+  return produced;
+}
+
+/**
+ * The payload must end between operations
+ */
+bool DeltaDecoder::finish() {
+  if (_receiver->state() != OTA_RECEIVING) {
+    return false;
+  }
+  if (_state != DELTA_OP) {
+    _fail(OTA_ERR_PROTOCOL);
+    return false;
+  }
+  return true;
+}
+
+size_t DeltaDecoder::_gather(const uint8_t *data, size_t length) {
+  size_t n = _fieldNeeded - _fieldUsed;
+  if (n > length) {
+    n = length;
+  }
+  memcpy(&_field[_fieldUsed], data, n);
+  _fieldUsed += n;
+  return n;
+}
+
+/**
+ * Check the delta was made against the image we hold
+ */
+bool DeltaDecoder::_preamble() {
+  if (_le32(_field) != DELTA_MAGIC) {
+    _fail(OTA_ERR_PROTOCOL);
+    return false;
+  }
+
+  _baseSize = _le32(&_field[4]);
+  if (!_baseSize || _baseSize > _base->size()) {
+    _fail(OTA_ERR_BASE);
+    return false;
+  }
+  if (!_hashBase(_baseSize)) {
+    _fail(OTA_ERR_FLASH);
+    return false;
+  }
+  if (memcmp(_hashed, &_field[8], SHA256_DIGEST_SIZE) != 0) {
+    _fail(OTA_ERR_BASE);
+    return false;
+  }
+
+  _state = DELTA_OP;
+  return true;
+}
+
+bool DeltaDecoder::_args() {
+  if (_op == DELTA_OP_ADD) {
+    _remaining = _le32(_field);
+    _state = _remaining ? DELTA_ADD : DELTA_OP;
+    return true;
+  }
+
+  _offset = _le32(_field);
+  _remaining = _le32(&_field[4]);
+  if (!_remaining || _offset > _baseSize ||
+      _remaining > _baseSize - _offset) {
+    _fail(OTA_ERR_PROTOCOL);
+    return false;
+  }
+  _state = DELTA_COPY;
+  return true;
+}
+
+bool DeltaDecoder::_hashBase(uint32_t size) {
+  if (_hashedSize == size) {
+    return true;
+  }
+
+  Sha256 hash;
+  for (uint32_t offset = 0; offset < size; offset += COPY_BUFFER) {
+    size_t n = (size - offset < COPY_BUFFER) ? size - offset : COPY_BUFFER;
+    if (!_base->read(offset, _buffer, n)) {
+      _hashedSize = 0;
+      return false;
+    }
+    hash.update(_buffer, n);
+  }
+  hash.finish(_hashed);
+  _hashedSize = size;
+  return true;
+}
+
+void DeltaDecoder::_fail(uint8_t error) {
+  _receiver->abort(error);
+}
+
+uint32_t DeltaDecoder::_le32(const uint8_t *data) {
+  return (uint32_t)data[0] | ((uint32_t)data[1] << 8) |
+         ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+}
@@ -0,0 +1,91 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Builds a new image from a binary delta against the running image.
+ *
+ * Design:
+ *   A delta starts with a preamble giving the size and SHA-256 of the image
+ * it was made against, which is checked against the base before anything is
+ * written, followed by a sequence of operations:
+ *
+ *     ADD  (0): u32 length, then length bytes of new data
+ *     COPY (1): u32 offset, u32 length of bytes to copy from the base
+ *
+ * with all values little-endian.  Most releases change only a little, so a
+ * delta is mostly short COPYs of unchanged code between the ADDs.
+ *
+ *   Operations are applied as they arrive, so the only RAM used beyond the
+ * OTAReceiver's pages is a small buffer for copying from the base.  A COPY
+ * can produce far more than its few bytes, so it is held back and produced
+ * through pump() a bounded amount at a time.
+ *
+ *   The base is hashed once to check the preamble, and the hash kept for
+ * later updates.
+ */
+
+#ifndef DELTADECODER_H
+#define DELTADECODER_H
+
+#include "OTADecoder.h"
+#include "OTAFlash.h"
+#include "Sha256.h"
+
+#define DELTA_MAGIC 0x44424657  // "WFBD"
+
+typedef enum {
+  DELTA_OP_ADD = 0,
+  DELTA_OP_COPY = 1,
+} delta_op_t;
+
+class DeltaDecoder : public OTADecoder {
+  public:
+    static const size_t PREAMBLE_SIZE = 4 + 4 + SHA256_DIGEST_SIZE;
+    static const size_t COPY_BUFFER = 256;
+
+    DeltaDecoder(OTAFlash *base);
+
+    bool begin(OTAReceiver *receiver);
+    size_t write(const uint8_t *data, size_t length);
+    bool busy();
+    size_t pump(size_t limit);
+    bool finish();
+
+  protected:
+    typedef enum {
+      DELTA_PREAMBLE,
+      DELTA_OP,
+      DELTA_ARGS,
+      DELTA_ADD,
+      DELTA_COPY,
+    } delta_state_t;
+
+    OTAFlash *_base;
+    OTAReceiver *_receiver;
+
+    uint8_t _state;
+    uint8_t _op;
+    uint8_t _field[PREAMBLE_SIZE];
+    size_t _fieldUsed;
+    size_t _fieldNeeded;
+
+    uint32_t _baseSize;
+    uint32_t _offset;
+    uint32_t _remaining;
+    uint8_t _buffer[COPY_BUFFER];
+
+    /* Hash of the base last checked */
+    uint32_t _hashedSize;
+    uint8_t _hashed[SHA256_DIGEST_SIZE];
+
+    size_t _gather(const uint8_t *data, size_t length);
+    bool _preamble();
+    bool _args();
+    bool _hashBase(uint32_t size);
+    void _fail(uint8_t error);
+
+    static uint32_t _le32(const uint8_t *data);
+};
+
+#endif // DELTADECODER_H
@@ -0,0 +1,220 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ */
+
+#include <string.h>
+
+#include "JsonWriter.h"
+
+JsonWriter::JsonWriter(OutputSink *sink) {
+  _sink = sink;
+  _used = 0;
+  _bytes = 0;
+  _notFirst = 0;
+  _depth = 0;
+  _afterKey = false;
+}
+
+/**
+ * Write a comma if this isn't the first element at the current depth
+ */
+void JsonWriter::_separator() {
+  if (_afterKey) {
+    _afterKey = false;
+    return;
+  }
+
+  uint32_t bit = (uint32_t)1 << (_depth % MAX_DEPTH);
+  if (_notFirst & bit) {
+    _put(',');
+  }
+  _notFirst |= bit;
+}
+
+void JsonWriter::_open(char c) {
+  _separator();
+  _put(c);
+  _depth++;
+  _notFirst &= ~((uint32_t)1 << (_depth % MAX_DEPTH));
+}
+
+void JsonWriter::_close(char c) {
+  if (_depth) {
+    _depth--;
+  }
+  _put(c);
+}
+
+JsonWriter &JsonWriter::beginObject() {
+  _open('{');
+  return *this;
+}
+
+JsonWriter &JsonWriter::endObject() {
+  _close('}');
+  return *this;
+}
+
+JsonWriter &JsonWriter::beginArray() {
+  _open('[');
+  return *this;
+}
+
+JsonWriter &JsonWriter::endArray() {
+  _close(']');
+  return *this;
+}
+
+JsonWriter &JsonWriter::key(const char *name) {
+  _separator();
+  _string(name, strlen(name));
+  _put(':');
+  _afterKey = true;
+  return *this;
+}
+
+JsonWriter &JsonWriter::value(const char *str) {
+  if (!str) {
+    return null();
+  }
+  return value(str, strlen(str));
+}
+
+JsonWriter &JsonWriter::value(const char *str, size_t length) {
+  _separator();
+  _string(str, length);
+  return *this;
+}
+
+JsonWriter &JsonWriter::value(bool b) {
+  _separator();
+  if (b) {
+    _put("true", 4);
+  } else {
+    _put("false", 5);
+  }
+  return *this;
+}
+
+JsonWriter &JsonWriter::value(int i) {
+  return value((long)i);
+}
+
+JsonWriter &JsonWriter::value(unsigned int i) {
+  return value((unsigned long)i);
+}
+
+JsonWriter &JsonWriter::value(long i) {
+  _separator();
+  if (i < 0) {
+    _put('-');
+    _unsigned(0UL - (unsigned long)i);
+  } else {
+    _unsigned((unsigned long)i);
+  }
+  return *this;
+}
+
+JsonWriter &JsonWriter::value(unsigned long i) {
+  _separator();
+  _unsigned(i);
+  return *this;
+}
+
+JsonWriter &JsonWriter::null() {
+  _separator();
+  _put("null", 4);
+  return *this;
+}
+
+JsonWriter &JsonWriter::raw(const char *json, size_t length) {
+  _separator();
+  if (length >= BUFFER_SIZE) {
+    flush();
+    _sink->write(json, length);
+    _bytes += length;
+    return *this;
+  }
+  _put(json, length);
+  return *this;
+}
+
+void JsonWriter::flush() {
+  if (_used) {
+    _sink->write(_buffer, _used);
+    _used = 0;
+  }
+}
+
+size_t JsonWriter::bytes() {
+  return _bytes;
+}
+
+void JsonWriter::_put(char c) {
+  if (_used == BUFFER_SIZE) {
+    flush();
+  }
+  _buffer[_used++] = c;
+  _bytes++;
+}
+
+void JsonWriter::_put(const char *data, size_t length) {
+  while (length) {
+    if (_used == BUFFER_SIZE) {
+      flush();
+    }
+    size_t n = BUFFER_SIZE - _used;
+    if (n > length) {
+      n = length;
+    }
+    memcpy(&_buffer[_used], data, n);
+    _used += n;
+    _bytes += n;
+    data += n;
+    length -= n;
+  }
+}
+
+/**
+ * Write a quoted string, escaping quotes, backslashes and control characters
+ */
+void JsonWriter::_string(const char *str, size_t length) {
+  static const char hex[] = "0123456789abcdef";
+
+  _put('"');
+  for (size_t i = 0; i < length; i++) {
+    char c = str[i];
+    switch (c) {
+      case '"':  _put("\\\"", 2); break;
+      case '\\': _put("\\\\", 2); break;
+      case '\n': _put("\\n", 2); break;
+      case '\r': _put("\\r", 2); break;
+      case '\t': _put("\\t", 2); break;
+      case '\b': _put("\\b", 2); break;
+      case '\f': _put("\\f", 2); break;
+      default:
+        if ((unsigned char)c < 0x20) {
+          char escape[6] = {'\\', 'u', '0', '0', hex[(c >> 4) & 0xF], hex[c & 0xF]};
+          _put(escape, sizeof (escape));
+        } else {
+          _put(c);
+        }
+    }
+  }
+  _put('"');
+}
+
+void JsonWriter::_unsigned(unsigned long i) {
+  char digits[20];
+  uint8_t n = 0;
+  do {
+    digits[n++] = (char)('0' + i % 10);
+    i /= 10;
+  } while (i);
+
+  while (n) {
+    _put(digits[--n]);
+  }
+}
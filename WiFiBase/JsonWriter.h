@@ -0,0 +1,77 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Allocation-free streaming JSON writer.
+ *
+ * Design:
+ *   Output is formatted into a small fixed buffer which is handed to a sink
+ * whenever it fills, such as a web server's chunked response, so a response is
+ * never held in RAM in full and no heap allocations are made.  Separators are
+ * tracked per nesting level and strings are escaped as they are written.
+ */
+
+#ifndef JSONWRITER_H
+#define JSONWRITER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "OutputSink.h"
+
+class JsonWriter {
+  public:
+    static const size_t BUFFER_SIZE = 256;
+    static const uint8_t MAX_DEPTH = 32;
+
+    JsonWriter(OutputSink *sink);
+
+    JsonWriter &beginObject();
+    JsonWriter &endObject();
+    JsonWriter &beginArray();
+    JsonWriter &endArray();
+
+    JsonWriter &key(const char *name);
+
+    JsonWriter &value(const char *str);
+    JsonWriter &value(const char *str, size_t length);
+    JsonWriter &value(bool b);
+    JsonWriter &value(int i);
+    JsonWriter &value(unsigned int i);
+    JsonWriter &value(long i);
+    JsonWriter &value(unsigned long i);
+    JsonWriter &null();
+
+    /*
+     * Write preformatted JSON, either a value or within an object a run of
+     * members.  Long runs are passed straight to the sink without copying.
+     */
+    JsonWriter &raw(const char *json, size_t length);
+
+    /* Pass any buffered output to the sink */
+    void flush();
+
+    /* Total bytes written */
+    size_t bytes();
+
+  protected:
+    OutputSink *_sink;
+    char _buffer[BUFFER_SIZE];
+    size_t _used;
+    size_t _bytes;
+
+    uint32_t _notFirst;  // Bit per depth set once an element is written
+    uint8_t _depth;
+    bool _afterKey;
+
+    void _separator();
+    void _open(char c);
+    void _close(char c);
+    void _put(char c);
+    void _put(const char *data, size_t length);
+    void _string(const char *str, size_t length);
+    void _unsigned(unsigned long i);
+};
+
+#endif // JSONWRITER_H
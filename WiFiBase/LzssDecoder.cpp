@@ -0,0 +1,176 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "LzssDecoder.h"
+
+LzssDecoder::LzssDecoder() {
+  _receiver = nullptr;
+  _window = nullptr;
+  _state = LZSS_PREAMBLE;
+  _fieldUsed = 0;
+  _flags = 0;
+  _items = 0;
+  _produced = 0;
+  _flushed = 0;
+}
+
+LzssDecoder::~LzssDecoder() {
+  free(_window);
+}
+
+/**
+ * Allocate the window
+ * @return false if there isn't the memory, having aborted the receiver
+ */
+bool LzssDecoder::begin(OTAReceiver *receiver) {
+  _receiver = receiver;
+  _state = LZSS_PREAMBLE;
+  _fieldUsed = 0;
+  _produced = 0;
+  _flushed = 0;
+
+  if (!_window) {
+    _window = (uint8_t *)malloc(WINDOW);
+    if (!_window) {
+      _fail(OTA_ERR_NO_MEMORY);
+      return false;
+    }
+  }
+  return true;
+}
+
+size_t LzssDecoder::write(const uint8_t *data, size_t length) {
+  size_t consumed = 0;
+
+  while (consumed < length && _receiver->state() == OTA_RECEIVING) {
+    switch (_state) {
+      case LZSS_PREAMBLE:
+        while (_fieldUsed < 4 && consumed < length) {
+          _field[_fieldUsed++] = data[consumed++];
+        }
+        if (_fieldUsed == 4) {
+          uint32_t magic = (uint32_t)_field[0] | ((uint32_t)_field[1] << 8) |
+                           ((uint32_t)_field[2] << 16) |
+                           ((uint32_t)_field[3] << 24);
+          if (magic != LZSS_MAGIC) {
+            _fail(OTA_ERR_PROTOCOL);
+            break;
+          }
+          _fieldUsed = 0;
+          _state = LZSS_FLAGS;
+        }
+        break;
+
+      case LZSS_FLAGS:
+        _flags = data[consumed++];
+        _items = 8;
+        _state = LZSS_ITEM;
+        break;
+
+      case LZSS_ITEM:
+        if (!_item(data, length, &consumed)) {
+          break;
+        }
+        _flags >>= 1;
+        if (--_items == 0) {
+          _state = LZSS_FLAGS;
+        }
+        if (_produced - _flushed >= FLUSH_SIZE) {
+          _flush();
+        }
+        break;
+    }
+  }
+
+  if (_receiver->state() == OTA_RECEIVING) {
+    _flush();
+  }
+  return consumed;
+}
+
+/**
+ * The payload must end between items
+ */
+bool LzssDecoder::finish() {
+  if (_receiver->state() != OTA_RECEIVING) {
+    return false;
+  }
+  if (_state == LZSS_PREAMBLE || _fieldUsed) {
+    _fail(OTA_ERR_PROTOCOL);
+    return false;
+  }
+  if (!_flush()) {
+    return false;
+  }
+
+  free(_window);
+  _window = nullptr;
+  return true;
+}
+
+/**
+ * Decode the next item into the window
+ * @return true once the item is complete, false if it needs more data or
+ *         is invalid
+ */
+bool LzssDecoder::_item(const uint8_t *data, size_t length, size_t *consumed) {
+  if (_flags & 1) {
+    _window[_produced++ & (WINDOW - 1)] = data[(*consumed)++];
+    return true;
+  }
+
+  while (_fieldUsed < 2 && *consumed < length) {
+    _field[_fieldUsed++] = data[(*consumed)++];
+  }
+  if (_fieldUsed < 2) {
+    return false;
+  }
+  _fieldUsed = 0;
+
+  uint16_t match = (uint16_t)_field[0] | ((uint16_t)_field[1] << 8);
+  uint32_t distance = (match & (WINDOW - 1)) + 1;
+  size_t n = (match >> WINDOW_BITS) + MIN_MATCH;
+  if (distance > _produced) {
+    _fail(OTA_ERR_PROTOCOL);
+    return false;
+  }
+
+  /* Byte by byte, as a match may overlap what it produces */
+  while (n--) {
+    _window[_produced & (WINDOW - 1)] =
+      _window[(_produced - distance) & (WINDOW - 1)];
+    _produced++;
+  }
+  return true;
+}
+
+/**
+ * Pass what has been produced to the receiver, in two pieces if it wraps
+ * around the end of the window
+ */
+bool LzssDecoder::_flush() {
+  while (_flushed < _produced) {
+    size_t start = _flushed & (WINDOW - 1);
+    size_t n = _produced - _flushed;
+    if (n > WINDOW - start) {
+      n = WINDOW - start;
+    }
+    if (!_receiver->write(&_window[start], n)) {
+      return false;
+    }
+    _flushed += n;
+  }
+  return true;
+}
+
+void LzssDecoder::_fail(uint8_t error) {
+  _receiver->abort(error);
+  free(_window);
+  _window = nullptr;
+}
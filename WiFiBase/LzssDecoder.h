@@ -0,0 +1,74 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Decompresses an LZSS compressed image as it arrives.
+ *
+ * Design:
+ *   A compressed image starts with LZSS_MAGIC, followed by groups of up to
+ * eight items each led by a flag byte, whose bits from the lowest up give
+ * each item's kind:
+ *
+ *     1: a literal byte
+ *     0: a match, a little-endian u16 with the distance back less one in
+ *        the low 12 bits and the length less MIN_MATCH in the high 4
+ *
+ * so a match repeats 3 to 18 bytes from up to WINDOW bytes earlier.  The
+ * small window is what suits the ESP32: it is the only RAM used beyond the
+ * OTAReceiver's pages, allocated by begin() and released by finish().
+ *
+ *   Output is built in the window itself and passed to the receiver in
+ * pieces of at least FLUSH_SIZE, so decompression keeps pace with the link
+ * and the time taken is that of writing the image to flash.  Each byte of
+ * payload produces at most a few bytes of image, so nothing is held back.
+ */
+
+#ifndef LZSSDECODER_H
+#define LZSSDECODER_H
+
+#include "OTADecoder.h"
+
+#define LZSS_MAGIC 0x5A424657  // "WFBZ"
+
+class LzssDecoder : public OTADecoder {
+  public:
+    static const size_t WINDOW_BITS = 12;
+    static const size_t WINDOW = 1 << WINDOW_BITS;
+    static const size_t MIN_MATCH = 3;
+    static const size_t MAX_MATCH = MIN_MATCH + 15;
+    static const size_t FLUSH_SIZE = 512;
+
+    LzssDecoder();
+    ~LzssDecoder();
+
+    bool begin(OTAReceiver *receiver);
+    size_t write(const uint8_t *data, size_t length);
+    bool finish();
+
+  protected:
+    typedef enum {
+      LZSS_PREAMBLE,
+      LZSS_FLAGS,
+      LZSS_ITEM,
+    } lzss_state_t;
+
+    OTAReceiver *_receiver;
+    uint8_t *_window;
+
+    uint8_t _state;
+    uint8_t _field[4];
+    size_t _fieldUsed;
+    uint8_t _flags;
+    uint8_t _items;
+
+    /* Bytes produced, and those passed to the receiver */
+    uint32_t _produced;
+    uint32_t _flushed;
+
+    bool _item(const uint8_t *data, size_t length, size_t *consumed);
+    bool _flush();
+    void _fail(uint8_t error);
+};
+
+#endif // LZSSDECODER_H
@@ -0,0 +1,54 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Interface to decoders producing an image from an encoded update payload.
+ *
+ * Design:
+ *   The OTAServer passes the payload to a decoder as it is received, and the
+ * decoder writes the image it produces to the OTAReceiver, which verifies
+ * the image as it would a full one.  A decoder may produce much more than it
+ * is given, so it can hold output back: write() then consumes only part of
+ * the data, and pump() produces the held back output a bounded amount at a
+ * time so that no single call takes long.
+ *
+ *   A decoder that finds the payload invalid aborts the receiver with the
+ * reason, which the server reports to the sender.
+ */
+
+#ifndef OTADECODER_H
+#define OTADECODER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "OTAReceiver.h"
+
+class OTADecoder {
+  public:
+    virtual ~OTADecoder() {}
+
+    /* Start decoding a payload into the receiver, once it has begun */
+    virtual bool begin(OTAReceiver *receiver) = 0;
+
+    /*
+     * Decode from the data
+     * @return The bytes consumed, fewer than given while output is held back
+     */
+    virtual size_t write(const uint8_t *data, size_t length) = 0;
+
+    /* Whether output is held back */
+    virtual bool busy() { return false; }
+
+    /*
+     * Produce up to limit bytes of held back output
+     * @return The bytes produced
+     */
+    virtual size_t pump(size_t limit) { return 0; }
+
+    /* Check that the payload ended where it should */
+    virtual bool finish() = 0;
+};
+
+#endif // OTADECODER_H
@@ -0,0 +1,87 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * ESP32 implementation of the OTAFlash interface
+ */
+
+#ifdef ARDUINO
+
+#include <Arduino.h>
+#include <esp_ota_ops.h>
+#include <esp_image_format.h>
+#include <esp_spi_flash.h>
+
+#ifdef DEBUG_LEVEL_OTAFLASH
+  #define DEBUG_LEVEL DEBUG_LEVEL_OTAFLASH
+#endif
+#ifndef DEBUG_LEVEL
+  #define DEBUG_LEVEL DEBUG_HIGH
+#endif
+#include <Debug.h>
+
+#include "OTAFlash.h"
+
+ESPPartitionFlash::ESPPartitionFlash(const esp_partition_t *partition) {
+  _partition = partition ? partition : esp_ota_get_next_update_partition(nullptr);
+  if (!_partition) {
+    DEBUG_ERR("OTA: no update partition");
+  }
+}
+
+size_t ESPPartitionFlash::size() {
+  return _partition ? _partition->size : 0;
+}
+
+size_t ESPPartitionFlash::pageSize() {
+  return SPI_FLASH_SEC_SIZE;
+}
+
+bool ESPPartitionFlash::erase(size_t offset, size_t length) {
+  return _partition &&
+         esp_partition_erase_range(_partition, offset, length) == ESP_OK;
+}
+
+bool ESPPartitionFlash::write(size_t offset, const uint8_t *data,
+                              size_t length) {
+  return _partition &&
+         esp_partition_write(_partition, offset, data, length) == ESP_OK;
+}
+
+bool ESPPartitionFlash::read(size_t offset, uint8_t *data, size_t length) {
+  return _partition &&
+         esp_partition_read(_partition, offset, data, length) == ESP_OK;
+}
+
+/**
+ * Set the boot partition, which also has the SDK verify the image
+ */
+bool ESPPartitionFlash::activate() {
+  if (!_partition) {
+    return false;
+  }
+
+  esp_err_t err = esp_ota_set_boot_partition(_partition);
+  if (err != ESP_OK) {
+    DEBUG_ERR("OTA: image not bootable");
+    return false;
+  }
+  return true;
+}
+
+size_t ESPPartitionFlash::imageSize() {
+  esp_image_metadata_t data;
+
+  if (!_partition) {
+    return 0;
+  }
+
+  const esp_partition_pos_t pos = { _partition->address, _partition->size };
+  if (esp_image_verify(ESP_IMAGE_VERIFY_SILENT, &pos, &data) != ESP_OK) {
+    return 0;
+  }
+  return data.image_len;
+}
+
+#endif
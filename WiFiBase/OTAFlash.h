@@ -0,0 +1,68 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Interface to the flash partition a firmware image is written into.
+ *
+ * Design:
+ *   Updates are written against this interface rather than the ESP-IDF
+ * partition API, so that the receive path can be tested and benchmarked on
+ * the host with a file standing in for the partition.  Like NOR flash, an
+ * erased page reads as 0xFF and writes can only clear bits, so bytes written
+ * as 0xFF can be written again later without an erase.
+ *
+ *   ESPPartitionFlash writes the OTA partition that isn't running, and
+ * activate() makes it the boot partition only once the image is complete.
+ */
+
+#ifndef OTAFLASH_H
+#define OTAFLASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+class OTAFlash {
+  public:
+    virtual ~OTAFlash() {}
+
+    virtual size_t size() = 0;
+
+    /* Erase granularity, writes are made in pages of this size */
+    virtual size_t pageSize() = 0;
+
+    virtual bool erase(size_t offset, size_t length) = 0;
+    virtual bool write(size_t offset, const uint8_t *data, size_t length) = 0;
+    virtual bool read(size_t offset, uint8_t *data, size_t length) = 0;
+
+    /* Boot from the partition on the next restart */
+    virtual bool activate() = 0;
+};
+
+#ifdef ARDUINO
+#include <esp_partition.h>
+
+/*
+ * Flash implementation writing an ESP32 OTA partition
+ */
+class ESPPartitionFlash : public OTAFlash {
+  public:
+    /* The next update partition unless another is given */
+    ESPPartitionFlash(const esp_partition_t *partition = nullptr);
+
+    size_t size();
+    size_t pageSize();
+    bool erase(size_t offset, size_t length);
+    bool write(size_t offset, const uint8_t *data, size_t length);
+    bool read(size_t offset, uint8_t *data, size_t length);
+    bool activate();
+
+    /* Length of the app image held, 0 if there isn't a valid one */
+    size_t imageSize();
+
+  protected:
+    const esp_partition_t *_partition;
+};
+#endif
+
+#endif // OTAFLASH_H
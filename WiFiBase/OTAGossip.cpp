@@ -0,0 +1,343 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ */
+
+#include <string.h>
+
+#include "OTAGossip.h"
+
+OTAGossip::OTAGossip() {
+  _runningVersion = 0;
+  _capacity = 0;
+  _random = 1;
+  _target(0, 0, nullptr, true);
+}
+
+void OTAGossip::seed(uint32_t seed) {
+  _random = seed ? seed : 1;
+}
+
+bool OTAGossip::hold(uint32_t version, uint32_t size, const uint8_t *sha256,
+                     uint32_t capacity) {
+  if (!size || size > MAX_CHUNKS * CHUNK_SIZE) {
+    return false;
+  }
+  _runningVersion = version;
+  _capacity = capacity;
+  _target(version, size, sha256, true);
+  return true;
+}
+
+/**
+ * Record the peer's chunks if it holds our target, or adopt its image if
+ * newer and small enough to pull
+ */
+bool OTAGossip::heard(uint32_t ip, const gossip_advert_t *advert,
+                      unsigned long now) {
+  bool adopted = false;
+
+  if (advert->magic != GOSSIP_MAGIC) {
+    return false;
+  }
+
+  if (advert->size != _size ||
+      memcmp(advert->sha256, _sha256, SHA256_DIGEST_SIZE) != 0) {
+    if (advert->version <= _version || !advert->size ||
+        advert->size > _capacity || advert->size > MAX_CHUNKS * CHUNK_SIZE) {
+      return false;
+    }
+    _target(advert->version, advert->size, advert->sha256, false);
+    adopted = true;
+  }
+
+  /* Peers are only needed while pulling */
+  if (!downloading() || !advert->held) {
+    return adopted;
+  }
+
+  gossip_peer_t *peer = nullptr;
+  for (uint8_t i = 0; i < _numPeers; i++) {
+    if (_peers[i].ip == ip && _peers[i].port == advert->port) {
+      peer = &_peers[i];
+      break;
+    }
+  }
+  if (!peer) {
+    if (_numPeers < MAX_PEERS) {
+      peer = &_peers[_numPeers++];
+    } else {
+      peer = &_peers[0];
+      for (uint8_t i = 1; i < _numPeers; i++) {
+        if ((long)(_peers[i].lastHeard - peer->lastHeard) < 0) {
+          peer = &_peers[i];
+        }
+      }
+    }
+    peer->ip = ip;
+    peer->port = advert->port;
+    peer->busyUntil = now;
+  }
+  peer->lastHeard = now;
+  memcpy(peer->bitmap, advert->bitmap, GOSSIP_BITMAP_SIZE);
+  _changed = true;
+
+  return adopted;
+}
+
+void OTAGossip::advert(gossip_advert_t *advert, uint16_t port) {
+  advert->magic = GOSSIP_MAGIC;
+  advert->version = _version;
+  advert->size = _size;
+  memcpy(advert->sha256, _sha256, SHA256_DIGEST_SIZE);
+  advert->port = port;
+  advert->held = _held;
+  memcpy(advert->bitmap, _bitmap, GOSSIP_BITMAP_SIZE);
+}
+
+/**
+ * Choose the rarest chunk that a peer free to send it holds
+ */
+bool OTAGossip::next(unsigned long now, gossip_transfer_t *transfer) {
+  if (!downloading() || complete()) {
+    return false;
+  }
+  _expire(now);
+
+  gossip_slot_t *slot = nullptr;
+  for (uint8_t i = 0; i < MAX_TRANSFERS; i++) {
+    if (!_slots[i].active) {
+      slot = &_slots[i];
+      break;
+    }
+  }
+  if (!slot || (!_changed && (long)(now - _nextAttempt) < 0)) {
+    return false;
+  }
+
+  /* Whether each peer may be asked for a chunk now */
+  bool ready[MAX_PEERS];
+  for (uint8_t i = 0; i < _numPeers; i++) {
+    ready[i] = (long)(now - _peers[i].busyUntil) >= 0 &&
+               !_serving(&_peers[i]);
+  }
+
+  int chosen = -1;
+  uint8_t rarest = 0;
+  uint32_t ties = 0;
+  for (uint16_t chunk = 0; chunk < _chunks; chunk++) {
+    if (_bit(_bitmap, chunk) || _pulling(chunk)) {
+      continue;
+    }
+
+    uint8_t count = 0;
+    bool available = false;
+    for (uint8_t i = 0; i < _numPeers; i++) {
+      if (_bit(_peers[i].bitmap, chunk)) {
+        count++;
+        available |= ready[i];
+      }
+    }
+    if (!available) {
+      continue;
+    }
+
+    if (chosen < 0 || count < rarest) {
+      chosen = chunk;
+      rarest = count;
+      ties = 1;
+    } else if (count == rarest && _rand() % ++ties == 0) {
+      chosen = chunk;
+    }
+  }
+  if (chosen < 0) {
+    _nextAttempt = now + RETRY_INTERVAL;
+    _changed = false;
+    return false;
+  }
+
+  /* Any of the peers free to send it */
+  gossip_peer_t *peer = nullptr;
+  ties = 0;
+  for (uint8_t i = 0; i < _numPeers; i++) {
+    if (ready[i] && _bit(_peers[i].bitmap, chosen) && _rand() % ++ties == 0) {
+      peer = &_peers[i];
+    }
+  }
+
+  slot->active = true;
+  slot->transfer.ip = peer->ip;
+  slot->transfer.port = peer->port;
+  slot->transfer.chunk = chosen;
+  slot->transfer.started = now;
+  *transfer = slot->transfer;
+  return true;
+}
+
+void OTAGossip::received(uint16_t chunk) {
+  for (uint8_t i = 0; i < MAX_TRANSFERS; i++) {
+    if (_slots[i].active && _slots[i].transfer.chunk == chunk) {
+      _slots[i].active = false;
+    }
+  }
+  if (chunk < _chunks && !_bit(_bitmap, chunk)) {
+    _bitmap[chunk / 8] |= 1 << (chunk % 8);
+    _held++;
+  }
+  _changed = true;
+}
+
+/**
+ * Free the transfer, leaving a busy peer alone for a while and forgetting
+ * one that failed until it is heard from again
+ */
+void OTAGossip::failed(uint16_t chunk, bool busy, unsigned long now) {
+  for (uint8_t s = 0; s < MAX_TRANSFERS; s++) {
+    gossip_slot_t *slot = &_slots[s];
+    if (!slot->active || slot->transfer.chunk != chunk) {
+      continue;
+    }
+    slot->active = false;
+
+    for (uint8_t i = 0; i < _numPeers; i++) {
+      if (_peers[i].ip != slot->transfer.ip ||
+          _peers[i].port != slot->transfer.port) {
+        continue;
+      }
+      if (busy) {
+        _peers[i].busyUntil = now + BUSY_BACKOFF;
+      } else {
+        _peers[i] = _peers[--_numPeers];
+      }
+      break;
+    }
+  }
+  _changed = true;
+}
+
+bool OTAGossip::downloading() {
+  return (_version != _runningVersion);
+}
+
+bool OTAGossip::complete() {
+  return downloading() && _held == _chunks;
+}
+
+void OTAGossip::reset() {
+  memset(_bitmap, 0, sizeof (_bitmap));
+  _held = 0;
+  for (uint8_t i = 0; i < MAX_TRANSFERS; i++) {
+    _slots[i].active = false;
+  }
+  _changed = true;
+}
+
+uint32_t OTAGossip::version() {
+  return _version;
+}
+
+uint32_t OTAGossip::size() {
+  return _size;
+}
+
+const uint8_t *OTAGossip::sha256() {
+  return _sha256;
+}
+
+uint16_t OTAGossip::chunks() {
+  return _chunks;
+}
+
+uint16_t OTAGossip::held() {
+  return _held;
+}
+
+bool OTAGossip::has(uint16_t chunk) {
+  return chunk < _chunks && _bit(_bitmap, chunk);
+}
+
+uint8_t OTAGossip::peers() {
+  return _numPeers;
+}
+
+uint8_t OTAGossip::transfers() {
+  uint8_t count = 0;
+  for (uint8_t i = 0; i < MAX_TRANSFERS; i++) {
+    if (_slots[i].active) {
+      count++;
+    }
+  }
+  return count;
+}
+
+void OTAGossip::_target(uint32_t version, uint32_t size,
+                        const uint8_t *sha256, bool held) {
+  _version = version;
+  _size = size;
+  if (sha256) {
+    memcpy(_sha256, sha256, SHA256_DIGEST_SIZE);
+  } else {
+    memset(_sha256, 0, SHA256_DIGEST_SIZE);
+  }
+  _chunks = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+
+  memset(_bitmap, 0, sizeof (_bitmap));
+  _held = 0;
+  if (held) {
+    for (uint16_t chunk = 0; chunk < _chunks; chunk++) {
+      _bitmap[chunk / 8] |= 1 << (chunk % 8);
+    }
+    _held = _chunks;
+  }
+
+  _numPeers = 0;
+  for (uint8_t i = 0; i < MAX_TRANSFERS; i++) {
+    _slots[i].active = false;
+  }
+  _nextAttempt = 0;
+  _changed = true;
+}
+
+/**
+ * Forget peers that haven't been heard from
+ */
+void OTAGossip::_expire(unsigned long now) {
+  for (uint8_t i = 0; i < _numPeers; ) {
+    if (now - _peers[i].lastHeard > PEER_TIMEOUT) {
+      _peers[i] = _peers[--_numPeers];
+    } else {
+      i++;
+    }
+  }
+}
+
+bool OTAGossip::_pulling(uint16_t chunk) {
+  for (uint8_t i = 0; i < MAX_TRANSFERS; i++) {
+    if (_slots[i].active && _slots[i].transfer.chunk == chunk) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool OTAGossip::_serving(const gossip_peer_t *peer) {
+  for (uint8_t i = 0; i < MAX_TRANSFERS; i++) {
+    if (_slots[i].active && _slots[i].transfer.ip == peer->ip &&
+        _slots[i].transfer.port == peer->port) {
+      return true;
+    }
+  }
+  return false;
+}
+
+uint32_t OTAGossip::_rand() {
+  _random ^= _random << 13;
+  _random ^= _random >> 17;
+  _random ^= _random << 5;
+  return _random;
+}
+
+bool OTAGossip::_bit(const uint8_t *bitmap, uint16_t chunk) {
+  return bitmap[chunk / 8] & (1 << (chunk % 8));
+}
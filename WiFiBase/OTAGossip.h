@@ -0,0 +1,159 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Decides which firmware chunks a node pulls from its peers.
+ *
+ * Design:
+ *   Every node periodically advertises the newest image it holds, complete
+ * or not, as its version, size and SHA-256 with a bitmap of the chunks it
+ * has.  A node hearing of a newer image than it holds adopts it as its
+ * target, and from then on pulls the target's chunks from peers advertising
+ * them, and advertises the chunks it has in turn.  An update pushed to a
+ * single node so spreads across the fleet with each node sending to a few
+ * others, rather than one server sending to them all.
+ *
+ *   Chunks are pulled rarest first: of the chunks still missing, the one
+ * held by the fewest known peers is chosen, ties broken at random so that
+ * nodes spread across chunks.  That keeps every chunk available from many
+ * peers as the update spreads, rather than all nodes waiting on the few
+ * holding the last chunks.  At most MAX_TRANSFERS chunks are pulled at once,
+ * each from a different peer, and a peer that is busy is left alone for
+ * BUSY_BACKOFF.
+ *
+ *   This class holds only the decisions, and none of the networking, so
+ * that it can be tested and simulated across many nodes on the host.  The
+ * peer table is bounded, with the least recently heard peer replaced, so
+ * that memory doesn't grow with the size of the fleet.
+ */
+
+#ifndef OTAGOSSIP_H
+#define OTAGOSSIP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "Sha256.h"
+
+#define GOSSIP_MAGIC       0x47424657  // "WFBG"
+#define GOSSIP_MAX_CHUNKS  512
+#define GOSSIP_BITMAP_SIZE (GOSSIP_MAX_CHUNKS / 8)
+
+/* Fields are little-endian */
+typedef struct __attribute__((packed)) {
+  uint32_t magic;
+  uint32_t version;                     // Higher is newer
+  uint32_t size;
+  uint8_t  sha256[SHA256_DIGEST_SIZE];
+  uint16_t port;                        // Chunks are requested from
+  uint16_t held;                        // Chunks set in the bitmap
+  uint8_t  bitmap[GOSSIP_BITMAP_SIZE];
+} gossip_advert_t;
+
+typedef struct {
+  uint32_t      ip;
+  uint16_t      port;
+  uint16_t      chunk;
+  unsigned long started;
+} gossip_transfer_t;
+
+class OTAGossip {
+  public:
+    static const size_t CHUNK_SIZE = 4096;  // A flash page
+    static const uint16_t MAX_CHUNKS = GOSSIP_MAX_CHUNKS;
+    static const uint8_t MAX_PEERS = 16;
+    static const uint8_t MAX_TRANSFERS = 2;
+    static const unsigned long PEER_TIMEOUT = 30 * 1000;
+    static const unsigned long TRANSFER_TIMEOUT = 10 * 1000;
+    static const unsigned long BUSY_BACKOFF = 1000;
+    static const unsigned long RETRY_INTERVAL = 200;
+
+    OTAGossip();
+
+    /* Randomise choices, differently on each node */
+    void seed(uint32_t seed);
+
+    /* The image running, held complete, and the largest that can be pulled */
+    bool hold(uint32_t version, uint32_t size, const uint8_t *sha256,
+              uint32_t capacity);
+
+    /*
+     * Learn what a peer holds
+     * @return true if its image was adopted as the new target
+     */
+    bool heard(uint32_t ip, const gossip_advert_t *advert, unsigned long now);
+
+    /* Describe the newest image held, complete or not */
+    void advert(gossip_advert_t *advert, uint16_t port);
+
+    /*
+     * Choose the next chunk to pull and from whom, if a transfer may start
+     * @return false if there is nothing to start now
+     */
+    bool next(unsigned long now, gossip_transfer_t *transfer);
+
+    /* A transfer finished with the chunk written, or failed */
+    void received(uint16_t chunk);
+    void failed(uint16_t chunk, bool busy, unsigned long now);
+
+    /* Whether a newer image than the one running is being pulled */
+    bool downloading();
+
+    /* All chunks of the newer image are held */
+    bool complete();
+
+    /* Drop the chunks pulled, such as when the image doesn't verify */
+    void reset();
+
+    uint32_t version();
+    uint32_t size();
+    const uint8_t *sha256();
+    uint16_t chunks();
+    uint16_t held();
+    bool has(uint16_t chunk);
+    uint8_t peers();
+    uint8_t transfers();
+
+  protected:
+    typedef struct {
+      uint32_t      ip;
+      uint16_t      port;
+      unsigned long lastHeard;
+      unsigned long busyUntil;
+      uint8_t       bitmap[GOSSIP_BITMAP_SIZE];
+    } gossip_peer_t;
+
+    typedef struct {
+      bool          active;
+      gossip_transfer_t transfer;
+    } gossip_slot_t;
+
+    /* Image running, and the target which is it unless downloading */
+    uint32_t _runningVersion;
+    uint32_t _capacity;
+    uint32_t _version;
+    uint32_t _size;
+    uint8_t _sha256[SHA256_DIGEST_SIZE];
+    uint16_t _chunks;
+    uint16_t _held;
+    uint8_t _bitmap[GOSSIP_BITMAP_SIZE];
+
+    gossip_peer_t _peers[MAX_PEERS];
+    uint8_t _numPeers;
+    gossip_slot_t _slots[MAX_TRANSFERS];
+    unsigned long _nextAttempt;  // Scan again no sooner, unless
+    bool _changed;               // peers or chunks have changed since
+    uint32_t _random;
+
+    void _target(uint32_t version, uint32_t size, const uint8_t *sha256,
+                 bool held);
+    void _expire(unsigned long now);
+    bool _pulling(uint16_t chunk);
+    bool _serving(const gossip_peer_t *peer);
+    uint32_t _rand();
+
+    static bool _bit(const uint8_t *bitmap, uint16_t chunk);
+};
+
+#endif // OTAGOSSIP_H
@@ -0,0 +1,663 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef ARDUINO
+  #include <Arduino.h>
+  #include <lwip/sockets.h>
+#else
+  #include <time.h>
+  #include <fcntl.h>
+  #include <unistd.h>
+  #include <arpa/inet.h>
+  #include <netinet/in.h>
+  #include <sys/select.h>
+  #include <sys/socket.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+  #define MSG_NOSIGNAL 0
+#endif
+
+#include "OTAGossipNode.h"
+
+#define WRITE_ALIGN 16
+
+OTAGossipNode::OTAGossipNode(OTAFlash *running, OTAFlash *update,
+                             uint16_t port) {
+  _running = running;
+  _update = update;
+  _port = port;
+  _udpFd = -1;
+  _listenFd = -1;
+  _broadcast = true;
+  _lastAdvert = 0;
+  _advertised = false;
+  _numAdded = 0;
+  for (uint8_t i = 0; i < MAX_UPLOADS; i++) {
+    _uploads[i].fd = -1;
+  }
+  for (uint8_t i = 0; i < OTAGossip::MAX_TRANSFERS; i++) {
+    _downloads[i].fd = -1;
+    _downloads[i].page = nullptr;
+  }
+  memset(_header, 0xFF, sizeof (_header));
+  _complete = false;
+  _chunksSent = 0;
+  _chunksReceived = 0;
+  _failures = 0;
+}
+
+OTAGossipNode::~OTAGossipNode() {
+  stop();
+}
+
+/**
+ * Hash the running image and start listening for adverts and requests
+ * @return false if the image can't be read or the ports are unavailable
+ */
+bool OTAGossipNode::begin(uint32_t version, uint32_t size, uint32_t seed) {
+  struct sockaddr_in addr;
+  int one = 1;
+
+  if (_listenFd >= 0) {
+    return true;
+  }
+  if (!size || size > _running->size() ||
+      OTAGossip::CHUNK_SIZE % _update->pageSize() != 0) {
+    return false;
+  }
+
+  Sha256 hash;
+  uint8_t *buffer = _uploads[0].piece;
+  for (uint32_t offset = 0; offset < size; offset += PIECE_SIZE) {
+    size_t length = (size - offset < PIECE_SIZE) ? size - offset : PIECE_SIZE;
+    if (!_running->read(offset, buffer, length)) {
+      return false;
+    }
+    hash.update(buffer, length);
+  }
+  uint8_t sha256[SHA256_DIGEST_SIZE];
+  hash.finish(sha256);
+
+  _gossip.seed(seed);
+  if (!_gossip.hold(version, size, sha256, _update->size())) {
+    return false;
+  }
+  _complete = false;
+
+  _listenFd = socket(AF_INET, SOCK_STREAM, 0);
+  if (_listenFd < 0) {
+    return false;
+  }
+  setsockopt(_listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+
+  memset(&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(_port);
+  if (bind(_listenFd, (struct sockaddr *)&addr, sizeof (addr)) < 0 ||
+      listen(_listenFd, MAX_UPLOADS) < 0) {
+    stop();
+    return false;
+  }
+  fcntl(_listenFd, F_SETFL, fcntl(_listenFd, F_GETFL, 0) | O_NONBLOCK);
+
+  if (_port == 0) {
+    socklen_t len = sizeof (addr);
+    getsockname(_listenFd, (struct sockaddr *)&addr, &len);
+    _port = ntohs(addr.sin_port);
+  }
+
+  /* Adverts are heard on the same port number as requests */
+  _udpFd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (_udpFd < 0) {
+    stop();
+    return false;
+  }
+  setsockopt(_udpFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+  setsockopt(_udpFd, SOL_SOCKET, SO_BROADCAST, &one, sizeof (one));
+  if (bind(_udpFd, (struct sockaddr *)&addr, sizeof (addr)) < 0) {
+    stop();
+    return false;
+  }
+  fcntl(_udpFd, F_SETFL, fcntl(_udpFd, F_GETFL, 0) | O_NONBLOCK);
+
+  _advertised = false;
+  return true;
+}
+
+void OTAGossipNode::stop() {
+  _cancel();
+  for (uint8_t i = 0; i < MAX_UPLOADS; i++) {
+    if (_uploads[i].fd >= 0) {
+      close(_uploads[i].fd);
+      _uploads[i].fd = -1;
+    }
+  }
+  if (_udpFd >= 0) {
+    close(_udpFd);
+    _udpFd = -1;
+  }
+  if (_listenFd >= 0) {
+    close(_listenFd);
+    _listenFd = -1;
+  }
+}
+
+uint16_t OTAGossipNode::port() {
+  return _port;
+}
+
+bool OTAGossipNode::addPeer(uint32_t ip, uint16_t port) {
+  if (_numAdded >= MAX_ADDED_PEERS) {
+    return false;
+  }
+  _added[_numAdded].ip = ip;
+  _added[_numAdded].port = port;
+  _numAdded++;
+  return true;
+}
+
+void OTAGossipNode::setBroadcast(bool broadcast) {
+  _broadcast = broadcast;
+}
+
+void OTAGossipNode::handle() {
+  if (_listenFd < 0) {
+    return;
+  }
+  unsigned long now = _millis();
+
+  _listen(now);
+  _advertise(now);
+
+  _accept();
+  for (uint8_t i = 0; i < MAX_UPLOADS; i++) {
+    if (_uploads[i].fd >= 0) {
+      _serve(&_uploads[i]);
+    }
+  }
+
+  if (_complete) {
+    return;
+  }
+  _pull(now);
+  for (uint8_t i = 0; i < OTAGossip::MAX_TRANSFERS; i++) {
+    _download(&_downloads[i], now);
+  }
+  if (_gossip.complete()) {
+    _verify();
+  }
+}
+
+bool OTAGossipNode::complete() {
+  return _complete;
+}
+
+OTAGossip *OTAGossipNode::gossip() {
+  return &_gossip;
+}
+
+uint32_t OTAGossipNode::chunksSent() {
+  return _chunksSent;
+}
+
+uint32_t OTAGossipNode::chunksReceived() {
+  return _chunksReceived;
+}
+
+uint32_t OTAGossipNode::failures() {
+  return _failures;
+}
+
+void OTAGossipNode::_advertise(unsigned long now) {
+  if (_advertised && now - _lastAdvert < ADVERT_INTERVAL) {
+    return;
+  }
+  _advertised = true;
+  _lastAdvert = now;
+
+  gossip_advert_t advert;
+  _gossip.advert(&advert, _port);
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  if (_broadcast) {
+    addr.sin_addr.s_addr = htonl(INADDR_BROADCAST);
+    addr.sin_port = htons(_port);
+    sendto(_udpFd, &advert, sizeof (advert), 0, (struct sockaddr *)&addr,
+           sizeof (addr));
+  }
+  for (uint8_t i = 0; i < _numAdded; i++) {
+    addr.sin_addr.s_addr = _added[i].ip;
+    addr.sin_port = htons(_added[i].port);
+    sendto(_udpFd, &advert, sizeof (advert), 0, (struct sockaddr *)&addr,
+           sizeof (addr));
+  }
+}
+
+/**
+ * Pass on the adverts heard, dropping any transfers of an image replaced
+ */
+void OTAGossipNode::_listen(unsigned long now) {
+  gossip_advert_t advert;
+  struct sockaddr_in from;
+
+  while (true) {
+    socklen_t len = sizeof (from);
+    int result = recvfrom(_udpFd, &advert, sizeof (advert), 0,
+                          (struct sockaddr *)&from, &len);
+    if (result < 0) {
+      return;
+    }
+
+    /* Once activated the image pulled is kept until restarting */
+    if (result != sizeof (advert) || _complete) {
+      continue;
+    }
+    if (_gossip.heard(from.sin_addr.s_addr, &advert, now)) {
+      _cancel();
+    }
+  }
+}
+
+/**
+ * Accept requests while uploads are free, and turn away the rest
+ */
+void OTAGossipNode::_accept() {
+  while (true) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof (addr);
+    int fd = accept(_listenFd, (struct sockaddr *)&addr, &len);
+    if (fd < 0) {
+      return;
+    }
+
+    gossip_upload_t *upload = nullptr;
+    for (uint8_t i = 0; i < MAX_UPLOADS; i++) {
+      if (_uploads[i].fd < 0) {
+        upload = &_uploads[i];
+        break;
+      }
+    }
+    if (!upload) {
+      ota_reply_t reply;
+      memset(&reply, 0, sizeof (reply));
+      reply.magic = OTA_MAGIC;
+      reply.status = OTA_REPLY_BUSY;
+      send(fd, &reply, sizeof (reply), MSG_NOSIGNAL | MSG_DONTWAIT);
+      close(fd);
+      continue;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    upload->fd = fd;
+    upload->state = UPLOAD_REQUEST;
+    upload->requested = 0;
+    upload->lastActive = _millis();
+  }
+}
+
+/**
+ * Read the request, then send the reply and chunk as the socket allows
+ */
+void OTAGossipNode::_serve(gossip_upload_t *upload) {
+  if (upload->state == UPLOAD_REQUEST) {
+    int result = recv(upload->fd, (uint8_t *)&upload->request +
+                      upload->requested,
+                      sizeof (upload->request) - upload->requested, 0);
+    if (result == 0 ||
+        (result < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+      close(upload->fd);
+      upload->fd = -1;
+      return;
+    }
+    if (result > 0) {
+      upload->requested += result;
+      upload->lastActive = _millis();
+    }
+
+    if (upload->requested == sizeof (upload->request)) {
+      gossip_request_t *request = &upload->request;
+      bool ok = request->magic == GOSSIP_MAGIC &&
+                memcmp(request->sha256, _gossip.sha256(),
+                       SHA256_DIGEST_SIZE) == 0 &&
+                _gossip.has(request->chunk);
+
+      ota_reply_t reply;
+      memset(&reply, 0, sizeof (reply));
+      reply.magic = OTA_MAGIC;
+      reply.status = ok ? OTA_REPLY_OK : OTA_REPLY_ERROR;
+      reply.offset = request->chunk;
+      memcpy(upload->piece, &reply, sizeof (reply));
+
+      upload->state = UPLOAD_SENDING;
+      upload->length = ok ? _chunkLength(request->chunk) : 0;
+      upload->sent = 0;
+      upload->pieceLength = sizeof (reply);
+      upload->pieceSent = 0;
+    }
+  }
+
+  while (upload->state == UPLOAD_SENDING) {
+    if (upload->pieceSent == upload->pieceLength) {
+      if (upload->sent == upload->length) {
+        if (upload->length) {
+          _chunksSent++;
+        }
+        close(upload->fd);
+        upload->fd = -1;
+        return;
+      }
+      if (!_readPiece(upload)) {
+        close(upload->fd);
+        upload->fd = -1;
+        return;
+      }
+    }
+
+    int result = send(upload->fd, upload->piece + upload->pieceSent,
+                      upload->pieceLength - upload->pieceSent, MSG_NOSIGNAL);
+    if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    if (result <= 0) {
+      close(upload->fd);
+      upload->fd = -1;
+      return;
+    }
+    upload->pieceSent += result;
+    upload->lastActive = _millis();
+  }
+
+  if (_millis() - upload->lastActive > IDLE_TIMEOUT) {
+    close(upload->fd);
+    upload->fd = -1;
+  }
+}
+
+/**
+ * Read the next piece of the chunk requested, from the image pulled with the
+ * start that is held back, or from the running image
+ */
+bool OTAGossipNode::_readPiece(gossip_upload_t *upload) {
+  uint32_t offset = upload->request.chunk * OTAGossip::CHUNK_SIZE +
+                    upload->sent;
+  size_t length = upload->length - upload->sent;
+  if (length > PIECE_SIZE) {
+    length = PIECE_SIZE;
+  }
+
+  if (!_gossip.downloading()) {
+    if (!_running->read(offset, upload->piece, length)) {
+      return false;
+    }
+  } else {
+    if (!_update->read(offset, upload->piece, length)) {
+      return false;
+    }
+    if (offset < OTA_HEADER_HOLD) {
+      size_t held = OTA_HEADER_HOLD - offset;
+      memcpy(upload->piece, _header + offset,
+             (held < length) ? held : length);
+    }
+  }
+
+  upload->sent += length;
+  upload->pieceLength = length;
+  upload->pieceSent = 0;
+  return true;
+}
+
+/**
+ * Start whatever transfers the OTAGossip chooses
+ */
+void OTAGossipNode::_pull(unsigned long now) {
+  gossip_transfer_t transfer;
+
+  while (_gossip.next(now, &transfer)) {
+    gossip_download_t *download = nullptr;
+    for (uint8_t i = 0; i < OTAGossip::MAX_TRANSFERS; i++) {
+      if (_downloads[i].fd < 0) {
+        download = &_downloads[i];
+        break;
+      }
+    }
+    if (!download) {
+      _gossip.failed(transfer.chunk, true, now);
+      return;
+    }
+
+    download->transfer = transfer;
+    if (!_connect(download)) {
+      _finish(download, false, false, now);
+    }
+  }
+}
+
+bool OTAGossipNode::_connect(gossip_download_t *download) {
+  if (!download->page) {
+    download->page = (uint8_t *)malloc(OTAGossip::CHUNK_SIZE);
+    if (!download->page) {
+      return false;
+    }
+  }
+
+  download->fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (download->fd < 0) {
+    return false;
+  }
+  fcntl(download->fd, F_SETFL,
+        fcntl(download->fd, F_GETFL, 0) | O_NONBLOCK);
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = download->transfer.ip;
+  addr.sin_port = htons(download->transfer.port);
+  if (connect(download->fd, (struct sockaddr *)&addr, sizeof (addr)) < 0 &&
+      errno != EINPROGRESS) {
+    return false;
+  }
+
+  download->state = DOWNLOAD_CONNECTING;
+  download->replied = 0;
+  download->length = _chunkLength(download->transfer.chunk);
+  download->received = 0;
+  return true;
+}
+
+/**
+ * Send the request once connected, then read the reply and chunk
+ */
+void OTAGossipNode::_download(gossip_download_t *download,
+                              unsigned long now) {
+  if (download->fd < 0) {
+    return;
+  }
+  if (now - download->transfer.started > OTAGossip::TRANSFER_TIMEOUT) {
+    _finish(download, false, false, now);
+    return;
+  }
+
+  if (download->state == DOWNLOAD_CONNECTING) {
+    fd_set writable;
+    struct timeval timeout = { 0, 0 };
+    FD_ZERO(&writable);
+    FD_SET(download->fd, &writable);
+    if (select(download->fd + 1, nullptr, &writable, nullptr, &timeout) <= 0) {
+      return;
+    }
+
+    int error = 0;
+    socklen_t len = sizeof (error);
+    getsockopt(download->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+
+    gossip_request_t request;
+    memset(&request, 0, sizeof (request));
+    request.magic = GOSSIP_MAGIC;
+    memcpy(request.sha256, _gossip.sha256(), SHA256_DIGEST_SIZE);
+    request.chunk = download->transfer.chunk;
+    if (error || send(download->fd, &request, sizeof (request),
+                      MSG_NOSIGNAL) != sizeof (request)) {
+      _finish(download, false, false, now);
+      return;
+    }
+    download->state = DOWNLOAD_REPLY;
+  }
+
+  while (true) {
+    uint8_t *data;
+    size_t length;
+    if (download->state == DOWNLOAD_REPLY) {
+      data = (uint8_t *)&download->reply + download->replied;
+      length = sizeof (download->reply) - download->replied;
+    } else {
+      data = download->page + download->received;
+      length = download->length - download->received;
+    }
+
+    int result = recv(download->fd, data, length, 0);
+    if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    }
+    if (result <= 0) {
+      _finish(download, false, false, now);
+      return;
+    }
+
+    if (download->state == DOWNLOAD_CHUNK) {
+      download->received += result;
+      if (download->received == download->length) {
+        _finish(download, _store(download), false, now);
+        return;
+      }
+      continue;
+    }
+
+    download->replied += result;
+    if (download->replied < sizeof (download->reply)) {
+      continue;
+    }
+    ota_reply_t *reply = &download->reply;
+    if (reply->magic != OTA_MAGIC || reply->status != OTA_REPLY_OK ||
+        reply->offset != download->transfer.chunk) {
+      bool busy = (reply->magic == OTA_MAGIC &&
+                   reply->status == OTA_REPLY_BUSY);
+      _finish(download, false, busy, now);
+      return;
+    }
+    download->state = DOWNLOAD_CHUNK;
+  }
+}
+
+/**
+ * Write the chunk to its page, holding back the start of the image
+ */
+bool OTAGossipNode::_store(gossip_download_t *download) {
+  uint32_t offset = download->transfer.chunk * OTAGossip::CHUNK_SIZE;
+  size_t length = download->length;
+
+  if (offset == 0) {
+    memcpy(_header, download->page, OTA_HEADER_HOLD);
+    memset(download->page, 0xFF, OTA_HEADER_HOLD);
+  }
+
+  /* The last chunk is padded out to a whole write */
+  size_t padded = (length + WRITE_ALIGN - 1) & ~(WRITE_ALIGN - 1);
+  memset(download->page + length, 0xFF, padded - length);
+
+  return _update->erase(offset, OTAGossip::CHUNK_SIZE) &&
+         _update->write(offset, download->page, padded);
+}
+
+void OTAGossipNode::_finish(gossip_download_t *download, bool ok, bool busy,
+                            unsigned long now) {
+  if (download->fd >= 0) {
+    close(download->fd);
+    download->fd = -1;
+  }
+
+  if (ok) {
+    _gossip.received(download->transfer.chunk);
+    _chunksReceived++;
+  } else {
+    _gossip.failed(download->transfer.chunk, busy, now);
+    if (!busy) {
+      _failures++;
+    }
+  }
+}
+
+/**
+ * Check the image pulled against the hash advertised, and if it matches write
+ * the start and boot it on the next restart
+ */
+void OTAGossipNode::_verify() {
+  Sha256 hash;
+  uint8_t buffer[256];
+  uint32_t size = _gossip.size();
+  bool ok = true;
+
+  for (uint32_t offset = 0; ok && offset < size; offset += sizeof (buffer)) {
+    size_t length = (size - offset < sizeof (buffer)) ? size - offset :
+            sizeof (buffer);
+    ok = _update->read(offset, buffer, length);
+    if (offset == 0) {
+      memcpy(buffer, _header, OTA_HEADER_HOLD);
+    }
+    hash.update(buffer, length);
+  }
+
+  uint8_t sha256[SHA256_DIGEST_SIZE];
+  hash.finish(sha256);
+  if (!ok || memcmp(sha256, _gossip.sha256(), SHA256_DIGEST_SIZE) != 0 ||
+      !_update->write(0, _header, OTA_HEADER_HOLD) || !_update->activate()) {
+    _failures++;
+    _gossip.reset();
+    return;
+  }
+
+  _complete = true;
+  _cancel();
+}
+
+/**
+ * Drop the transfers in progress and the pages they used
+ */
+void OTAGossipNode::_cancel() {
+  for (uint8_t i = 0; i < OTAGossip::MAX_TRANSFERS; i++) {
+    gossip_download_t *download = &_downloads[i];
+    if (download->fd >= 0) {
+      close(download->fd);
+      download->fd = -1;
+    }
+    free(download->page);
+    download->page = nullptr;
+  }
+}
+
+uint32_t OTAGossipNode::_chunkLength(uint16_t chunk) {
+  uint32_t offset = chunk * OTAGossip::CHUNK_SIZE;
+  uint32_t size = _gossip.size();
+  return (size - offset < OTAGossip::CHUNK_SIZE) ? size - offset :
+          OTAGossip::CHUNK_SIZE;
+}
+
+unsigned long OTAGossipNode::_millis() {
+#ifdef ARDUINO
+  return millis();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
@@ -0,0 +1,162 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Spreads firmware updates between nodes, see OTAGossip.
+ *
+ * Design:
+ *   Adverts are sent as UDP broadcasts every ADVERT_INTERVAL, and to any
+ * peers added by address, and adverts heard are passed to the OTAGossip
+ * deciding what to pull.  Chunks are pulled over TCP, one per connection:
+ * the puller sends a gossip_request_t naming the image and chunk, and is
+ * answered with an ota_reply_t, as an OTAServer answers a sender, followed by
+ * the chunk when the reply is OK.  A node sends at most MAX_UPLOADS chunks at
+ * once and answers BUSY beyond that, so that no node is swamped by the rest.
+ *
+ *   Each chunk is a flash page and is written to the update partition as it
+ * arrives, so that only a page per transfer is held in memory.  As with the
+ * OTAReceiver, the start of the image is held back until the whole image has
+ * been pulled and its hash checked against the one advertised, so that a
+ * partial image is never bootable.  A node serves the chunks it has pulled
+ * while still pulling the rest, and serves the running image once it has
+ * none newer.
+ */
+
+#ifndef OTAGOSSIPNODE_H
+#define OTAGOSSIPNODE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "OTAFlash.h"
+#include "OTAGossip.h"
+#include "OTAServer.h"
+
+/* Fields are little-endian */
+typedef struct __attribute__((packed)) {
+  uint32_t magic;                       // GOSSIP_MAGIC
+  uint8_t  sha256[SHA256_DIGEST_SIZE];  // Of the image the chunk is from
+  uint16_t chunk;
+  uint16_t reserved;
+} gossip_request_t;
+
+class OTAGossipNode {
+  public:
+    static const uint16_t DEFAULT_PORT = 3234;
+    static const uint8_t MAX_UPLOADS = 2;
+    static const uint8_t MAX_ADDED_PEERS = 8;
+    static const size_t PIECE_SIZE = 1024;  // Read from flash to send
+    static const unsigned long ADVERT_INTERVAL = 2000;
+    static const unsigned long IDLE_TIMEOUT = 10 * 1000;
+
+    /* Serves the running image, and pulls newer ones into the update flash */
+    OTAGossipNode(OTAFlash *running, OTAFlash *update,
+                  uint16_t port = DEFAULT_PORT);
+    ~OTAGossipNode();
+
+    /* Hash and advertise the running image, with a seed unique to the node */
+    bool begin(uint32_t version, uint32_t size, uint32_t seed);
+    void stop();
+
+    /* Port listened on, useful when created with port 0 */
+    uint16_t port();
+
+    /* Also advertise to this address, such as a peer on another subnet */
+    bool addPeer(uint32_t ip, uint16_t port);
+
+    /* Whether adverts are broadcast, which they are by default */
+    void setBroadcast(bool broadcast);
+
+    /* Advertise, serve and pull without blocking, except to write a page */
+    void handle();
+
+    /* A newer image has been pulled, verified and activated */
+    bool complete();
+
+    OTAGossip *gossip();
+    uint32_t chunksSent();
+    uint32_t chunksReceived();
+    uint32_t failures();      // Transfers that failed, other than busy
+
+  protected:
+    typedef enum {
+      UPLOAD_REQUEST,         // Reading the request
+      UPLOAD_SENDING,         // Sending the reply and chunk
+    } upload_state_t;
+
+    typedef struct {
+      int            fd;
+      upload_state_t state;
+      gossip_request_t request;
+      size_t         requested;   // Request bytes read
+      uint32_t       length;      // Of the chunk
+      uint32_t       sent;        // Chunk bytes sent
+      size_t         pieceLength;
+      size_t         pieceSent;
+      unsigned long  lastActive;
+      uint8_t        piece[PIECE_SIZE];
+    } gossip_upload_t;
+
+    typedef enum {
+      DOWNLOAD_CONNECTING,
+      DOWNLOAD_REPLY,         // Request sent, reading the reply
+      DOWNLOAD_CHUNK,
+    } download_state_t;
+
+    typedef struct {
+      int              fd;
+      download_state_t state;
+      gossip_transfer_t transfer;
+      ota_reply_t      reply;
+      size_t           replied;   // Reply bytes read
+      uint32_t         length;    // Of the chunk
+      uint32_t         received;
+      uint8_t          *page;
+    } gossip_download_t;
+
+    typedef struct {
+      uint32_t ip;
+      uint16_t port;
+    } gossip_address_t;
+
+    OTAFlash *_running;
+    OTAFlash *_update;
+    uint16_t _port;
+    int _udpFd;
+    int _listenFd;
+    bool _broadcast;
+    unsigned long _lastAdvert;
+    bool _advertised;
+
+    OTAGossip _gossip;
+    gossip_address_t _added[MAX_ADDED_PEERS];
+    uint8_t _numAdded;
+    gossip_upload_t _uploads[MAX_UPLOADS];
+    gossip_download_t _downloads[OTAGossip::MAX_TRANSFERS];
+    uint8_t _header[OTA_HEADER_HOLD];  // Of the image being pulled
+    bool _complete;
+
+    uint32_t _chunksSent;
+    uint32_t _chunksReceived;
+    uint32_t _failures;
+
+    void _advertise(unsigned long now);
+    void _listen(unsigned long now);
+    void _accept();
+    void _serve(gossip_upload_t *upload);
+    bool _readPiece(gossip_upload_t *upload);
+    void _pull(unsigned long now);
+    bool _connect(gossip_download_t *download);
+    void _download(gossip_download_t *download, unsigned long now);
+    bool _store(gossip_download_t *download);
+    void _finish(gossip_download_t *download, bool ok, bool busy,
+                 unsigned long now);
+    void _verify();
+    void _cancel();
+
+    uint32_t _chunkLength(uint16_t chunk);
+    static unsigned long _millis();
+};
+
+#endif // OTAGOSSIPNODE_H
@@ -0,0 +1,360 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#ifdef ARDUINO
+  #include <Arduino.h>
+  #include <lwip/sockets.h>
+#else
+  #include <time.h>
+  #include <fcntl.h>
+  #include <unistd.h>
+  #include <arpa/inet.h>
+  #include <netinet/in.h>
+  #include <sys/socket.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+  #define MSG_NOSIGNAL 0
+#endif
+
+#include "OTAHub.h"
+
+OTAHub::OTAHub(OTAFlash *flash, uint16_t port) {
+  _flash = flash;
+  _port = port;
+  _listenFd = -1;
+  _rateLimit = 0;
+  memset(&_header, 0, sizeof (_header));
+  for (uint8_t i = 0; i < MAX_CLIENTS; i++) {
+    _clients[i].fd = -1;
+  }
+  for (uint8_t i = 0; i < CACHE_CHUNKS; i++) {
+    _cache[i].index = NO_CHUNK;
+    _cache[i].lastUsed = 0;
+  }
+  _uses = 0;
+  _chunkReads = 0;
+  _bytesSent = 0;
+  _completed = 0;
+}
+
+OTAHub::~OTAHub() {
+  stop();
+}
+
+/**
+ * Hash the image and start listening for clients
+ * @return false if the image can't be read or the port is unavailable
+ */
+bool OTAHub::begin(uint32_t size) {
+  struct sockaddr_in addr;
+  int one = 1;
+
+  if (_listenFd >= 0) {
+    return true;
+  }
+  if (!size || size > _flash->size()) {
+    return false;
+  }
+
+  /* Read once up front so that clients can be told the hash */
+  Sha256 hash;
+  for (uint32_t offset = 0; offset < size; offset += CHUNK_SIZE) {
+    size_t length = (size - offset < CHUNK_SIZE) ? size - offset : CHUNK_SIZE;
+    if (!_flash->read(offset, _cache[0].data, length)) {
+      return false;
+    }
+    hash.update(_cache[0].data, length);
+  }
+  for (uint8_t i = 0; i < CACHE_CHUNKS; i++) {
+    _cache[i].index = NO_CHUNK;
+    _cache[i].lastUsed = 0;
+  }
+
+  _header.magic = OTA_MAGIC;
+  _header.version = OTA_VERSION;
+  _header.type = OTA_TYPE_FULL;
+  _header.payloadSize = size;
+  _header.imageSize = size;
+  hash.finish(_header.sha256);
+
+  _listenFd = socket(AF_INET, SOCK_STREAM, 0);
+  if (_listenFd < 0) {
+    return false;
+  }
+  setsockopt(_listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+
+  memset(&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(_port);
+  if (bind(_listenFd, (struct sockaddr *)&addr, sizeof (addr)) < 0 ||
+      listen(_listenFd, MAX_CLIENTS) < 0) {
+    stop();
+    return false;
+  }
+  fcntl(_listenFd, F_SETFL, fcntl(_listenFd, F_GETFL, 0) | O_NONBLOCK);
+
+  if (_port == 0) {
+    socklen_t len = sizeof (addr);
+    getsockname(_listenFd, (struct sockaddr *)&addr, &len);
+    _port = ntohs(addr.sin_port);
+  }
+
+  return true;
+}
+
+void OTAHub::stop() {
+  for (uint8_t i = 0; i < MAX_CLIENTS; i++) {
+    _close(&_clients[i]);
+  }
+  if (_listenFd >= 0) {
+    close(_listenFd);
+    _listenFd = -1;
+  }
+}
+
+uint16_t OTAHub::port() {
+  return _port;
+}
+
+void OTAHub::setRateLimit(uint32_t bytesPerSec) {
+  _rateLimit = bytesPerSec;
+}
+
+void OTAHub::handle() {
+  uint8_t discard[16];
+
+  if (_listenFd < 0) {
+    return;
+  }
+
+  _accept();
+
+  for (uint8_t i = 0; i < MAX_CLIENTS; i++) {
+    hub_client_t *client = &_clients[i];
+    if (client->fd < 0) {
+      continue;
+    }
+
+    /* Clients send nothing, but close once they have what they need */
+    int result = recv(client->fd, discard, sizeof (discard), MSG_DONTWAIT);
+    if (result == 0 ||
+        (result < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+      _close(client);
+      continue;
+    }
+
+    _send(client);
+
+    if (client->fd >= 0 && _millis() - client->lastActive > IDLE_TIMEOUT) {
+      _close(client);
+    }
+  }
+}
+
+uint8_t OTAHub::clients() {
+  uint8_t count = 0;
+  for (uint8_t i = 0; i < MAX_CLIENTS; i++) {
+    if (_clients[i].fd >= 0) {
+      count++;
+    }
+  }
+  return count;
+}
+
+/**
+ * Progress of the index'th connected client
+ * @return false if there aren't that many clients
+ */
+bool OTAHub::progress(uint8_t index, ota_hub_progress_t *progress) {
+  for (uint8_t i = 0; i < MAX_CLIENTS; i++) {
+    hub_client_t *client = &_clients[i];
+    if (client->fd < 0) {
+      continue;
+    }
+    if (index-- == 0) {
+      progress->ip = client->ip;
+      progress->sent = (client->sent > sizeof (_header)) ?
+              client->sent - sizeof (_header) : 0;
+      progress->size = _header.imageSize;
+      progress->elapsed = _millis() - client->started;
+      return true;
+    }
+  }
+  return false;
+}
+
+uint32_t OTAHub::chunkReads() {
+  return _chunkReads;
+}
+
+uint32_t OTAHub::bytesSent() {
+  return _bytesSent;
+}
+
+uint32_t OTAHub::completed() {
+  return _completed;
+}
+
+void OTAHub::_accept() {
+  for (uint8_t i = 0; i < MAX_CLIENTS; i++) {
+    hub_client_t *client = &_clients[i];
+    if (client->fd >= 0) {
+      continue;
+    }
+
+    struct sockaddr_in addr;
+    socklen_t len = sizeof (addr);
+    int fd = accept(_listenFd, (struct sockaddr *)&addr, &len);
+    if (fd < 0) {
+      return;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+    client->fd = fd;
+    client->ip = addr.sin_addr.s_addr;
+    client->sent = 0;
+    client->started = _millis();
+    client->lastActive = client->started;
+    client->tokens = CHUNK_SIZE;
+    client->refilled = client->started;
+  }
+}
+
+/**
+ * Send the client as much as its budget and socket allow
+ */
+void OTAHub::_send(hub_client_t *client) {
+  size_t total = sizeof (_header) + _header.imageSize;
+  size_t budget = _budget(client);
+  size_t spent = 0;
+
+  while (spent < budget && client->sent < total) {
+    const uint8_t *data;
+    size_t length;
+
+    if (client->sent < sizeof (_header)) {
+      data = (const uint8_t *)&_header + client->sent;
+      length = sizeof (_header) - client->sent;
+    } else {
+      uint32_t offset = client->sent - sizeof (_header);
+      hub_chunk_t *chunk = _chunk(offset / CHUNK_SIZE);
+      if (!chunk) {
+        _close(client);
+        return;
+      }
+      data = chunk->data + offset % CHUNK_SIZE;
+      length = chunk->length - offset % CHUNK_SIZE;
+    }
+    if (length > budget - spent) {
+      length = budget - spent;
+    }
+
+    int result = send(client->fd, data, length, MSG_NOSIGNAL);
+    if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    if (result <= 0) {
+      _close(client);
+      return;
+    }
+
+    client->sent += result;
+    client->lastActive = _millis();
+    spent += result;
+  }
+
+  if (_rateLimit) {
+    client->tokens -= spent;
+  }
+  _bytesSent += spent;
+
+  if (client->sent == total) {
+    _completed++;
+    _close(client);
+  }
+}
+
+/**
+ * Refill the client's tokens for the time passed, allowing a burst of up to
+ * 50ms or two chunks, whichever is larger.
+ * @return The bytes the client may be sent now
+ */
+size_t OTAHub::_budget(hub_client_t *client) {
+  if (!_rateLimit) {
+    return MAX_SEND;
+  }
+
+  unsigned long now = _millis();
+  uint32_t added = (uint64_t)_rateLimit * (now - client->refilled) / 1000;
+  if (added) {
+    uint32_t burst = _rateLimit / 20;
+    if (burst < 2 * CHUNK_SIZE) {
+      burst = 2 * CHUNK_SIZE;
+    }
+    client->tokens = (client->tokens + added > burst) ? burst :
+            client->tokens + added;
+    client->refilled = now;
+  }
+
+  return (client->tokens < MAX_SEND) ? client->tokens : MAX_SEND;
+}
+
+/**
+ * Find a chunk in the cache, reading it over the least recently used
+ * @return The chunk, or null if it couldn't be read
+ */
+OTAHub::hub_chunk_t *OTAHub::_chunk(uint32_t index) {
+  hub_chunk_t *victim = &_cache[0];
+
+  for (uint8_t i = 0; i < CACHE_CHUNKS; i++) {
+    if (_cache[i].index == index) {
+      _cache[i].lastUsed = ++_uses;
+      return &_cache[i];
+    }
+    if (_cache[i].lastUsed < victim->lastUsed) {
+      victim = &_cache[i];
+    }
+  }
+
+  uint32_t offset = index * CHUNK_SIZE;
+  size_t length = _header.imageSize - offset;
+  if (length > CHUNK_SIZE) {
+    length = CHUNK_SIZE;
+  }
+  if (!_flash->read(offset, victim->data, length)) {
+    victim->index = NO_CHUNK;
+    victim->lastUsed = 0;
+    return nullptr;
+  }
+
+  victim->index = index;
+  victim->length = length;
+  victim->lastUsed = ++_uses;
+  _chunkReads++;
+  return victim;
+}
+
+void OTAHub::_close(hub_client_t *client) {
+  if (client->fd >= 0) {
+    close(client->fd);
+    client->fd = -1;
+  }
+}
+
+unsigned long OTAHub::_millis() {
+#ifdef ARDUINO
+  return millis();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
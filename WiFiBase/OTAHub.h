@@ -0,0 +1,115 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Serves a firmware image held in flash to many downloading nodes at once.
+ *
+ * Design:
+ *   A node connects and is sent an ota_header_t describing the image, as a
+ * sender would push to an OTAServer, followed by the image itself.  The node
+ * can compare the hash against its own image and close early if it has it.
+ *
+ *   The image is read from flash a chunk at a time into a small shared cache,
+ * and every client is sent from the cache.  Nodes that download together all
+ * move through the same few chunks, so each chunk is read from flash once and
+ * fanned out to all of them, and the hub's memory doesn't grow with the
+ * number of clients.  A client that falls behind the cache, such as one that
+ * joins late, has its chunks read again rather than holding the others back.
+ *
+ *   Each client is sent at most the configured rate, so that downloads share
+ * the access point with other traffic, and its progress can be queried.
+ */
+
+#ifndef OTAHUB_H
+#define OTAHUB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "OTAFlash.h"
+#include "OTAServer.h"
+
+typedef struct {
+  uint32_t      ip;       // As held by IPAddress
+  uint32_t      sent;     // Image bytes sent
+  uint32_t      size;
+  unsigned long elapsed;  // ms since connecting
+} ota_hub_progress_t;
+
+class OTAHub {
+  public:
+    static const uint16_t DEFAULT_PORT = 3233;
+    static const uint8_t MAX_CLIENTS = 8;
+    static const size_t CHUNK_SIZE = 1024;
+    static const uint8_t CACHE_CHUNKS = 8;
+    static const size_t MAX_SEND = 4 * CHUNK_SIZE;  // Per client per handle()
+    static const unsigned long IDLE_TIMEOUT = 10 * 1000;
+
+    OTAHub(OTAFlash *flash, uint16_t port = DEFAULT_PORT);
+    ~OTAHub();
+
+    /* Serve the first size bytes of the flash, which are hashed first */
+    bool begin(uint32_t size);
+    void stop();
+
+    /* Port being listened on, useful when created with port 0 */
+    uint16_t port();
+
+    /* Limit the rate each client is sent, 0 for no limit */
+    void setRateLimit(uint32_t bytesPerSec);
+
+    /* Accept clients and send to them without blocking */
+    void handle();
+
+    uint8_t clients();
+    bool progress(uint8_t index, ota_hub_progress_t *progress);
+
+    uint32_t chunkReads();  // Chunks read from flash to send
+    uint32_t bytesSent();
+    uint32_t completed();
+
+  protected:
+    typedef struct {
+      int           fd;
+      uint32_t      ip;
+      uint32_t      sent;       // Including the header
+      unsigned long started;
+      unsigned long lastActive;
+      uint32_t      tokens;     // Bytes that may be sent under the limit
+      unsigned long refilled;
+    } hub_client_t;
+
+    typedef struct {
+      uint32_t      index;      // Chunk of the image held, or NO_CHUNK
+      size_t        length;
+      unsigned long lastUsed;
+      uint8_t       data[CHUNK_SIZE];
+    } hub_chunk_t;
+
+    static const uint32_t NO_CHUNK = 0xFFFFFFFF;
+
+    OTAFlash *_flash;
+    uint16_t _port;
+    int _listenFd;
+    uint32_t _rateLimit;
+
+    ota_header_t _header;
+    hub_client_t _clients[MAX_CLIENTS];
+    hub_chunk_t _cache[CACHE_CHUNKS];
+    unsigned long _uses;
+
+    uint32_t _chunkReads;
+    uint32_t _bytesSent;
+    uint32_t _completed;
+
+    void _accept();
+    void _send(hub_client_t *client);
+    size_t _budget(hub_client_t *client);
+    hub_chunk_t *_chunk(uint32_t index);
+    void _close(hub_client_t *client);
+
+    static unsigned long _millis();
+};
+
+#endif // OTAHUB_H
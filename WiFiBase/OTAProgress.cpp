@@ -0,0 +1,74 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * ESP32 implementation of the OTAProgress interface
+ */
+
+#ifdef ARDUINO
+
+#include <Arduino.h>
+#include <nvs.h>
+
+#ifdef DEBUG_LEVEL_OTAPROGRESS
+  #define DEBUG_LEVEL DEBUG_LEVEL_OTAPROGRESS
+#endif
+#ifndef DEBUG_LEVEL
+  #define DEBUG_LEVEL DEBUG_HIGH
+#endif
+#include <Debug.h>
+
+#include "OTAProgress.h"
+
+#define PROGRESS_NAMESPACE "wfbota"
+#define PROGRESS_KEY       "progress"
+
+ESPProgress::ESPProgress() {
+  _handle = 0;
+}
+
+ESPProgress::~ESPProgress() {
+  if (_handle) {
+    nvs_close(_handle);
+  }
+}
+
+bool ESPProgress::load(ota_progress_t *progress) {
+  size_t length = sizeof (*progress);
+  return _open() &&
+         nvs_get_blob(_handle, PROGRESS_KEY, progress, &length) == ESP_OK &&
+         length == sizeof (*progress) &&
+         progress->magic == OTA_PROGRESS_MAGIC;
+}
+
+bool ESPProgress::save(const ota_progress_t *progress) {
+  if (!_open() ||
+      nvs_set_blob(_handle, PROGRESS_KEY, progress,
+                   sizeof (*progress)) != ESP_OK ||
+      nvs_commit(_handle) != ESP_OK) {
+    DEBUG_ERR("OTA: progress not saved");
+    return false;
+  }
+  return true;
+}
+
+void ESPProgress::clear() {
+  if (_open() && nvs_erase_key(_handle, PROGRESS_KEY) == ESP_OK) {
+    nvs_commit(_handle);
+  }
+}
+
+/**
+ * Open the namespace on first use, as NVS is initialised along with WiFi
+ */
+bool ESPProgress::_open() {
+  if (!_handle &&
+      nvs_open(PROGRESS_NAMESPACE, NVS_READWRITE, &_handle) != ESP_OK) {
+    _handle = 0;
+    return false;
+  }
+  return true;
+}
+
+#endif // ARDUINO
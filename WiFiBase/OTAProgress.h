@@ -0,0 +1,70 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Persistent record of how much of an image has been received.
+ *
+ * Design:
+ *   The OTAReceiver saves a record as pages are written, giving the image
+ * being received, the bytes of it committed to flash, the state of the hash
+ * over those bytes and the held back start of the image.  That is all that
+ * is needed to continue the image from where it was committed, whether the
+ * sender went away or the node restarted, since everything else is already
+ * in flash.
+ *
+ *   ESPProgress keeps the record in NVS, which survives a restart.
+ */
+
+#ifndef OTAPROGRESS_H
+#define OTAPROGRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "Sha256.h"
+
+#define OTA_PROGRESS_MAGIC 0x50424657  // "WFBP"
+#define OTA_HEADER_HOLD    32
+
+typedef struct {
+  uint32_t magic;
+  uint32_t size;                        // The image, identified by its size
+  uint8_t  sha256[SHA256_DIGEST_SIZE];  // and SHA-256
+  uint32_t committed;                   // Bytes written to flash
+  sha256_state_t hash;                  // Over the bytes committed
+  uint8_t  header[OTA_HEADER_HOLD];     // Start of the image held back
+} ota_progress_t;
+
+class OTAProgress {
+  public:
+    virtual ~OTAProgress() {}
+
+    /* @return false if there is no record */
+    virtual bool load(ota_progress_t *progress) = 0;
+    virtual bool save(const ota_progress_t *progress) = 0;
+    virtual void clear() = 0;
+};
+
+#ifdef ARDUINO
+#include <nvs.h>
+
+/*
+ * Progress kept in the NVS partition
+ */
+class ESPProgress : public OTAProgress {
+  public:
+    ESPProgress();
+    ~ESPProgress();
+
+    bool load(ota_progress_t *progress);
+    bool save(const ota_progress_t *progress);
+    void clear();
+
+  protected:
+    nvs_handle _handle;
+    bool _open();
+};
+#endif
+
+#endif // OTAPROGRESS_H
@@ -0,0 +1,433 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "OTAReceiver.h"
+
+/* Encrypted flash is written in blocks of this size */
+#define WRITE_ALIGN 16
+
+OTAReceiver::OTAReceiver(OTAFlash *flash) {
+  _flash = flash;
+  _useWriter = false;
+  _progress = nullptr;
+  _saved = 0;
+  _state = OTA_IDLE;
+  _error = OTA_ERR_NONE;
+  _size = 0;
+  _received = 0;
+  _pageSize = 0;
+  _pages[0] = _pages[1] = nullptr;
+  _fill = 0;
+  _used = 0;
+  _pageOffset = 0;
+  _writing = false;
+  _writeFailed = false;
+#ifdef ARDUINO
+  _writerTask = nullptr;
+  _writeDone = nullptr;
+#else
+  _writerThread = nullptr;
+  _stopping = false;
+#endif
+}
+
+OTAReceiver::~OTAReceiver() {
+  _stopWriter();
+  _release();
+}
+
+bool OTAReceiver::useWriter(bool writer) {
+  if (_state == OTA_RECEIVING) {
+    return false;
+  }
+  _useWriter = writer;
+  return true;
+}
+
+void OTAReceiver::useProgress(OTAProgress *progress) {
+  _progress = progress;
+}
+
+/**
+ * Allocate the page buffers and start the writer
+ * @return false if the image can't be received, with the reason in error()
+ */
+bool OTAReceiver::begin(uint32_t size, const uint8_t *sha256, bool resume) {
+  if (_state == OTA_RECEIVING) {
+    abort();
+  }
+
+  _error = OTA_ERR_NONE;
+  _size = size;
+  _received = 0;
+  _used = 0;
+  _fill = 0;
+  _pageOffset = 0;
+  _saved = 0;
+  _writing = false;
+  _writeFailed = false;
+  _hash.reset();
+  memcpy(_expected, sha256, SHA256_DIGEST_SIZE);
+  memset(_header, 0xFF, sizeof (_header));
+
+  if (!size || size > _flash->size()) {
+    _state = OTA_FAILED;
+    _error = OTA_ERR_TOO_LARGE;
+    return false;
+  }
+
+  _pageSize = _flash->pageSize();
+  _pages[0] = (uint8_t *)malloc(_pageSize);
+  _pages[1] = (uint8_t *)malloc(_pageSize);
+  if (!_pages[0] || !_pages[1] || (_useWriter && !_startWriter())) {
+    _release();
+    _state = OTA_FAILED;
+    _error = OTA_ERR_NO_MEMORY;
+    return false;
+  }
+
+  if (_progress && !(resume && _resume())) {
+    _progress->clear();
+  }
+
+  _state = OTA_RECEIVING;
+  return true;
+}
+
+bool OTAReceiver::write(const uint8_t *data, size_t length) {
+  if (_state != OTA_RECEIVING) {
+    return false;
+  }
+  if (_received + length > _size) {
+    abort(OTA_ERR_OVERRUN);
+    return false;
+  }
+
+  _received += length;
+
+  while (length) {
+    size_t n = _pageSize - _used;
+    if (n > length) {
+      n = length;
+    }
+    memcpy(&_pages[_fill][_used], data, n);
+    _used += n;
+    data += n;
+    length -= n;
+
+    if (_used == _pageSize && !_submit()) {
+      abort(OTA_ERR_FLASH);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool OTAReceiver::finish() {
+  uint8_t digest[SHA256_DIGEST_SIZE];
+
+  if (_state != OTA_RECEIVING) {
+    return false;
+  }
+  if (_received != _size) {
+    abort(OTA_ERR_INCOMPLETE);
+    return false;
+  }
+
+  if (_used && !_submit()) {
+    abort(OTA_ERR_FLASH);
+    return false;
+  }
+  _wait();
+  if (_writeFailed) {
+    abort(OTA_ERR_FLASH);
+    return false;
+  }
+
+  _hash.finish(digest);
+  if (memcmp(digest, _expected, SHA256_DIGEST_SIZE) != 0) {
+    abort(OTA_ERR_HASH);
+    return false;
+  }
+
+  /* Only now complete the image's header */
+  if (!_flash->write(0, _header, HEADER_HOLD)) {
+    abort(OTA_ERR_FLASH);
+    return false;
+  }
+  if (!_flash->activate()) {
+    abort(OTA_ERR_ACTIVATE);
+    return false;
+  }
+
+  _stopWriter();
+  _release();
+  if (_progress) {
+    _progress->clear();
+  }
+  _state = OTA_COMPLETE;
+  return true;
+}
+
+/**
+ * Stop receiving, leaving the partition without a valid image.  If the
+ * sender went away what was committed is recorded to be resumed.
+ */
+void OTAReceiver::abort(uint8_t error) {
+  _stopWriter();
+
+  if (_progress && _state == OTA_RECEIVING) {
+    if ((error == OTA_ERR_INCOMPLETE || error == OTA_ERR_TIMEOUT ||
+         error == OTA_ERR_ABORTED) && !_writeFailed) {
+      if (_pageOffset > _saved) {
+        _saveProgress();
+      }
+    } else {
+      _progress->clear();
+    }
+  }
+
+  _release();
+  _state = OTA_FAILED;
+  _error = error;
+}
+
+uint8_t OTAReceiver::state() {
+  return _state;
+}
+
+uint8_t OTAReceiver::error() {
+  return _error;
+}
+
+uint32_t OTAReceiver::size() {
+  return _size;
+}
+
+uint32_t OTAReceiver::received() {
+  return _received;
+}
+
+const char *OTAReceiver::errorString(uint8_t error) {
+  static const char *strings[OTA_ERR_MAX] = {
+    "none",
+    "too large",
+    "no memory",
+    "flash",
+    "overrun",
+    "incomplete",
+    "hash mismatch",
+    "activate",
+    "protocol",
+    "timeout",
+    "aborted",
+    "base mismatch",
+  };
+  return (error < OTA_ERR_MAX) ? strings[error] : "unknown";
+}
+
+/**
+ * Hand the filled page to be written, once the previous write has finished,
+ * and start filling the other page.  The hash covers the pages submitted,
+ * so is that of what is committed once the previous write has finished.
+ */
+bool OTAReceiver::_submit() {
+  uint8_t *page = _pages[_fill];
+  size_t length = _used;
+
+  _wait();
+  if (_writeFailed) {
+    return false;
+  }
+  if (_progress && _pageOffset - _saved >= PROGRESS_INTERVAL) {
+    _saveProgress();
+  }
+  _hash.update(page, length);
+
+  if (_pageOffset == 0) {
+    size_t hold = (length < HEADER_HOLD) ? length : HEADER_HOLD;
+    memcpy(_header, page, hold);
+    memset(page, 0xFF, hold);
+  }
+
+  /* Pad a final partial page with erased bytes */
+  while (length % WRITE_ALIGN) {
+    page[length++] = 0xFF;
+  }
+
+  _writeData = page;
+  _writeOffset = _pageOffset;
+  _writeLength = length;
+
+  if (!_useWriter) {
+    _writeFailed = !_writePage(page, _pageOffset, length);
+  } else {
+#ifdef ARDUINO
+    _writing = true;
+    xTaskNotifyGive(_writerTask);
+#else
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _writing = true;
+    }
+    _cond.notify_all();
+#endif
+  }
+
+  _pageOffset += _used;
+  _used = 0;
+  _fill ^= 1;
+  return !_writeFailed;
+}
+
+/**
+ * Continue from the recorded progress if it is for the same image
+ */
+bool OTAReceiver::_resume() {
+  ota_progress_t progress;
+
+  if (!_progress->load(&progress) || progress.magic != OTA_PROGRESS_MAGIC ||
+      progress.size != _size ||
+      memcmp(progress.sha256, _expected, SHA256_DIGEST_SIZE) != 0 ||
+      !progress.committed || progress.committed >= _size ||
+      progress.committed % _pageSize) {
+    return false;
+  }
+
+  _hash.restore(&progress.hash);
+  memcpy(_header, progress.header, HEADER_HOLD);
+  _received = _pageOffset = _saved = progress.committed;
+  return true;
+}
+
+/**
+ * Record the pages written so far, which must have finished
+ */
+void OTAReceiver::_saveProgress() {
+  ota_progress_t progress;
+
+  memset(&progress, 0, sizeof (progress));
+  progress.magic = OTA_PROGRESS_MAGIC;
+  progress.size = _size;
+  memcpy(progress.sha256, _expected, SHA256_DIGEST_SIZE);
+  progress.committed = _pageOffset;
+  memcpy(&progress.hash, _hash.state(), sizeof (progress.hash));
+  memcpy(progress.header, _header, HEADER_HOLD);
+
+  if (_progress->save(&progress)) {
+    _saved = _pageOffset;
+  }
+}
+
+/**
+ * Wait for any write in progress to finish
+ */
+void OTAReceiver::_wait() {
+#ifdef ARDUINO
+  if (_writing) {
+    xSemaphoreTake(_writeDone, portMAX_DELAY);
+    _writing = false;
+  }
+#else
+  std::unique_lock<std::mutex> lock(_mutex);
+  _cond.wait(lock, [this]() { return !_writing; });
+#endif
+}
+
+bool OTAReceiver::_writePage(const uint8_t *data, uint32_t offset,
+                             size_t length) {
+  return _flash->erase(offset, _pageSize) &&
+         _flash->write(offset, data, length);
+}
+
+#ifdef ARDUINO
+bool OTAReceiver::_startWriter() {
+  if (!_writeDone) {
+    _writeDone = xSemaphoreCreateBinary();
+    if (!_writeDone) {
+      return false;
+    }
+  }
+  if (xTaskCreate(_writerLoop, "otawriter", WRITER_STACK, this,
+                  uxTaskPriorityGet(nullptr), &_writerTask) != pdPASS) {
+    _writerTask = nullptr;
+    return false;
+  }
+  return true;
+}
+
+void OTAReceiver::_stopWriter() {
+  if (!_writerTask) {
+    return;
+  }
+  _wait();
+  vTaskDelete(_writerTask);
+  _writerTask = nullptr;
+}
+
+void OTAReceiver::_writerLoop(void *arg) {
+  OTAReceiver *receiver = (OTAReceiver *)arg;
+
+  while (true) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    if (!receiver->_writePage(receiver->_writeData, receiver->_writeOffset,
+                              receiver->_writeLength)) {
+      receiver->_writeFailed = true;
+    }
+    xSemaphoreGive(receiver->_writeDone);
+  }
+}
+#else
+bool OTAReceiver::_startWriter() {
+  _stopping = false;
+  _writerThread = new std::thread(&OTAReceiver::_writerLoop, this);
+  return (_writerThread != nullptr);
+}
+
+void OTAReceiver::_stopWriter() {
+  if (!_writerThread) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stopping = true;
+  }
+  _cond.notify_all();
+  _writerThread->join();
+  delete _writerThread;
+  _writerThread = nullptr;
+}
+
+void OTAReceiver::_writerLoop() {
+  std::unique_lock<std::mutex> lock(_mutex);
+
+  while (true) {
+    _cond.wait(lock, [this]() { return _writing || _stopping; });
+    if (_writing) {
+      lock.unlock();
+      bool written = _writePage(_writeData, _writeOffset, _writeLength);
+      lock.lock();
+      if (!written) {
+        _writeFailed = true;
+      }
+      _writing = false;
+      _cond.notify_all();
+    } else {
+      return;
+    }
+  }
+}
+#endif
+
+void OTAReceiver::_release() {
+  free(_pages[0]);
+  free(_pages[1]);
+  _pages[0] = _pages[1] = nullptr;
+}
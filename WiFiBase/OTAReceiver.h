@@ -0,0 +1,151 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Streams a firmware image into flash as it is received.
+ *
+ * Design:
+ *   Data is gathered into page sized buffers, and each full page is erased and
+ * written as a unit.  There are two page buffers, so with the background
+ * writer enabled one page is written to flash while the next is filled from
+ * the network, and receiving only waits when both are full.
+ *
+ *   The image is hashed as it arrives and checked against the expected
+ * SHA-256 once complete.  The first bytes of the image, which hold its header,
+ * are written as erased bytes and only filled in once the hash matches, so an
+ * interrupted or corrupt transfer never leaves a bootable image.  Only then is
+ * the partition activated.
+ *
+ *   With an OTAProgress the receiver records how much has been committed to
+ * flash, after every PROGRESS_INTERVAL bytes and when the sender goes away.
+ * begin() asked to resume the same image then continues from there, with
+ * the hash restored, so an update interrupted near its end need not start
+ * again.  Any other begin() or failure discards the record.
+ */
+
+#ifndef OTARECEIVER_H
+#define OTARECEIVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "OTAFlash.h"
+#include "OTAProgress.h"
+#include "Sha256.h"
+
+#ifdef ARDUINO
+  #include <Arduino.h>
+#else
+  #include <condition_variable>
+  #include <mutex>
+  #include <thread>
+#endif
+
+typedef enum {
+  OTA_IDLE = 0,
+  OTA_RECEIVING,
+  OTA_COMPLETE,   // Verified and activated
+  OTA_FAILED,
+} ota_state_t;
+
+typedef enum {
+  OTA_ERR_NONE = 0,
+  OTA_ERR_TOO_LARGE,
+  OTA_ERR_NO_MEMORY,
+  OTA_ERR_FLASH,
+  OTA_ERR_OVERRUN,     // More data than the image size
+  OTA_ERR_INCOMPLETE,
+  OTA_ERR_HASH,
+  OTA_ERR_ACTIVATE,
+  OTA_ERR_PROTOCOL,
+  OTA_ERR_TIMEOUT,
+  OTA_ERR_ABORTED,
+  OTA_ERR_BASE,        // Update made against a different image
+  OTA_ERR_MAX
+} ota_error_t;
+
+class OTAReceiver {
+  public:
+    OTAReceiver(OTAFlash *flash);
+    ~OTAReceiver();
+
+    /* Bytes at the start of the image that are written only once verified */
+    static const size_t HEADER_HOLD = OTA_HEADER_HOLD;
+
+    /* Write pages from a background task, must be set before begin() */
+    static const uint32_t WRITER_STACK = 4096;
+    bool useWriter(bool writer);
+
+    /* Record progress to resume from, must be set before begin() */
+    static const uint32_t PROGRESS_INTERVAL = 16 * 1024;
+    void useProgress(OTAProgress *progress);
+
+    /*
+     * Start receiving an image of the given size and SHA-256, or resume it
+     * from what was last committed, in which case received() is non-zero
+     */
+    bool begin(uint32_t size, const uint8_t *sha256, bool resume = false);
+    bool write(const uint8_t *data, size_t length);
+
+    /* Write the final page, verify and activate the image */
+    bool finish();
+    void abort(uint8_t error = OTA_ERR_ABORTED);
+
+    uint8_t state();
+    uint8_t error();
+    uint32_t size();
+    uint32_t received();
+    static const char *errorString(uint8_t error);
+
+  protected:
+    OTAFlash *_flash;
+    bool _useWriter;
+    OTAProgress *_progress;
+    uint32_t _saved;
+
+    uint8_t _state;
+    uint8_t _error;
+    uint32_t _size;
+    uint32_t _received;
+    Sha256 _hash;
+    uint8_t _expected[SHA256_DIGEST_SIZE];
+    uint8_t _header[HEADER_HOLD];
+
+    /* Page being filled, and the other being written */
+    size_t _pageSize;
+    uint8_t *_pages[2];
+    uint8_t _fill;
+    size_t _used;
+    uint32_t _pageOffset;
+
+    /* Write handed to the writer */
+    volatile bool _writing;
+    volatile bool _writeFailed;
+    const uint8_t *_writeData;
+    uint32_t _writeOffset;
+    size_t _writeLength;
+
+    bool _submit();
+    bool _resume();
+    void _saveProgress();
+    void _wait();
+    bool _writePage(const uint8_t *data, uint32_t offset, size_t length);
+    bool _startWriter();
+    void _stopWriter();
+    void _release();
+
+#ifdef ARDUINO
+    TaskHandle_t _writerTask;
+    SemaphoreHandle_t _writeDone;
+    static void _writerLoop(void *arg);
+#else
+    std::thread *_writerThread;
+    std::mutex _mutex;
+    std::condition_variable _cond;
+    bool _stopping;
+    void _writerLoop();
+#endif
+};
+
+#endif // OTARECEIVER_H
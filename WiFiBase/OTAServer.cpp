@@ -0,0 +1,349 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#ifdef ARDUINO
+  #include <Arduino.h>
+  #include <lwip/sockets.h>
+#else
+  #include <time.h>
+  #include <fcntl.h>
+  #include <unistd.h>
+  #include <arpa/inet.h>
+  #include <netinet/in.h>
+  #include <sys/socket.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+  #define MSG_NOSIGNAL 0
+#endif
+
+#include "OTAServer.h"
+
+OTAServer::OTAServer(OTAReceiver *receiver, uint16_t port) {
+  _receiver = receiver;
+  for (uint8_t i = 0; i < OTA_TYPE_MAX; i++) {
+    _decoders[i] = nullptr;
+  }
+  _port = port;
+  _listenFd = -1;
+  _fd = -1;
+  _headerUsed = 0;
+  _decoder = nullptr;
+  _payloadReceived = _decoder ? 0 : _receiver->received();
+  _bufferUsed = 0;
+  _bufferOffset = 0;
+  _lastActive = 0;
+  _complete = false;
+  _updates = 0;
+  _failures = 0;
+}
+
+OTAServer::~OTAServer() {
+  stop();
+}
+
+bool OTAServer::begin() {
+  struct sockaddr_in addr;
+  int one = 1;
+
+  if (_listenFd >= 0) {
+    return true;
+  }
+
+  _listenFd = socket(AF_INET, SOCK_STREAM, 0);
+  if (_listenFd < 0) {
+    return false;
+  }
+  setsockopt(_listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+
+  memset(&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(_port);
+  if (bind(_listenFd, (struct sockaddr *)&addr, sizeof (addr)) < 0 ||
+      listen(_listenFd, 1) < 0) {
+    stop();
+    return false;
+  }
+  fcntl(_listenFd, F_SETFL, fcntl(_listenFd, F_GETFL, 0) | O_NONBLOCK);
+
+  if (_port == 0) {
+    socklen_t len = sizeof (addr);
+    getsockname(_listenFd, (struct sockaddr *)&addr, &len);
+    _port = ntohs(addr.sin_port);
+  }
+
+  return true;
+}
+
+void OTAServer::stop() {
+  if (_fd >= 0) {
+    _receiver->abort();
+    _close();
+  }
+  if (_listenFd >= 0) {
+    close(_listenFd);
+    _listenFd = -1;
+  }
+}
+
+uint16_t OTAServer::port() {
+  return _port;
+}
+
+bool OTAServer::setDecoder(uint8_t type, OTADecoder *decoder) {
+  if (type == OTA_TYPE_FULL || type >= OTA_TYPE_MAX || _fd >= 0) {
+    return false;
+  }
+  _decoders[type] = decoder;
+  return true;
+}
+
+void OTAServer::handle() {
+  if (_listenFd < 0) {
+    return;
+  }
+
+  _accept();
+
+  if (_fd >= 0) {
+    _read();
+  }
+
+  if (_fd >= 0 && _millis() - _lastActive > IDLE_TIMEOUT) {
+    _fail(OTA_ERR_TIMEOUT);
+  }
+}
+
+bool OTAServer::active() {
+  return (_fd >= 0);
+}
+
+bool OTAServer::complete() {
+  return _complete;
+}
+
+uint32_t OTAServer::updates() {
+  return _updates;
+}
+
+uint32_t OTAServer::failures() {
+  return _failures;
+}
+
+/**
+ * Accept a new sender, turning away any others while one is connected
+ */
+void OTAServer::_accept() {
+  while (true) {
+    int fd = accept(_listenFd, nullptr, nullptr);
+    if (fd < 0) {
+      return;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+    if (_fd >= 0) {
+      _reply(fd, OTA_REPLY_BUSY, OTA_ERR_NONE);
+      close(fd);
+      continue;
+    }
+
+    _fd = fd;
+    _headerUsed = 0;
+    _lastActive = _millis();
+  }
+}
+
+void OTAServer::_read() {
+  size_t total = 0;
+
+  while (_fd >= 0 && total < MAX_RECEIVE) {
+    uint8_t *into;
+    size_t length;
+
+    if (_headerUsed == sizeof (_header)) {
+      /* Use what was received before receiving more */
+      if (!_consume(&total)) {
+        return;
+      }
+      if (_payloadReceived == _header.payloadSize) {
+        _finish();
+        return;
+      }
+
+      /* Leave anything beyond the payload unread */
+      into = _buffer;
+      length = _header.payloadSize - _payloadReceived;
+      if (length > sizeof (_buffer)) {
+        length = sizeof (_buffer);
+      }
+    } else {
+      into = (uint8_t *)&_header + _headerUsed;
+      length = sizeof (_header) - _headerUsed;
+    }
+
+    int result = recv(_fd, into, length, 0);
+    if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    }
+    if (result <= 0) {
+      /* The sender went away before the image was complete */
+      _fail(_headerUsed < sizeof (_header) ? OTA_ERR_PROTOCOL :
+            OTA_ERR_INCOMPLETE);
+      return;
+    }
+
+    _lastActive = _millis();
+    total += result;
+
+    if (_headerUsed < sizeof (_header)) {
+      _headerUsed += result;
+      if (_headerUsed == sizeof (_header) && !_start()) {
+        return;
+      }
+    } else {
+      _payloadReceived += result;
+      _bufferUsed = result;
+      _bufferOffset = 0;
+    }
+  }
+}
+
+/**
+ * Pass the payload received to the receiver, or through the decoder along
+ * with any output it held back.  Output produced counts against the total.
+ * @return true once all that was received is used, false while the decoder
+ *         has more to produce or if the update failed
+ */
+bool OTAServer::_consume(size_t *total) {
+  while (*total < MAX_RECEIVE) {
+    if (_decoder && _decoder->busy()) {
+      *total += _decoder->pump(MAX_RECEIVE - *total);
+      _lastActive = _millis();
+    } else if (_bufferOffset < _bufferUsed) {
+      const uint8_t *data = &_buffer[_bufferOffset];
+      size_t length = _bufferUsed - _bufferOffset;
+      if (_decoder) {
+        uint32_t received = _receiver->received();
+        _bufferOffset += _decoder->write(data, length);
+        *total += _receiver->received() - received;
+      } else {
+        _receiver->write(data, length);
+        _bufferOffset = _bufferUsed;
+      }
+    } else {
+      return true;
+    }
+
+    if (_receiver->state() != OTA_RECEIVING) {
+      _fail(_receiver->error());
+      return false;
+    }
+  }
+
+  return false;
+}
+
+/**
+ * Check the header and start receiving the image it describes
+ */
+bool OTAServer::_start() {
+  if (_header.magic != OTA_MAGIC || _header.version != OTA_VERSION ||
+      _header.type >= OTA_TYPE_MAX) {
+    _fail(OTA_ERR_PROTOCOL);
+    return false;
+  }
+
+  /* Full images are sent as is, others need their decoder */
+  _decoder = _decoders[_header.type];
+  if ((_header.type == OTA_TYPE_FULL) ?
+      _header.payloadSize != _header.imageSize : !_decoder) {
+    _fail(OTA_ERR_PROTOCOL);
+    return false;
+  }
+
+  /* Decoders hold state of their own, so only full images resume */
+  bool resume = (_header.flags & OTA_FLAG_RESUME) &&
+                _header.type == OTA_TYPE_FULL;
+  if (!_receiver->begin(_header.imageSize, _header.sha256, resume)) {
+    _fail(_receiver->error());
+    return false;
+  }
+  if (_decoder && !_decoder->begin(_receiver)) {
+    _fail(_receiver->error());
+    return false;
+  }
+
+  _payloadReceived = _decoder ? 0 : _receiver->received();
+  _bufferUsed = 0;
+  _bufferOffset = 0;
+
+  _complete = false;
+  _reply(_fd, OTA_REPLY_READY, OTA_ERR_NONE);
+  return true;
+}
+
+void OTAServer::_finish() {
+  if (_decoder && !_decoder->finish()) {
+    _fail(_receiver->error());
+    return;
+  }
+  if (!_receiver->finish()) {
+    _fail(_receiver->error());
+    return;
+  }
+
+  _complete = true;
+  _updates++;
+  _reply(_fd, OTA_REPLY_OK, OTA_ERR_NONE);
+  _close();
+}
+
+void OTAServer::_fail(uint8_t error) {
+  if (_receiver->state() == OTA_RECEIVING) {
+    _receiver->abort(error);
+  }
+  _failures++;
+  _reply(_fd, OTA_REPLY_ERROR, error);
+  _close();
+}
+
+void OTAServer::_close() {
+  if (_fd >= 0) {
+    close(_fd);
+    _fd = -1;
+  }
+  _headerUsed = 0;
+}
+
+/**
+ * Replies are small enough to always fit in the socket's send buffer
+ */
+void OTAServer::_reply(int fd, uint8_t status, uint8_t error) {
+  ota_reply_t reply;
+
+  memset(&reply, 0, sizeof (reply));
+  reply.magic = OTA_MAGIC;
+  reply.status = status;
+  reply.error = error;
+  if (fd == _fd && _headerUsed == sizeof (_header)) {
+    reply.offset = _payloadReceived;
+  }
+  send(fd, &reply, sizeof (reply), MSG_NOSIGNAL);
+}
+
+unsigned long OTAServer::_millis() {
+#ifdef ARDUINO
+  return millis();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
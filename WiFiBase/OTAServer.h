@@ -0,0 +1,144 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Receives firmware images pushed over TCP.
+ *
+ * Design:
+ *   A sender connects and writes an ota_header_t giving the image's size and
+ * SHA-256, followed by the image itself.  Once the header is accepted the
+ * server replies READY, and once the image has been received, verified and
+ * activated it replies OK, or ERROR with the reason at any point it fails.
+ * Only one sender is handled at a time, any other is told BUSY and closed.
+ *
+ *   A sender setting OTA_FLAG_RESUME on a full image is told in READY's
+ * offset how much of it the receiver already holds from an earlier attempt,
+ * and sends only the rest.
+ *
+ *   The payload is either the image itself or, for other types, an encoding
+ * of it that a registered OTADecoder turns back into the image.
+ *
+ *   handle() never waits: it reads whatever has arrived, up to MAX_RECEIVE
+ * bytes per call so that the rest of the loop keeps running, and passes it to
+ * the OTAReceiver, or to the decoder whose output also counts towards it.
+ * A sender that goes quiet is dropped after IDLE_TIMEOUT, leaving no bootable
+ * image.
+ */
+
+#ifndef OTASERVER_H
+#define OTASERVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "OTAReceiver.h"
+#include "OTADecoder.h"
+
+#define OTA_MAGIC   0x4F424657  // "WFBO"
+#define OTA_VERSION 1
+
+typedef enum {
+  OTA_TYPE_FULL = 0,    // The complete image
+  OTA_TYPE_DELTA,       // Changes from the running image, see DeltaDecoder
+  OTA_TYPE_COMPRESSED,  // The image compressed, see LzssDecoder
+  OTA_TYPE_MAX
+} ota_type_t;
+
+typedef enum {
+  OTA_FLAG_RESUME = 0x01,  // Continue an interrupted full image
+} ota_flag_t;
+
+typedef enum {
+  OTA_REPLY_READY = 0,
+  OTA_REPLY_OK,
+  OTA_REPLY_BUSY,
+  OTA_REPLY_ERROR,
+} ota_reply_status_t;
+
+/* Fields are little-endian */
+typedef struct __attribute__((packed)) {
+  uint32_t magic;
+  uint8_t  version;
+  uint8_t  type;
+  uint8_t  flags;
+  uint8_t  reserved;
+  uint32_t payloadSize;  // Bytes following the header
+  uint32_t imageSize;    // Bytes written to flash
+  uint8_t  sha256[SHA256_DIGEST_SIZE];  // Of the image written
+} ota_header_t;
+
+typedef struct __attribute__((packed)) {
+  uint32_t magic;
+  uint8_t  status;
+  uint8_t  error;        // ota_error_t with OTA_REPLY_ERROR
+  uint8_t  reserved[2];
+  uint32_t offset;       // Payload bytes received, or held with READY
+} ota_reply_t;
+
+class OTAServer {
+  public:
+    static const uint16_t DEFAULT_PORT = 3232;
+    static const size_t RECEIVE_SIZE = 1024;
+    static const size_t MAX_RECEIVE = 16 * 1024;
+    static const unsigned long IDLE_TIMEOUT = 10 * 1000;
+
+    OTAServer(OTAReceiver *receiver, uint16_t port = DEFAULT_PORT);
+    ~OTAServer();
+
+    bool begin();
+    void stop();
+
+    /* Port being listened on, useful when created with port 0 */
+    uint16_t port();
+
+    /* Accept payloads of a type other than OTA_TYPE_FULL */
+    bool setDecoder(uint8_t type, OTADecoder *decoder);
+
+    /* Accept and receive without blocking */
+    void handle();
+
+    /* Whether a sender is connected */
+    bool active();
+
+    /* An image has been verified and activated, and awaits a restart */
+    bool complete();
+
+    uint32_t updates();
+    uint32_t failures();
+
+  protected:
+    OTAReceiver *_receiver;
+    OTADecoder *_decoders[OTA_TYPE_MAX];
+    uint16_t _port;
+    int _listenFd;
+    int _fd;
+
+    ota_header_t _header;
+    size_t _headerUsed;
+    OTADecoder *_decoder;
+    uint32_t _payloadReceived;
+
+    /* Payload received but not yet consumed by the decoder */
+    uint8_t _buffer[RECEIVE_SIZE];
+    size_t _bufferUsed;
+    size_t _bufferOffset;
+
+    unsigned long _lastActive;
+    bool _complete;
+    uint32_t _updates;
+    uint32_t _failures;
+
+    void _accept();
+    void _read();
+    bool _consume(size_t *total);
+    bool _start();
+    void _finish();
+    void _fail(uint8_t error);
+    void _close();
+    void _reply(int fd, uint8_t status, uint8_t error);
+
+    static unsigned long _millis();
+};
+
+#endif // OTASERVER_H
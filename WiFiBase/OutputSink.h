@@ -0,0 +1,20 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Destination for responses that are streamed rather than assembled in RAM.
+ */
+
+#ifndef OUTPUTSINK_H
+#define OUTPUTSINK_H
+
+#include <stddef.h>
+
+class OutputSink {
+  public:
+    virtual ~OutputSink() {}
+    virtual void write(const char *data, size_t length) = 0;
+};
+
+#endif // OUTPUTSINK_H
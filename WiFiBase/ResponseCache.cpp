@@ -0,0 +1,131 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ResponseCache.h"
+
+#define INITIAL_SIZE 256
+
+ResponseCache::ResponseCache() {
+  _key = 0;
+  _valid = false;
+  _failed = false;
+  _buffer = nullptr;
+  _length = 0;
+  _allocated = 0;
+  _etag[0] = '\0';
+  _notModified = 0;
+}
+
+ResponseCache::~ResponseCache() {
+  free(_buffer);
+}
+
+bool ResponseCache::valid(uint32_t key) {
+  return (_valid && _key == key);
+}
+
+void ResponseCache::begin(uint32_t key) {
+  _key = key;
+  _valid = false;
+  _failed = false;
+  _length = 0;
+  snprintf(_etag, sizeof (_etag), "\"%08lx\"", (unsigned long)key);
+}
+
+/**
+ * Append to the response, growing the buffer by doubling up to MAX_SIZE
+ */
+void ResponseCache::write(const char *data, size_t length) {
+  if (_failed) {
+    return;
+  }
+
+  if (_length + length > _allocated) {
+    size_t size = _allocated ? _allocated : INITIAL_SIZE;
+    while (size < _length + length) {
+      size *= 2;
+    }
+    if (size > MAX_SIZE) {
+      size = MAX_SIZE;
+    }
+
+    char *buffer = nullptr;
+    if (_length + length <= size) {
+      buffer = (char *)realloc(_buffer, size);
+    }
+    if (!buffer) {
+      _failed = true;
+      return;
+    }
+    _buffer = buffer;
+    _allocated = size;
+  }
+
+  memcpy(&_buffer[_length], data, length);
+  _length += length;
+}
+
+bool ResponseCache::end() {
+  _valid = !_failed;
+  return _valid;
+}
+
+/**
+ * Discard the response and release its memory
+ */
+void ResponseCache::clear() {
+  free(_buffer);
+  _buffer = nullptr;
+  _allocated = 0;
+  _length = 0;
+  _valid = false;
+}
+
+const char *ResponseCache::data() {
+  return _buffer;
+}
+
+size_t ResponseCache::length() {
+  return _length;
+}
+
+const char *ResponseCache::etag() {
+  return _etag;
+}
+
+/**
+ * Check a list of entity tags, which may be weak, or "*" for any
+ */
+bool ResponseCache::matches(const char *ifNoneMatch) {
+  if (!_valid || !ifNoneMatch) {
+    return false;
+  }
+  if (strcmp(ifNoneMatch, "*") == 0) {
+    return true;
+  }
+  return (strstr(ifNoneMatch, _etag) != nullptr);
+}
+
+void ResponseCache::send(WiFiBaseServer *server, const char *type) {
+  server->sendHeader("ETag", _etag);
+  server->sendHeader("Cache-Control", "no-cache");
+
+  if (matches(server->header("If-None-Match"))) {
+    _notModified++;
+    server->send(304, type, "", 0);
+    return;
+  }
+
+  server->send(200, type, _buffer ? _buffer : "", _length);
+}
+
+uint32_t ResponseCache::notModified() {
+  return _notModified;
+}
@@ -0,0 +1,73 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Rendered response held for reuse while the state it reflects is unchanged.
+ *
+ * Design:
+ *   A response is rendered into the cache, which is an OutputSink, along with
+ * a key identifying the state it was rendered from.  While the caller's key is
+ * unchanged the cached bytes are sent as they are, and since the ETag is
+ * derived from the key a client that already has them is answered with a 304
+ * and no body.  Keys should start from a random value at boot so that an ETag
+ * from before a restart doesn't match.
+ *
+ *   Responses larger than MAX_SIZE aren't cached, the caller streams them
+ * instead.
+ */
+
+#ifndef RESPONSECACHE_H
+#define RESPONSECACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "OutputSink.h"
+#include "WiFiBaseServer.h"
+
+class ResponseCache : public OutputSink {
+  public:
+    ResponseCache();
+    ~ResponseCache();
+
+    static const size_t MAX_SIZE = 4096;
+    static const size_t ETAG_LEN = 10;  // Quoted 8 hex digits
+
+    /* True if holding a response rendered for the key */
+    bool valid(uint32_t key);
+
+    /* Discard the current response and start rendering one for the key */
+    void begin(uint32_t key);
+    void write(const char *data, size_t length);
+
+    /* Finish rendering, returns false if it couldn't be held */
+    bool end();
+
+    void clear();
+
+    const char *data();
+    size_t length();
+    const char *etag();
+
+    /* True if an If-None-Match header lists the current ETag */
+    bool matches(const char *ifNoneMatch);
+
+    /* Send the response, or a 304 if the request shows the client has it */
+    void send(WiFiBaseServer *server, const char *type);
+
+    /* Responses answered with a 304 */
+    uint32_t notModified();
+
+  protected:
+    uint32_t _key;
+    bool _valid;
+    bool _failed;
+    char *_buffer;
+    size_t _length;
+    size_t _allocated;
+    char _etag[ETAG_LEN + 1];
+    uint32_t _notModified;
+};
+
+#endif // RESPONSECACHE_H
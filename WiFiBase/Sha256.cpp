@@ -0,0 +1,146 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Implementation of SHA-256 as specified in FIPS 180-4.
+ */
+
+#include <string.h>
+
+#include "Sha256.h"
+
+static const uint32_t K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+  0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+  0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+  0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+  0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+  0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+  0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+  0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+  0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+Sha256::Sha256() {
+  reset();
+}
+
+void Sha256::reset() {
+  static const uint32_t initial[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+  memcpy(_state.h, initial, sizeof (initial));
+  _state.length = 0;
+}
+
+void Sha256::update(const void *data, size_t length) {
+  const uint8_t *bytes = (const uint8_t *)data;
+  size_t used = _state.length % SHA256_BLOCK_SIZE;
+
+  _state.length += length;
+
+  /* Complete a partial block first */
+  if (used) {
+    size_t fill = SHA256_BLOCK_SIZE - used;
+    if (length < fill) {
+      memcpy(&_state.block[used], bytes, length);
+      return;
+    }
+    memcpy(&_state.block[used], bytes, fill);
+    _transform(_state.block);
+    bytes += fill;
+    length -= fill;
+  }
+
+  /* Whole blocks are hashed straight from the input */
+  while (length >= SHA256_BLOCK_SIZE) {
+    _transform(bytes);
+    bytes += SHA256_BLOCK_SIZE;
+    length -= SHA256_BLOCK_SIZE;
+  }
+
+  memcpy(_state.block, bytes, length);
+}
+
+void Sha256::finish(uint8_t *digest) {
+  uint64_t bits = _state.length * 8;
+  size_t used = _state.length % SHA256_BLOCK_SIZE;
+
+  /* Pad with a one bit, zeros, and the length in bits */
+  _state.block[used++] = 0x80;
+  if (used > SHA256_BLOCK_SIZE - 8) {
+    memset(&_state.block[used], 0, SHA256_BLOCK_SIZE - used);
+    _transform(_state.block);
+    used = 0;
+  }
+  memset(&_state.block[used], 0, SHA256_BLOCK_SIZE - 8 - used);
+  for (int i = 0; i < 8; i++) {
+    _state.block[SHA256_BLOCK_SIZE - 1 - i] = (uint8_t)(bits >> (8 * i));
+  }
+  _transform(_state.block);
+
+  for (int i = 0; i < 8; i++) {
+    digest[4 * i]     = (uint8_t)(_state.h[i] >> 24);
+    digest[4 * i + 1] = (uint8_t)(_state.h[i] >> 16);
+    digest[4 * i + 2] = (uint8_t)(_state.h[i] >> 8);
+    digest[4 * i + 3] = (uint8_t)(_state.h[i]);
+  }
+}
+
+const sha256_state_t *Sha256::state() {
+  return &_state;
+}
+
+void Sha256::restore(const sha256_state_t *state) {
+  memcpy(&_state, state, sizeof (_state));
+}
+
+void Sha256::_transform(const uint8_t *block) {
+  uint32_t w[64];
+
+  for (int i = 0; i < 16; i++) {
+    w[i] = ((uint32_t)block[4 * i] << 24) | ((uint32_t)block[4 * i + 1] << 16) |
+           ((uint32_t)block[4 * i + 2] << 8) | (uint32_t)block[4 * i + 3];
+  }
+  for (int i = 16; i < 64; i++) {
+    uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  uint32_t a = _state.h[0], b = _state.h[1], c = _state.h[2], d = _state.h[3];
+  uint32_t e = _state.h[4], f = _state.h[5], g = _state.h[6], h = _state.h[7];
+
+  for (int i = 0; i < 64; i++) {
+    uint32_t S1 = ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25);
+    uint32_t ch = (e & f) ^ (~e & g);
+    uint32_t t1 = h + S1 + ch + K[i] + w[i];
+    uint32_t S0 = ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22);
+    uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+    uint32_t t2 = S0 + maj;
+
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+
+  _state.h[0] += a;
+  _state.h[1] += b;
+  _state.h[2] += c;
+  _state.h[3] += d;
+  _state.h[4] += e;
+  _state.h[5] += f;
+  _state.h[6] += g;
+  _state.h[7] += h;
+}
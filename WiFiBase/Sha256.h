@@ -0,0 +1,48 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Self contained incremental SHA-256, for verifying firmware images as they
+ * are received.
+ *
+ * Design:
+ *   The whole state is a plain struct, so that a partly computed hash can be
+ * saved and restored to continue an interrupted transfer.
+ */
+
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_SIZE 32
+#define SHA256_BLOCK_SIZE  64
+
+typedef struct {
+  uint32_t h[8];
+  uint64_t length;                     // Bytes hashed
+  uint8_t  block[SHA256_BLOCK_SIZE];   // Partial block of length % 64 bytes
+} sha256_state_t;
+
+class Sha256 {
+  public:
+    Sha256();
+
+    void reset();
+    void update(const void *data, size_t length);
+
+    /* Write the digest, after which the hash must be reset */
+    void finish(uint8_t *digest);
+
+    const sha256_state_t *state();
+    void restore(const sha256_state_t *state);
+
+  protected:
+    sha256_state_t _state;
+
+    void _transform(const uint8_t *block);
+};
+
+#endif // SHA256_H
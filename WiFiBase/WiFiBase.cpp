@@ -20,7 +20,8 @@
 /**
  * Create a default WifiBase object
  */
-WiFiBase::WiFiBase(boolean useStored) {
+WiFiBase::WiFiBase(boolean useStored) :
+    _connector(&_driver), _uplink(&_driver, &_connector) {
   _background = true;
   _APSsid = nullptr;
   _APPasswd = nullptr;
@@ -28,15 +29,62 @@ WiFiBase::WiFiBase(boolean useStored) {
   _accessPointEnabled = false;
   _accessPointActive = false;
   _configPortal = false;
+  _concurrent = false;
+  _portalClosing = false;
+  _portalConnected = 0;
 
   _numKnownNetworks = 0;
   _allocatedKnownNetworks = 0;
   _knownNetworks = nullptr;
 
-  _connectionTimeoutMs = DEFAULT_CONNECT_TIMEOUT;
   _connectedIndex = INDEX_DISCONNECTED;
 
+  _roaming = false;
+  _roamScanning = false;
+  _roamIndex = INDEX_DISCONNECTED;
+  _roamFrom = INDEX_DISCONNECTED;
+  _roamReturning = false;
+  _scanBeforeConnect = false;
+
   _server = nullptr;
+  _endpoints = nullptr;
+  _routeMetrics = nullptr;
+  _numCounters = 0;
+  _requestCount = 0;
+  _eventsChecked = 0;
+
+  _updates = false;
+  _updatePort = OTAServer::DEFAULT_PORT;
+  _updateFlash = nullptr;
+  _updateProgress = nullptr;
+  _updateReceiver = nullptr;
+  _updateServer = nullptr;
+  _baseFlash = nullptr;
+  _deltaDecoder = nullptr;
+  _lzssDecoder = nullptr;
+  _distributeUpdates = false;
+  _distributePort = OTAHub::DEFAULT_PORT;
+  _distributeRate = DEFAULT_DISTRIBUTE_RATE;
+  _runningFlash = nullptr;
+  _hub = nullptr;
+  _gossipUpdates = false;
+  _gossipVersion = 0;
+  _gossipPort = OTAGossipNode::DEFAULT_PORT;
+  _gossipRunning = nullptr;
+  _gossipFlash = nullptr;
+  _gossip = nullptr;
+
+  /* Start from random generations so that ETags differ across restarts */
+  _generation = esp_random();
+  _documentationGeneration = esp_random();
+
+  _serviceMode = WFB_SERVICE_POLL;
+  _serviceStack = DEFAULT_SERVICE_STACK;
+  _servicePriority = DEFAULT_SERVICE_PRIORITY;
+  _serviceTask = nullptr;
+  _serviceStarted = false;
+  _connecting = false;
+  _lock = nullptr;
 
   /*
    * If there was a previously connected WiFi, add it as the default known
@@ -52,12 +100,34 @@ WiFiBase::WiFiBase(boolean useStored) {
 
 WiFiBase::~WiFiBase() {
   DEBUG4_PRINTLN("WFB: freeing");
+  _serviceTicker.detach();
+  if (_serviceTask) {
+    vTaskDelete(_serviceTask);
+  }
   WiFi.disconnect();
   for (int i = 0; i < _numKnownNetworks; i++) {
     free(_knownNetworks[i].ssid);
     free(_knownNetworks[i].passwd);
   }
   delete _server;
+  delete _updateServer;
+  delete _updateReceiver;
+  delete _updateFlash;
+  delete _updateProgress;
+  delete _deltaDecoder;
+  delete _lzssDecoder;
+  delete _baseFlash;
+  _stopHub();
+  _stopGossip();
+  free(_routeMetrics);
+  if (_lock) {
+    vSemaphoreDelete(_lock);
+  }
+  while (_endpoints) {
+    struct endpoint *next = _endpoints->next;
+    delete _endpoints;
+    _endpoints = next;
+  }
 }
 
 /*******************************************************************************
@@ -83,6 +153,7 @@ bool WiFiBase::configureAccessPoint(const char *ssid, const char *passwd) {
   _APSsid = ssid;
   _APPasswd = passwd;
   _accessPointEnabled = true;
+  _invalidate();
   return true;
 }
 
@@ -98,6 +169,26 @@ bool WiFiBase::disableAccessPoint() {
   return true;
 }
 
+/**
+ * Configure keeping the access point up alongside the station
+ * @param concurrent Whether to run both at once
+ * @param forward Whether to forward traffic from the access point upstream
+ * @param retryMinMs Wait after a round of failed attempts, doubling each round
+ * @param retryMaxMs Limit on the wait between rounds
+ * @return
+ */
+bool WiFiBase::useConcurrentAccessPoint(bool concurrent, bool forward,
+                                        unsigned long retryMinMs,
+                                        unsigned long retryMaxMs) {
+  if (_accessPointActive) {
+    DEBUG_ERR("WFB: access point is active");
+    return false;
+  }
+  _concurrent = concurrent;
+  _uplink.configure(retryMinMs, retryMaxMs, forward);
+  return true;
+}
+
 bool WiFiBase::useConfigPortal(bool configPortal) {
   if (_accessPointActive) {
     DEBUG_ERR("WFB: access point is active")
@@ -116,6 +207,14 @@ bool WiFiBase::useConfigPortal(bool configPortal) {
  * @return
  */
 uint8_t WiFiBase::addKnownNetwork(const char *ssid, const char *passwd) {
+  WiFiBaseLock guard(this);
+
+  if (_connecting || _roamIndex != INDEX_DISCONNECTED) {
+    /* The list may not move while a connect iterates over it */
+    DEBUG_ERR("WFB: connect in progress");
+    return INDEX_DISCONNECTED;
+  }
+
   if (!_allocatedKnownNetworks) {
     _allocatedKnownNetworks = 2;
     _numKnownNetworks = 0;
@@ -144,7 +243,8 @@ uint8_t WiFiBase::addKnownNetwork(const char *ssid, const char *passwd) {
              sizeof(struct network) * _numKnownNetworks);
       free(_knownNetworks);
 
-      /* Swap to the new copied array */
+      /* Swap to the new copied array, restarting any attempt on the old */
+      _uplink.defer(millis());
       _knownNetworks = newNetworks;
       _allocatedKnownNetworks = newAlloc;
     }
@@ -154,11 +254,18 @@ uint8_t WiFiBase::addKnownNetwork(const char *ssid, const char *passwd) {
 
   _knownNetworks[_numKnownNetworks].ssid = strdup(ssid);
   _knownNetworks[_numKnownNetworks].passwd = strdup(passwd);
+  memset(&_knownNetworks[_numKnownNetworks].cache, 0, sizeof (network_cache_t));
+  memset(&_knownNetworks[_numKnownNetworks].history, 0, sizeof (network_history_t));
+  memset(&_knownNetworks[_numKnownNetworks].penalty, 0, sizeof (network_penalty_t));
+  memset(&_knownNetworks[_numKnownNetworks].stats, 0, sizeof (network_stats_t));
+  _knownNetworks[_numKnownNetworks].lastFailure = WFB_FAIL_NONE;
+  _knownNetworks[_numKnownNetworks].lastChannel = 0;
 
   DEBUG4_VALUE(" ", _knownNetworks[_numKnownNetworks].ssid);
   DEBUG4_VALUELN(" ", _knownNetworks[_numKnownNetworks].passwd);
 
   _numKnownNetworks++;
+  _invalidate();
 
   return (_numKnownNetworks - (uint8_t)1);
 }
@@ -170,20 +277,35 @@ uint8_t WiFiBase::addKnownNetwork(const char *ssid, const char *passwd) {
  * @return
  */
 bool WiFiBase::connectAddKnownNetwork(const char *ssid, const char *passwd) {
-  WiFi.begin(ssid, passwd);
+  WiFiBaseLock guard(this);
+
+  if (_connecting || _roamIndex != INDEX_DISCONNECTED) {
+    return false;
+  }
 
-  if (!_connectWait()) {
-    DEBUG4_VALUELN("WFB: connectAdd failed ", ssid);
+  if (!_connectToNetwork(ssid, passwd)) {
+    DEBUG4_VALUE("WFB: connectAdd failed ", ssid);
+    DEBUG4_VALUELN(" ", WiFiConnector::failureString(_connector.lastFailure()));
     return false;
   }
 
+  _addConnectedNetwork(ssid, passwd);
+
+  return true;
+}
+
+/**
+ * Add the network that was just connected to as a known network
+ */
+void WiFiBase::_addConnectedNetwork(const char *ssid, const char *passwd) {
   DEBUG4_VALUE("WFB: connectAdd ssid:", ssid);
   DEBUG4_VALUELN(" localIP:", WiFi.localIP());
 
   uint8_t index = addKnownNetwork(ssid, passwd);
+  if (index != INDEX_DISCONNECTED) {
+    _connector.recordConnection(&_knownNetworks[index]);
+  }
   _setConnected(index);
-
-  return true;
 }
 
 /**
@@ -208,6 +330,18 @@ uint8_t WiFiBase::lookupKnownNetwork(const char *ssid) {
   return INDEX_DISCONNECTED;
 }
 
+/**
+ * Reason for the most recent failed connection attempt to a known network
+ * @param index Index of the network
+ * @return      Failure reason, or WFB_FAIL_NONE
+ */
+wifi_fail_t WiFiBase::failureReason(uint8_t index) {
+  if (index >= _numKnownNetworks) {
+    return WFB_FAIL_NONE;
+  }
+  return (wifi_fail_t)_knownNetworks[index].lastFailure;
+}
+
 /**
  * Check if a given ssid is included in the known networks list
  * @param ssid  Name of network to lookup
@@ -218,7 +352,100 @@ bool WiFiBase::hasKnownNetwork(const char *ssid) {
 }
 
 bool WiFiBase::setConnectTimeoutMs(unsigned long ms) {
-  _connectionTimeoutMs = ms;
+  _connector.setTimeoutMs(ms);
+  return true;
+}
+
+/**
+ * Set the timeout for a directed reconnect to a network's cached access point,
+ * after which a full connect is attempted.
+ */
+bool WiFiBase::setFastConnectTimeoutMs(unsigned long ms) {
+  _connector.setFastTimeoutMs(ms);
+  return true;
+}
+
+/**
+ * Enable or disable reconnecting via the cached BSSID, channel and IP lease
+ * of a known network.
+ */
+bool WiFiBase::useFastReconnect(bool fastReconnect) {
+  _connector.setFastReconnect(fastReconnect);
+  return true;
+}
+
+/**
+ * Enable or disable deriving each network's connect timeout from the durations
+ * of its recent connects, bounded by minMs and maxMs.
+ */
+bool WiFiBase::useAdaptiveTimeout(bool adaptive, unsigned long minMs,
+                                  unsigned long maxMs, uint16_t marginPercent) {
+  _connector.setAdaptiveTimeout(adaptive);
+  _connector.setAdaptiveTimeout(minMs, maxMs, marginPercent);
+  return true;
+}
+
+/**
+ * Enable or disable skipping networks that have recently failed.  Each failure
+ * doubles a network's cooldown from baseMs up to maxMs, and the failure count
+ * halves with every halfLifeMs without a failure.  Off by default.
+ */
+bool WiFiBase::useFailurePenalties(bool penalties, unsigned long baseMs,
+                                   unsigned long maxMs,
+                                   unsigned long halfLifeMs) {
+  _connector.setPenalties(penalties);
+  _connector.setPenalties(baseMs, maxMs, halfLifeMs);
+  return true;
+}
+
+/**
+ * Enable or disable roaming to a stronger access point of a known network.
+ * While connected the RSSI is sampled every sampleIntervalMs, and if it falls
+ * below scanThresholdDbm a background scan is made at most every
+ * scanIntervalMs.  A known network that is stronger by hysteresisDb is roamed
+ * to.  Roaming is performed from checkServer(), joining the access point over
+ * several passes within the fast reconnect timeout.
+ */
+bool WiFiBase::useRoaming(bool roaming, uint8_t hysteresisDb,
+                          int8_t scanThresholdDbm,
+                          unsigned long sampleIntervalMs,
+                          unsigned long scanIntervalMs) {
+  _roamer.configure(hysteresisDb, scanThresholdDbm, sampleIntervalMs,
+                    scanIntervalMs);
+  _roaming = roaming;
+  return true;
+}
+
+/**
+ * Enable or disable scanning for known networks before connecting.  The
+ * channels that known networks were last seen on are scanned first, each for
+ * the active or passive dwell time, and only if none is found are all channels
+ * scanned.  Only networks found by the scan are attempted, so hidden networks
+ * require this to be disabled, other than the network stored by the SDK which
+ * is attempted if none of them connects.
+ */
+bool WiFiBase::useScanBeforeConnect(bool scan, uint16_t activeDwellMs,
+                                    uint16_t passiveDwellMs, bool passive) {
+  _scanPlanner.configure(activeDwellMs, passiveDwellMs, passive);
+  _scanBeforeConnect = scan;
+  return true;
+}
+
+/**
+ * Enable or disable abandoning connection attempts as soon as the status or
+ * disconnect reason shows they cannot succeed, rather than at the timeout.
+ */
+bool WiFiBase::useFailFast(bool failFast) {
+  _connector.setFailFast(failFast);
+  return true;
+}
+
+/**
+ * Set how long scan results are reused by /scan, roaming and scan-before-
+ * connect before a new scan is started.
+ */
+bool WiFiBase::setScanCacheTtlMs(unsigned long ms) {
+  _scanCache.setTtlMs(ms);
   return true;
 }
 
@@ -238,13 +465,202 @@ bool WiFiBase::setServerPort(int port) {
   return true;
 }
 
+/**
+ * Configure receiving over-the-air firmware updates
+ * @param updates Whether to accept updates
+ * @param port TCP port images are pushed to
+ * @return
+ */
+bool WiFiBase::useUpdates(bool updates, uint16_t port) {
+  if (_updateServer) {
+    DEBUG_ERR("WFB: update server is active");
+    return false;
+  }
+
+  _updates = updates;
+  _updatePort = port;
+
+  return true;
+}
+
+/**
+ * Configure serving the running firmware to nodes connected to the access point
+ * @param distribute Whether to serve it
+ * @param port TCP port nodes download from
+ * @param bytesPerSec Limit on the rate each node is sent, 0 for none
+ * @return
+ */
+bool WiFiBase::distributeUpdates(bool distribute, uint16_t port,
+                                 uint32_t bytesPerSec) {
+  if (_hub) {
+    DEBUG_ERR("WFB: hub is active");
+    return false;
+  }
+
+  _distributeUpdates = distribute;
+  _distributePort = port;
+  _distributeRate = bytesPerSec;
+
+  return true;
+}
+
+/**
+ * @return The hub serving updates, for its progress, or null if not serving
+ */
+OTAHub *WiFiBase::getHub() {
+  return _hub;
+}
+
+/**
+ * Configure spreading updates between nodes
+ * @param gossip Whether to pull newer images from other nodes and serve ours
+ * @param version Of the running build, higher than any before it
+ * @param port UDP port adverts are broadcast on, and TCP port chunks are
+ *             requested from
+ * @return
+ */
+bool WiFiBase::gossipUpdates(bool gossip, uint32_t version, uint16_t port) {
+  if (_gossip) {
+    DEBUG_ERR("WFB: gossip is active");
+    return false;
+  }
+
+  _gossipUpdates = gossip;
+  _gossipVersion = version;
+  _gossipPort = port;
+
+  return true;
+}
+
+/**
+ * @return The node spreading updates, for its progress, or null if not started
+ */
+OTAGossipNode *WiFiBase::getGossip() {
+  return _gossip;
+}
+
+bool WiFiBase::setServiceMode(wifi_service_mode_t mode,
+                              unsigned long intervalMs, uint32_t stackSize,
+                              uint8_t priority) {
+  if (_serviceStarted) {
+    DEBUG_ERR("WFB: service is active");
+    return false;
+  }
+
+  /* Locking is only needed once servicing moves off the application's task */
+  if (mode != WFB_SERVICE_POLL && !_lock) {
+    _lock = xSemaphoreCreateRecursiveMutex();
+    if (!_lock) {
+      DEBUG_ERR("WFB: alloc failure");
+      return false;
+    }
+  }
+
+  _serviceMode = mode;
+  _scheduler.configure(intervalMs, WiFiServiceScheduler::DEFAULT_BUSY_INTERVAL);
+  _serviceStack = stackSize;
+  _servicePriority = priority;
+
+  return true;
+}
+
+void WiFiBase::lock() {
+  if (_lock) {
+    xSemaphoreTakeRecursive(_lock, portMAX_DELAY);
+  }
+}
+
+void WiFiBase::unlock() {
+  if (_lock) {
+    xSemaphoreGiveRecursive(_lock);
+  }
+}
+
+/**
+ * Release the lock for a blocking connect, so that background servicing can
+ * still serve requests.  The service pass leaves the radio and the known
+ * networks alone until the connect ends.
+ */
+void WiFiBase::_beginConnect() {
+  _connecting = true;
+  unlock();
+}
+
+void WiFiBase::_endConnect() {
+  lock();
+  _connecting = false;
+}
+
 /**
  * Return the webserver, to allow endpoints to be added by other code
  */
-WebServer* WiFiBase::getServer() {
+WiFiBaseServer* WiFiBase::getServer() {
   return _server;
 }
 
+/**
+ * Add an endpoint to the server and its documentation.  If the server hasn't
+ * been created yet the endpoint is registered once it is.  The strings are
+ * not copied and must remain valid.
+ * @return true if the endpoint was added, false if the server has no room
+ */
+bool WiFiBase::addEndpoint(const char *route,
+                           WiFiBaseServer::THandlerFunction handler,
+                           const char *description, const char *args) {
+  WiFiBaseLock guard(this);
+
+  struct endpoint *ep = new struct endpoint;
+  if (!ep) {
+    DEBUG_ERR("WFB: alloc failure");
+    return false;
+  }
+  ep->route = route;
+  ep->description = description;
+  ep->args = args;
+  ep->handler = handler;
+  memset(&ep->metrics, 0, sizeof (metrics_route_t));
+  ep->next = nullptr;
+
+  /* Keep the order endpoints were added in */
+  struct endpoint **tail = &_endpoints;
+  while (*tail) {
+    tail = &(*tail)->next;
+  }
+  *tail = ep;
+
+  if (_server && !_server->on(route, _timed(handler, &ep->metrics))) {
+    DEBUG_ERR("WFB: too many routes");
+    *tail = nullptr;
+    delete ep;
+    return false;
+  }
+  _documentationGeneration++;
+
+  return true;
+}
+
+/**
+ * Register a counter to be reported by /metrics.  The name and help strings
+ * are not copied, and the value is read each time the metrics are rendered.
+ * @return true if the counter was registered
+ */
+bool WiFiBase::registerCounter(const char *name, const char *help,
+                               const uint32_t *value) {
+  WiFiBaseLock guard(this);
+
+  if (_numCounters >= MAX_COUNTERS) {
+    DEBUG_ERR("WFB: too many counters");
+    return false;
+  }
+
+  _counters[_numCounters].name = name;
+  _counters[_numCounters].help = help;
+  _counters[_numCounters].value = value;
+  _numCounters++;
+
+  return true;
+}
+
 /*******************************************************************************
  * Operational functions
  */
@@ -254,7 +670,14 @@ WebServer* WiFiBase::getServer() {
  * @return
  */
 bool WiFiBase::_startupConnect() {
-
+  if (_concurrent && _accessPointEnabled) {
+    /* Serve local nodes at once, the station connects in the background */
+    if (_configPortal ? !_startupConfigPortal() : !_startupAccessPoint()) {
+      return false;
+    }
+    _uplink.begin(millis());
+    return true;
+  }
 
   if (_connectToNetwork()) {
     DEBUG3_VALUELN("WFB: Connected as ", WiFi.localIP().toString());
@@ -281,43 +704,33 @@ bool WiFiBase::_startupConnect() {
 }
 
 bool WiFiBase::startup() {
+  WiFiBaseLock guard(this);
+
   if (_background) {
     /* TODO: Set this to running in the background */
   }
 
+  if (_jobs.busy() || _connecting || _roamIndex != INDEX_DISCONNECTED) {
+    /* Leave the radio to the connect in progress */
+    return false;
+  }
+
+  if (_portal.active() && !_concurrent) {
+    /* A network is being configured through the portal */
+    return false;
+  }
+
+  if (_uplink.state() != WFB_UPLINK_OFF) {
+    /* The station is maintained in the background */
+    return connected();
+  }
+
   if (!_startupConnect()) {
     return false;
   }
 
   _createServer();
-  return true;
-}
-
-/**
- * Wait for connect to succeed or fail
- * @return True if connected
- */
-bool WiFiBase::_connectWait() {
-  uint8_t status;
-  DEBUG4_PRINTLN("WFB: _connectWait");
-  unsigned long start = millis();
-  while (true) {
-    status = WiFi.status();
-    if (status == WL_CONNECTED) {
-      DEBUG4_PRINTLN("WFB: connect succeeded");
-      return true;
-    }
-    if (status == WL_CONNECT_FAILED) {
-      DEBUG4_VALUELN("WFB: connect failed ", status);
-      return false;
-    }
-    if (millis() - start > _connectionTimeoutMs) {
-      DEBUG4_PRINTLN("WFB: connect timeout")
-      esp_wifi_disconnect();
-      return false;
-    }
-    delay(100);
-  };
+  return _startService();
 }
 
 /**
@@ -328,11 +741,30 @@ bool WiFiBase::connected() {
 }
 
 void WiFiBase::_setConnected(uint8_t index) {
+  uint8_t bssid[WFB_BSSID_LEN];
+
   _connectedIndex = index;
+  _connectedTime.update(true, millis());
+  _uplink.connected(index);
+  _invalidate();
+
+  if (_driver.bssid(bssid)) {
+    _roamer.reset(bssid, _driver.rssi(), millis());
+  }
 }
 
 void WiFiBase::_setDisconnected() {
   _connectedIndex = INDEX_DISCONNECTED;
+  _connectedTime.update(false, millis());
+  _invalidate();
+}
+
+/**
+ * Note a change in the state reported by the server, so that cached responses
+ * are rendered again
+ */
+void WiFiBase::_invalidate() {
+  _generation++;
 }
 
 /**
@@ -341,36 +773,25 @@ void WiFiBase::_setDisconnected() {
  * @return Whether this connected to a known network
  */
 bool WiFiBase::_connectToNetwork() {
-  int index = 0;
-
   if (WiFi.status() == WL_CONNECTED) {
     DEBUG3_PRINTLN("WFB: already connected");
     return true;
   }
 
   if (_numKnownNetworks) {
-    // TODO: Should we scan for networks here?
-
-    if (_knownNetworks[index].ssid[index] == '\0') {
-      /* This indicates to try the ssid stored via the Esp SDK */
-      DEBUG3_PRINTLN("WFB: attempting stored network");
-      WiFi.begin();
-      if (_connectWait()) {
-        _setConnected(index);
-        return true;
-      }
-
-      index++;
+    uint8_t index;
+    _beginConnect();
+    if (_scanBeforeConnect) {
+      index = _connector.connectScanned(_knownNetworks, _numKnownNetworks,
+                                        &_scanPlanner, &_scanCache);
+    } else {
+      index = _connector.connectKnown(_knownNetworks, _numKnownNetworks);
     }
-
-    /* Iterate over remaining networks and attempt connections */
-    for (; index < _numKnownNetworks; index++) {
-      DEBUG3_VALUELN("WFB: Connect ", _knownNetworks[index].ssid);
-      WiFi.begin(_knownNetworks[index].ssid, _knownNetworks[index].passwd);
-      if (_connectWait()) {
-        _setConnected(index);
-        return true;
-      }
+    _endConnect();
+    if (index != WiFiConnector::INDEX_NONE) {
+      DEBUG3_VALUELN("WFB: Connected ", _knownNetworks[index].ssid);
+      _setConnected(index);
+      return true;
     }
 
     DEBUG3_PRINTLN("WFB: Failed connect");
@@ -381,39 +802,156 @@ bool WiFiBase::_connectToNetwork() {
 }
 
 bool WiFiBase::_connectToNetwork(const char *ssid, const char *passwd) {
-  WiFi.begin(ssid, passwd);
-  return _connectWait();
+  _beginConnect();
+  bool connected = _connector.connect(ssid, passwd);
+  _endConnect();
+  return connected;
+}
+
+/**
+ * Sample the signal of the current connection and run a background scan when
+ * it is weak, roaming if the scan found a stronger known access point.
+ */
+void WiFiBase::_checkRoaming() {
+  unsigned long now = millis();
+
+  if (_roamIndex != INDEX_DISCONNECTED) {
+    _checkRoam();
+    return;
+  }
+
+  if (!_roaming || !connected() || _jobs.busy()) {
+    return;
+  }
+
+  if (_roamScanning) {
+    if (_scanCache.scanning()) {
+      return;
+    }
+    _roamScanning = false;
+    _roamFromCache();
+    return;
+  }
+
+  if (_roamer.sampleDue(now)) {
+    _roamer.sample(_driver.rssi(), now);
+  }
+
+  if (_roamer.scanDue(now)) {
+    DEBUG4_VALUELN("WFB: roam scan, rssi ", _roamer.average());
+    _roamer.scanStarted(now);
+    if (_scanCache.fresh(now)) {
+      _roamFromCache();
+    } else if (_scanCache.start(&_driver)) {
+      _roamScanning = true;
+      _invalidate();
+    }
+  }
 }
 
 /**
- * Start as access point with a config portal to allow manual network
- * configuration
+ * Consider the cached scan results as roaming candidates and roam if one wins.
+ * Networks within a failure cooldown are not candidates.
+ */
+bool WiFiBase::_roamFromCache() {
+  for (uint16_t i = 0; i < _scanCache.count(); i++) {
+    const wifi_scan_entry_t *entry = _scanCache.entry(i);
+    uint8_t index = lookupKnownNetwork(entry->ssid);
+    if (index != INDEX_DISCONNECTED) {
+      _knownNetworks[index].lastChannel = entry->channel;
+      if (_connector.penalized(&_knownNetworks[index])) {
+        index = WiFiRoamer::INDEX_UNKNOWN;
+      }
+    }
+    _roamer.consider(entry, index);
+  }
+
+  return _roam();
+}
+
+/**
+ * Start switching to the roaming candidate if there is one.  The connect is
+ * directed at the candidate's access point and progressed by _checkRoam() on
+ * each service pass, so nothing blocks while it associates.
  *
- * TODO: It would be good to switch to something simpler than WiFiManager for
- * this, or to write a custom variant.
+ * @return Whether a roam was started
+ */
+bool WiFiBase::_roam() {
+  wifi_scan_entry_t entry;
+  uint8_t index;
+
+  if (!_roamer.candidate(&entry, &index) ||
+      _connector.penalized(&_knownNetworks[index])) {
+    return false;
+  }
+
+  DEBUG3_VALUE("WFB: roaming to ", entry.ssid);
+  DEBUG3_VALUE(" ch:", entry.channel);
+  DEBUG3_VALUELN(" rssi:", entry.rssi);
+
+  _roamFrom = _driver.bssid(_roamBssid) ? _connectedIndex : INDEX_DISCONNECTED;
+  _roamChannel = (uint8_t)_driver.channel();
+  _roamReturning = false;
+  _roamIndex = index;
+  _connector.startConnect(&_knownNetworks[index], entry.bssid, entry.channel);
+
+  return true;
+}
+
+/**
+ * Progress a roam, reassociating with the previous access point if the
+ * candidate can't be connected within the fast timeout.  If that fails too
+ * the connection is left to the uplink or the application's startup().
+ */
+void WiFiBase::_checkRoam() {
+  wifi_attempt_t result = _connector.checkConnect();
+  if (result == WFB_ATTEMPT_PENDING) {
+    return;
+  }
+
+  uint8_t index = _roamIndex;
+  _roamIndex = INDEX_DISCONNECTED;
+  if (result == WFB_ATTEMPT_CONNECTED) {
+    _setConnected(index);
+    return;
+  }
+
+  if (!_roamReturning && _roamFrom != INDEX_DISCONNECTED) {
+    DEBUG_ERR("WFB: roam failed");
+    _roamReturning = true;
+    _roamIndex = _roamFrom;
+    _connector.startConnect(&_knownNetworks[_roamFrom], _roamBssid,
+                            _roamChannel);
+    return;
+  }
+
+  DEBUG_ERR("WFB: roam lost connection");
+  _setDisconnected();
+}
+
+/**
+ * Start as access point with a captive portal to allow manual network
+ * configuration.  The portal is served along with the rest of the server, so
+ * this returns once it is open rather than once a network is configured.
  *
- * @return Whether a connection was configured via the config portal
+ * @return Whether the portal was opened
  */
 bool WiFiBase::_startupConfigPortal() {
   DEBUG3_PRINTLN("WFB: starting config portal");
-  WiFiManager wifiManager;
-  if (!wifiManager.startConfigPortal(_APSsid, _APPasswd)) {
-    DEBUG_ERR("WFB: Config portal failed");
+  if (!_startupAccessPoint()) {
     return false;
   }
 
-  DEBUG3_VALUE("WFB: Config connected ", wifiManager.getSSID());
-  DEBUG3_VALUELN(" ", wifiManager.getPassword());
-
-  /* Check if the connected SSID is in the known list, if not then add it */
-  int index = lookupKnownNetwork(wifiManager.getSSID().c_str());
-  if (index == INDEX_DISCONNECTED) {
-    addKnownNetwork(wifiManager.getSSID().c_str(),
-                    wifiManager.getPassword().c_str());
-    index = _numKnownNetworks - 1;
+  if (!_portal.begin((uint32_t)WiFi.softAPIP())) {
+    DEBUG_ERR("WFB: Config portal failed");
+    return false;
   }
+  _portalClosing = false;
 
-  _setConnected(index);
+  /* Have the networks listed by the time the page asks for them */
+  if (!_scanCache.scanning() && _scanCache.start(&_driver)) {
+    _invalidate();
+  }
 
   return true;
 }
@@ -426,10 +964,20 @@ bool WiFiBase::_startupAccessPoint() {
   if (!_accessPointActive) {
     DEBUG3_PRINTLN("WFB: starting AP");
 
-    WiFi.softAP(_APSsid, _APPasswd);
-    DEBUG3_VALUELN("WFB: AP IP:", WiFi.softAPIP());
+    /* Where the station is expected to join, so that clients aren't moved */
+    uint8_t channel = WiFiUplink::chooseChannel(_knownNetworks,
+                                                _numKnownNetworks,
+                                                _scanCache.ready() ?
+                                                &_scanCache : nullptr);
+    if (!_uplink.startAccessPoint(_APSsid, _APPasswd, channel)) {
+      DEBUG_ERR("WFB: AP failed");
+      return false;
+    }
+    DEBUG3_VALUE("WFB: AP IP:", WiFi.softAPIP());
+    DEBUG3_VALUELN(" ch:", _uplink.channel());
 
     _accessPointActive = true;
+    _invalidate();
   }
 
   return true;
@@ -440,9 +988,10 @@ bool WiFiBase::_shutdownAccessPoint() {
     return false;
   }
 
-  WiFi.softAPdisconnect(true);
+  _uplink.stopAccessPoint();
 
-  _accessPointActive = true;
+  _accessPointActive = false;
+  _invalidate();
   return true;
 }
 
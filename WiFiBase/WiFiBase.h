@@ -11,15 +11,12 @@
  * once startup() is called will launch a "background" process which searches
  * for any known WiFi network from its list to connect to.  On a failure to
  * find a network, it will launch an access point.  The access point can provide
- * a config portal to allow manual configuration as well as setting up a hub
- * for a mesh network.
+ * a captive config portal to allow manual configuration, see WiFiPortal, as
+ * well as setting up a hub for a mesh network.  A hub can instead keep its
+ * access point up while connecting upstream in the background, see WiFiUplink.
  *   By default the class will also provide a port for receiving over-the-air
  * firmware updates, and optionally redistribute those updates when acting as a
- * hub.
- *
- * Notes:
- *   - Use the Update and ArduinoOTA libraries?
- *   - Wifi configuration from WiFiManager (TODO: link)
+ * hub, or pass them from node to node by gossip.
  */
 
 #ifndef WIFIBASE_H
@@ -27,13 +24,45 @@
 
 #include <Ticker.h>
 
-#include <WiFiManager.h>
+#include "WiFiDriver.h"
+#include "WiFiConnector.h"
+#include "WiFiRoamer.h"
+#include "WiFiScanPlanner.h"
+#include "WiFiScanCache.h"
+#include "WiFiConnectJobs.h"
+#include "WiFiMetrics.h"
+#include "WiFiServiceScheduler.h"
+#include "WiFiBaseServer.h"
+#include "WiFiEvents.h"
+#include "WiFiPortal.h"
+#include "WiFiUplink.h"
+#include "ResponseCache.h"
+#include "OTAFlash.h"
+#include "OTAProgress.h"
+#include "OTAReceiver.h"
+#include "OTAServer.h"
+#include "DeltaDecoder.h"
+#include "LzssDecoder.h"
+#include "OTAHub.h"
+#include "OTAGossipNode.h"
 
-struct network {
-  char *ssid;
-  char *passwd;
+/* Endpoint added by the application, documented along with the built in ones */
+struct endpoint {
+  const char *route;
+  const char *description;
+  const char *args;  // Comma separated argument names
+  WiFiBaseServer::THandlerFunction handler;
+  metrics_route_t metrics;
+  struct endpoint *next;
 };
 
+/* How the server and background work are serviced */
+typedef enum {
+  WFB_SERVICE_POLL = 0,  // By the application calling checkServer()
+  WFB_SERVICE_TASK,      // From a dedicated FreeRTOS task
+  WFB_SERVICE_TICKER,    // From the task, woken by a Ticker at a fixed interval
+} wifi_service_mode_t;
+
 class WiFiBase {
   public:
     WiFiBase(boolean useStored = true);
@@ -44,6 +73,15 @@ class WiFiBase {
     bool useConfigPortal(bool configPortal);
     bool disableAccessPoint();
 
+    /*
+     * Run the access point alongside the station, which is connected to the
+     * known networks in the background and reconnected whenever lost.  Must be
+     * configured before startup().
+     */
+    bool useConcurrentAccessPoint(bool concurrent, bool forward = true,
+                                  unsigned long retryMinMs = WiFiUplink::DEFAULT_RETRY_MIN,
+                                  unsigned long retryMaxMs = WiFiUplink::DEFAULT_RETRY_MAX);
+
     static const uint8_t INDEX_DISCONNECTED = (uint8_t)-1;
     static const uint8_t MAX_KNOWN_NETWORKS = 255;
     uint8_t addKnownNetwork(const char *ssid, const char *passwd);
@@ -51,24 +89,98 @@ class WiFiBase {
     uint8_t lookupKnownNetwork(const char *ssid);
     bool hasKnownNetwork(const char *ssid);
     bool connectAddKnownNetwork(const char *ssid, const char *passwd);
+    wifi_fail_t failureReason(uint8_t index);
 
     bool setConnectTimeoutMs(unsigned long ms);
+    bool setFastConnectTimeoutMs(unsigned long ms);
+    bool useFastReconnect(bool fastReconnect);
+    bool useFailFast(bool failFast);
+    bool useAdaptiveTimeout(bool adaptive,
+                            unsigned long minMs = WiFiConnector::DEFAULT_ADAPTIVE_MIN,
+                            unsigned long maxMs = WiFiConnector::DEFAULT_ADAPTIVE_MAX,
+                            uint16_t marginPercent = WiFiConnector::DEFAULT_ADAPTIVE_MARGIN);
+    bool useRoaming(bool roaming,
+                    uint8_t hysteresisDb = WiFiRoamer::DEFAULT_HYSTERESIS,
+                    int8_t scanThresholdDbm = WiFiRoamer::DEFAULT_SCAN_THRESHOLD,
+                    unsigned long sampleIntervalMs = WiFiRoamer::DEFAULT_SAMPLE_INTERVAL,
+                    unsigned long scanIntervalMs = WiFiRoamer::DEFAULT_SCAN_INTERVAL);
+    bool useScanBeforeConnect(bool scan,
+                              uint16_t activeDwellMs = WiFiScanPlanner::DEFAULT_ACTIVE_DWELL,
+                              uint16_t passiveDwellMs = WiFiScanPlanner::DEFAULT_PASSIVE_DWELL,
+                              bool passive = false);
+    bool useFailurePenalties(bool penalties,
+                             unsigned long baseMs = WiFiConnector::DEFAULT_PENALTY_BASE,
+                             unsigned long maxMs = WiFiConnector::DEFAULT_PENALTY_MAX,
+                             unsigned long halfLifeMs = WiFiConnector::DEFAULT_PENALTY_HALFLIFE);
+    bool setScanCacheTtlMs(unsigned long ms);
     bool setServerPort(int port);
-    WebServer *getServer();
+
+    /*
+     * Receive firmware images pushed to the port, restarting into each once
+     * it is verified.  Must be configured before startup().
+     */
+    bool useUpdates(bool updates, uint16_t port = OTAServer::DEFAULT_PORT);
+
+    /*
+     * While the access point is active, serve the running firmware to nodes
+     * connected to it, each sent at no more than the rate.
+     */
+    static const uint32_t DEFAULT_DISTRIBUTE_RATE = 64 * 1024;
+    bool distributeUpdates(bool distribute,
+                           uint16_t port = OTAHub::DEFAULT_PORT,
+                           uint32_t bytesPerSec = DEFAULT_DISTRIBUTE_RATE);
+    OTAHub *getHub();
+
+    /*
+     * Pull newer firmware from other nodes once connected, and serve ours to
+     * them, restarting into an image once it is verified.  Each build must be
+     * given a higher version than the last.
+     */
+    bool gossipUpdates(bool gossip, uint32_t version,
+                       uint16_t port = OTAGossipNode::DEFAULT_PORT);
+    OTAGossipNode *getGossip();
+    WiFiBaseServer *getServer();
+    bool addEndpoint(const char *route, WiFiBaseServer::THandlerFunction handler,
+                     const char *description = nullptr,
+                     const char *args = nullptr);
+
+    /* Expose a counter maintained elsewhere, such as by a TCPSocket, in /metrics */
+    static const uint8_t MAX_COUNTERS = 16;
+    bool registerCounter(const char *name, const char *help,
+                         const uint32_t *value);
 
     /* Start WiFiBase */
     bool startup();
     bool connected();
 
-    /* Check the web server for traffic */
+    /* Check the web server for traffic, when serviced by polling */
     void checkServer();
 
+    /*
+     * Service the web server in the background instead of through
+     * checkServer().  Must be configured before startup().  While startup()
+     * or connectAddKnownNetwork() block in a connect the lock is released, so
+     * that requests are still served, but the radio is left to the connect.
+     */
+    static const uint32_t DEFAULT_SERVICE_STACK = 8192;
+    static const uint8_t DEFAULT_SERVICE_PRIORITY = 1;
+    bool setServiceMode(wifi_service_mode_t mode,
+                        unsigned long intervalMs = WiFiServiceScheduler::DEFAULT_INTERVAL,
+                        uint32_t stackSize = DEFAULT_SERVICE_STACK,
+                        uint8_t priority = DEFAULT_SERVICE_PRIORITY);
+
+    /*
+     * Exclude background servicing while the application accesses WiFiBase
+     * or state shared with its own handlers.  Locks may be nested.  Background
+     * passes are skipped while the lock is held, so it should be held briefly.
+     */
+    void lock();
+    void unlock();
+
   protected:
     bool _running;
     bool _background;
 
-    WiFiManager *_wifiManager; // TODO: Should this be a temporary object?
-
     bool _startupConnect();
 
     /* Config portal and network hub */
@@ -81,38 +193,164 @@ class WiFiBase {
     bool _startupAccessPoint();
     bool _shutdownAccessPoint();
 
+    /* Captive portal, closed a while after a network is configured */
+    WiFiPortal _portal;
+    bool _portalClosing;
+    unsigned long _portalConnected;
+    void _checkPortal();
+
     /* Known networks */
     uint8_t _numKnownNetworks;
     uint16_t _allocatedKnownNetworks;
     struct network *_knownNetworks;
 
+    /* Radio access and connection logic */
+    ArduinoWiFiDriver _driver;
+    WiFiConnector _connector;
+
+    bool _scanBeforeConnect;
+    WiFiScanPlanner _scanPlanner;
+    WiFiScanCache _scanCache;
+
+    /* Connects requested through the server */
+    WiFiConnectJobs _jobs;
+    void _checkJobs();
+
+    /* Station maintained alongside the access point */
+    bool _concurrent;
+    WiFiUplink _uplink;
+    void _checkUplink();
 
-    static const unsigned long DEFAULT_CONNECT_TIMEOUT = 10 * 1000;
-    unsigned long _connectionTimeoutMs = 5*1000;
     uint8_t _connectedIndex;
+    void _addConnectedNetwork(const char *ssid, const char *passwd);
     bool _connectToNetwork();
     bool _connectToNetwork(const char *ssid, const char *passwd);
-    bool _connectWait();
     void _setConnected(uint8_t index);
     void _setDisconnected();
 
+    /* Roaming to stronger access points of known networks */
+    bool _roaming;
+    bool _roamScanning;
+    WiFiRoamer _roamer;
+    uint8_t _roamIndex;      // Network being joined, or INDEX_DISCONNECTED
+    uint8_t _roamFrom;       // Network to return to, or INDEX_DISCONNECTED
+    uint8_t _roamBssid[WFB_BSSID_LEN];  // Access point to return to
+    uint8_t _roamChannel;
+    bool _roamReturning;
+    void _checkRoaming();
+    bool _roamFromCache();
+    bool _roam();
+    void _checkRoam();
+
     int _serverPort = 80;
-    WebServer *_server;
+    WiFiBaseServer *_server;
+    struct endpoint *_endpoints;
     bool _createServer();
 
+    /* Background servicing */
+    wifi_service_mode_t _serviceMode;
+    uint32_t _serviceStack;
+    uint8_t _servicePriority;
+    WiFiServiceScheduler _scheduler;
+    SemaphoreHandle_t _lock;
+    TaskHandle_t _serviceTask;
+    Ticker _serviceTicker;
+    bool _serviceStarted;
+    bool _connecting;     // The application is blocked in a connect, unlocked
+    bool _startService();
+    void _beginConnect();
+    void _endConnect();
+    void _service();
+    static void _serviceLoop(void *arg);
+    static void _serviceTick(WiFiBase *wfb);
+
+    /* State changes pushed to /events subscribers */
+    WiFiEvents _events;
+    unsigned long _eventsChecked;
+    void _checkEvents(bool force = false);
+
+    /*
+     * Rendered responses, reused until the state they reflect changes.  The
+     * generation is advanced by _invalidate() on any change to that state.
+     */
+    uint32_t _generation;
+    uint32_t _documentationGeneration;
+    ResponseCache _documentationResponse;
+    ResponseCache _infoResponse;
+    ResponseCache _scanResponse;
+    void _invalidate();
+    void _respond(ResponseCache *cache, uint32_t generation,
+                  void (WiFiBase::*render)(OutputSink *sink));
+
+    /* Metrics */
+    ConnectedTime _connectedTime;
+    metrics_route_t *_routeMetrics;  // Built in routes, then not found
+    metrics_counter_t _counters[MAX_COUNTERS];
+    uint8_t _numCounters;
+    uint32_t _requestCount;
+    WiFiBaseServer::THandlerFunction _timed(WiFiBaseServer::THandlerFunction handler,
+                                       metrics_route_t *metrics);
+
     /*
      * Server endpoints
      */
     void _handleDocumentation();
+    void _handleEvents();
     void _handleInfo();
+    void _handleMetrics();
     void _handleNetwork();
+    void _handleNetworkStatus();
     void _handleNotFound();
+    void _handlePortal();
     void _handleScan();
+    void _renderDocumentation(OutputSink *sink);
+    void _renderInfo(OutputSink *sink);
+    void _renderScan(OutputSink *sink);
+
+    /* Over-the-air updates */
+    bool _updates;
+    uint16_t _updatePort;
+    OTAFlash *_updateFlash;
+    OTAProgress *_updateProgress;
+    OTAReceiver *_updateReceiver;
+    OTAServer *_updateServer;
+    OTAFlash *_baseFlash;
+    DeltaDecoder *_deltaDecoder;
+    LzssDecoder *_lzssDecoder;
+    bool _createUpdateServer();
+    void _checkUpdates();
+
+    /* Serving the running image as a hub */
+    bool _distributeUpdates;
+    uint16_t _distributePort;
+    uint32_t _distributeRate;
+    ESPPartitionFlash *_runningFlash;
+    OTAHub *_hub;
+    bool _startHub();
+    void _stopHub();
+    void _checkDistribution();
 
-    /* TODO: Over-the-air updates */
-    //uint16_t _updatePort;
-    //bool _distributeUpdates;
+    /* Spreading updates between nodes */
+    bool _gossipUpdates;
+    uint32_t _gossipVersion;
+    uint16_t _gossipPort;
+    ESPPartitionFlash *_gossipRunning;
+    ESPPartitionFlash *_gossipFlash;
+    OTAGossipNode *_gossip;
+    bool _startGossip();
+    void _stopGossip();
+    void _checkGossip();
 };
 
 
+/* Holds a WiFiBase's lock for the duration of a scope */
+class WiFiBaseLock {
+  public:
+    WiFiBaseLock(WiFiBase *wfb) : _wfb(wfb) { _wfb->lock(); }
+    ~WiFiBaseLock() { _wfb->unlock(); }
+
+  private:
+    WiFiBase *_wfb;
+};
+
 #endif // WIFIBASE_H
\ No newline at end of file
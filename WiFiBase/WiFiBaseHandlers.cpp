@@ -3,11 +3,12 @@
  * License: MIT
  * Copyright: 2018
  *
- * Implementation of WiFiBase's WebServer and REST implementation
+ * Implementation of WiFiBase's management server and REST implementation
  */
 
 #include <Arduino.h>
 #include <WiFi.h>
+#include <esp_ota_ops.h>
 
 
 #ifdef DEBUG_LEVEL_WIFIBASEHANDLERS
@@ -19,6 +20,148 @@
 #include <Debug.h>
 
 #include "WiFiBase.h"
+#include "JsonWriter.h"
+#include "WiFiMetrics.h"
+
+#define IP_STRING_LEN 16
+
+/*
+ * Built in endpoints, giving the route, handler, description and arguments.
+ * The arguments are given as a list of JSON strings so that the documentation
+ * can be assembled at compile time.
+ */
+#define WFB_ENDPOINTS(ENDPOINT) \
+  ENDPOINT("/documentation", _handleDocumentation, "list endpoints", "") \
+  ENDPOINT("/events", _handleEvents, "stream of state changes as Server-Sent Events", "") \
+  ENDPOINT("/info", _handleInfo, "connection status", "") \
+  ENDPOINT("/metrics", _handleMetrics, "metrics in Prometheus text format", "") \
+  ENDPOINT("/network", _handleNetwork, "queue connect to network", "\"ssid\",\"passwd\"") \
+  ENDPOINT("/network/status", _handleNetworkStatus, "state of a queued connect", "\"id\"") \
+  ENDPOINT("/scan", _handleScan, "scan for networks", "")
+
+#define WFB_DOC_ENTRY(route, handler, description, args) \
+  ",\"" route "\":{\"description\":\"" description "\",\"args\":[" args "]}"
+
+/* Documentation members for the built in endpoints, after the leading comma */
+static const char builtinDocumentation[] PROGMEM = WFB_ENDPOINTS(WFB_DOC_ENTRY);
+
+/*
+ * Captive portal page, listing networks from /scan and connecting to the one
+ * chosen through /network, then following it with /network/status
+ */
+static const char portalPage[] PROGMEM =
+  "<!DOCTYPE html><html><head><meta charset=\"utf-8\">"
+  "<meta name=\"viewport\" content=\"width=device-width,initial-scale=1\">"
+  "<title>WiFi setup</title><style>"
+  "body{font-family:sans-serif;max-width:24em;margin:1em auto;padding:0 1em}"
+  "li{cursor:pointer;padding:.3em 0}input,button{width:100%;margin:.3em 0;"
+  "padding:.5em;box-sizing:border-box}</style></head><body>"
+  "<h3>Choose a network</h3><ul id=\"n\"><li>Scanning...</li></ul>"
+  "<form id=\"f\"><input id=\"s\" placeholder=\"Network\">"
+  "<input id=\"p\" type=\"password\" placeholder=\"Password\">"
+  "<button>Connect</button></form><p id=\"r\"></p><script>"
+  "function $(i){return document.getElementById(i)}"
+  "function scan(){fetch('/scan').then(function(r){return r.json()})"
+  ".then(function(j){if(!j.networks){setTimeout(scan,1000);return}"
+  "var l=$('n');l.innerHTML='';j.networks.forEach(function(n){"
+  "var e=document.createElement('li');e.textContent=n[0]+' '+n[2]+' '+n[1]+"
+  "'dBm';e.onclick=function(){$('s').value=n[0];$('p').focus()};"
+  "l.appendChild(e)})}).catch(function(){setTimeout(scan,1000)})}"
+  "function status(id){fetch('/network/status?id='+id).then(function(r){"
+  "return r.json()}).then(function(j){$('r').textContent=j.ssid+': '+"
+  "j.state+(j.state=='failed'?' ('+j.failure+')':'')+"
+  "(j.connected?', '+j.local_IP:'');"
+  "if(j.state=='queued'||j.state=='connecting')setTimeout(function(){"
+  "status(id)},1000)})}"
+  "$('f').onsubmit=function(e){e.preventDefault();"
+  "fetch('/network?ssid='+encodeURIComponent($('s').value)+'&passwd='+"
+  "encodeURIComponent($('p').value)).then(function(r){return r.json()})"
+  ".then(function(j){if(j.id)status(j.id);"
+  "else $('r').textContent=j.error})};scan()</script></body></html>";
+
+#define WFB_ROUTE_NAME(route, handler, description, args) route,
+static const char *const builtinRoutes[] = { WFB_ENDPOINTS(WFB_ROUTE_NAME) };
+#define NUM_BUILTIN_ROUTES (sizeof (builtinRoutes) / sizeof (builtinRoutes[0]))
+
+/*
+ * Sink that writes to the current response through sendChunk()
+ */
+class ChunkSink : public OutputSink {
+  public:
+    ChunkSink(WiFiBaseServer *server) {
+      _server = server;
+    }
+
+    void write(const char *data, size_t length) {
+      _server->sendChunk(data, length);
+    }
+
+  protected:
+    WiFiBaseServer *_server;
+};
+
+/*
+ * Sink that streams into a chunked response, so that responses are never
+ * assembled in a String.
+ */
+class ServerSink : public ChunkSink {
+  public:
+    ServerSink(WiFiBaseServer *server, int code,
+               const char *type = "application/json") : ChunkSink(server) {
+      _server->beginChunked(code, type);
+    }
+
+    /* Terminate the chunked response */
+    void end() {
+      _server->endChunked();
+    }
+};
+
+/*
+ * Sink that gathers events so that each is sent to every subscriber in as
+ * few writes as possible.
+ */
+class BroadcastSink : public OutputSink {
+  public:
+    BroadcastSink(WiFiBaseServer *server) {
+      _server = server;
+      _used = 0;
+    }
+
+    void write(const char *data, size_t length) {
+      if (_used + length > sizeof (_buffer)) {
+        end();
+      }
+      if (length >= sizeof (_buffer)) {
+        _server->broadcast(data, length);
+        return;
+      }
+      memcpy(&_buffer[_used], data, length);
+      _used += length;
+    }
+
+    /* Send anything gathered */
+    void end() {
+      if (_used) {
+        _server->broadcast(_buffer, _used);
+        _used = 0;
+      }
+    }
+
+  protected:
+    WiFiBaseServer *_server;
+    char _buffer[512];
+    size_t _used;
+};
+
+/**
+ * Format an address into a caller supplied buffer
+ * @return The buffer
+ */
+static const char *ipString(IPAddress ip, char *buffer) {
+  snprintf(buffer, IP_STRING_LEN, "%u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
+  return buffer;
+}
 
 /**
  * Startup the management server
@@ -26,7 +169,7 @@
  */
 bool WiFiBase::_createServer() {
   if (!_server) {
-    _server = new WebServer(_serverPort);
+    _server = new WiFiBaseServer(_serverPort);
     if (!_server) {
       DEBUG_ERR("WFB: alloc failure");
       return false;
@@ -34,140 +177,893 @@ bool WiFiBase::_createServer() {
 
     DEBUG4_VALUELN("WFB: server on ", _serverPort);
 
-    _server->on("/documentation", std::bind(&WiFiBase::_handleDocumentation, this));
-    _server->on("/info", std::bind(&WiFiBase::_handleInfo, this));
-    _server->on("/network", std::bind(&WiFiBase::_handleNetwork, this));
-    _server->on("/scan", std::bind(&WiFiBase::_handleScan, this));
-    _server->onNotFound(std::bind(&WiFiBase::_handleNotFound, this));
+#define WFB_ROUTE_ENTRY(route, handler, description, args) \
+    { route, &WiFiBase::handler },
+    static const struct {
+      const char *route;
+      void (WiFiBase::*handler)();
+    } builtin[] = { WFB_ENDPOINTS(WFB_ROUTE_ENTRY) };
+
+    /* Request metrics for each built in route and for not found */
+    _routeMetrics = (metrics_route_t *)calloc(NUM_BUILTIN_ROUTES + 1,
+                                              sizeof (metrics_route_t));
+    if (!_routeMetrics) {
+      DEBUG_ERR("WFB: alloc failure");
+      delete _server;
+      _server = nullptr;
+      return false;
+    }
+
+    for (uint8_t i = 0; i < NUM_BUILTIN_ROUTES; i++) {
+      _server->on(builtin[i].route,
+                  _timed(std::bind(builtin[i].handler, this), &_routeMetrics[i]));
+    }
+    for (struct endpoint *ep = _endpoints; ep; ep = ep->next) {
+      if (!_server->on(ep->route, _timed(ep->handler, &ep->metrics))) {
+        DEBUG_ERR("WFB: too many routes");
+      }
+    }
+    _server->onNotFound(_timed(std::bind(&WiFiBase::_handleNotFound, this),
+                               &_routeMetrics[NUM_BUILTIN_ROUTES]));
+    if (_configPortal) {
+      _server->on("/", std::bind(&WiFiBase::_handlePortal, this));
+    }
     _server->begin();
 
+    if (_updates) {
+      _createUpdateServer();
+    }
+
     return true;
   }
 
   return true;
 }
 
+/**
+ * Start listening for firmware updates, written to the partition not running,
+ * accepting deltas against the running image and compressed images, and
+ * resuming images interrupted part way
+ * @return
+ */
+bool WiFiBase::_createUpdateServer() {
+  _updateFlash = new ESPPartitionFlash();
+  _updateProgress = new ESPProgress();
+  if (_updateFlash && _updateFlash->size() && _updateProgress) {
+    _updateReceiver = new OTAReceiver(_updateFlash);
+    if (_updateReceiver) {
+      _updateReceiver->useWriter(true);
+      _updateReceiver->useProgress(_updateProgress);
+      _updateServer = new OTAServer(_updateReceiver, _updatePort);
+    }
+  }
+  if (_updateServer) {
+    _baseFlash = new ESPPartitionFlash(esp_ota_get_running_partition());
+    if (_baseFlash) {
+      _deltaDecoder = new DeltaDecoder(_baseFlash);
+    }
+    if (_deltaDecoder) {
+      _updateServer->setDecoder(OTA_TYPE_DELTA, _deltaDecoder);
+    }
+    _lzssDecoder = new LzssDecoder();
+    if (_lzssDecoder) {
+      _updateServer->setDecoder(OTA_TYPE_COMPRESSED, _lzssDecoder);
+    }
+  }
+
+  if (!_updateServer || !_updateServer->begin()) {
+    DEBUG_ERR("WFB: update server failed");
+    delete _updateServer;
+    delete _updateReceiver;
+    delete _updateFlash;
+    delete _updateProgress;
+    delete _deltaDecoder;
+    delete _lzssDecoder;
+    delete _baseFlash;
+    _updateServer = nullptr;
+    _updateReceiver = nullptr;
+    _updateFlash = nullptr;
+    _updateProgress = nullptr;
+    _deltaDecoder = nullptr;
+    _lzssDecoder = nullptr;
+    _baseFlash = nullptr;
+    return false;
+  }
+
+  DEBUG4_VALUELN("WFB: updates on ", _updatePort);
+  return true;
+}
+
+/**
+ * Receive any update in progress, restarting into it once activated
+ */
+void WiFiBase::_checkUpdates() {
+  if (!_updateServer) {
+    return;
+  }
+
+  _updateServer->handle();
+
+  if (_updateServer->complete()) {
+    DEBUG1_VALUELN("WFB: restarting into update of ",
+                   _updateReceiver->size());
+    delay(100);
+    ESP.restart();
+  }
+}
+
+/**
+ * Start serving the running image, which is hashed before any node connects
+ * @return
+ */
+bool WiFiBase::_startHub() {
+  _runningFlash = new ESPPartitionFlash(esp_ota_get_running_partition());
+  size_t size = _runningFlash ? _runningFlash->imageSize() : 0;
+  if (size) {
+    _hub = new OTAHub(_runningFlash, _distributePort);
+  }
+
+  if (!_hub || !_hub->begin(size)) {
+    DEBUG_ERR("WFB: hub failed");
+    _stopHub();
+    return false;
+  }
+
+  _hub->setRateLimit(_distributeRate);
+  DEBUG4_VALUELN("WFB: serving image of ", size);
+  return true;
+}
+
+void WiFiBase::_stopHub() {
+  delete _hub;
+  delete _runningFlash;
+  _hub = nullptr;
+  _runningFlash = nullptr;
+}
+
+/**
+ * Serve the running image to nodes while the access point is up
+ */
+void WiFiBase::_checkDistribution() {
+  if (!_distributeUpdates) {
+    return;
+  }
+
+  if (_accessPointActive && !_hub) {
+    if (!_startHub()) {
+      /* Don't retry on every pass */
+      _distributeUpdates = false;
+      return;
+    }
+  } else if (!_accessPointActive && _hub) {
+    _stopHub();
+    return;
+  }
+
+  if (_hub) {
+    _hub->handle();
+  }
+}
+
+/**
+ * Advertise the running image and serve it to other nodes, pulling any newer
+ * image into the partition not running
+ * @return
+ */
+bool WiFiBase::_startGossip() {
+  _gossipRunning = new ESPPartitionFlash(esp_ota_get_running_partition());
+  _gossipFlash = new ESPPartitionFlash();
+  size_t size = _gossipRunning ? _gossipRunning->imageSize() : 0;
+  if (size && _gossipFlash && _gossipFlash->size()) {
+    _gossip = new OTAGossipNode(_gossipRunning, _gossipFlash, _gossipPort);
+  }
+
+  if (!_gossip || !_gossip->begin(_gossipVersion, size, esp_random())) {
+    DEBUG_ERR("WFB: gossip failed");
+    _stopGossip();
+    return false;
+  }
+
+  DEBUG4_VALUELN("WFB: gossiping version ", _gossipVersion);
+  return true;
+}
+
+void WiFiBase::_stopGossip() {
+  delete _gossip;
+  delete _gossipRunning;
+  delete _gossipFlash;
+  _gossip = nullptr;
+  _gossipRunning = nullptr;
+  _gossipFlash = nullptr;
+}
+
+/**
+ * Spread updates with other nodes once there is a network, restarting into
+ * any newer image pulled
+ */
+void WiFiBase::_checkGossip() {
+  if (!_gossipUpdates) {
+    return;
+  }
+
+  if (!_gossip) {
+    if (!connected() && !_accessPointActive) {
+      return;
+    }
+    if (!_startGossip()) {
+      /* Don't retry on every pass */
+      _gossipUpdates = false;
+      return;
+    }
+  }
+
+  /* An image being pushed is written to the same partition */
+  if (_updateServer && _updateServer->active()) {
+    return;
+  }
+
+  _gossip->handle();
+
+  if (_gossip->complete()) {
+    DEBUG1_VALUELN("WFB: restarting into version ",
+                   _gossip->gossip()->version());
+    delay(100);
+    ESP.restart();
+  }
+}
+
+/**
+ * Wrap a handler to count its requests and the time taken to serve them
+ */
+WiFiBaseServer::THandlerFunction WiFiBase::_timed(WiFiBaseServer::THandlerFunction handler,
+                                                  metrics_route_t *metrics) {
+  return [this, handler, metrics]() {
+    unsigned long start = micros();
+    handler();
+    _requestCount++;
+    metrics->requests++;
+    MetricsWriter::observe(&metrics->latency, &WFB_LATENCY_BUCKETS,
+                           micros() - start);
+  };
+}
+
 /**
  * Endpoint handler to get documentation for the server
  */
 void WiFiBase::_handleDocumentation() {
   DEBUG4_PRINTLN("WFB: /documentation");
 
-  String response = "{\"/documentation\":{},";
-  response += "\"/info\":{},";
-  response += "\"/network\":{\"description\":\"connect to network\",\"args\":[\"ssid\",\"passwd\"]},";
-  response += "\"/scan\":{}";
-  response += "}";
+  _respond(&_documentationResponse, _documentationGeneration,
+           &WiFiBase::_renderDocumentation);
+}
+
+void WiFiBase::_renderDocumentation(OutputSink *sink) {
+  JsonWriter json(sink);
+
+  json.beginObject();
+  json.raw(builtinDocumentation + 1, sizeof (builtinDocumentation) - 2);
+
+  for (struct endpoint *ep = _endpoints; ep; ep = ep->next) {
+    json.key(ep->route).beginObject();
+    json.key("description").value(ep->description ? ep->description : "");
+    json.key("args").beginArray();
+    const char *arg = ep->args;
+    while (arg && *arg) {
+      const char *end = strchr(arg, ',');
+      if (!end) {
+        end = arg + strlen(arg);
+      }
+      json.value(arg, end - arg);
+      arg = *end ? end + 1 : end;
+    }
+    json.endArray();
+    json.endObject();
+  }
+
+  json.endObject();
+  json.flush();
+}
+
+/**
+ * Subscribe to state changes, starting with a snapshot of the current state.
+ * Every subscriber shares the same stream of events.
+ */
+void WiFiBase::_handleEvents() {
+  /* Bring the state up to date so that the snapshot is current */
+  _checkEvents(true);
+
+  if (!_server->subscribe("text/event-stream")) {
+    _server->send(503, "application/json", "{\"error\":\"busy\"}");
+    return;
+  }
+
+  DEBUG4_VALUELN("WFB: /events subscribers ", _server->subscribers());
 
-  _server->send(200, "application/json", response);
+  ChunkSink sink(_server);
+  _events.snapshot(&_scanCache, &sink);
 }
 
 void WiFiBase::_handleInfo() {
   DEBUG4_PRINTLN("WFB: /info");
 
-  String response = "{\"connected\":";
-  response += connected() ? "true" : "false";
-  response += ",\"connect_ssid\":\"";
-  response += connected() ? WiFi.SSID() : "none";
-  response += "\",\"local_IP\":\"";
-  response += WiFi.localIP().toString();
-  response += "\",\"access_point\":\"";
-  response += _accessPointActive ? "true" : "false";
-  response += "\",\"AP_ssid\":\"";
-  response += _APSsid;
-  response += "\",\"AP_IP\":\"";
-  response += WiFi.softAPIP().toString();
-  response += "\"}";
+  /*
+   * The times until a penalized network and the uplink are retried count
+   * down, and failure scores decay, without an invalidation, so aren't cached
+   */
+  bool counting = (_uplink.retryIn(millis()) != 0);
+  for (uint8_t i = 0; i < _numKnownNetworks; i++) {
+    counting |= (_connector.penalized(&_knownNetworks[i]) ||
+                 _connector.penaltyScore(&_knownNetworks[i]) != 0);
+  }
+
+  _respond(counting ? nullptr : &_infoResponse, _generation,
+           &WiFiBase::_renderInfo);
+}
+
+void WiFiBase::_renderInfo(OutputSink *sink) {
+  char ip[IP_STRING_LEN];
+  unsigned long now = millis();
+
+  JsonWriter json(sink);
+
+  json.beginObject();
+  json.key("connected").value(connected());
+  json.key("connect_ssid");
+  if (connected()) {
+    json.value(WiFi.SSID().c_str());
+  } else {
+    json.value("none");
+  }
+  json.key("local_IP").value(ipString(WiFi.localIP(), ip));
+  json.key("access_point").value(_accessPointActive ? "true" : "false");
+  json.key("AP_ssid").value(_APSsid);
+  json.key("AP_IP").value(ipString(WiFi.softAPIP(), ip));
+  json.key("AP_channel").value((unsigned int)_uplink.channel());
+  json.key("uplink").value(WiFiUplink::stateString(_uplink.state()));
+  json.key("uplink_retry_in").value(_uplink.retryIn(now));
+
+  json.key("networks").beginArray();
+  for (uint8_t i = 0; i < _numKnownNetworks; i++) {
+    struct network *net = &_knownNetworks[i];
+    json.beginObject();
+    json.key("ssid").value(net->ssid);
+    json.key("failure").value(WiFiConnector::failureString(net->lastFailure));
+    json.key("timeout").value(_connector.timeoutFor(net));
+    json.key("failures").value((unsigned int)_connector.penaltyScore(net));
+    json.key("retry_in").value(_connector.penalized(net) ?
+                               net->penalty.retryAt - now : 0UL);
+    json.endObject();
+  }
+  json.endArray();
+  json.endObject();
+
+  json.flush();
+}
+
+/**
+ * Render metrics in the Prometheus text format
+ */
+void WiFiBase::_handleMetrics() {
+  unsigned long now = millis();
+
+  DEBUG4_PRINTLN("WFB: /metrics");
+
+  ServerSink sink(_server, 200, "text/plain; version=0.0.4");
+  MetricsWriter metrics(&sink);
+
+  metrics.family("wifibase_uptime_seconds", "gauge", "Time since boot");
+  metrics.sampleFixed("wifibase_uptime_seconds", now, 3);
+  metrics.family("wifibase_connected", "gauge", "Whether a network is connected");
+  metrics.sample("wifibase_connected", (unsigned long)connected());
+  metrics.family("wifibase_connected_seconds_total", "counter",
+                 "Time spent connected");
+  metrics.sampleFixed("wifibase_connected_seconds_total",
+                      _connectedTime.connectedMs(now), 3);
+  metrics.family("wifibase_connected_ratio", "gauge",
+                 "Fraction of uptime spent connected");
+  metrics.sampleFixed("wifibase_connected_ratio",
+                      now ? (uint64_t)_connectedTime.connectedMs(now) * 1000 / now : 0,
+                      3);
+  if (connected()) {
+    metrics.family("wifibase_rssi_dbm", "gauge", "Signal strength");
+    metrics.sample("wifibase_rssi_dbm", (long)_driver.rssi());
+  }
+  metrics.family("wifibase_heap_free_bytes", "gauge", "Free heap");
+  metrics.sample("wifibase_heap_free_bytes", (unsigned long)ESP.getFreeHeap());
+  metrics.family("wifibase_heap_min_free_bytes", "gauge",
+                 "Lowest free heap since boot");
+  metrics.sample("wifibase_heap_min_free_bytes",
+                 (unsigned long)ESP.getMinFreeHeap());
+
+  /* Per network connect statistics, the stored network has an empty SSID */
+  metrics.family("wifibase_connect_attempts_total", "counter",
+                 "Connect attempts per known network");
+  for (uint8_t i = 0; i < _numKnownNetworks; i++) {
+    metrics.sample("wifibase_connect_attempts_total",
+                   (unsigned long)_knownNetworks[i].stats.attempts,
+                   "network", _knownNetworks[i].ssid);
+  }
+  metrics.family("wifibase_connect_successes_total", "counter",
+                 "Successful connects per known network");
+  for (uint8_t i = 0; i < _numKnownNetworks; i++) {
+    metrics.sample("wifibase_connect_successes_total",
+                   (unsigned long)_knownNetworks[i].stats.successes,
+                   "network", _knownNetworks[i].ssid);
+  }
+  metrics.family("wifibase_connect_failures_total", "counter",
+                 "Failed connects per known network");
+  for (uint8_t i = 0; i < _numKnownNetworks; i++) {
+    metrics.sample("wifibase_connect_failures_total",
+                   (unsigned long)_knownNetworks[i].stats.failures,
+                   "network", _knownNetworks[i].ssid);
+  }
+  metrics.family("wifibase_connect_duration_seconds", "histogram",
+                 "Duration of successful connects per known network");
+  for (uint8_t i = 0; i < _numKnownNetworks; i++) {
+    metrics.histogram("wifibase_connect_duration_seconds",
+                      &_knownNetworks[i].stats.durations, &WFB_CONNECT_BUCKETS,
+                      "network", _knownNetworks[i].ssid);
+  }
+
+  /* Requests per route, not found requests are reported under an empty route */
+  metrics.family("wifibase_http_requests_total", "counter",
+                 "HTTP requests per route");
+  for (uint8_t i = 0; i <= NUM_BUILTIN_ROUTES; i++) {
+    metrics.sample("wifibase_http_requests_total",
+                   (unsigned long)_routeMetrics[i].requests, "route",
+                   (i < NUM_BUILTIN_ROUTES) ? builtinRoutes[i] : "");
+  }
+  for (struct endpoint *ep = _endpoints; ep; ep = ep->next) {
+    metrics.sample("wifibase_http_requests_total",
+                   (unsigned long)ep->metrics.requests, "route", ep->route);
+  }
+  metrics.family("wifibase_http_request_duration_seconds", "histogram",
+                 "Time to serve HTTP requests per route");
+  for (uint8_t i = 0; i <= NUM_BUILTIN_ROUTES; i++) {
+    metrics.histogram("wifibase_http_request_duration_seconds",
+                      &_routeMetrics[i].latency, &WFB_LATENCY_BUCKETS, "route",
+                      (i < NUM_BUILTIN_ROUTES) ? builtinRoutes[i] : "");
+  }
+  for (struct endpoint *ep = _endpoints; ep; ep = ep->next) {
+    metrics.histogram("wifibase_http_request_duration_seconds",
+                      &ep->metrics.latency, &WFB_LATENCY_BUCKETS, "route",
+                      ep->route);
+  }
+
+  /* Counters registered by other code */
+  for (uint8_t i = 0; i < _numCounters; i++) {
+    metrics.family(_counters[i].name, "counter", _counters[i].help);
+    metrics.sample(_counters[i].name, (unsigned long)*_counters[i].value);
+  }
 
-  _server->send(200, "application/json", response);
+  metrics.flush();
+  sink.end();
 }
 
 void WiFiBase::_handleNotFound() {
+  /* Send requests for other hosts, such as connectivity checks, to the portal */
+  if (_portal.captures(_server->header("Host"))) {
+    DEBUG4_VALUELN("WFB: portal redirect ", _server->header("Host"));
+    _server->sendHeader("Location", _portal.location());
+    _server->send(302, "text/plain", "");
+    return;
+  }
+
   DEBUG4_VALUELN("WFB: notFound:", _server->uri());
 
-  String response = "Endpoint " + _server->uri() + " not defined";
   _server->sendHeader("Cache-Control", "no-cache, no-store, must-revalidate");
   _server->sendHeader("Pragma", "no-cache");
   _server->sendHeader("Expires", "-1");
-  _server->sendHeader("Content-Length", String(response.length()));
-  _server->send ( 404, "text/plain", response );
+
+  ServerSink sink(_server, 404, "text/plain");
+  const char *uri = _server->uri();
+  sink.write("Endpoint ", 9);
+  sink.write(uri, strlen(uri));
+  sink.write(" not defined", 12);
+  sink.end();
+}
+
+/**
+ * Serve the captive portal's page while it is open
+ */
+void WiFiBase::_handlePortal() {
+  if (!_portal.active()) {
+    _handleNotFound();
+    return;
+  }
+
+  DEBUG4_PRINTLN("WFB: portal");
+  _server->sendHeader("Cache-Control", "no-cache");
+  _server->send(200, "text/html", portalPage, sizeof (portalPage) - 1);
+}
+
+/**
+ * Answer the portal's DNS queries, closing it and the access point once a
+ * network has been connected and the page has had time to show it
+ */
+void WiFiBase::_checkPortal() {
+  if (!_portal.active()) {
+    return;
+  }
+
+  _portal.handle();
+
+  if (!connected()) {
+    _portalClosing = false;
+    return;
+  }
+  if (!_portalClosing) {
+    _portalClosing = true;
+    _portalConnected = millis();
+    return;
+  }
+  if (millis() - _portalConnected >= WiFiPortal::CLOSE_DELAY) {
+    DEBUG3_PRINTLN("WFB: closing config portal");
+    _portal.stop();
+    if (!_concurrent) {
+      _shutdownAccessPoint();
+    }
+  }
 }
 
 /**
- * Attempt to connect to a network specified by the arguments, adding it to
- * the known networks on successful connect.
+ * Maintain the station alongside the access point, leaving the radio to any
+ * requested connect
+ */
+void WiFiBase::_checkUplink() {
+  if (_jobs.busy() || _roamIndex != INDEX_DISCONNECTED) {
+    _uplink.defer(millis());
+    return;
+  }
+
+  wifi_uplink_t state = _uplink.state();
+  bool changed = _uplink.poll(_knownNetworks, _numKnownNetworks, millis());
+  if (_uplink.state() != state) {
+    /* Reported by /info even when nothing else changed */
+    _invalidate();
+  }
+  if (!changed) {
+    return;
+  }
+
+  if (_uplink.state() == WFB_UPLINK_CONNECTED) {
+    if (_uplink.index() != _connectedIndex) {
+      DEBUG3_VALUELN("WFB: uplink ", _knownNetworks[_uplink.index()].ssid);
+      _setConnected(_uplink.index());
+    }
+  } else if (connected()) {
+    DEBUG3_PRINTLN("WFB: uplink lost");
+    _setDisconnected();
+  }
+  DEBUG4_VALUELN("WFB: AP ch:", _uplink.channel());
+  _invalidate();
+}
+
+/**
+ * Queue a connect to the network specified by the arguments, returning the
+ * job's ID to be polled through /network/status.  The network is added to the
+ * known networks once the connect succeeds.
  */
 void WiFiBase::_handleNetwork() {
-  int result = 200;
-  String ssid = _server->arg("ssid");
-  String passwd = _server->arg("passwd");
+  const char *ssid = _server->arg("ssid");
+  const char *passwd = _server->arg("passwd");
 
   DEBUG4_VALUELN("WFB: /network ", ssid);
 
-  String response = "{\"connected\":";
-  unsigned long elapsed = millis();
-  if (connectAddKnownNetwork(ssid.c_str(), passwd.c_str())) {
-    response += "true";
-  } else {
-    result = 400;
-    response += "false";
+  if (!ssid[0]) {
+    _server->send(400, "application/json", "{\"error\":\"no ssid\"}");
+    return;
+  }
+
+  uint16_t id = _jobs.add(ssid, passwd, millis());
+  if (id == WiFiConnectJobs::JOB_NONE) {
+    _server->send(503, "application/json", "{\"error\":\"busy\"}");
+    return;
+  }
+
+  ServerSink sink(_server, 202);
+  JsonWriter json(&sink);
+
+  json.beginObject();
+  json.key("id").value((unsigned int)id);
+  json.key("state").value(WiFiConnectJobs::stateString(WFB_JOB_QUEUED));
+  json.endObject();
+
+  json.flush();
+  sink.end();
+}
+
+/**
+ * Report the progress of a connect queued by /network
+ */
+void WiFiBase::_handleNetworkStatus() {
+  char ip[IP_STRING_LEN];
+  const wifi_job_t *job = _jobs.find(strtoul(_server->arg("id"), nullptr, 10));
+
+  if (!job) {
+    _server->send(404, "application/json", "{\"error\":\"unknown id\"}");
+    return;
   }
-  elapsed = millis() - elapsed;
-  response += ",\"ssid\":\"";
-  response += ssid;
-  response += "\",\"local_IP\":\"";
-  response += WiFi.localIP().toString();
-  response += "\",\"elapsed\":";
-  response += elapsed;
 
-  response += "}";
+  DEBUG4_VALUELN("WFB: /network/status ", job->id);
 
-  _server->send(result, "application/json", response);
+  ServerSink sink(_server, 200);
+  JsonWriter json(&sink);
+
+  json.beginObject();
+  json.key("id").value((unsigned int)job->id);
+  json.key("ssid").value(job->ssid);
+  json.key("state").value(WiFiConnectJobs::stateString(job->state));
+  json.key("connected").value(job->state == WFB_JOB_CONNECTED);
+  json.key("failure").value(WiFiConnector::failureString(job->failure));
+  json.key("elapsed").value(WiFiConnectJobs::elapsed(job, millis()));
+  if (job->state == WFB_JOB_CONNECTED) {
+    json.key("local_IP").value(ipString(WiFi.localIP(), ip));
+  }
+  json.endObject();
+
+  json.flush();
+  sink.end();
 }
 
 /**
- * Scan for networks and return the networks
+ * Return the cached scan results with their age in seconds as an Age header,
+ * starting a background scan if they are older than the cache's TTL.  If no
+ * results are available yet a 202 is returned indicating that the scan is in
+ * progress.
  */
 void WiFiBase::_handleScan() {
+  unsigned long now = millis();
 
-  long start = millis();
-  int networks = WiFi.scanNetworks();
-
-  DEBUG4_VALUELN("WFB: /scan elapsed ", millis() - start);
-
-  String response = "{\"count\":";
-  response += networks;
-  response += ",\"elapsed\":";
-  response += millis() - start;
-  response += ",\"networks\":[";
-
-  if (networks) {
-    for (int i = 0; i < networks; i++) {
-      response += "[\"" + WiFi.SSID(i) + "\",";
-      response += WiFi.RSSI(i);
-      response += ",";
-      response += (WiFi.encryptionType(i) == WIFI_AUTH_OPEN) ? "\"\"":"\"*\"";
-      response += "]";
-      if (i != networks - 1) {
-        response += ",";
-      }
-    }
+  if (_connecting) {
+    /* The connect may be scanning with the cache */
+    _server->send(503, "application/json", "{\"error\":\"connecting\"}");
+    return;
+  }
+
+  if (_scanCache.poll(&_driver, now)) {
+    _invalidate();
+  }
+  if (!_scanCache.fresh(now) && !_scanCache.scanning() &&
+      _scanCache.start(&_driver)) {
+    _invalidate();
+  }
+
+  if (!_scanCache.ready()) {
+    DEBUG4_PRINTLN("WFB: /scan in progress");
+    _server->send(202, "application/json", "{\"state\":\"scanning\"}");
+    return;
+  }
+
+  DEBUG4_VALUELN("WFB: /scan age ", _scanCache.age(now));
+
+  /* The age changes on every request, so is a header outside the cache */
+  char age[12];
+  snprintf(age, sizeof (age), "%lu", _scanCache.age(now) / 1000);
+  _server->sendHeader("Age", age);
+
+  _respond(&_scanResponse, _generation, &WiFiBase::_renderScan);
+}
+
+void WiFiBase::_renderScan(OutputSink *sink) {
+  JsonWriter json(sink);
+
+  json.beginObject();
+  json.key("state").value(_scanCache.scanning() ? "refreshing" : "ready");
+  json.key("count").value((unsigned int)_scanCache.count());
+  json.key("networks").beginArray();
+  for (uint16_t i = 0; i < _scanCache.count(); i++) {
+    const wifi_scan_entry_t *entry = _scanCache.entry(i);
+    json.beginArray();
+    json.value(entry->ssid);
+    json.value((int)entry->rssi);
+    json.value(entry->open ? "" : "*");
+    json.endArray();
   }
+  json.endArray();
+  json.endObject();
+
+  json.flush();
+}
 
-  WiFi.scanDelete();
+/**
+ * Respond from the cache, rendering into it first if the generation changed.
+ * Without a cache, or if the response is too large for it, the response is
+ * streamed instead.
+ */
+void WiFiBase::_respond(ResponseCache *cache, uint32_t generation,
+                        void (WiFiBase::*render)(OutputSink *sink)) {
+  if (cache && !cache->valid(generation)) {
+    cache->begin(generation);
+    (this->*render)(cache);
+    if (!cache->end()) {
+      DEBUG4_PRINTLN("WFB: response too large to cache");
+      cache->clear();
+      cache = nullptr;
+    }
+  }
 
-  response += "]}";
+  if (!cache) {
+    ServerSink sink(_server, 200);
+    (this->*render)(&sink);
+    sink.end();
+    return;
+  }
 
-  _server->send(200, "application/json", response);
+  cache->send(_server, "application/json");
 }
 
 /**
- * Perform repetitive tasks
- * TODO: This should be done via ticker
+ * Perform repetitive tasks, unless they are being serviced in the background
  */
 void WiFiBase::checkServer() {
+  if (_serviceMode != WFB_SERVICE_POLL) {
+    return;
+  }
+
+  _service();
+}
+
+/**
+ * Handle server traffic and background work.  Passes from the background are
+ * skipped while the application holds the lock, and while it is blocked in a
+ * connect only requests and events are served.
+ */
+void WiFiBase::_service() {
+  if (!_server) {
+    return;
+  }
+
+  if (_lock && xSemaphoreTakeRecursive(_lock, 0) != pdTRUE) {
+    return;
+  }
 
   /* Check for HTTP requests */
   _server->handleClient();
+
+  if (!_connecting) {
+    /* Receive any firmware update, and serve ours to other nodes */
+    _checkUpdates();
+    _checkDistribution();
+    _checkGossip();
+
+    /* Progress any requested connect, and the portal that requested it */
+    _checkJobs();
+    _checkPortal();
+    _checkUplink();
+
+    /* Collect the results of any background scan */
+    if (_scanCache.poll(&_driver, millis())) {
+      _invalidate();
+    }
+
+    _checkRoaming();
+  }
+
+  /* Push any changes in state to subscribers */
+  _checkEvents();
+
+  unlock();
+}
+
+/**
+ * Loop of the service task, making passes as scheduled or when woken by the
+ * ticker
+ */
+void WiFiBase::_serviceLoop(void *arg) {
+  WiFiBase *wfb = (WiFiBase *)arg;
+
+  while (true) {
+    if (wfb->_serviceMode == WFB_SERVICE_TICKER) {
+      ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+      wfb->_service();
+      continue;
+    }
+
+    unsigned long start = millis();
+    if (wfb->_scheduler.due(start)) {
+      uint32_t requests = wfb->_requestCount;
+      wfb->_service();
+      wfb->_scheduler.serviced(start, millis(),
+                               wfb->_requestCount != requests);
+    }
+
+    unsigned long wait = wfb->_scheduler.wait(millis());
+    vTaskDelay(pdMS_TO_TICKS(wait ? wait : 1));
+  }
 }
 
+/**
+ * Wake the service task.  The pass can block, so it is never made from the
+ * timer task itself.
+ */
+void WiFiBase::_serviceTick(WiFiBase *wfb) {
+  xTaskNotifyGive(wfb->_serviceTask);
+}
+
+/**
+ * Start background servicing for the configured mode
+ * @return false if the task could not be created
+ */
+bool WiFiBase::_startService() {
+  if (_serviceMode == WFB_SERVICE_POLL || _serviceStarted) {
+    return true;
+  }
+
+  if (xTaskCreate(_serviceLoop, "wifibase", _serviceStack, this,
+                  _servicePriority, &_serviceTask) != pdPASS) {
+    DEBUG_ERR("WFB: service task failed");
+    _serviceTask = nullptr;
+    return false;
+  }
+
+  if (_serviceMode == WFB_SERVICE_TICKER) {
+    _serviceTicker.attach_ms(_scheduler.interval(), _serviceTick, this);
+    DEBUG4_VALUELN("WFB: service ticker every ", _scheduler.interval());
+  } else {
+    DEBUG4_VALUELN("WFB: service task every ", _scheduler.interval());
+  }
+  _serviceStarted = true;
+
+  return true;
+}
+
+/**
+ * Progress the queued connect jobs, adding networks that were connected to
+ */
+void WiFiBase::_checkJobs() {
+  if (_roamIndex != INDEX_DISCONNECTED) {
+    /* Queued until the roam leaves the radio */
+    return;
+  }
+
+  wifi_job_t *job = _jobs.poll(&_connector, millis());
+  if (!job) {
+    return;
+  }
+
+  _invalidate();
+  if (job->state == WFB_JOB_CONNECTED) {
+    _addConnectedNetwork(job->ssid, job->passwd);
+  } else {
+    DEBUG4_VALUE("WFB: job failed ", job->ssid);
+    DEBUG4_VALUELN(" ", WiFiConnector::failureString(job->failure));
+  }
+}
+
+/**
+ * Compare the current state against that last pushed, at most every
+ * CHECK_INTERVAL unless forced, and broadcast events for any changes
+ */
+void WiFiBase::_checkEvents(bool force) {
+  unsigned long now = millis();
+  if (!force && now - _eventsChecked < WiFiEvents::CHECK_INTERVAL) {
+    return;
+  }
+  _eventsChecked = now;
+
+  wifi_event_state_t state;
+  memset(&state, 0, sizeof (state));
+  state.connected = connected();
+  if (state.connected) {
+    if (_connectedIndex < _numKnownNetworks) {
+      strncpy(state.ssid, _knownNetworks[_connectedIndex].ssid, WFB_SSID_LEN);
+    }
+    state.localIP = WiFi.localIP();
+    state.rssi = _driver.rssi();
+  }
+  state.apActive = _accessPointActive;
+  if (state.apActive) {
+    state.apIP = WiFi.softAPIP();
+  }
+
+  if (!_server->subscribers()) {
+    /* Just record the state, for the snapshot sent to a new subscriber */
+    _events.update(&state, &_scanCache, nullptr);
+    return;
+  }
+
+  BroadcastSink sink(_server);
+  _events.update(&state, &_scanCache, &sink);
+  sink.end();
+}
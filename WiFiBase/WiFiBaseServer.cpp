@@ -0,0 +1,746 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#ifdef ARDUINO
+  #include <Arduino.h>
+  #include <lwip/sockets.h>
+#else
+  #include <time.h>
+  #include <fcntl.h>
+  #include <unistd.h>
+  #include <arpa/inet.h>
+  #include <netinet/in.h>
+  #include <netinet/tcp.h>
+  #include <sys/select.h>
+  #include <sys/socket.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+  #define MSG_NOSIGNAL 0
+#endif
+
+#include "WiFiBaseServer.h"
+
+WiFiBaseServer::WiFiBaseServer(uint16_t port) {
+  _port = port;
+  _listenFd = -1;
+  for (uint8_t i = 0; i < MAX_CLIENTS; i++) {
+    _conns[i].fd = -1;
+    _conns[i].used = 0;
+    _conns[i].closing = false;
+    _conns[i].subscribed = false;
+  }
+  _numRoutes = 0;
+  _notFound = nullptr;
+  _requests = 0;
+
+  _conn = nullptr;
+  _method = "";
+  _path = "";
+  _numHeaders = 0;
+  _numArgs = 0;
+  _responded = false;
+  _chunked = false;
+  _failed = false;
+  _extraUsed = 0;
+  _outputUsed = 0;
+}
+
+WiFiBaseServer::~WiFiBaseServer() {
+  stop();
+}
+
+bool WiFiBaseServer::begin() {
+  struct sockaddr_in addr;
+  int one = 1;
+
+  if (_listenFd >= 0) {
+    return true;
+  }
+
+  _listenFd = socket(AF_INET, SOCK_STREAM, 0);
+  if (_listenFd < 0) {
+    return false;
+  }
+  setsockopt(_listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+
+  memset(&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(_port);
+  if (bind(_listenFd, (struct sockaddr *)&addr, sizeof (addr)) < 0 ||
+      listen(_listenFd, MAX_CLIENTS) < 0) {
+    stop();
+    return false;
+  }
+  fcntl(_listenFd, F_SETFL, fcntl(_listenFd, F_GETFL, 0) | O_NONBLOCK);
+
+  if (_port == 0) {
+    socklen_t len = sizeof (addr);
+    getsockname(_listenFd, (struct sockaddr *)&addr, &len);
+    _port = ntohs(addr.sin_port);
+  }
+
+  return true;
+}
+
+void WiFiBaseServer::stop() {
+  for (uint8_t i = 0; i < MAX_CLIENTS; i++) {
+    _close(&_conns[i]);
+  }
+  if (_listenFd >= 0) {
+    close(_listenFd);
+    _listenFd = -1;
+  }
+}
+
+uint16_t WiFiBaseServer::port() {
+  return _port;
+}
+
+/**
+ * Route requests for path to handler, replacing any existing handler
+ * @return false if the route table is full
+ */
+bool WiFiBaseServer::on(const char *path, THandlerFunction handler) {
+  /* Replace an existing route for the path */
+  for (uint8_t i = 0; i < _numRoutes; i++) {
+    if (strcmp(_routes[i].path, path) == 0) {
+      _routes[i].handler = handler;
+      return true;
+    }
+  }
+
+  if (_numRoutes >= MAX_ROUTES) {
+    return false;
+  }
+
+  _routes[_numRoutes].path = path;
+  _routes[_numRoutes].handler = handler;
+  _numRoutes++;
+
+  return true;
+}
+
+void WiFiBaseServer::onNotFound(THandlerFunction handler) {
+  _notFound = handler;
+}
+
+uint32_t WiFiBaseServer::requests() {
+  return _requests;
+}
+
+uint8_t WiFiBaseServer::clients() {
+  uint8_t count = 0;
+  for (uint8_t i = 0; i < MAX_CLIENTS; i++) {
+    if (_conns[i].fd >= 0) {
+      count++;
+    }
+  }
+  return count;
+}
+
+void WiFiBaseServer::handleClient() {
+  if (_listenFd < 0) {
+    return;
+  }
+
+  _accept();
+
+  for (uint8_t i = 0; i < MAX_CLIENTS; i++) {
+    http_conn_t *conn = &_conns[i];
+    if (conn->fd < 0) {
+      continue;
+    }
+
+    if (conn->closing || conn->subscribed) {
+      _linger(conn);
+      continue;
+    }
+
+    _read(conn);
+    while (conn->fd >= 0 && _process(conn));
+
+    if (conn->fd >= 0 && _millis() - conn->lastActive > IDLE_TIMEOUT) {
+      _close(conn);
+    }
+  }
+}
+
+/**
+ * Accept pending connections while there are free slots, leaving any others
+ * in the listen backlog.
+ */
+void WiFiBaseServer::_accept() {
+  for (uint8_t i = 0; i < MAX_CLIENTS; i++) {
+    http_conn_t *conn = &_conns[i];
+    if (conn->fd >= 0) {
+      continue;
+    }
+
+    int fd = accept(_listenFd, nullptr, nullptr);
+    if (fd < 0) {
+      return;
+    }
+
+    int one = 1;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+
+    conn->fd = fd;
+    conn->used = 0;
+    conn->lastActive = _millis();
+    conn->keepAlive = true;
+    conn->closing = false;
+    conn->subscribed = false;
+  }
+}
+
+void WiFiBaseServer::_read(http_conn_t *conn) {
+  if (conn->used >= BUFFER_SIZE) {
+    return;
+  }
+
+  int result = recv(conn->fd, conn->buffer + conn->used,
+                    BUFFER_SIZE - conn->used, 0);
+  if (result > 0) {
+    conn->used += result;
+    conn->lastActive = _millis();
+  } else if (result == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+    _close(conn);
+  }
+}
+
+void WiFiBaseServer::_close(http_conn_t *conn) {
+  if (conn->fd >= 0) {
+    close(conn->fd);
+    conn->fd = -1;
+  }
+  conn->used = 0;
+  conn->closing = false;
+  conn->subscribed = false;
+}
+
+/**
+ * Discard input from a connection being closed after an error, so that
+ * closing with unread data doesn't reset the connection and lose the response.
+ * Subscribers are also drained, but only closed when the client closes.
+ */
+void WiFiBaseServer::_linger(http_conn_t *conn) {
+  char discard[64];
+  int result = recv(conn->fd, discard, sizeof (discard), 0);
+  if (result > 0) {
+    return;
+  }
+  if (result == 0 || (errno != EAGAIN && errno != EWOULDBLOCK) ||
+      (conn->closing && _millis() - conn->lastActive > SEND_TIMEOUT)) {
+    _close(conn);
+  }
+}
+
+/**
+ * Find the length of a request's body from its unparsed head
+ * @return The body length, or -1 if it is invalid
+ */
+static long contentLength(const char *head) {
+  static const char name[] = "\r\ncontent-length:";
+  for (const char *p = strchr(head, '\r'); p; p = strchr(p + 1, '\r')) {
+    if (strncasecmp(p, name, sizeof (name) - 1) == 0) {
+      char *end;
+      long length = strtol(p + sizeof (name) - 1, &end, 10);
+      return (end == p + sizeof (name) - 1 || length < 0) ? -1 : length;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Handle the next complete request in a connection's buffer
+ * @return true if a request was handled and the connection remains open
+ */
+bool WiFiBaseServer::_process(http_conn_t *conn) {
+  conn->buffer[conn->used] = '\0';
+
+  char *end = strstr(conn->buffer, "\r\n\r\n");
+  if (!end) {
+    if (strlen(conn->buffer) < conn->used) {
+      /* Binary data, which isn't HTTP */
+      _error(conn, 400);
+    } else if (conn->used >= BUFFER_SIZE) {
+      _error(conn, 431);
+    }
+    return false;
+  }
+
+  size_t headLen = end - conn->buffer + 4;
+  *end = '\0';
+  long bodyLen = contentLength(conn->buffer);
+  if (bodyLen < 0 || headLen + bodyLen > BUFFER_SIZE) {
+    _error(conn, 413);
+    return false;
+  }
+  if (conn->used < headLen + bodyLen) {
+    /* Wait for the rest of the body, leaving the head to be parsed again */
+    *end = '\r';
+    return false;
+  }
+
+  _conn = conn;
+  _numArgs = 0;
+  _responded = false;
+  _chunked = false;
+  _failed = false;
+  _outputUsed = 0;
+
+  if (!_parseHead(conn->buffer)) {
+    _extraUsed = 0;
+    _error(conn, 400);
+    _conn = nullptr;
+    return false;
+  }
+
+  /* Terminate the body in place, preserving the start of any pipelined request */
+  char *body = conn->buffer + headLen;
+  char next = body[bodyLen];
+  body[bodyLen] = '\0';
+  const char *type = header("Content-Type");
+  if (bodyLen && type &&
+      strncasecmp(type, "application/x-www-form-urlencoded", 33) == 0) {
+    _parseArgs(body);
+  }
+
+  _dispatch();
+  body[bodyLen] = next;
+
+  size_t consumed = headLen + bodyLen;
+  memmove(conn->buffer, conn->buffer + consumed, conn->used - consumed);
+  conn->used -= consumed;
+  _conn = nullptr;
+
+  if (_failed) {
+    _close(conn);
+    return false;
+  }
+  if (conn->subscribed) {
+    /* Anything further from the client is discarded */
+    conn->used = 0;
+    return false;
+  }
+  if (!conn->keepAlive) {
+    _close(conn);
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Split the request line and headers in place
+ * @return false if the request line is malformed
+ */
+bool WiFiBaseServer::_parseHead(char *head) {
+  char *line = head;
+  char *next = strstr(line, "\r\n");
+  if (next) {
+    *next = '\0';
+    next += 2;
+  }
+
+  /* Request line: method, target and version */
+  char *target = strchr(line, ' ');
+  if (!target) {
+    return false;
+  }
+  *target++ = '\0';
+  char *version = strchr(target, ' ');
+  if (!version) {
+    return false;
+  }
+  *version++ = '\0';
+  if (strncmp(version, "HTTP/1.", 7) != 0) {
+    return false;
+  }
+
+  _method = line;
+  _path = target;
+
+  char *query = strchr(target, '?');
+  if (query) {
+    *query++ = '\0';
+  }
+  _decode(target);
+
+  _numHeaders = 0;
+  while (next && *next) {
+    line = next;
+    next = strstr(line, "\r\n");
+    if (next) {
+      *next = '\0';
+      next += 2;
+    }
+
+    char *value = strchr(line, ':');
+    if (!value || _numHeaders >= MAX_HEADERS) {
+      continue;
+    }
+    *value++ = '\0';
+    while (*value == ' ' || *value == '\t') {
+      value++;
+    }
+    _headers[_numHeaders].name = line;
+    _headers[_numHeaders].value = value;
+    _numHeaders++;
+  }
+
+  /* HTTP/1.1 defaults to keep-alive and HTTP/1.0 to close */
+  const char *connection = header("Connection");
+  if (version[7] == '0') {
+    _conn->keepAlive = (connection && strcasecmp(connection, "keep-alive") == 0);
+  } else {
+    _conn->keepAlive = !(connection && strcasecmp(connection, "close") == 0);
+  }
+
+  if (query) {
+    _parseArgs(query);
+  }
+
+  return true;
+}
+
+/**
+ * Split name=value pairs separated by '&' in place, decoding each
+ */
+void WiFiBaseServer::_parseArgs(char *str) {
+  while (str && *str && _numArgs < MAX_ARGS) {
+    char *next = strchr(str, '&');
+    if (next) {
+      *next++ = '\0';
+    }
+
+    char *value = strchr(str, '=');
+    if (value) {
+      *value++ = '\0';
+    } else {
+      value = str + strlen(str);
+    }
+    _decode(str);
+    _decode(value);
+
+    _args[_numArgs].name = str;
+    _args[_numArgs].value = value;
+    _numArgs++;
+
+    str = next;
+  }
+}
+
+void WiFiBaseServer::_dispatch() {
+  _requests++;
+
+  THandlerFunction *handler = _notFound ? &_notFound : nullptr;
+  for (uint8_t i = 0; i < _numRoutes; i++) {
+    if (strcmp(_routes[i].path, _path) == 0) {
+      handler = &_routes[i].handler;
+      break;
+    }
+  }
+
+  if (handler) {
+    (*handler)();
+  }
+
+  if (_chunked) {
+    endChunked();
+  }
+  if (!_responded) {
+    send((handler ? 500 : 404), "text/plain", "");
+  }
+  _flush();
+  _extraUsed = 0;
+}
+
+/**
+ * Respond with an error and close the connection
+ */
+void WiFiBaseServer::_error(http_conn_t *conn, int code) {
+  _conn = conn;
+  conn->keepAlive = false;
+  _responded = false;
+  _chunked = false;
+  _failed = false;
+  _outputUsed = 0;
+  send(code, "text/plain", "");
+  shutdown(conn->fd, SHUT_WR);
+  conn->closing = true;
+  conn->lastActive = _millis();
+  _conn = nullptr;
+}
+
+const char *WiFiBaseServer::method() {
+  return _method;
+}
+
+const char *WiFiBaseServer::uri() {
+  return _path;
+}
+
+const char *WiFiBaseServer::arg(const char *name) {
+  for (uint8_t i = 0; i < _numArgs; i++) {
+    if (strcmp(_args[i].name, name) == 0) {
+      return _args[i].value;
+    }
+  }
+  return "";
+}
+
+bool WiFiBaseServer::hasArg(const char *name) {
+  for (uint8_t i = 0; i < _numArgs; i++) {
+    if (strcmp(_args[i].name, name) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+const char *WiFiBaseServer::header(const char *name) {
+  for (uint8_t i = 0; i < _numHeaders; i++) {
+    if (strcasecmp(_headers[i].name, name) == 0) {
+      return _headers[i].value;
+    }
+  }
+  return nullptr;
+}
+
+void WiFiBaseServer::sendHeader(const char *name, const char *value) {
+  int len = snprintf(_extraHeaders + _extraUsed,
+                     sizeof (_extraHeaders) - _extraUsed, "%s: %s\r\n",
+                     name, value);
+  if (len > 0 && _extraUsed + len < sizeof (_extraHeaders)) {
+    _extraUsed += len;
+  } else {
+    /* Drop a header that doesn't fit rather than truncating it */
+    _extraHeaders[_extraUsed] = '\0';
+  }
+}
+
+void WiFiBaseServer::send(int code, const char *type, const char *body) {
+  send(code, type, body, strlen(body));
+}
+
+void WiFiBaseServer::send(int code, const char *type, const char *body,
+                          size_t length) {
+  if (!_conn || _responded) {
+    return;
+  }
+  _status(code, type, length);
+  _write(body, length);
+  _flush();
+  _responded = true;
+}
+
+void WiFiBaseServer::beginChunked(int code, const char *type) {
+  if (!_conn || _responded) {
+    return;
+  }
+  _status(code, type, -1);
+  _responded = true;
+  _chunked = true;
+}
+
+void WiFiBaseServer::sendChunk(const char *data, size_t length) {
+  char size[12];
+
+  if (_conn && _conn->subscribed) {
+    _write(data, length);
+    return;
+  }
+  if (!_chunked || !length) {
+    return;
+  }
+  snprintf(size, sizeof (size), "%x\r\n", (unsigned)length);
+  _write(size);
+  _write(data, length);
+  _write("\r\n", 2);
+}
+
+void WiFiBaseServer::endChunked() {
+  if (!_chunked) {
+    return;
+  }
+  _write("0\r\n\r\n", 5);
+  _flush();
+  _chunked = false;
+}
+
+bool WiFiBaseServer::subscribe(const char *type) {
+  if (!_conn || _responded || subscribers() >= MAX_SUBSCRIBERS) {
+    return false;
+  }
+
+  /* The response is delimited by the connection closing */
+  _conn->keepAlive = false;
+  sendHeader("Cache-Control", "no-cache");
+  _status(200, type, -2);
+  _responded = true;
+  _conn->subscribed = true;
+  return true;
+}
+
+/**
+ * Write to every subscriber, closing any whose send would block.  A stalled
+ * subscriber isn't waited on so it can't hold up the caller, and one that
+ * took only part of the data is closed too as its stream is now corrupt.
+ */
+void WiFiBaseServer::broadcast(const char *data, size_t length) {
+  for (uint8_t i = 0; i < MAX_CLIENTS; i++) {
+    http_conn_t *conn = &_conns[i];
+    if (conn->fd < 0 || !conn->subscribed || conn == _conn) {
+      continue;
+    }
+
+    int result = ::send(conn->fd, data, length, MSG_NOSIGNAL);
+    if (result < 0 || (size_t)result != length) {
+      _close(conn);
+    }
+  }
+}
+
+uint8_t WiFiBaseServer::subscribers() {
+  uint8_t count = 0;
+  for (uint8_t i = 0; i < MAX_CLIENTS; i++) {
+    if (_conns[i].fd >= 0 && _conns[i].subscribed) {
+      count++;
+    }
+  }
+  return count;
+}
+
+/**
+ * Write the status line and headers, with a length of -1 for chunked or -2
+ * for a response delimited by closing the connection
+ */
+void WiFiBaseServer::_status(int code, const char *type, long length) {
+  char line[48];
+
+  snprintf(line, sizeof (line), "HTTP/1.1 %d %s\r\n", code, _reason(code));
+  _write(line);
+  if (code == 204 || code == 304) {
+    /* Responses that never have a body */
+  } else {
+    _write("Content-Type: ");
+    _write(type);
+    if (length >= 0) {
+      snprintf(line, sizeof (line), "\r\nContent-Length: %ld\r\n", length);
+      _write(line);
+    } else if (length == -1) {
+      _write("\r\nTransfer-Encoding: chunked\r\n");
+    } else {
+      _write("\r\n");
+    }
+  }
+  _write(_conn->keepAlive ? "Connection: keep-alive\r\n" :
+                            "Connection: close\r\n");
+  _write(_extraHeaders, _extraUsed);
+  _write("\r\n", 2);
+}
+
+void WiFiBaseServer::_write(const char *str) {
+  _write(str, strlen(str));
+}
+
+void WiFiBaseServer::_write(const char *data, size_t length) {
+  if (_outputUsed + length > OUTPUT_SIZE) {
+    _flush();
+  }
+  if (length >= OUTPUT_SIZE) {
+    /* Large writes go straight out rather than through the buffer */
+    _send(data, length);
+    return;
+  }
+  memcpy(_output + _outputUsed, data, length);
+  _outputUsed += length;
+}
+
+void WiFiBaseServer::_flush() {
+  size_t used = _outputUsed;
+  _outputUsed = 0;
+  _send(_output, used);
+}
+
+/**
+ * Send data to the current connection, waiting up to SEND_TIMEOUT for the
+ * socket to drain.  On failure the connection is closed after the request.
+ */
+void WiFiBaseServer::_send(const char *data, size_t length) {
+  unsigned long start = _millis();
+
+  while (length && _conn && !_failed) {
+    int result = ::send(_conn->fd, data, length, MSG_NOSIGNAL);
+    if (result > 0) {
+      data += result;
+      length -= result;
+    } else if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) &&
+               _millis() - start < SEND_TIMEOUT) {
+      fd_set writable;
+      struct timeval tv = { 0, 10 * 1000 };
+      FD_ZERO(&writable);
+      FD_SET(_conn->fd, &writable);
+      select(_conn->fd + 1, nullptr, &writable, nullptr, &tv);
+    } else {
+      _failed = true;
+    }
+  }
+}
+
+/**
+ * Decode %xx escapes and '+' in place
+ */
+void WiFiBaseServer::_decode(char *str) {
+  char *out = str;
+  for (char *in = str; *in; in++) {
+    if (*in == '+') {
+      *out++ = ' ';
+    } else if (*in == '%' && in[1] && in[2]) {
+      char hex[3] = { in[1], in[2], '\0' };
+      *out++ = (char)strtol(hex, nullptr, 16);
+      in += 2;
+    } else {
+      *out++ = *in;
+    }
+  }
+  *out = '\0';
+}
+
+const char *WiFiBaseServer::_reason(int code) {
+  switch (code) {
+    case 200: return "OK";
+    case 202: return "Accepted";
+    case 204: return "No Content";
+    case 304: return "Not Modified";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 413: return "Payload Too Large";
+    case 431: return "Request Header Fields Too Large";
+    case 500: return "Internal Server Error";
+    case 503: return "Service Unavailable";
+  }
+  return "";
+}
+
+unsigned long WiFiBaseServer::_millis() {
+#ifdef ARDUINO
+  return millis();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
@@ -0,0 +1,170 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Compact non-blocking HTTP/1.1 server for WiFiBase's management API.
+ *
+ * Design:
+ *   Connections are held in a fixed set of slots, each with its own receive
+ * buffer.  Requests are parsed in place within that buffer, with the method,
+ * path, headers and arguments left as pointers into it, so no Strings are
+ * created.  handleClient() never waits on a client: it accepts any pending
+ * connections, reads whatever has arrived, and dispatches each complete
+ * request through a fixed route table.
+ *
+ *   Connections are kept alive between requests unless the client asks
+ * otherwise, and pipelined requests are handled in order.  Responses are
+ * gathered in a small output buffer and sent either with a length or with
+ * chunked encoding when streamed.
+ *
+ *   A handler may instead subscribe its connection to events, which holds it
+ * open after the handler returns.  broadcast() then writes the same data to
+ * every subscriber, such as a Server-Sent Events stream, dropping any that
+ * can't take it without blocking.
+ *
+ *   The server uses BSD sockets, which lwIP provides on the ESP32, so it also
+ * builds on a host for testing and benchmarking.
+ */
+
+#ifndef WIFIBASESERVER_H
+#define WIFIBASESERVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+
+class WiFiBaseServer {
+  public:
+    typedef std::function<void(void)> THandlerFunction;
+
+    static const uint8_t MAX_CLIENTS = 4;
+    static const uint8_t MAX_SUBSCRIBERS = MAX_CLIENTS - 1;
+    static const uint8_t MAX_ROUTES = 24;
+    static const uint8_t MAX_HEADERS = 12;
+    static const uint8_t MAX_ARGS = 8;
+    static const size_t BUFFER_SIZE = 1024;
+    static const size_t OUTPUT_SIZE = 512;
+    static const size_t EXTRA_HEADERS_SIZE = 192;
+    static const unsigned long IDLE_TIMEOUT = 5 * 1000;
+    static const unsigned long SEND_TIMEOUT = 2 * 1000;
+
+    WiFiBaseServer(uint16_t port);
+    ~WiFiBaseServer();
+
+    bool begin();
+    void stop();
+
+    /* Port being listened on, useful when created with port 0 */
+    uint16_t port();
+
+    bool on(const char *path, THandlerFunction handler);
+    void onNotFound(THandlerFunction handler);
+
+    /* Accept, read and dispatch without blocking */
+    void handleClient();
+
+    /*
+     * The request being handled.  Strings point into the receive buffer and
+     * are only valid during the handler.
+     */
+    const char *method();
+    const char *uri();
+    const char *arg(const char *name);  // "" if not present
+    bool hasArg(const char *name);
+    const char *header(const char *name); // null if not present
+
+    /* Add a header to the next response */
+    void sendHeader(const char *name, const char *value);
+
+    void send(int code, const char *type, const char *body);
+    void send(int code, const char *type, const char *body, size_t length);
+
+    /* Stream a response of unknown length with chunked encoding */
+    void beginChunked(int code, const char *type);
+    void sendChunk(const char *data, size_t length);
+    void endChunked();
+
+    /*
+     * Hold the current connection open as a subscriber, sending a response of
+     * the given type that continues until the connection closes.  Until the
+     * handler returns, sendChunk() writes unframed data to just this
+     * subscriber.  Returns false if there are already MAX_SUBSCRIBERS.
+     */
+    bool subscribe(const char *type);
+    void broadcast(const char *data, size_t length);
+    uint8_t subscribers();
+
+    uint32_t requests();
+    uint8_t clients();
+
+  protected:
+    typedef struct {
+      int           fd;
+      char          buffer[BUFFER_SIZE + 1];
+      size_t        used;
+      unsigned long lastActive;
+      bool          keepAlive;
+      bool          closing;     // Response sent, draining before close
+      bool          subscribed;  // Held open for broadcast()
+    } http_conn_t;
+
+    typedef struct {
+      const char       *path;
+      THandlerFunction handler;
+    } http_route_t;
+
+    typedef struct {
+      const char *name;
+      const char *value;
+    } http_pair_t;
+
+    uint16_t _port;
+    int _listenFd;
+
+    http_conn_t _conns[MAX_CLIENTS];
+    http_route_t _routes[MAX_ROUTES];
+    uint8_t _numRoutes;
+    THandlerFunction _notFound;
+    uint32_t _requests;
+
+    /* Current request */
+    http_conn_t *_conn;
+    const char *_method;
+    const char *_path;
+    http_pair_t _headers[MAX_HEADERS];
+    uint8_t _numHeaders;
+    http_pair_t _args[MAX_ARGS];
+    uint8_t _numArgs;
+
+    /* Current response */
+    bool _responded;
+    bool _chunked;
+    bool _failed;
+    char _extraHeaders[EXTRA_HEADERS_SIZE];
+    size_t _extraUsed;
+    char _output[OUTPUT_SIZE];
+    size_t _outputUsed;
+
+    void _accept();
+    void _read(http_conn_t *conn);
+    void _close(http_conn_t *conn);
+    void _linger(http_conn_t *conn);
+    bool _process(http_conn_t *conn);
+    bool _parseHead(char *head);
+    void _parseArgs(char *str);
+    void _dispatch();
+    void _error(http_conn_t *conn, int code);
+
+    void _status(int code, const char *type, long length);
+    void _write(const char *data, size_t length);
+    void _write(const char *str);
+    void _flush();
+    void _send(const char *data, size_t length);
+
+    static void _decode(char *str);
+    static const char *_reason(int code);
+    static unsigned long _millis();
+};
+
+#endif // WIFIBASESERVER_H
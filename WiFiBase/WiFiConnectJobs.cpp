@@ -0,0 +1,137 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ */
+
+#include <string.h>
+
+#include "WiFiConnectJobs.h"
+
+WiFiConnectJobs::WiFiConnectJobs() {
+  memset(_jobs, 0, sizeof (_jobs));
+  _nextId = 1;
+  _current = nullptr;
+  _finished = nullptr;
+}
+
+/**
+ * Queue a connect in a free slot, or else the slot of the oldest finished job
+ * @return The job's ID, or JOB_NONE if every slot is in use
+ */
+uint16_t WiFiConnectJobs::add(const char *ssid, const char *passwd,
+                              unsigned long now) {
+  if (strlen(ssid) > WFB_SSID_LEN || strlen(passwd) > WFB_PASSWD_LEN) {
+    return JOB_NONE;
+  }
+
+  wifi_job_t *job = nullptr;
+  for (uint8_t i = 0; i < MAX_JOBS; i++) {
+    wifi_job_t *slot = &_jobs[i];
+    if (slot->state == WFB_JOB_FREE) {
+      job = slot;
+      break;
+    }
+    if ((slot->state == WFB_JOB_CONNECTED || slot->state == WFB_JOB_FAILED) &&
+        slot != _finished &&
+        (!job || (long)(slot->finished - job->finished) < 0)) {
+      job = slot;
+    }
+  }
+  if (!job) {
+    return JOB_NONE;
+  }
+
+  job->id = _nextId++;
+  if (_nextId == JOB_NONE) {
+    _nextId++;
+  }
+  job->state = WFB_JOB_QUEUED;
+  job->failure = WFB_FAIL_NONE;
+  strcpy(job->ssid, ssid);
+  strcpy(job->passwd, passwd);
+  job->queued = now;
+  job->finished = 0;
+
+  return job->id;
+}
+
+const wifi_job_t *WiFiConnectJobs::find(uint16_t id) {
+  if (id == JOB_NONE) {
+    return nullptr;
+  }
+  for (uint8_t i = 0; i < MAX_JOBS; i++) {
+    if (_jobs[i].state != WFB_JOB_FREE && _jobs[i].id == id) {
+      return &_jobs[i];
+    }
+  }
+  return nullptr;
+}
+
+wifi_job_t *WiFiConnectJobs::poll(WiFiConnector *connector, unsigned long now) {
+  /* The previously finished job has been handled, forget its password */
+  if (_finished) {
+    memset(_finished->passwd, 0, sizeof (_finished->passwd));
+    _finished = nullptr;
+  }
+
+  if (!_current) {
+    /* Start the longest queued job */
+    for (uint8_t i = 0; i < MAX_JOBS; i++) {
+      wifi_job_t *job = &_jobs[i];
+      if (job->state == WFB_JOB_QUEUED &&
+          (!_current || (long)(job->queued - _current->queued) < 0)) {
+        _current = job;
+      }
+    }
+    if (_current) {
+      _current->state = WFB_JOB_CONNECTING;
+      connector->startConnect(_current->ssid, _current->passwd);
+    }
+    return nullptr;
+  }
+
+  wifi_attempt_t result = connector->checkConnect();
+  if (result == WFB_ATTEMPT_PENDING) {
+    return nullptr;
+  }
+
+  _current->state = (result == WFB_ATTEMPT_CONNECTED) ? WFB_JOB_CONNECTED :
+                                                        WFB_JOB_FAILED;
+  _current->failure = connector->lastFailure();
+  _current->finished = now;
+
+  _finished = _current;
+  _current = nullptr;
+  return _finished;
+}
+
+bool WiFiConnectJobs::busy() {
+  if (_current) {
+    return true;
+  }
+  for (uint8_t i = 0; i < MAX_JOBS; i++) {
+    if (_jobs[i].state == WFB_JOB_QUEUED) {
+      return true;
+    }
+  }
+  return false;
+}
+
+unsigned long WiFiConnectJobs::elapsed(const wifi_job_t *job, unsigned long now) {
+  if (job->state == WFB_JOB_CONNECTED || job->state == WFB_JOB_FAILED) {
+    return job->finished - job->queued;
+  }
+  return now - job->queued;
+}
+
+const char *WiFiConnectJobs::stateString(uint8_t state) {
+  switch (state) {
+    case WFB_JOB_FREE:       return "free";
+    case WFB_JOB_QUEUED:     return "queued";
+    case WFB_JOB_CONNECTING: return "connecting";
+    case WFB_JOB_CONNECTED:  return "connected";
+    case WFB_JOB_FAILED:     return "failed";
+  }
+  return "unknown";
+}
@@ -0,0 +1,76 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Queue of connect requests made through the management server.
+ *
+ * Design:
+ *   A request to connect to a network is queued as a job and its ID returned
+ * immediately, so that the server isn't held for the duration of the attempt.
+ * Jobs are run one at a time using the connector's non-blocking attempts,
+ * progressed by poll() from the server loop, and their state can be looked up
+ * by ID until the slot is reused.  Passwords are kept only until the job has
+ * finished and been handled.
+ */
+
+#ifndef WIFICONNECTJOBS_H
+#define WIFICONNECTJOBS_H
+
+#include "WiFiConnector.h"
+
+#define WFB_PASSWD_LEN 64
+
+typedef enum {
+  WFB_JOB_FREE = 0,
+  WFB_JOB_QUEUED,
+  WFB_JOB_CONNECTING,
+  WFB_JOB_CONNECTED,
+  WFB_JOB_FAILED,
+} wifi_job_state_t;
+
+typedef struct {
+  uint16_t      id;
+  uint8_t       state;
+  uint8_t       failure;
+  char          ssid[WFB_SSID_LEN + 1];
+  char          passwd[WFB_PASSWD_LEN + 1];
+  unsigned long queued;    // ms
+  unsigned long finished;  // ms
+} wifi_job_t;
+
+class WiFiConnectJobs {
+  public:
+    WiFiConnectJobs();
+
+    static const uint8_t MAX_JOBS = 4;
+    static const uint16_t JOB_NONE = 0;
+
+    /* Queue a connect, returning its ID or JOB_NONE if the queue is full */
+    uint16_t add(const char *ssid, const char *passwd, unsigned long now);
+
+    /* Lookup a job by ID, returning null if it is unknown or was reused */
+    const wifi_job_t *find(uint16_t id);
+
+    /*
+     * Progress the current job, starting the next queued job if none is
+     * running.  Returns a job that has just finished, whose password remains
+     * valid until the next call.
+     */
+    wifi_job_t *poll(WiFiConnector *connector, unsigned long now);
+
+    /* True if a job is queued or connecting */
+    bool busy();
+
+    /* Time the job has been queued and running for */
+    static unsigned long elapsed(const wifi_job_t *job, unsigned long now);
+    static const char *stateString(uint8_t state);
+
+  protected:
+    wifi_job_t _jobs[MAX_JOBS];
+    uint16_t _nextId;
+    wifi_job_t *_current;
+    wifi_job_t *_finished;
+};
+
+#endif // WIFICONNECTJOBS_H
@@ -0,0 +1,655 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ */
+
+#include <string.h>
+
+#include "WiFiConnector.h"
+#include "WiFiScanPlanner.h"
+#include "WiFiScanCache.h"
+
+WiFiConnector::WiFiConnector(WiFiDriver *driver) {
+  _driver = driver;
+  _timeoutMs = DEFAULT_CONNECT_TIMEOUT;
+  _fastTimeoutMs = DEFAULT_FAST_TIMEOUT;
+  _fastReconnect = true;
+  _failFast = true;
+  _adaptive = true;
+  _adaptiveMinMs = DEFAULT_ADAPTIVE_MIN;
+  _adaptiveMaxMs = DEFAULT_ADAPTIVE_MAX;
+  _adaptiveMargin = DEFAULT_ADAPTIVE_MARGIN;
+  _penalties = false;
+  _penaltyBaseMs = DEFAULT_PENALTY_BASE;
+  _penaltyMaxMs = DEFAULT_PENALTY_MAX;
+  _penaltyHalfLifeMs = DEFAULT_PENALTY_HALFLIFE;
+  _staticConfig = false;
+  _lastFailure = WFB_FAIL_NONE;
+  _attemptStart = 0;
+  _attemptTimeoutMs = _timeoutMs;
+  _attemptNetwork = nullptr;
+  _attemptFull = false;
+  _staleStatus = WFB_STATUS_DISCONNECTED;
+  _statusChanged = false;
+  _targetSsid[0] = '\0';
+  _targetDirected = false;
+}
+
+void WiFiConnector::setTimeoutMs(unsigned long ms) {
+  _timeoutMs = ms;
+}
+
+void WiFiConnector::setFastTimeoutMs(unsigned long ms) {
+  _fastTimeoutMs = ms;
+}
+
+void WiFiConnector::setFastReconnect(bool enable) {
+  _fastReconnect = enable;
+}
+
+void WiFiConnector::setFailFast(bool enable) {
+  _failFast = enable;
+}
+
+void WiFiConnector::setAdaptiveTimeout(bool enable) {
+  _adaptive = enable;
+}
+
+void WiFiConnector::setAdaptiveTimeout(unsigned long minMs,
+                                       unsigned long maxMs,
+                                       uint16_t marginPercent) {
+  _adaptiveMinMs = minMs;
+  _adaptiveMaxMs = maxMs;
+  _adaptiveMargin = marginPercent;
+}
+
+/**
+ * Determine the timeout for a full connect from the network's history, as the
+ * 95th percentile of recent connect durations scaled by the margin.
+ *
+ * @return Timeout in ms
+ */
+unsigned long WiFiConnector::timeoutFor(struct network *net) {
+  network_history_t *history = &net->history;
+
+  if (!_adaptive || history->count < WFB_HISTORY_MIN) {
+    return _timeoutMs;
+  }
+
+  /* Insertion sort a copy of the history */
+  uint16_t sorted[WFB_HISTORY_LEN];
+  for (uint8_t i = 0; i < history->count; i++) {
+    uint16_t value = history->durations[i];
+    uint8_t j = i;
+    for (; j > 0 && sorted[j - 1] > value; j--) {
+      sorted[j] = sorted[j - 1];
+    }
+    sorted[j] = value;
+  }
+
+  uint8_t rank = (uint8_t)((history->count * 95 + 99) / 100);
+  unsigned long timeout = (unsigned long)sorted[rank - 1] * _adaptiveMargin / 100;
+
+  if (timeout < _adaptiveMinMs) {
+    timeout = _adaptiveMinMs;
+  }
+  if (timeout > _adaptiveMaxMs) {
+    timeout = _adaptiveMaxMs;
+  }
+  return timeout;
+}
+
+void WiFiConnector::_recordDuration(struct network *net, unsigned long ms) {
+  network_history_t *history = &net->history;
+
+  history->durations[history->next] = (ms > 0xFFFF) ? 0xFFFF : (uint16_t)ms;
+  history->next = (history->next + 1) % WFB_HISTORY_LEN;
+  if (history->count < WFB_HISTORY_LEN) {
+    history->count++;
+  }
+}
+
+/**
+ * Note the result of an attempt given the network's own timeout, learning its
+ * duration once connected
+ */
+void WiFiConnector::_learnAttempt(struct network *net, bool connected,
+                                  unsigned long start) {
+  net->lastFailure = _lastFailure;
+  if (connected) {
+    _recordDuration(net, _driver->millis() - start);
+    recordConnection(net);
+  } else if (_lastFailure == WFB_FAIL_TIMEOUT) {
+    /* The history no longer reflects this network, use the default timeout */
+    net->history.count = 0;
+    net->history.next = 0;
+  }
+}
+
+void WiFiConnector::setPenalties(bool enable) {
+  _penalties = enable;
+}
+
+void WiFiConnector::setPenalties(unsigned long baseMs, unsigned long maxMs,
+                                 unsigned long halfLifeMs) {
+  _penaltyBaseMs = baseMs;
+  _penaltyMaxMs = maxMs;
+  _penaltyHalfLifeMs = halfLifeMs;
+}
+
+/**
+ * @return Whether a network is within its failure cooldown
+ */
+bool WiFiConnector::penalized(struct network *net) {
+  if (!_penalties || !net->penalty.active) {
+    return false;
+  }
+  if ((long)(_driver->millis() - net->penalty.retryAt) >= 0) {
+    net->penalty.active = false;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @return Failure score of a network, decayed to the current time
+ */
+uint8_t WiFiConnector::penaltyScore(struct network *net) {
+  network_penalty_t *penalty = &net->penalty;
+
+  if (!penalty->score || !_penaltyHalfLifeMs) {
+    return penalty->score;
+  }
+
+  unsigned long periods =
+          (_driver->millis() - penalty->lastFailure) / _penaltyHalfLifeMs;
+  return (periods >= 8) ? 0 : (penalty->score >> periods);
+}
+
+/**
+ * Update a network's statistics and penalty after an attempt started at the
+ * given time, a failure raising its score and starting a cooldown of
+ * base * 2^(score - 1).
+ */
+void WiFiConnector::_recordResult(struct network *net, bool connected,
+                                  unsigned long start) {
+  network_penalty_t *penalty = &net->penalty;
+  network_stats_t *stats = &net->stats;
+
+  stats->attempts++;
+  if (connected) {
+    stats->successes++;
+    MetricsWriter::observe(&stats->durations, &WFB_CONNECT_BUCKETS,
+                           _driver->millis() - start);
+  } else {
+    stats->failures++;
+  }
+
+  if (connected) {
+    penalty->score = 0;
+    penalty->active = false;
+    return;
+  }
+
+  uint8_t score = penaltyScore(net);
+  if (score < WFB_PENALTY_MAX_SCORE) {
+    score++;
+  }
+
+  unsigned long cooldown = _penaltyBaseMs;
+  for (uint8_t i = 1; i < score && cooldown < _penaltyMaxMs; i++) {
+    cooldown *= 2;
+  }
+  if (cooldown > _penaltyMaxMs) {
+    cooldown = _penaltyMaxMs;
+  }
+
+  penalty->score = score;
+  penalty->lastFailure = _driver->millis();
+  penalty->retryAt = penalty->lastFailure + cooldown;
+  penalty->active = true;
+}
+
+wifi_fail_t WiFiConnector::lastFailure() {
+  return _lastFailure;
+}
+
+/**
+ * Iterate over a list of networks and connect to the first one possible.  An
+ * empty ssid for the first network indicates the network stored by the SDK.
+ * Networks within a failure cooldown are skipped.
+ *
+ * @return Index of the connected network or INDEX_NONE
+ */
+uint8_t WiFiConnector::connectKnown(struct network *networks, uint8_t count) {
+  uint8_t index = 0;
+
+  if (count && networks[0].ssid[0] == '\0') {
+    if (_connectStoredKnown(&networks[0])) {
+      return 0;
+    }
+    index++;
+  }
+
+  for (; index < count; index++) {
+    if (penalized(&networks[index])) {
+      continue;
+    }
+    unsigned long start = _driver->millis();
+    bool connected = connect(&networks[index]);
+    _recordResult(&networks[index], connected, start);
+    if (connected) {
+      return index;
+    }
+  }
+
+  return INDEX_NONE;
+}
+
+/**
+ * Attempt the network stored by the SDK, unless it is within a cooldown
+ * @return Whether it was connected
+ */
+bool WiFiConnector::_connectStoredKnown(struct network *net) {
+  if (penalized(net)) {
+    return false;
+  }
+
+  unsigned long start = _driver->millis();
+  bool connected = connectStored();
+  net->lastFailure = _lastFailure;
+  _recordResult(net, connected, start);
+  return connected;
+}
+
+/**
+ * Scan the channels the known networks were last seen on, widening to a full
+ * scan if none are found, and connect to the strongest network found.
+ * Networks within a failure cooldown don't count as found.  The network
+ * stored by the SDK can't be matched by a scan, so is attempted last.
+ *
+ * @return Index of the connected network or INDEX_NONE
+ */
+uint8_t WiFiConnector::connectScanned(struct network *networks, uint8_t count,
+                                      WiFiScanPlanner *planner,
+                                      WiFiScanCache *cache) {
+  wifi_scan_step_t step;
+  wifi_scan_entry_t entry;
+
+  planner->plan(networks, count);
+  for (uint8_t i = 0; i < count; i++) {
+    if (penalized(&networks[i])) {
+      planner->ignore(i);
+    }
+  }
+
+  if (cache) {
+    /* A background scan must finish before the radio can be used */
+    while (cache->scanning()) {
+      if (cache->poll(_driver, _driver->millis())) {
+        break;
+      }
+      _driver->delay(100);
+    }
+
+    if (cache->fresh(_driver->millis())) {
+      for (uint16_t i = 0; i < cache->count(); i++) {
+        planner->consider(cache->entry(i), networks, count);
+      }
+    }
+  }
+
+  while (planner->next(&step)) {
+    if (!_driver->scanStart(false, step.channel, step.passive, step.dwellMs)) {
+      break;
+    }
+
+    int16_t results = _driver->scanComplete();
+    if (cache && step.channel == 0) {
+      /* Full scans refresh the shared cache */
+      cache->store(_driver, results, _driver->millis());
+      for (uint16_t i = 0; i < cache->count(); i++) {
+        planner->consider(cache->entry(i), networks, count);
+      }
+      continue;
+    }
+
+    for (int16_t i = 0; i < results; i++) {
+      if (_driver->scanResult(i, &entry)) {
+        planner->consider(&entry, networks, count);
+      }
+    }
+    _driver->scanDelete();
+  }
+
+  for (uint8_t i = 0; i < planner->numMatches(); i++) {
+    const wifi_scan_match_t *match = planner->match(i);
+    struct network *net = &networks[match->index];
+    unsigned long start = _driver->millis();
+    bool connected = connect(net, match->entry.bssid, match->entry.channel);
+    _recordResult(net, connected, start);
+    if (connected) {
+      return match->index;
+    }
+  }
+
+  if (count && networks[0].ssid[0] == '\0' &&
+      _connectStoredKnown(&networks[0])) {
+    return 0;
+  }
+
+  return INDEX_NONE;
+}
+
+/**
+ * Connect to a known network, trying a directed association with the cached
+ * lease before falling back to a full connect.
+ *
+ * @return Whether the network was connected
+ */
+bool WiFiConnector::connect(struct network *net) {
+  if (_fastReconnect && net->cache.valid) {
+    if (_connectDirected(net, net->cache.bssid, net->cache.channel)) {
+      return true;
+    }
+
+    /* The access point may have moved or the lease expired */
+    net->cache.valid = false;
+  }
+
+  unsigned long start = _driver->millis();
+  bool connected = _connectFull(net->ssid, net->passwd, timeoutFor(net));
+  _learnAttempt(net, connected, start);
+
+  return connected;
+}
+
+/**
+ * Connect to a specific access point of a known network, such as when roaming
+ * between access points.  The network's lease is tried first if it is cached,
+ * and the cache only moves to the access point once it is connected.
+ *
+ * @return Whether the network was connected
+ */
+bool WiFiConnector::connect(struct network *net, const uint8_t *bssid,
+                            uint8_t channel) {
+  if (_fastReconnect && net->cache.valid &&
+      _connectDirected(net, bssid, channel)) {
+    recordConnection(net);
+    return true;
+  }
+
+  unsigned long start = _driver->millis();
+  _useDHCP();
+  _begin(net->ssid, net->passwd, channel, bssid);
+  bool connected = wait(timeoutFor(net));
+  _learnAttempt(net, connected, start);
+  return connected;
+}
+
+bool WiFiConnector::connect(const char *ssid, const char *passwd) {
+  return _connectFull(ssid, passwd, _timeoutMs);
+}
+
+bool WiFiConnector::_connectFull(const char *ssid, const char *passwd,
+                                 unsigned long timeoutMs) {
+  _useDHCP();
+  _begin(ssid, passwd);
+  return wait(timeoutMs);
+}
+
+bool WiFiConnector::connectStored() {
+  _useDHCP();
+  _begin(nullptr, nullptr);
+  return wait(_timeoutMs);
+}
+
+/**
+ * Attempt to associate with an access point using the cached lease as a
+ * static IP
+ */
+bool WiFiConnector::_connectDirected(struct network *net, const uint8_t *bssid,
+                                     uint8_t channel) {
+  if (!_driver->config(&net->cache.lease)) {
+    return false;
+  }
+  _staticConfig = true;
+
+  _begin(net->ssid, net->passwd, channel, bssid);
+  return wait(_fastTimeoutMs);
+}
+
+/**
+ * Revert to DHCP if a static configuration was applied for a fast reconnect
+ */
+void WiFiConnector::_useDHCP() {
+  if (_staticConfig) {
+    _driver->config(nullptr);
+    _staticConfig = false;
+  }
+}
+
+void WiFiConnector::recordConnection(struct network *net) {
+  network_cache_t *cache = &net->cache;
+
+  if (!_driver->bssid(cache->bssid) || !_driver->lease(&cache->lease)) {
+    cache->valid = false;
+    return;
+  }
+  cache->channel = (uint8_t)_driver->channel();
+  cache->valid = true;
+  net->lastChannel = cache->channel;
+}
+
+/**
+ * Wait for connect to succeed or fail
+ * @return True if connected
+ */
+bool WiFiConnector::wait(unsigned long timeoutMs) {
+  _startAttempt(timeoutMs, nullptr);
+  while (true) {
+    wifi_attempt_t result = checkConnect();
+    if (result != WFB_ATTEMPT_PENDING) {
+      return (result == WFB_ATTEMPT_CONNECTED);
+    }
+    _driver->delay(100);
+  };
+}
+
+void WiFiConnector::startConnect(const char *ssid, const char *passwd) {
+  _useDHCP();
+  _begin(ssid, passwd);
+  _startAttempt(_timeoutMs, nullptr);
+}
+
+void WiFiConnector::startConnect(struct network *net) {
+  _useDHCP();
+  if (net->ssid[0] == '\0') {
+    _begin(nullptr, nullptr);
+  } else {
+    _begin(net->ssid, net->passwd);
+  }
+  _startAttempt(timeoutFor(net), net, true);
+}
+
+void WiFiConnector::startConnect(struct network *net, const uint8_t *bssid,
+                                 uint8_t channel) {
+  if (_fastReconnect && net->cache.valid &&
+      _driver->config(&net->cache.lease)) {
+    _staticConfig = true;
+  } else {
+    _useDHCP();
+  }
+  _begin(net->ssid, net->passwd, channel, bssid);
+  _startAttempt(_fastTimeoutMs, net);
+}
+
+/**
+ * Start associating, noting the network or access point targeted so that an
+ * association left over from before can be told apart.  A null ssid uses the
+ * network stored by the SDK.
+ */
+void WiFiConnector::_begin(const char *ssid, const char *passwd,
+                           uint8_t channel, const uint8_t *bssid) {
+  _targetDirected = (ssid && channel && bssid);
+  if (_targetDirected) {
+    memcpy(_targetBssid, bssid, WFB_BSSID_LEN);
+  }
+
+  if (ssid) {
+    strncpy(_targetSsid, ssid, WFB_SSID_LEN);
+    _targetSsid[WFB_SSID_LEN] = '\0';
+    _driver->begin(ssid, passwd, channel, bssid);
+  } else {
+    _targetSsid[0] = '\0';
+    _driver->beginStored();
+  }
+}
+
+/**
+ * Determine if a connected status is the association the attempt began.  The
+ * SDK keeps reporting an earlier association until it leaves it, so when one
+ * was already up the access point or network in use must be the target.
+ * @return Whether the attempt's target is associated
+ */
+bool WiFiConnector::_joinedTarget() {
+  if (_staleStatus != WFB_STATUS_CONNECTED) {
+    return true;
+  }
+
+  if (_targetDirected) {
+    uint8_t bssid[WFB_BSSID_LEN];
+    return (_driver->bssid(bssid) &&
+            memcmp(bssid, _targetBssid, WFB_BSSID_LEN) == 0);
+  }
+  if (_targetSsid[0]) {
+    char ssid[WFB_SSID_LEN + 1];
+    return (_driver->ssid(ssid) && strcmp(ssid, _targetSsid) == 0);
+  }
+
+  /* The stored network can't be matched, so the earlier one must be left */
+  return (_statusChanged || _driver->disconnectReason() != WFB_REASON_NONE);
+}
+
+/**
+ * Note the start of an attempt that has just begun.  The SDK's status isn't
+ * reset by begin(), so the status it reports until its next event is that of
+ * the previous attempt.
+ */
+void WiFiConnector::_startAttempt(unsigned long timeoutMs,
+                                  struct network *net, bool full) {
+  _attemptStart = _driver->millis();
+  _attemptTimeoutMs = timeoutMs;
+  _attemptNetwork = net;
+  _attemptFull = full;
+  _staleStatus = _driver->status();
+  _statusChanged = false;
+}
+
+/**
+ * Check the progress of the current attempt, abandoning it if it has failed
+ * or timed out.
+ * @return The state of the attempt
+ */
+wifi_attempt_t WiFiConnector::checkConnect() {
+  wifi_attempt_t result = _checkAttempt();
+  struct network *net = _attemptNetwork;
+  if (result == WFB_ATTEMPT_PENDING || !net) {
+    return result;
+  }
+
+  _attemptNetwork = nullptr;
+  bool connected = (result == WFB_ATTEMPT_CONNECTED);
+  if (_attemptFull) {
+    _recordResult(net, connected, _attemptStart);
+    _learnAttempt(net, connected, _attemptStart);
+    return result;
+  }
+
+  /*
+   * A directed attempt ran out the fast timeout rather than the network's, so
+   * only a DHCP connect's duration is learned from it
+   */
+  net->lastFailure = _lastFailure;
+  if (connected) {
+    if (!_staticConfig) {
+      _recordDuration(net, _driver->millis() - _attemptStart);
+    }
+    recordConnection(net);
+  }
+  return result;
+}
+
+wifi_attempt_t WiFiConnector::_checkAttempt() {
+  uint8_t status = _driver->status();
+  if (status != _staleStatus) {
+    _statusChanged = true;
+  }
+  if (status == WFB_STATUS_CONNECTED && _joinedTarget()) {
+    _lastFailure = WFB_FAIL_NONE;
+    return WFB_ATTEMPT_CONNECTED;
+  }
+  if (_statusChanged && status == WFB_STATUS_CONNECT_FAILED) {
+    _lastFailure = WFB_FAIL_ASSOC;
+    return WFB_ATTEMPT_FAILED;
+  }
+  if (_failFast) {
+    /*
+     * A status left over from before begin() says nothing of this attempt,
+     * unlike the reason, which the driver clears on begin()
+     */
+    wifi_fail_t failure = classify(_statusChanged ? status :
+                                   WFB_STATUS_DISCONNECTED,
+                                   _driver->disconnectReason());
+    if (failure != WFB_FAIL_NONE) {
+      _driver->disconnect();
+      _lastFailure = failure;
+      return WFB_ATTEMPT_FAILED;
+    }
+  }
+  if (_driver->millis() - _attemptStart > _attemptTimeoutMs) {
+    _driver->disconnect();
+    _lastFailure = WFB_FAIL_TIMEOUT;
+    return WFB_ATTEMPT_FAILED;
+  }
+  return WFB_ATTEMPT_PENDING;
+}
+
+wifi_fail_t WiFiConnector::classify(uint8_t status, uint8_t reason) {
+  switch (status) {
+    case WFB_STATUS_NO_SSID:
+      return WFB_FAIL_NO_SSID;
+    case WFB_STATUS_CONNECT_FAILED:
+      return WFB_FAIL_ASSOC;
+  }
+
+  switch (reason) {
+    case WFB_REASON_NO_AP_FOUND:
+      return WFB_FAIL_NO_SSID;
+    case WFB_REASON_AUTH_EXPIRE:
+    case WFB_REASON_MIC_FAILURE:
+    case WFB_REASON_4WAY_HANDSHAKE_TIMEOUT:
+    case WFB_REASON_802_1X_AUTH_FAILED:
+    case WFB_REASON_AUTH_FAIL:
+    case WFB_REASON_HANDSHAKE_TIMEOUT:
+      return WFB_FAIL_AUTH;
+    case WFB_REASON_ASSOC_FAIL:
+    case WFB_REASON_CONNECTION_FAIL:
+      return WFB_FAIL_ASSOC;
+  }
+
+  /* Other reasons, such as a beacon timeout, may be transient */
+  return WFB_FAIL_NONE;
+}
+
+const char *WiFiConnector::failureString(uint8_t failure) {
+  switch (failure) {
+    case WFB_FAIL_NONE:    return "none";
+    case WFB_FAIL_NO_SSID: return "no_ssid";
+    case WFB_FAIL_AUTH:    return "auth";
+    case WFB_FAIL_ASSOC:   return "assoc";
+    case WFB_FAIL_TIMEOUT: return "timeout";
+  }
+  return "unknown";
+}
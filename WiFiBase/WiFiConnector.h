@@ -0,0 +1,249 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Connection logic for WiFiBase's known networks.
+ *
+ * Design:
+ *   Each known network caches the BSSID, channel and IP lease of its last
+ * successful connection.  A reconnect first attempts a directed association
+ * to that access point using the cached lease as a static configuration, which
+ * skips both the channel sweep and DHCP.  If that fails within a short timeout
+ * the cache is dropped and a full connect is attempted.
+ *
+ *   While waiting on an attempt the connection status and the SDK's disconnect
+ * reasons are classified, and an attempt that is known to be doomed (the
+ * network is absent, or authentication was rejected) is abandoned immediately
+ * rather than running out its full timeout.  The reason for the most recent
+ * failure is recorded for each network.
+ *
+ *   The durations of recent successful connects to each network are kept, and
+ * the timeout for a full connect is derived from them as the 95th percentile
+ * scaled by a margin and bounded to a configured range.  Until a network has
+ * enough history, or after it times out, the default timeout is used.
+ *
+ *   Failures accumulate a per-network score which halves with each decay
+ * period since the last failure.  A failed network is skipped by
+ * connectKnown() for a cooldown that doubles with the score, so networks that
+ * are repeatedly failing cost nothing until their cooldown expires.
+ *
+ *   All radio access goes through a WiFiDriver so that this class can be tested
+ * on the host.
+ */
+
+#ifndef WIFICONNECTOR_H
+#define WIFICONNECTOR_H
+
+#include "WiFiDriver.h"
+#include "WiFiMetrics.h"
+
+class WiFiScanPlanner;
+class WiFiScanCache;
+
+/* Reasons for a connection attempt to fail */
+typedef enum {
+  WFB_FAIL_NONE = 0,
+  WFB_FAIL_NO_SSID,    // Network was not found
+  WFB_FAIL_AUTH,       // Authentication was rejected or timed out
+  WFB_FAIL_ASSOC,      // Association was rejected
+  WFB_FAIL_TIMEOUT,    // No result before the timeout
+} wifi_fail_t;
+
+/* Progress of a non-blocking connection attempt */
+typedef enum {
+  WFB_ATTEMPT_PENDING = 0,
+  WFB_ATTEMPT_CONNECTED,
+  WFB_ATTEMPT_FAILED,
+} wifi_attempt_t;
+
+/* Rolling history of connect durations */
+#define WFB_HISTORY_LEN 8
+#define WFB_HISTORY_MIN 3
+typedef struct {
+  uint16_t durations[WFB_HISTORY_LEN]; // ms
+  uint8_t  count;
+  uint8_t  next;
+} network_history_t;
+
+/* Failure score and cooldown of a network */
+#define WFB_PENALTY_MAX_SCORE 16
+typedef struct {
+  uint8_t       score;
+  bool          active;
+  unsigned long lastFailure;  // ms
+  unsigned long retryAt;      // ms
+} network_penalty_t;
+
+/* Connect statistics of a network */
+typedef struct {
+  uint32_t            attempts;
+  uint32_t            successes;
+  uint32_t            failures;
+  metrics_histogram_t durations;  // ms, successful connects
+} network_stats_t;
+
+/* Last known good association of a network, used for fast reconnects */
+typedef struct {
+  bool         valid;
+  uint8_t      bssid[WFB_BSSID_LEN];
+  uint8_t      channel;
+  wifi_lease_t lease;
+} network_cache_t;
+
+struct network {
+  char *ssid;
+  char *passwd;
+  network_cache_t cache;
+  network_history_t history;
+  network_penalty_t penalty;
+  network_stats_t stats;
+  uint8_t lastFailure;
+  uint8_t lastChannel;  // Channel last connected or seen on, 0 if unknown
+};
+
+class WiFiConnector {
+  public:
+    WiFiConnector(WiFiDriver *driver);
+
+    static const uint8_t INDEX_NONE = (uint8_t)-1;
+    static const unsigned long DEFAULT_CONNECT_TIMEOUT = 10 * 1000;
+    static const unsigned long DEFAULT_FAST_TIMEOUT = 2 * 1000;
+    static const unsigned long DEFAULT_ADAPTIVE_MIN = 2 * 1000;
+    static const unsigned long DEFAULT_ADAPTIVE_MAX = 20 * 1000;
+    static const uint16_t DEFAULT_ADAPTIVE_MARGIN = 150; // percent
+    static const unsigned long DEFAULT_PENALTY_BASE = 5 * 1000;
+    static const unsigned long DEFAULT_PENALTY_MAX = 10 * 60 * 1000;
+    static const unsigned long DEFAULT_PENALTY_HALFLIFE = 10 * 60 * 1000;
+
+    void setTimeoutMs(unsigned long ms);
+    void setFastTimeoutMs(unsigned long ms);
+    void setFastReconnect(bool enable);
+    void setFailFast(bool enable);
+    void setAdaptiveTimeout(bool enable);
+    void setAdaptiveTimeout(unsigned long minMs, unsigned long maxMs,
+                            uint16_t marginPercent);
+
+    /* Timeout to use for a full connect to a network */
+    unsigned long timeoutFor(struct network *net);
+
+    /* Off by default, as a lone network would be skipped while it's down */
+    void setPenalties(bool enable);
+    void setPenalties(unsigned long baseMs, unsigned long maxMs,
+                      unsigned long halfLifeMs);
+
+    /* Whether a network is being skipped, and the current decayed score */
+    bool penalized(struct network *net);
+    uint8_t penaltyScore(struct network *net);
+
+    /* Connect to the first possible network of a list */
+    uint8_t connectKnown(struct network *networks, uint8_t count);
+
+    /*
+     * Scan for known networks following a channel-restricted plan, then
+     * connect to the networks found in order of signal strength.  Fresh
+     * results in the cache are used without rescanning, and the cache is
+     * updated by any full scan.
+     */
+    uint8_t connectScanned(struct network *networks, uint8_t count,
+                           WiFiScanPlanner *planner,
+                           WiFiScanCache *cache = nullptr);
+
+    /* Connect to a single known network, using its cache if valid */
+    bool connect(struct network *net);
+
+    /* Connect to a known network directed at a specific access point */
+    bool connect(struct network *net, const uint8_t *bssid, uint8_t channel);
+
+    /* Connect to a network without any cached information */
+    bool connect(const char *ssid, const char *passwd);
+    bool connectStored();
+
+    /* Save the details of the current connection into a network's cache */
+    void recordConnection(struct network *net);
+
+    /* Wait for the current attempt to succeed or fail */
+    bool wait(unsigned long timeoutMs);
+
+    /*
+     * Start a connect to a network without waiting on it, the attempt is then
+     * progressed by calling checkConnect() until it is no longer pending.
+     */
+    void startConnect(const char *ssid, const char *passwd);
+    wifi_attempt_t checkConnect();
+
+    /*
+     * Start a full connect to a known network without waiting on it, its
+     * result is recorded against the network as by connectKnown() once
+     * checkConnect() reports it.  The network must remain valid until then.
+     */
+    void startConnect(struct network *net);
+
+    /*
+     * Start a connect directed at an access point of a known network without
+     * waiting on it, such as a roam.  It is bounded by the fast timeout, uses
+     * the cached lease when fast reconnects are on, and is never widened to a
+     * full connect.  Once checkConnect() reports it connected the network's
+     * cache moves to it, and the network must remain valid until then.
+     */
+    void startConnect(struct network *net, const uint8_t *bssid,
+                      uint8_t channel);
+
+    /* Reason the most recent attempt failed */
+    wifi_fail_t lastFailure();
+
+    /*
+     * Determine if an attempt has failed from the connection status and
+     * disconnect reason, returning WFB_FAIL_NONE if it may still succeed.
+     */
+    static wifi_fail_t classify(uint8_t status, uint8_t reason);
+    static const char *failureString(uint8_t failure);
+
+  protected:
+    WiFiDriver *_driver;
+
+    unsigned long _timeoutMs;
+    unsigned long _fastTimeoutMs;
+    bool _fastReconnect;
+    bool _failFast;
+    bool _adaptive;
+    unsigned long _adaptiveMinMs;
+    unsigned long _adaptiveMaxMs;
+    uint16_t _adaptiveMargin;
+
+    bool _penalties;
+    unsigned long _penaltyBaseMs;
+    unsigned long _penaltyMaxMs;
+    unsigned long _penaltyHalfLifeMs;
+    bool _staticConfig;
+    wifi_fail_t _lastFailure;
+    unsigned long _attemptStart;
+    unsigned long _attemptTimeoutMs;
+    struct network *_attemptNetwork;  // Of a non-blocking attempt
+    bool _attemptFull;        // Counted toward its penalty and timeout
+    uint8_t _staleStatus;     // Left over from before the attempt's begin()
+    bool _statusChanged;      // Since begin(), so it describes the attempt
+    char _targetSsid[WFB_SSID_LEN + 1];  // Of the attempt, empty if stored
+    uint8_t _targetBssid[WFB_BSSID_LEN];
+    bool _targetDirected;
+
+    bool _connectDirected(struct network *net, const uint8_t *bssid,
+                          uint8_t channel);
+    bool _connectStoredKnown(struct network *net);
+    bool _connectFull(const char *ssid, const char *passwd,
+                      unsigned long timeoutMs);
+    void _recordDuration(struct network *net, unsigned long ms);
+    void _learnAttempt(struct network *net, bool connected,
+                       unsigned long start);
+    void _recordResult(struct network *net, bool connected,
+                       unsigned long start);
+    void _useDHCP();
+    void _begin(const char *ssid, const char *passwd, uint8_t channel = 0,
+                const uint8_t *bssid = nullptr);
+    bool _joinedTarget();
+    void _startAttempt(unsigned long timeoutMs, struct network *net,
+                       bool full = false);
+    wifi_attempt_t _checkAttempt();
+};
+
+#endif // WIFICONNECTOR_H
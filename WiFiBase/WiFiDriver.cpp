@@ -0,0 +1,194 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Arduino implementation of the WiFiDriver interface
+ */
+
+#ifdef ARDUINO
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <lwip/opt.h>
+
+/* NAPT is only available when enabled in the core's lwIP configuration */
+#if defined(IP_NAPT) && IP_NAPT
+  #include <lwip/lwip_napt.h>
+  #define WFB_NAPT
+#endif
+
+#include "WiFiDriver.h"
+
+/* The disconnect event and its info changed names in the 2.x core */
+#if defined(ESP_ARDUINO_VERSION_MAJOR) && ESP_ARDUINO_VERSION_MAJOR >= 2
+  #define WFB_EVENT_STA_DISCONNECTED ARDUINO_EVENT_WIFI_STA_DISCONNECTED
+  #define WFB_EVENT_REASON(info) (info).wifi_sta_disconnected.reason
+#else
+  #define WFB_EVENT_STA_DISCONNECTED SYSTEM_EVENT_STA_DISCONNECTED
+  #define WFB_EVENT_REASON(info) (info).disconnected.reason
+#endif
+
+ArduinoWiFiDriver::ArduinoWiFiDriver() {
+  _reason = WFB_REASON_NONE;
+  _eventRegistered = false;
+}
+
+void ArduinoWiFiDriver::begin(const char *ssid, const char *passwd,
+                              int32_t channel, const uint8_t *bssid) {
+  if (!_eventRegistered) {
+    /* Registered lazily as the WiFi event loop may not exist at construction */
+    WiFi.onEvent([this](WiFiEvent_t event, WiFiEventInfo_t info) {
+      _reason = WFB_EVENT_REASON(info);
+    }, WFB_EVENT_STA_DISCONNECTED);
+    _eventRegistered = true;
+  }
+
+  _reason = WFB_REASON_NONE;
+  if (ssid) {
+    WiFi.begin(ssid, passwd, channel, bssid);
+  } else {
+    WiFi.begin();
+  }
+}
+
+void ArduinoWiFiDriver::beginStored() {
+  begin(nullptr, nullptr);
+}
+
+bool ArduinoWiFiDriver::config(const wifi_lease_t *lease) {
+  if (!lease) {
+    /* Setting empty addresses re-enables DHCP */
+    return WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE);
+  }
+  return WiFi.config(IPAddress(lease->ip), IPAddress(lease->gateway),
+                     IPAddress(lease->subnet), IPAddress(lease->dns));
+}
+
+uint8_t ArduinoWiFiDriver::status() {
+  return WiFi.status();
+}
+
+void ArduinoWiFiDriver::disconnect() {
+  esp_wifi_disconnect();
+}
+
+uint8_t ArduinoWiFiDriver::disconnectReason() {
+  return _reason;
+}
+
+/*
+ * WiFi.SSID() reports the configured network, which begin() changes before
+ * the association does, so ask the SDK for the access point in use
+ */
+bool ArduinoWiFiDriver::ssid(char *ssid) {
+  wifi_ap_record_t info;
+  if (esp_wifi_sta_get_ap_info(&info) != ESP_OK) {
+    return false;
+  }
+  strncpy(ssid, (const char *)info.ssid, WFB_SSID_LEN);
+  ssid[WFB_SSID_LEN] = '\0';
+  return true;
+}
+
+bool ArduinoWiFiDriver::bssid(uint8_t *bssid) {
+  uint8_t *current = WiFi.BSSID();
+  if (!current) {
+    return false;
+  }
+  memcpy(bssid, current, WFB_BSSID_LEN);
+  return true;
+}
+
+int32_t ArduinoWiFiDriver::channel() {
+  return WiFi.channel();
+}
+
+bool ArduinoWiFiDriver::lease(wifi_lease_t *lease) {
+  lease->ip = WiFi.localIP();
+  lease->gateway = WiFi.gatewayIP();
+  lease->subnet = WiFi.subnetMask();
+  lease->dns = WiFi.dnsIP();
+  return (lease->ip != 0);
+}
+
+int32_t ArduinoWiFiDriver::rssi() {
+  return WiFi.RSSI();
+}
+
+bool ArduinoWiFiDriver::scanStart(bool async, uint8_t channel, bool passive,
+                                  uint32_t dwellMs) {
+  if (!dwellMs) {
+    dwellMs = 300;
+  }
+#if defined(ESP_ARDUINO_VERSION_MAJOR) && ESP_ARDUINO_VERSION_MAJOR >= 2
+  int16_t result = WiFi.scanNetworks(async, false, passive, dwellMs, channel);
+#else
+  /* Older cores can't restrict the channel and scan everything */
+  int16_t result = WiFi.scanNetworks(async, false, passive, dwellMs);
+#endif
+  return (result != WIFI_SCAN_FAILED);
+}
+
+int16_t ArduinoWiFiDriver::scanComplete() {
+  return WiFi.scanComplete();
+}
+
+bool ArduinoWiFiDriver::scanResult(int16_t index, wifi_scan_entry_t *entry) {
+  uint8_t *bssid = WiFi.BSSID(index);
+  if (!bssid) {
+    return false;
+  }
+
+  strncpy(entry->ssid, WiFi.SSID(index).c_str(), WFB_SSID_LEN);
+  entry->ssid[WFB_SSID_LEN] = '\0';
+  memcpy(entry->bssid, bssid, WFB_BSSID_LEN);
+  entry->channel = (uint8_t)WiFi.channel(index);
+  entry->rssi = (int8_t)WiFi.RSSI(index);
+  entry->open = (WiFi.encryptionType(index) == WIFI_AUTH_OPEN);
+  return true;
+}
+
+void ArduinoWiFiDriver::scanDelete() {
+  WiFi.scanDelete();
+}
+
+bool ArduinoWiFiDriver::softAP(const char *ssid, const char *passwd,
+                               uint8_t channel) {
+  /* Starting the access point leaves the station enabled */
+  return WiFi.softAP(ssid, passwd, channel);
+}
+
+void ArduinoWiFiDriver::softAPdisconnect() {
+  WiFi.softAPdisconnect(true);
+}
+
+uint8_t ArduinoWiFiDriver::softAPChannel() {
+  uint8_t primary;
+  wifi_second_chan_t second;
+
+  if (!(WiFi.getMode() & WIFI_MODE_AP) ||
+      esp_wifi_get_channel(&primary, &second) != ESP_OK) {
+    return 0;
+  }
+  return primary;
+}
+
+bool ArduinoWiFiDriver::forward(bool enable) {
+#ifdef WFB_NAPT
+  ip_napt_enable((uint32_t)WiFi.softAPIP(), enable ? 1 : 0);
+  return true;
+#else
+  return !enable;
+#endif
+}
+
+unsigned long ArduinoWiFiDriver::millis() {
+  return ::millis();
+}
+
+void ArduinoWiFiDriver::delay(unsigned long ms) {
+  ::delay(ms);
+}
+
+#endif // ARDUINO
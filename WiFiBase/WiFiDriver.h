@@ -0,0 +1,165 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Thin interface over the WiFi radio as used by WiFiBase's connection logic.
+ *
+ * Design:
+ *   WiFiBase's connect, scan and roaming decisions are made against this
+ * interface rather than the global WiFi object, so that the decision logic can
+ * be exercised on the host with a scripted stand-in and a virtual clock.  The
+ * ArduinoWiFiDriver implementation simply forwards to WiFi.
+ */
+
+#ifndef WIFIDRIVER_H
+#define WIFIDRIVER_H
+
+#include <stdint.h>
+
+/* Connection status values, these match the Arduino wl_status_t codes */
+#define WFB_STATUS_IDLE             0
+#define WFB_STATUS_NO_SSID          1
+#define WFB_STATUS_SCAN_COMPLETED   2
+#define WFB_STATUS_CONNECTED        3
+#define WFB_STATUS_CONNECT_FAILED   4
+#define WFB_STATUS_CONNECTION_LOST  5
+#define WFB_STATUS_DISCONNECTED     6
+
+/* Disconnect reasons reported by the SDK, from esp_wifi_types.h */
+#define WFB_REASON_NONE                   0
+#define WFB_REASON_AUTH_EXPIRE            2
+#define WFB_REASON_MIC_FAILURE            14
+#define WFB_REASON_4WAY_HANDSHAKE_TIMEOUT 15
+#define WFB_REASON_802_1X_AUTH_FAILED     23
+#define WFB_REASON_BEACON_TIMEOUT         200
+#define WFB_REASON_NO_AP_FOUND            201
+#define WFB_REASON_AUTH_FAIL              202
+#define WFB_REASON_ASSOC_FAIL             203
+#define WFB_REASON_HANDSHAKE_TIMEOUT      204
+#define WFB_REASON_CONNECTION_FAIL        205
+
+#define WFB_BSSID_LEN 6
+#define WFB_SSID_LEN 32
+
+/* Scan states returned by scanComplete(), matching the Arduino values */
+#define WFB_SCAN_RUNNING  -1
+#define WFB_SCAN_FAILED   -2
+
+/* A network found by a scan */
+typedef struct {
+  char     ssid[WFB_SSID_LEN + 1];
+  uint8_t  bssid[WFB_BSSID_LEN];
+  uint8_t  channel;
+  int8_t   rssi;
+  bool     open;
+} wifi_scan_entry_t;
+
+/* IP configuration of a connection, addresses are as stored by IPAddress */
+typedef struct {
+  uint32_t ip;
+  uint32_t gateway;
+  uint32_t subnet;
+  uint32_t dns;
+} wifi_lease_t;
+
+class WiFiDriver {
+  public:
+    virtual ~WiFiDriver() {}
+
+    /*
+     * Start connecting to a network.  If channel and bssid are provided the
+     * association is directed at that access point without a channel sweep.
+     */
+    virtual void begin(const char *ssid, const char *passwd,
+                       int32_t channel = 0, const uint8_t *bssid = nullptr) = 0;
+
+    /* Start connecting with the credentials stored by the SDK */
+    virtual void beginStored() = 0;
+
+    /* Use a static IP configuration, or revert to DHCP if lease is null */
+    virtual bool config(const wifi_lease_t *lease) = 0;
+
+    /* Not reset by begin(), it changes only with the SDK's next event */
+    virtual uint8_t status() = 0;
+    virtual void disconnect() = 0;
+
+    /* Most recent disconnect reason since begin(), or WFB_REASON_NONE */
+    virtual uint8_t disconnectReason() = 0;
+
+    /* Details of the current association, ssid holding WFB_SSID_LEN + 1 */
+    virtual bool ssid(char *ssid) = 0;
+    virtual bool bssid(uint8_t *bssid) = 0;
+    virtual int32_t channel() = 0;
+    virtual bool lease(wifi_lease_t *lease) = 0;
+    virtual int32_t rssi() = 0;
+
+    /*
+     * Scanning, with results available once scanComplete() returns a count.
+     * Results remain valid until scanDelete().  A channel of 0 scans all
+     * channels, and a dwellMs of 0 uses the SDK's default time per channel.
+     */
+    virtual bool scanStart(bool async, uint8_t channel = 0,
+                           bool passive = false, uint32_t dwellMs = 0) = 0;
+    virtual int16_t scanComplete() = 0;
+    virtual bool scanResult(int16_t index, wifi_scan_entry_t *entry) = 0;
+    virtual void scanDelete() = 0;
+
+    /*
+     * The access point, run alongside the station.  The radio has a single
+     * channel, so the access point follows the station's once it associates
+     * and softAPChannel() reports the channel actually in use, or 0 if the
+     * access point is down.
+     */
+    virtual bool softAP(const char *ssid, const char *passwd,
+                        uint8_t channel) = 0;
+    virtual void softAPdisconnect() = 0;
+    virtual uint8_t softAPChannel() = 0;
+
+    /* Forward traffic from the access point upstream, false if unsupported */
+    virtual bool forward(bool enable) = 0;
+
+    /* Time source */
+    virtual unsigned long millis() = 0;
+    virtual void delay(unsigned long ms) = 0;
+};
+
+#ifdef ARDUINO
+/*
+ * Driver implementation using the Arduino WiFi object
+ */
+class ArduinoWiFiDriver : public WiFiDriver {
+  public:
+    ArduinoWiFiDriver();
+
+    void begin(const char *ssid, const char *passwd,
+               int32_t channel = 0, const uint8_t *bssid = nullptr);
+    void beginStored();
+    bool config(const wifi_lease_t *lease);
+    uint8_t status();
+    void disconnect();
+    uint8_t disconnectReason();
+    bool ssid(char *ssid);
+    bool bssid(uint8_t *bssid);
+    int32_t channel();
+    bool lease(wifi_lease_t *lease);
+    int32_t rssi();
+    bool scanStart(bool async, uint8_t channel = 0, bool passive = false,
+                   uint32_t dwellMs = 0);
+    int16_t scanComplete();
+    bool scanResult(int16_t index, wifi_scan_entry_t *entry);
+    void scanDelete();
+    bool softAP(const char *ssid, const char *passwd, uint8_t channel);
+    void softAPdisconnect();
+    uint8_t softAPChannel();
+    bool forward(bool enable);
+    unsigned long millis();
+    void delay(unsigned long ms);
+
+  protected:
+    volatile uint8_t _reason;
+    bool _eventRegistered;
+};
+#endif
+
+#endif // WIFIDRIVER_H
@@ -0,0 +1,207 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "WiFiEvents.h"
+#include "JsonWriter.h"
+
+#define IP_STRING_LEN 16
+
+/* Lower bound of each RSSI bucket above the first, in dBm */
+static const int8_t rssiBounds[WiFiEvents::NUM_RSSI_BUCKETS - 1] = {
+  -85, -75, -67, -55
+};
+
+/**
+ * Format an address held as by IPAddress, first octet in the low byte
+ * @return The buffer
+ */
+static const char *ipString(uint32_t ip, char *buffer) {
+  snprintf(buffer, IP_STRING_LEN, "%u.%u.%u.%u", (unsigned)(ip & 0xFF),
+           (unsigned)((ip >> 8) & 0xFF), (unsigned)((ip >> 16) & 0xFF),
+           (unsigned)(ip >> 24));
+  return buffer;
+}
+
+WiFiEvents::WiFiEvents() {
+  _started = false;
+  memset(&_last, 0, sizeof (_last));
+  _bucket = 0;
+  _scanGeneration = 0;
+  _events = 0;
+}
+
+uint8_t WiFiEvents::rssiBucket(int8_t rssi) {
+  uint8_t bucket = 0;
+  while (bucket < NUM_RSSI_BUCKETS - 1 && rssi >= rssiBounds[bucket]) {
+    bucket++;
+  }
+  return bucket;
+}
+
+uint8_t WiFiEvents::update(const wifi_event_state_t *state,
+                           WiFiScanCache *cache, OutputSink *sink) {
+  uint8_t written = 0;
+
+  bool wifi = !_started ||
+          state->connected != _last.connected ||
+          state->localIP != _last.localIP ||
+          strcmp(state->ssid, _last.ssid) != 0;
+  bool ap = !_started ||
+          state->apActive != _last.apActive ||
+          state->apIP != _last.apIP;
+
+  /* Only move to a new bucket once past its boundary by the hysteresis */
+  bool rssi = false;
+  if (state->connected) {
+    uint8_t bucket = rssiBucket(state->rssi);
+    if (!_started || !_last.connected) {
+      rssi = true;
+    } else if (bucket > _bucket) {
+      rssi = (rssiBucket(state->rssi - RSSI_HYSTERESIS) > _bucket);
+    } else if (bucket < _bucket) {
+      rssi = (rssiBucket(state->rssi + RSSI_HYSTERESIS) < _bucket);
+    }
+    if (rssi) {
+      _bucket = bucket;
+    }
+  }
+
+  int8_t lastRssi = _last.rssi;
+  memcpy(&_last, state, sizeof (_last));
+  if (!rssi) {
+    /* Keep the value reported with the current bucket */
+    _last.rssi = lastRssi;
+  }
+  _started = true;
+
+  bool scan = (cache && cache->ready() &&
+               cache->generation() != _scanGeneration);
+  if (scan) {
+    _scanGeneration = cache->generation();
+  }
+
+  if (!sink) {
+    return 0;
+  }
+
+  if (wifi) {
+    _wifiEvent(sink);
+    written++;
+  }
+  if (ap) {
+    _apEvent(sink);
+    written++;
+  }
+  if (rssi) {
+    _rssiEvent(sink);
+    written++;
+  }
+  if (scan) {
+    _scanEvent(cache, sink);
+    written++;
+  }
+
+  return written;
+}
+
+void WiFiEvents::snapshot(WiFiScanCache *cache, OutputSink *sink) {
+  if (!_started) {
+    return;
+  }
+
+  _wifiEvent(sink);
+  _apEvent(sink);
+  if (_last.connected) {
+    _rssiEvent(sink);
+  }
+  if (_scanGeneration) {
+    _scanEvent(cache, sink);
+  }
+}
+
+uint32_t WiFiEvents::events() {
+  return _events;
+}
+
+void WiFiEvents::_wifiEvent(OutputSink *sink) {
+  char ip[IP_STRING_LEN];
+
+  _begin(sink, "wifi");
+  JsonWriter json(sink);
+  json.beginObject();
+  json.key("connected").value(_last.connected);
+  if (_last.connected) {
+    json.key("ssid").value(_last.ssid);
+    json.key("local_IP").value(ipString(_last.localIP, ip));
+  }
+  json.endObject();
+  json.flush();
+  _end(sink);
+}
+
+void WiFiEvents::_apEvent(OutputSink *sink) {
+  char ip[IP_STRING_LEN];
+
+  _begin(sink, "ap");
+  JsonWriter json(sink);
+  json.beginObject();
+  json.key("active").value(_last.apActive);
+  if (_last.apActive) {
+    json.key("AP_IP").value(ipString(_last.apIP, ip));
+  }
+  json.endObject();
+  json.flush();
+  _end(sink);
+}
+
+void WiFiEvents::_rssiEvent(OutputSink *sink) {
+  _begin(sink, "rssi");
+  JsonWriter json(sink);
+  json.beginObject();
+  json.key("bucket").value((unsigned int)_bucket);
+  json.key("rssi").value((int)_last.rssi);
+  json.endObject();
+  json.flush();
+  _end(sink);
+}
+
+void WiFiEvents::_scanEvent(WiFiScanCache *cache, OutputSink *sink) {
+  _begin(sink, "scan");
+  JsonWriter json(sink);
+  json.beginObject();
+  json.key("count").value((unsigned int)cache->count());
+  json.key("networks").beginArray();
+  for (uint16_t i = 0; i < cache->count(); i++) {
+    const wifi_scan_entry_t *entry = cache->entry(i);
+    json.beginArray();
+    json.value(entry->ssid);
+    json.value((int)entry->rssi);
+    json.value(entry->open ? "" : "*");
+    json.endArray();
+  }
+  json.endArray();
+  json.endObject();
+  json.flush();
+  _end(sink);
+}
+
+/*
+ * Each event is a name and a single line of JSON data, which can't contain
+ * newlines since JsonWriter escapes them.
+ */
+void WiFiEvents::_begin(OutputSink *sink, const char *name) {
+  sink->write("event: ", 7);
+  sink->write(name, strlen(name));
+  sink->write("\ndata: ", 7);
+}
+
+void WiFiEvents::_end(OutputSink *sink) {
+  sink->write("\n\n", 2);
+  _events++;
+}
@@ -0,0 +1,75 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Changes in WiFi state, pushed to subscribers as Server-Sent Events.
+ *
+ * Design:
+ *   The state last pushed is kept, and each update() compares the current
+ * state against it, writing an event only for the parts that changed: the
+ * station connection, the access point, the RSSI quantized into buckets and
+ * the scan results.  The events are written once to a single sink shared by
+ * every subscriber.  A new subscriber is sent a snapshot of the state last
+ * pushed, after which the deltas keep it current.
+ *
+ *   RSSI buckets change only once the signal is past a boundary by the
+ * hysteresis, so that a signal sitting on a boundary doesn't flap.
+ */
+
+#ifndef WIFIEVENTS_H
+#define WIFIEVENTS_H
+
+#include "WiFiDriver.h"
+#include "WiFiScanCache.h"
+#include "OutputSink.h"
+
+typedef struct {
+  bool     connected;
+  char     ssid[WFB_SSID_LEN + 1];
+  uint32_t localIP;     // As held by IPAddress
+  bool     apActive;
+  uint32_t apIP;
+  int8_t   rssi;
+} wifi_event_state_t;
+
+class WiFiEvents {
+  public:
+    WiFiEvents();
+
+    static const unsigned long CHECK_INTERVAL = 250;
+    static const uint8_t NUM_RSSI_BUCKETS = 5;
+    static const uint8_t RSSI_HYSTERESIS = 2;  // dB
+
+    /* Bucket from 0 (unusable) to NUM_RSSI_BUCKETS - 1 (excellent) */
+    static uint8_t rssiBucket(int8_t rssi);
+
+    /*
+     * Write events for whatever changed since the last update, to a null
+     * sink just to record the state.
+     * @return The number of events written
+     */
+    uint8_t update(const wifi_event_state_t *state, WiFiScanCache *cache,
+                   OutputSink *sink);
+
+    /* Write the full state last pushed, for a new subscriber */
+    void snapshot(WiFiScanCache *cache, OutputSink *sink);
+
+    uint32_t events();
+
+  protected:
+    bool _started;
+    wifi_event_state_t _last;
+    uint8_t _bucket;
+    uint32_t _scanGeneration;
+    uint32_t _events;
+
+    void _wifiEvent(OutputSink *sink);
+    void _apEvent(OutputSink *sink);
+    void _rssiEvent(OutputSink *sink);
+    void _scanEvent(WiFiScanCache *cache, OutputSink *sink);
+    void _begin(OutputSink *sink, const char *name);
+    void _end(OutputSink *sink);
+};
+
+#endif // WIFIEVENTS_H
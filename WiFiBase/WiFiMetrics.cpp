@@ -0,0 +1,246 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ */
+
+#include "WiFiMetrics.h"
+
+/* Connect durations from 250ms to 16s */
+const metrics_buckets_t WFB_CONNECT_BUCKETS = {
+  { 250, 500, 1000, 2000, 4000, 8000, 16000 }, 7, 3
+};
+
+/* Request handling times from 500us to 1s */
+const metrics_buckets_t WFB_LATENCY_BUCKETS = {
+  { 500, 1000, 5000, 10000, 50000, 100000, 500000, 1000000 }, 8, 6
+};
+
+ConnectedTime::ConnectedTime() {
+  _connected = false;
+  _since = 0;
+  _totalMs = 0;
+}
+
+void ConnectedTime::update(bool connected, unsigned long now) {
+  if (connected == _connected) {
+    return;
+  }
+  if (_connected) {
+    _totalMs += now - _since;
+  }
+  _connected = connected;
+  _since = now;
+}
+
+unsigned long ConnectedTime::connectedMs(unsigned long now) {
+  return _totalMs + (_connected ? now - _since : 0);
+}
+
+MetricsWriter::MetricsWriter(OutputSink *sink) {
+  _sink = sink;
+  _used = 0;
+  _bytes = 0;
+}
+
+void MetricsWriter::observe(metrics_histogram_t *histogram,
+                            const metrics_buckets_t *buckets, uint32_t value) {
+  uint8_t i;
+  for (i = 0; i < buckets->count; i++) {
+    if (value <= buckets->bounds[i]) {
+      break;
+    }
+  }
+  histogram->buckets[i]++;
+  histogram->count++;
+  histogram->sum += value;
+}
+
+void MetricsWriter::family(const char *name, const char *type,
+                           const char *help) {
+  _put("# HELP ");
+  _put(name);
+  _put(' ');
+  _put(help);
+  _put("\n# TYPE ");
+  _put(name);
+  _put(' ');
+  _put(type);
+  _put('\n');
+}
+
+void MetricsWriter::sample(const char *name, unsigned long value,
+                           const char *label, const char *labelValue) {
+  _name(name, nullptr, label, labelValue);
+  _unsigned(value);
+  _put('\n');
+}
+
+void MetricsWriter::sample(const char *name, long value,
+                           const char *label, const char *labelValue) {
+  _name(name, nullptr, label, labelValue);
+  if (value < 0) {
+    _put('-');
+    _unsigned(0UL - (unsigned long)value);
+  } else {
+    _unsigned((unsigned long)value);
+  }
+  _put('\n');
+}
+
+void MetricsWriter::sampleFixed(const char *name, uint64_t value,
+                                uint8_t decimals, const char *label,
+                                const char *labelValue) {
+  _name(name, nullptr, label, labelValue);
+  _fixed(value, decimals);
+  _put('\n');
+}
+
+void MetricsWriter::histogram(const char *name,
+                              const metrics_histogram_t *histogram,
+                              const metrics_buckets_t *buckets,
+                              const char *label, const char *labelValue) {
+  uint32_t cumulative = 0;
+  for (uint8_t i = 0; i < buckets->count; i++) {
+    cumulative += histogram->buckets[i];
+    _bucket(name, label, labelValue);
+    _fixed(buckets->bounds[i], buckets->decimals);
+    _put("\"} ");
+    _unsigned(cumulative);
+    _put('\n');
+  }
+
+  _bucket(name, label, labelValue);
+  _put("+Inf\"} ");
+  _unsigned(histogram->count);
+  _put('\n');
+
+  _name(name, "_sum", label, labelValue);
+  _fixed(histogram->sum, buckets->decimals);
+  _put('\n');
+
+  _name(name, "_count", label, labelValue);
+  _unsigned(histogram->count);
+  _put('\n');
+}
+
+void MetricsWriter::flush() {
+  if (_used) {
+    _sink->write(_buffer, _used);
+    _used = 0;
+  }
+}
+
+size_t MetricsWriter::bytes() {
+  return _bytes;
+}
+
+void MetricsWriter::_put(char c) {
+  if (_used == BUFFER_SIZE) {
+    flush();
+  }
+  _buffer[_used++] = c;
+  _bytes++;
+}
+
+void MetricsWriter::_put(const char *str) {
+  while (*str) {
+    _put(*str++);
+  }
+}
+
+/**
+ * Write a sample's name and label up to its value
+ */
+void MetricsWriter::_name(const char *name, const char *suffix,
+                          const char *label, const char *labelValue) {
+  _put(name);
+  if (suffix) {
+    _put(suffix);
+  }
+  if (label) {
+    _put('{');
+    _label(label, labelValue);
+    _put('}');
+  }
+  _put(' ');
+}
+
+/**
+ * Write a histogram bucket's name and labels up to the value of its bound
+ */
+void MetricsWriter::_bucket(const char *name, const char *label,
+                            const char *labelValue) {
+  _put(name);
+  _put("_bucket{");
+  if (label) {
+    _label(label, labelValue);
+    _put(',');
+  }
+  _put("le=\"");
+}
+
+void MetricsWriter::_label(const char *label, const char *labelValue) {
+  _put(label);
+  _put("=\"");
+  _escaped(labelValue ? labelValue : "");
+  _put('"');
+}
+
+/**
+ * Write a label value, escaping backslashes, quotes and newlines
+ */
+void MetricsWriter::_escaped(const char *str) {
+  for (; *str; str++) {
+    switch (*str) {
+      case '\\': _put("\\\\"); break;
+      case '"':  _put("\\\""); break;
+      case '\n': _put("\\n"); break;
+      default:   _put(*str);
+    }
+  }
+}
+
+void MetricsWriter::_unsigned(uint64_t value) {
+  char digits[20];
+  uint8_t n = 0;
+  do {
+    digits[n++] = (char)('0' + value % 10);
+    value /= 10;
+  } while (value);
+
+  while (n) {
+    _put(digits[--n]);
+  }
+}
+
+/**
+ * Write value * 10^-decimals, dropping trailing zeros of the fraction
+ */
+void MetricsWriter::_fixed(uint64_t value, uint8_t decimals) {
+  uint64_t scale = 1;
+  for (uint8_t i = 0; i < decimals; i++) {
+    scale *= 10;
+  }
+
+  _unsigned(value / scale);
+
+  uint64_t fraction = value % scale;
+  if (!fraction) {
+    return;
+  }
+  while (fraction % 10 == 0) {
+    fraction /= 10;
+    decimals--;
+  }
+
+  char digits[20];
+  for (uint8_t i = decimals; i > 0; i--) {
+    digits[i - 1] = (char)('0' + fraction % 10);
+    fraction /= 10;
+  }
+  _put('.');
+  for (uint8_t i = 0; i < decimals; i++) {
+    _put(digits[i]);
+  }
+}
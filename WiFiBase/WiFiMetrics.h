@@ -0,0 +1,124 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Metrics collection and rendering in the Prometheus text format.
+ *
+ * Design:
+ *   Metrics are plain counters and fixed-bucket histograms kept alongside the
+ * state they describe, such as per-network connect statistics.  They are only
+ * formatted when scraped, streaming through a small buffer into an OutputSink
+ * so that rendering makes no allocations.  Times are recorded in integer
+ * milliseconds or microseconds and written as seconds.
+ */
+
+#ifndef WIFIMETRICS_H
+#define WIFIMETRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "OutputSink.h"
+
+#define WFB_HISTOGRAM_BOUNDS 8
+
+typedef struct {
+  uint32_t buckets[WFB_HISTOGRAM_BOUNDS + 1]; // Last counts values above every bound
+  uint32_t count;
+  uint64_t sum;
+} metrics_histogram_t;
+
+/* Ascending upper bounds of histogram buckets */
+typedef struct {
+  uint32_t bounds[WFB_HISTOGRAM_BOUNDS];
+  uint8_t  count;
+  uint8_t  decimals;  // Values are in units of 10^-decimals seconds
+} metrics_buckets_t;
+
+extern const metrics_buckets_t WFB_CONNECT_BUCKETS;  // ms
+extern const metrics_buckets_t WFB_LATENCY_BUCKETS;  // us
+
+/* HTTP requests served by a route */
+typedef struct {
+  uint32_t            requests;
+  metrics_histogram_t latency;
+} metrics_route_t;
+
+/* Counter maintained elsewhere and read when rendered */
+typedef struct {
+  const char     *name;
+  const char     *help;
+  const uint32_t *value;
+} metrics_counter_t;
+
+/* Accumulated time spent connected */
+class ConnectedTime {
+  public:
+    ConnectedTime();
+
+    /* Record the connection state, called whenever it changes */
+    void update(bool connected, unsigned long now);
+
+    unsigned long connectedMs(unsigned long now);
+
+  protected:
+    bool _connected;
+    unsigned long _since;
+    unsigned long _totalMs;
+};
+
+class MetricsWriter {
+  public:
+    static const size_t BUFFER_SIZE = 256;
+
+    MetricsWriter(OutputSink *sink);
+
+    /* Add a value to a histogram */
+    static void observe(metrics_histogram_t *histogram,
+                        const metrics_buckets_t *buckets, uint32_t value);
+
+    /* Write the help and type of a metric family */
+    void family(const char *name, const char *type, const char *help);
+
+    /* Write a sample, with an optional label */
+    void sample(const char *name, unsigned long value,
+                const char *label = nullptr, const char *labelValue = nullptr);
+    void sample(const char *name, long value,
+                const char *label = nullptr, const char *labelValue = nullptr);
+
+    /* Write a sample scaled by 10^-decimals, such as milliseconds as seconds */
+    void sampleFixed(const char *name, uint64_t value, uint8_t decimals,
+                     const char *label = nullptr,
+                     const char *labelValue = nullptr);
+
+    /* Write the cumulative buckets, sum and count of a histogram */
+    void histogram(const char *name, const metrics_histogram_t *histogram,
+                   const metrics_buckets_t *buckets,
+                   const char *label = nullptr,
+                   const char *labelValue = nullptr);
+
+    /* Pass any buffered output to the sink */
+    void flush();
+
+    /* Total bytes written */
+    size_t bytes();
+
+  protected:
+    OutputSink *_sink;
+    char _buffer[BUFFER_SIZE];
+    size_t _used;
+    size_t _bytes;
+
+    void _put(char c);
+    void _put(const char *str);
+    void _name(const char *name, const char *suffix, const char *label,
+               const char *labelValue);
+    void _bucket(const char *name, const char *label, const char *labelValue);
+    void _label(const char *label, const char *labelValue);
+    void _escaped(const char *str);
+    void _unsigned(uint64_t value);
+    void _fixed(uint64_t value, uint8_t decimals);
+};
+
+#endif // WIFIMETRICS_H
@@ -0,0 +1,200 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef ARDUINO
+  #include <Arduino.h>
+  #include <lwip/sockets.h>
+#else
+  #include <fcntl.h>
+  #include <unistd.h>
+  #include <arpa/inet.h>
+  #include <netinet/in.h>
+  #include <sys/socket.h>
+#endif
+
+#include "WiFiPortal.h"
+
+#define DNS_HEADER_SIZE 12
+#define DNS_FLAG_QR     0x80  // In the first flags byte
+#define DNS_FLAG_AA     0x04
+#define DNS_FLAG_RD     0x01
+#define DNS_OPCODE(b)   (((b) >> 3) & 0x0F)
+#define DNS_TYPE_A      1
+#define DNS_TYPE_ANY    255
+#define DNS_CLASS_IN    1
+
+WiFiPortal::WiFiPortal(uint16_t port) {
+  _port = port;
+  _fd = -1;
+  _ip = 0;
+  _address[0] = '\0';
+  _location[0] = '\0';
+  _queries = 0;
+}
+
+WiFiPortal::~WiFiPortal() {
+  stop();
+}
+
+/**
+ * Start answering DNS queries
+ * @return false if the port is unavailable
+ */
+bool WiFiPortal::begin(uint32_t ip) {
+  struct sockaddr_in addr;
+  int one = 1;
+
+  if (_fd >= 0) {
+    return true;
+  }
+
+  _fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (_fd < 0) {
+    return false;
+  }
+  setsockopt(_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+
+  memset(&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(_port);
+  if (bind(_fd, (struct sockaddr *)&addr, sizeof (addr)) < 0) {
+    stop();
+    return false;
+  }
+  fcntl(_fd, F_SETFL, fcntl(_fd, F_GETFL, 0) | O_NONBLOCK);
+
+  if (_port == 0) {
+    socklen_t len = sizeof (addr);
+    getsockname(_fd, (struct sockaddr *)&addr, &len);
+    _port = ntohs(addr.sin_port);
+  }
+
+  _ip = ip;
+  const uint8_t *bytes = (const uint8_t *)&_ip;
+  snprintf(_address, sizeof (_address), "%u.%u.%u.%u",
+           bytes[0], bytes[1], bytes[2], bytes[3]);
+  snprintf(_location, sizeof (_location), "http://%s/", _address);
+  return true;
+}
+
+void WiFiPortal::stop() {
+  if (_fd >= 0) {
+    close(_fd);
+    _fd = -1;
+  }
+}
+
+bool WiFiPortal::active() {
+  return (_fd >= 0);
+}
+
+uint16_t WiFiPortal::port() {
+  return _port;
+}
+
+void WiFiPortal::handle() {
+  uint8_t packet[MAX_PACKET];
+  struct sockaddr_in from;
+
+  if (_fd < 0) {
+    return;
+  }
+
+  for (uint8_t i = 0; i < MAX_QUERIES; i++) {
+    socklen_t fromLen = sizeof (from);
+    int result = recvfrom(_fd, packet, sizeof (packet), 0,
+                          (struct sockaddr *)&from, &fromLen);
+    if (result <= 0) {
+      return;
+    }
+
+    size_t length = _answer(packet, result);
+    if (length) {
+      sendto(_fd, packet, length, 0, (struct sockaddr *)&from, fromLen);
+      _queries++;
+    }
+  }
+}
+
+/**
+ * Anything other than the portal's own address is captured, while requests
+ * without a host are served as they are
+ */
+bool WiFiPortal::captures(const char *host) {
+  if (_fd < 0 || !host || !host[0]) {
+    return false;
+  }
+
+  size_t length = strlen(_address);
+  return !(strncmp(host, _address, length) == 0 &&
+           (host[length] == '\0' || host[length] == ':'));
+}
+
+const char *WiFiPortal::location() {
+  return _location;
+}
+
+uint32_t WiFiPortal::queries() {
+  return _queries;
+}
+
+/**
+ * Turn a query into its answer in place, keeping just the question
+ * @return Length of the answer, 0 if the query is to be dropped
+ */
+size_t WiFiPortal::_answer(uint8_t *packet, size_t length) {
+  if (length < DNS_HEADER_SIZE || (packet[2] & DNS_FLAG_QR) ||
+      DNS_OPCODE(packet[2]) != 0 || packet[4] != 0 || packet[5] != 1) {
+    return 0;
+  }
+
+  /* Walk the name, which is never compressed in a question */
+  size_t offset = DNS_HEADER_SIZE;
+  while (offset < length && packet[offset]) {
+    if (packet[offset] > 63) {
+      return 0;
+    }
+    offset += packet[offset] + 1;
+  }
+  offset++;
+  if (offset + 4 > length) {
+    return 0;
+  }
+  uint16_t type = (packet[offset] << 8) | packet[offset + 1];
+  uint16_t cls = (packet[offset + 2] << 8) | packet[offset + 3];
+  offset += 4;
+
+  bool answered = ((type == DNS_TYPE_A || type == DNS_TYPE_ANY) &&
+                   cls == DNS_CLASS_IN);
+  if (answered && offset + 16 > MAX_PACKET) {
+    return 0;
+  }
+
+  packet[2] = DNS_FLAG_QR | DNS_FLAG_AA | (packet[2] & DNS_FLAG_RD);
+  packet[3] = 0;                  // No error
+  packet[6] = 0;                  // Answers
+  packet[7] = answered ? 1 : 0;
+  memset(&packet[8], 0, 4);       // No authority or additional records
+  if (!answered) {
+    return offset;
+  }
+
+  static const uint8_t answer[] = {
+    0xC0, DNS_HEADER_SIZE,        // The name in the question
+    0x00, DNS_TYPE_A,
+    0x00, DNS_CLASS_IN,
+    (uint8_t)(ANSWER_TTL >> 24), (uint8_t)(ANSWER_TTL >> 16),
+    (uint8_t)(ANSWER_TTL >> 8), (uint8_t)ANSWER_TTL,
+    0x00, 0x04,                   // Address length
+  };
+  memcpy(&packet[offset], answer, sizeof (answer));
+  memcpy(&packet[offset + sizeof (answer)], &_ip, 4);
+  return offset + sizeof (answer) + 4;
+}
@@ -0,0 +1,74 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Captive portal for configuring a network from the access point.
+ *
+ * Design:
+ *   While the portal is open every DNS query from a client of the access
+ * point is answered with the access point's own address, so that whatever
+ * the client's OS or browser asks for reaches WiFiBase's server.  Requests
+ * there for any other host, such as an OS's connectivity check, are
+ * redirected to the portal's page, which the OS then shows as a sign in page.
+ *
+ *   The page itself is served by WiFiBase and drives its existing routes:
+ * networks are listed from the cached background scan behind /scan, and the
+ * chosen one is connected through a /network job, so nothing here blocks and
+ * the server and the application's loop keep running throughout.
+ *
+ *   Only A queries are answered with an address, others get an empty answer
+ * so that clients fall back to IPv4.  Like the server, the responder uses BSD
+ * sockets so it also builds on a host for testing.
+ */
+
+#ifndef WIFIPORTAL_H
+#define WIFIPORTAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+class WiFiPortal {
+  public:
+    static const uint16_t DNS_PORT = 53;
+    static const size_t MAX_PACKET = 512;
+    static const uint32_t ANSWER_TTL = 60;  // s
+    static const uint8_t MAX_QUERIES = 8;   // Answered per handle()
+
+    /* Time the page is left to show the result once connected */
+    static const unsigned long CLOSE_DELAY = 10 * 1000;
+
+    WiFiPortal(uint16_t port = DNS_PORT);
+    ~WiFiPortal();
+
+    /* Answer every name with the address, given in network byte order */
+    bool begin(uint32_t ip);
+    void stop();
+    bool active();
+
+    /* Port listened on, useful when created with port 0 */
+    uint16_t port();
+
+    /* Answer any queries that have arrived, without blocking */
+    void handle();
+
+    /* Whether a request for the host is to be redirected to the portal */
+    bool captures(const char *host);
+
+    /* Where captured requests are redirected to */
+    const char *location();
+
+    uint32_t queries();
+
+  protected:
+    uint16_t _port;
+    int _fd;
+    uint32_t _ip;
+    char _address[16];
+    char _location[24];
+    uint32_t _queries;
+
+    size_t _answer(uint8_t *packet, size_t length);
+};
+
+#endif // WIFIPORTAL_H
@@ -0,0 +1,113 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ */
+
+#include <string.h>
+
+#include "WiFiRoamer.h"
+
+WiFiRoamer::WiFiRoamer() {
+  configure(DEFAULT_HYSTERESIS, DEFAULT_SCAN_THRESHOLD,
+            DEFAULT_SAMPLE_INTERVAL, DEFAULT_SCAN_INTERVAL);
+  reset(nullptr, 0, 0);
+}
+
+void WiFiRoamer::configure(uint8_t hysteresisDb, int8_t scanThresholdDbm,
+                           unsigned long sampleIntervalMs,
+                           unsigned long scanIntervalMs) {
+  _hysteresis = hysteresisDb;
+  _scanThreshold = scanThresholdDbm;
+  _sampleInterval = sampleIntervalMs;
+  _scanInterval = scanIntervalMs;
+}
+
+void WiFiRoamer::reset(const uint8_t *bssid, int32_t rssi, unsigned long now) {
+  if (bssid) {
+    memcpy(_bssid, bssid, WFB_BSSID_LEN);
+  } else {
+    memset(_bssid, 0, WFB_BSSID_LEN);
+  }
+  _average = (int16_t)(rssi * 4);
+  _lastSample = now;
+  _lastScan = now;
+  _scanned = false;
+  _haveCandidate = false;
+}
+
+bool WiFiRoamer::sampleDue(unsigned long now) {
+  return (now - _lastSample >= _sampleInterval);
+}
+
+/**
+ * Add an RSSI sample to the moving average, weighting new samples by 1/4
+ */
+void WiFiRoamer::sample(int32_t rssi, unsigned long now) {
+  _average += (int16_t)(rssi * 4 - _average) / 4;
+  _lastSample = now;
+}
+
+/**
+ * @return Average RSSI of the current access point in dBm
+ */
+int16_t WiFiRoamer::average() {
+  return _average / 4;
+}
+
+/**
+ * A scan is due if the signal is weak and the scan interval has elapsed since
+ * the association or the previous scan.
+ */
+bool WiFiRoamer::scanDue(unsigned long now) {
+  if (average() >= _scanThreshold) {
+    return false;
+  }
+  return (now - _lastScan >= _scanInterval);
+}
+
+void WiFiRoamer::scanStarted(unsigned long now) {
+  _lastScan = now;
+  _scanned = true;
+  _haveCandidate = false;
+}
+
+void WiFiRoamer::consider(const wifi_scan_entry_t *entry,
+                          uint8_t networkIndex) {
+  if (memcmp(entry->bssid, _bssid, WFB_BSSID_LEN) == 0) {
+    /* The scan gives a fresh sample of the current access point */
+    sample(entry->rssi, _lastSample);
+    return;
+  }
+
+  if (networkIndex == INDEX_UNKNOWN) {
+    return;
+  }
+
+  if (_haveCandidate && entry->rssi <= _candidate.rssi) {
+    return;
+  }
+
+  _candidate = *entry;
+  _candidateIndex = networkIndex;
+  _haveCandidate = true;
+}
+
+/**
+ * @return Whether the strongest known network found by the scan beats the
+ *         current access point by the hysteresis
+ */
+bool WiFiRoamer::candidate(wifi_scan_entry_t *entry, uint8_t *networkIndex) {
+  if (!_scanned || !_haveCandidate) {
+    return false;
+  }
+  _scanned = false;
+
+  if (_candidate.rssi < average() + _hysteresis) {
+    return false;
+  }
+
+  *entry = _candidate;
+  *networkIndex = _candidateIndex;
+  return true;
+}
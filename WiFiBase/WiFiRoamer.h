@@ -0,0 +1,77 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Roaming decisions for WiFiBase.
+ *
+ * Design:
+ *   While connected the RSSI of the current access point is sampled at a low
+ * duty cycle and smoothed with a moving average.  When the average falls below
+ * a threshold an occasional background scan is requested, and each network
+ * found is considered as a candidate.  A known network on a different BSSID
+ * whose signal beats the current average by the hysteresis is chosen as the
+ * roaming target.
+ *
+ *   This class only makes decisions, the caller feeds it RSSI samples and scan
+ * results so that it can be tested against scripted traces.
+ */
+
+#ifndef WIFIROAMER_H
+#define WIFIROAMER_H
+
+#include "WiFiDriver.h"
+
+class WiFiRoamer {
+  public:
+    WiFiRoamer();
+
+    static const uint8_t DEFAULT_HYSTERESIS = 10;                   // dB
+    static const int8_t DEFAULT_SCAN_THRESHOLD = -65;               // dBm
+    static const unsigned long DEFAULT_SAMPLE_INTERVAL = 5 * 1000;
+    static const unsigned long DEFAULT_SCAN_INTERVAL = 60 * 1000;
+
+    void configure(uint8_t hysteresisDb, int8_t scanThresholdDbm,
+                   unsigned long sampleIntervalMs,
+                   unsigned long scanIntervalMs);
+
+    /* Restart monitoring for a new association */
+    void reset(const uint8_t *bssid, int32_t rssi, unsigned long now);
+
+    /* RSSI sampling of the current access point */
+    bool sampleDue(unsigned long now);
+    void sample(int32_t rssi, unsigned long now);
+    int16_t average();
+
+    /* Whether a background scan should be started */
+    bool scanDue(unsigned long now);
+    void scanStarted(unsigned long now);
+
+    /*
+     * Consider each result of a completed scan, with the index of the known
+     * network it matches or INDEX_UNKNOWN.
+     */
+    static const uint8_t INDEX_UNKNOWN = (uint8_t)-1;
+    void consider(const wifi_scan_entry_t *entry, uint8_t networkIndex);
+
+    /* Retrieve the chosen target once all results are considered */
+    bool candidate(wifi_scan_entry_t *entry, uint8_t *networkIndex);
+
+  protected:
+    uint8_t _hysteresis;
+    int8_t _scanThreshold;
+    unsigned long _sampleInterval;
+    unsigned long _scanInterval;
+
+    uint8_t _bssid[WFB_BSSID_LEN];
+    int16_t _average;  // dBm * 4
+    unsigned long _lastSample;
+    unsigned long _lastScan;
+    bool _scanned;
+
+    bool _haveCandidate;
+    wifi_scan_entry_t _candidate;
+    uint8_t _candidateIndex;
+};
+
+#endif // WIFIROAMER_H
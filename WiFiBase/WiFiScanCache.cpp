@@ -0,0 +1,119 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ */
+
+#include <stdlib.h>
+
+#include "WiFiScanCache.h"
+
+WiFiScanCache::WiFiScanCache() {
+  _ttl = DEFAULT_TTL;
+  _scanning = false;
+  _ready = false;
+  _timestamp = 0;
+  _generation = 0;
+  _entries = nullptr;
+  _count = 0;
+  _allocated = 0;
+}
+
+WiFiScanCache::~WiFiScanCache() {
+  free(_entries);
+}
+
+void WiFiScanCache::setTtlMs(unsigned long ms) {
+  _ttl = ms;
+}
+
+bool WiFiScanCache::start(WiFiDriver *driver) {
+  if (_scanning) {
+    return true;
+  }
+  _scanning = driver->scanStart(true);
+  return _scanning;
+}
+
+bool WiFiScanCache::poll(WiFiDriver *driver, unsigned long now) {
+  if (!_scanning) {
+    return false;
+  }
+
+  int16_t result = driver->scanComplete();
+  if (result == WFB_SCAN_RUNNING) {
+    return false;
+  }
+
+  _scanning = false;
+  if (result == WFB_SCAN_FAILED) {
+    return false;
+  }
+
+  store(driver, result, now);
+  return true;
+}
+
+/**
+ * Copy scan results from the driver, reusing the entry array when it is large
+ * enough, and release the driver's copy.
+ */
+void WiFiScanCache::store(WiFiDriver *driver, int16_t count, unsigned long now) {
+  if (count < 0) {
+    count = 0;
+  }
+
+  if (count > _allocated) {
+    wifi_scan_entry_t *entries =
+            (wifi_scan_entry_t *)realloc(_entries, sizeof (wifi_scan_entry_t) * count);
+    if (!entries) {
+      count = _allocated;
+    } else {
+      _entries = entries;
+      _allocated = count;
+    }
+  }
+
+  _count = 0;
+  for (int16_t i = 0; i < count; i++) {
+    if (driver->scanResult(i, &_entries[_count])) {
+      _count++;
+    }
+  }
+  driver->scanDelete();
+
+  _timestamp = now;
+  _ready = true;
+  _generation++;
+}
+
+bool WiFiScanCache::scanning() {
+  return _scanning;
+}
+
+bool WiFiScanCache::ready() {
+  return _ready;
+}
+
+bool WiFiScanCache::fresh(unsigned long now) {
+  return (_ready && age(now) < _ttl);
+}
+
+unsigned long WiFiScanCache::age(unsigned long now) {
+  return now - _timestamp;
+}
+
+uint16_t WiFiScanCache::count() {
+  return _count;
+}
+
+const wifi_scan_entry_t *WiFiScanCache::entry(uint16_t i) {
+  if (i >= _count) {
+    return nullptr;
+  }
+  return &_entries[i];
+}
+
+uint32_t WiFiScanCache::generation() {
+  return _generation;
+}
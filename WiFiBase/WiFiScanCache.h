@@ -0,0 +1,61 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Shared cache of WiFi scan results.
+ *
+ * Design:
+ *   Scans are run asynchronously and their results copied into the cache when
+ * they complete, so that nothing waits on the radio.  The /scan endpoint, the
+ * roaming monitor and scan-before-connect all read from the same cache, and
+ * only start a new scan once the cached results are older than the TTL.
+ */
+
+#ifndef WIFISCANCACHE_H
+#define WIFISCANCACHE_H
+
+#include "WiFiDriver.h"
+
+class WiFiScanCache {
+  public:
+    WiFiScanCache();
+    ~WiFiScanCache();
+
+    static const unsigned long DEFAULT_TTL = 30 * 1000;
+
+    void setTtlMs(unsigned long ms);
+
+    /* Start an asynchronous scan unless one is already running */
+    bool start(WiFiDriver *driver);
+
+    /* Check for completion of a running scan, returns true if it completed */
+    bool poll(WiFiDriver *driver, unsigned long now);
+
+    /* Copy the results of a completed full scan into the cache */
+    void store(WiFiDriver *driver, int16_t count, unsigned long now);
+
+    bool scanning();
+    bool ready();
+    bool fresh(unsigned long now);
+    unsigned long age(unsigned long now);
+
+    uint16_t count();
+    const wifi_scan_entry_t *entry(uint16_t i);
+
+    /* Incremented each time new results are stored */
+    uint32_t generation();
+
+  protected:
+    unsigned long _ttl;
+    bool _scanning;
+    bool _ready;
+    unsigned long _timestamp;
+    uint32_t _generation;
+
+    wifi_scan_entry_t *_entries;
+    uint16_t _count;
+    uint16_t _allocated;
+};
+
+#endif // WIFISCANCACHE_H
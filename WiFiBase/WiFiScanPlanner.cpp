@@ -0,0 +1,162 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ */
+
+#include <string.h>
+
+#include "WiFiScanPlanner.h"
+
+WiFiScanPlanner::WiFiScanPlanner() {
+  configure(DEFAULT_ACTIVE_DWELL, DEFAULT_PASSIVE_DWELL, false);
+  _numChannels = 0;
+  _nextChannel = 0;
+  _fullDone = true;
+  _numMatches = 0;
+  memset(_ignored, 0, sizeof (_ignored));
+}
+
+void WiFiScanPlanner::configure(uint16_t activeDwellMs,
+                                uint16_t passiveDwellMs, bool passive) {
+  _activeDwell = activeDwellMs;
+  _passiveDwell = passiveDwellMs;
+  _passive = passive;
+}
+
+/**
+ * Order the channels the known networks were last seen on by the number of
+ * networks seen on each, most first, with ties going to the channel of the
+ * earlier known network.
+ */
+void WiFiScanPlanner::plan(struct network *networks, uint8_t count) {
+  uint8_t perChannel[MAX_CHANNELS + 1];
+  memset(perChannel, 0, sizeof (perChannel));
+
+  _numChannels = 0;
+  for (uint8_t i = 0; i < count; i++) {
+    uint8_t channel = networks[i].lastChannel;
+    if (!channel || channel > MAX_CHANNELS) {
+      continue;
+    }
+    if (!perChannel[channel]) {
+      _channels[_numChannels++] = channel;
+    }
+    if (perChannel[channel] < 0xFF) {
+      perChannel[channel]++;
+    }
+  }
+
+  /* Stable insertion sort by network count */
+  for (uint8_t i = 1; i < _numChannels; i++) {
+    uint8_t channel = _channels[i];
+    uint8_t j = i;
+    for (; j > 0 && perChannel[_channels[j - 1]] < perChannel[channel]; j--) {
+      _channels[j] = _channels[j - 1];
+    }
+    _channels[j] = channel;
+  }
+
+  _nextChannel = 0;
+  _fullDone = false;
+  _numMatches = 0;
+  memset(_ignored, 0, sizeof (_ignored));
+}
+
+void WiFiScanPlanner::ignore(uint8_t index) {
+  _ignored[index / 32] |= (uint32_t)1 << (index % 32);
+}
+
+bool WiFiScanPlanner::next(wifi_scan_step_t *step) {
+  if (found()) {
+    return false;
+  }
+
+  step->passive = _passive;
+  step->dwellMs = _passive ? _passiveDwell : _activeDwell;
+
+  if (_nextChannel < _numChannels) {
+    step->channel = _channels[_nextChannel++];
+    return true;
+  }
+
+  if (!_fullDone) {
+    /* No known network on its last channel, widen to every channel */
+    _fullDone = true;
+    step->channel = 0;
+    return true;
+  }
+
+  return false;
+}
+
+void WiFiScanPlanner::consider(const wifi_scan_entry_t *entry,
+                               struct network *networks, uint8_t count) {
+  uint8_t index;
+
+  if (!entry->ssid[0]) {
+    /* Hidden networks can't be matched */
+    return;
+  }
+
+  for (index = 0; index < count; index++) {
+    if (strcmp(networks[index].ssid, entry->ssid) == 0) {
+      break;
+    }
+  }
+  if (index == count) {
+    return;
+  }
+
+  networks[index].lastChannel = entry->channel;
+  if (_ignored[index / 32] & ((uint32_t)1 << (index % 32))) {
+    return;
+  }
+
+  /* Replace an existing weaker match, or insert in order of signal */
+  uint8_t i;
+  for (i = 0; i < _numMatches; i++) {
+    if (_matches[i].index == index) {
+      if (_matches[i].entry.rssi >= entry->rssi) {
+        return;
+      }
+      memmove(&_matches[i], &_matches[i + 1],
+              sizeof (wifi_scan_match_t) * (_numMatches - i - 1));
+      _numMatches--;
+      break;
+    }
+  }
+
+  for (i = _numMatches; i > 0 && _matches[i - 1].entry.rssi < entry->rssi; i--) {
+    if (i < MAX_MATCHES) {
+      _matches[i] = _matches[i - 1];
+    }
+  }
+  if (i >= MAX_MATCHES) {
+    return;
+  }
+  _matches[i].index = index;
+  _matches[i].entry = *entry;
+  if (_numMatches < MAX_MATCHES) {
+    _numMatches++;
+  }
+}
+
+bool WiFiScanPlanner::found() {
+  return (_numMatches > 0);
+}
+
+uint8_t WiFiScanPlanner::numChannels() {
+  return _numChannels;
+}
+
+uint8_t WiFiScanPlanner::numMatches() {
+  return _numMatches;
+}
+
+const wifi_scan_match_t *WiFiScanPlanner::match(uint8_t i) {
+  if (i >= _numMatches) {
+    return nullptr;
+  }
+  return &_matches[i];
+}
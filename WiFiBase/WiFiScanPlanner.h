@@ -0,0 +1,89 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Planning of channel-restricted scans for WiFiBase's known networks.
+ *
+ * Design:
+ *   Each known network remembers the channel it was last seen on.  Rather than
+ * sweeping every channel, the planner first probes only those channels, with
+ * the channels holding the most known networks first.  Only if none of them
+ * finds a known network does the plan widen to a full scan.
+ *
+ *   The planner is given the result of each scan step and keeps the strongest
+ * sighting of each known network, which can then be connected to directly.
+ * Networks that are not to be attempted, such as those in a failure cooldown,
+ * can be ignored so that finding them doesn't end the plan.
+ */
+
+#ifndef WIFISCANPLANNER_H
+#define WIFISCANPLANNER_H
+
+#include "WiFiConnector.h"
+
+/* A single scan of the plan, channel 0 being a full scan */
+typedef struct {
+  uint8_t  channel;
+  bool     passive;
+  uint16_t dwellMs;
+} wifi_scan_step_t;
+
+/* A known network found by a scan */
+typedef struct {
+  uint8_t           index;
+  wifi_scan_entry_t entry;
+} wifi_scan_match_t;
+
+class WiFiScanPlanner {
+  public:
+    WiFiScanPlanner();
+
+    static const uint8_t MAX_CHANNELS = 14;
+    static const uint8_t MAX_MATCHES = 8;
+    static const uint16_t DEFAULT_ACTIVE_DWELL = 120;   // ms per channel
+    static const uint16_t DEFAULT_PASSIVE_DWELL = 360;  // ms per channel
+
+    void configure(uint16_t activeDwellMs, uint16_t passiveDwellMs,
+                   bool passive);
+
+    /* Build a plan from the channels the networks were last seen on */
+    void plan(struct network *networks, uint8_t count);
+
+    /* Don't match a network in the current plan, though its channel is noted */
+    void ignore(uint8_t index);
+
+    /* Get the next scan to perform, false once the plan is finished */
+    bool next(wifi_scan_step_t *step);
+
+    /*
+     * Consider a scan result, recording the channel of any known network and
+     * keeping the strongest sighting of each.
+     */
+    void consider(const wifi_scan_entry_t *entry, struct network *networks,
+                  uint8_t count);
+
+    bool found();
+    uint8_t numChannels();
+    uint8_t numMatches();
+
+    /* Matches ordered from strongest to weakest */
+    const wifi_scan_match_t *match(uint8_t i);
+
+  protected:
+    uint16_t _activeDwell;
+    uint16_t _passiveDwell;
+    bool _passive;
+
+    uint8_t _channels[MAX_CHANNELS];
+    uint8_t _numChannels;
+    uint8_t _nextChannel;
+    bool _fullDone;
+
+    wifi_scan_match_t _matches[MAX_MATCHES];
+    uint8_t _numMatches;
+
+    uint32_t _ignored[256 / 32];  // Bit per network index
+};
+
+#endif // WIFISCANPLANNER_H
@@ -0,0 +1,51 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ */
+
+#include "WiFiServiceScheduler.h"
+
+WiFiServiceScheduler::WiFiServiceScheduler() {
+  configure(DEFAULT_INTERVAL, DEFAULT_BUSY_INTERVAL);
+  _nextAt = 0;
+  _passes = 0;
+  _overruns = 0;
+}
+
+void WiFiServiceScheduler::configure(unsigned long intervalMs,
+                                     unsigned long busyIntervalMs) {
+  _intervalMs = intervalMs;
+  _busyIntervalMs = (busyIntervalMs < intervalMs) ? busyIntervalMs : intervalMs;
+}
+
+unsigned long WiFiServiceScheduler::interval() {
+  return _intervalMs;
+}
+
+bool WiFiServiceScheduler::due(unsigned long now) {
+  return ((long)(now - _nextAt) >= 0);
+}
+
+unsigned long WiFiServiceScheduler::wait(unsigned long now) {
+  return due(now) ? 0 : _nextAt - now;
+}
+
+void WiFiServiceScheduler::serviced(unsigned long start, unsigned long end,
+                                    bool busy) {
+  _passes++;
+  _nextAt = start + (busy ? _busyIntervalMs : _intervalMs);
+  if ((long)(end - _nextAt) > 0) {
+    /* Start the next interval from the end of the overrunning pass */
+    _overruns++;
+    _nextAt = end + (busy ? _busyIntervalMs : _intervalMs);
+  }
+}
+
+uint32_t WiFiServiceScheduler::passes() {
+  return _passes;
+}
+
+uint32_t WiFiServiceScheduler::overruns() {
+  return _overruns;
+}
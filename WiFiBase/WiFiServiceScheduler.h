@@ -0,0 +1,49 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Scheduling of WiFiBase's background servicing.
+ *
+ * Design:
+ *   When WiFiBase services its server from its own task, passes are made at a
+ * fixed interval while idle.  After a pass that handled a request the next
+ * pass is made after a much shorter interval, so that queued requests and the
+ * remainder of a client's exchange are served promptly.  A pass that overruns
+ * the interval pushes the next one back rather than causing a burst of passes.
+ */
+
+#ifndef WIFISERVICESCHEDULER_H
+#define WIFISERVICESCHEDULER_H
+
+#include <stdint.h>
+
+class WiFiServiceScheduler {
+  public:
+    WiFiServiceScheduler();
+
+    static const unsigned long DEFAULT_INTERVAL = 10;     // ms
+    static const unsigned long DEFAULT_BUSY_INTERVAL = 1; // ms
+
+    void configure(unsigned long intervalMs, unsigned long busyIntervalMs);
+    unsigned long interval();
+
+    /* Whether a pass is due, and the time until it is */
+    bool due(unsigned long now);
+    unsigned long wait(unsigned long now);
+
+    /* Record a pass made from start to end, and if it did any work */
+    void serviced(unsigned long start, unsigned long end, bool busy);
+
+    uint32_t passes();
+    uint32_t overruns();
+
+  protected:
+    unsigned long _intervalMs;
+    unsigned long _busyIntervalMs;
+    unsigned long _nextAt;
+    uint32_t _passes;
+    uint32_t _overruns;
+};
+
+#endif // WIFISERVICESCHEDULER_H
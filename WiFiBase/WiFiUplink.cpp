@@ -0,0 +1,288 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ */
+
+#include <string.h>
+
+#include "WiFiUplink.h"
+#include "WiFiScanCache.h"
+
+WiFiUplink::WiFiUplink(WiFiDriver *driver, WiFiConnector *connector) {
+  _driver = driver;
+  _connector = connector;
+  configure(DEFAULT_RETRY_MIN, DEFAULT_RETRY_MAX, true);
+
+  _apActive = false;
+  _channel = 0;
+  _forwarding = false;
+  _forwardFailed = false;
+
+  _state = WFB_UPLINK_OFF;
+  _index = INDEX_NONE;
+  _next = 0;
+  _retryAt = 0;
+  _backoff = _retryMin;
+
+  _attempts = 0;
+  _channelMoves = 0;
+}
+
+void WiFiUplink::configure(unsigned long retryMinMs, unsigned long retryMaxMs,
+                           bool forward) {
+  _retryMin = retryMinMs;
+  _retryMax = (retryMaxMs < retryMinMs) ? retryMinMs : retryMaxMs;
+  _forward = forward;
+  _forwardFailed = false;
+}
+
+/**
+ * Pick the channel the upstream is most likely to be found on, so that the
+ * access point isn't moved when the station associates.
+ *
+ * @return Channel to start the access point on
+ */
+uint8_t WiFiUplink::chooseChannel(struct network *networks, uint8_t count,
+                                  WiFiScanCache *cache) {
+  /* The strongest access point of the most preferred network seen */
+  if (cache) {
+    for (uint8_t i = 0; i < count; i++) {
+      const wifi_scan_entry_t *best = nullptr;
+      if (networks[i].ssid[0] == '\0') {
+        continue;  // The SDK's stored network, named only by the SDK
+      }
+      for (uint16_t j = 0; j < cache->count(); j++) {
+        const wifi_scan_entry_t *entry = cache->entry(j);
+        if (strcmp(entry->ssid, networks[i].ssid) == 0 &&
+            (!best || entry->rssi > best->rssi)) {
+          best = entry;
+        }
+      }
+      if (best) {
+        return best->channel;
+      }
+    }
+  }
+
+  for (uint8_t i = 0; i < count; i++) {
+    if (networks[i].lastChannel) {
+      return networks[i].lastChannel;
+    }
+  }
+
+  return DEFAULT_CHANNEL;
+}
+
+/**
+ * Start the access point, leaving the station as it is
+ * @return Whether the access point was started
+ */
+bool WiFiUplink::startAccessPoint(const char *ssid, const char *passwd,
+                                  uint8_t channel) {
+  if (!_driver->softAP(ssid, passwd, channel ? channel : DEFAULT_CHANNEL)) {
+    return false;
+  }
+
+  _apActive = true;
+  _channel = _driver->softAPChannel();
+  _updateForwarding();
+  return true;
+}
+
+void WiFiUplink::stopAccessPoint() {
+  if (!_apActive) {
+    return;
+  }
+
+  _apActive = false;
+  _updateForwarding();
+  _driver->softAPdisconnect();
+  _channel = 0;
+}
+
+bool WiFiUplink::accessPointActive() {
+  return _apActive;
+}
+
+uint8_t WiFiUplink::channel() {
+  return _channel;
+}
+
+void WiFiUplink::begin(unsigned long now) {
+  if (_state != WFB_UPLINK_OFF) {
+    return;
+  }
+
+  _state = (_driver->status() == WFB_STATUS_CONNECTED) ?
+           WFB_UPLINK_CONNECTED : WFB_UPLINK_WAITING;
+  _next = 0;
+  _retryAt = now;
+  _backoff = _retryMin;
+  _updateForwarding();
+}
+
+void WiFiUplink::end() {
+  _state = WFB_UPLINK_OFF;
+  _index = INDEX_NONE;
+  _updateForwarding();
+}
+
+void WiFiUplink::connected(uint8_t index) {
+  _index = index;
+  if (_state == WFB_UPLINK_OFF) {
+    return;
+  }
+
+  _state = WFB_UPLINK_CONNECTED;
+  _backoff = _retryMin;
+  _updateForwarding();
+}
+
+void WiFiUplink::defer(unsigned long now) {
+  if (_state != WFB_UPLINK_CONNECTING) {
+    return;
+  }
+
+  _state = WFB_UPLINK_WAITING;
+  _next = _index;
+  _index = INDEX_NONE;
+  _retryAt = now;
+}
+
+bool WiFiUplink::poll(struct network *networks, uint8_t count,
+                      unsigned long now) {
+  bool changed = false;
+
+  switch (_state) {
+    case WFB_UPLINK_OFF:
+      return false;
+
+    case WFB_UPLINK_CONNECTED:
+      if (_driver->status() != WFB_STATUS_CONNECTED) {
+        _lost(now);
+        changed = true;
+      }
+      break;
+
+    case WFB_UPLINK_CONNECTING: {
+      wifi_attempt_t result = _connector->checkConnect();
+      if (result == WFB_ATTEMPT_CONNECTED) {
+        _state = WFB_UPLINK_CONNECTED;
+        _backoff = _retryMin;
+        changed = true;
+      } else if (result == WFB_ATTEMPT_FAILED) {
+        /* Move straight on to the next network of the round */
+        _state = WFB_UPLINK_WAITING;
+        _index = INDEX_NONE;
+        _retryAt = now;
+      }
+      break;
+    }
+
+    case WFB_UPLINK_WAITING:
+      if ((long)(now - _retryAt) >= 0) {
+        _attempt(networks, count, now);
+      }
+      break;
+  }
+
+  /* The access point follows the station to its channel */
+  if (_apActive) {
+    uint8_t channel = _driver->softAPChannel();
+    if (channel && channel != _channel) {
+      _channel = channel;
+      _channelMoves++;
+      changed = true;
+    }
+  }
+
+  _updateForwarding();
+  return changed;
+}
+
+void WiFiUplink::_lost(unsigned long now) {
+  _state = WFB_UPLINK_WAITING;
+  _index = INDEX_NONE;
+  _next = 0;
+  _retryAt = now;
+  _backoff = _retryMin;
+}
+
+/**
+ * Start an attempt on the next network of the round that isn't penalized, or
+ * once the round is done wait out the backoff before starting another
+ */
+void WiFiUplink::_attempt(struct network *networks, uint8_t count,
+                          unsigned long now) {
+  while (_next < count && _connector->penalized(&networks[_next])) {
+    _next++;
+  }
+
+  if (_next >= count) {
+    _next = 0;
+    _retryAt = now + _backoff;
+    _backoff = (_backoff > _retryMax / 2) ? _retryMax : _backoff * 2;
+    return;
+  }
+
+  _index = _next++;
+  _connector->startConnect(&networks[_index]);
+  _attempts++;
+  _state = WFB_UPLINK_CONNECTING;
+}
+
+/**
+ * Forward only while both interfaces are up, giving up for good if the driver
+ * can't
+ */
+void WiFiUplink::_updateForwarding() {
+  bool forwarding = (_forward && !_forwardFailed && _apActive &&
+                     _state == WFB_UPLINK_CONNECTED);
+  if (forwarding == _forwarding) {
+    return;
+  }
+
+  if (!_driver->forward(forwarding)) {
+    _forwardFailed = true;
+    return;
+  }
+  _forwarding = forwarding;
+}
+
+wifi_uplink_t WiFiUplink::state() {
+  return _state;
+}
+
+uint8_t WiFiUplink::index() {
+  return _index;
+}
+
+bool WiFiUplink::forwarding() {
+  return _forwarding;
+}
+
+unsigned long WiFiUplink::retryIn(unsigned long now) {
+  if (_state != WFB_UPLINK_WAITING || (long)(now - _retryAt) >= 0) {
+    return 0;
+  }
+  return _retryAt - now;
+}
+
+uint32_t WiFiUplink::attempts() {
+  return _attempts;
+}
+
+uint32_t WiFiUplink::channelMoves() {
+  return _channelMoves;
+}
+
+const char *WiFiUplink::stateString(uint8_t state) {
+  switch (state) {
+    case WFB_UPLINK_OFF:        return "off";
+    case WFB_UPLINK_WAITING:    return "waiting";
+    case WFB_UPLINK_CONNECTING: return "connecting";
+    case WFB_UPLINK_CONNECTED:  return "connected";
+  }
+  return "unknown";
+}
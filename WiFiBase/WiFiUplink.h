@@ -0,0 +1,132 @@
+/*
+ * Author: Adam Phelps
+ * License: MIT
+ * Copyright: 2018
+ *
+ * Concurrent access point and station operation for hub nodes.
+ *
+ * Design:
+ *   A hub keeps its access point up for local nodes while its station
+ * connects to an upstream network whenever one is available.  The radio has a
+ * single channel shared by both interfaces, so when the station associates the
+ * SDK moves the access point to the upstream's channel and every local node
+ * has to find it again.  To avoid that the access point is started on the
+ * channel the upstream is expected on: that of the first known network seen by
+ * the latest scan, else the channel a known network was last connected or seen
+ * on, else DEFAULT_CHANNEL.  Any move that does still happen is detected and
+ * counted.
+ *
+ *   The station is maintained without ever stopping the access point.  Once
+ * the upstream is lost the known networks are attempted in order, one
+ * non-blocking attempt at a time, skipping those penalized by the connector.
+ * An undirected attempt sweeps every channel and takes the radio away from the
+ * access point's clients, so after a round of failures the next round is held
+ * off by a retry interval which doubles up to a maximum.
+ *
+ *   While both interfaces are up, traffic from the access point's clients is
+ * forwarded upstream by NAPT where the driver supports it.
+ *
+ *   All radio access goes through a WiFiDriver so that the state machine can
+ * be tested on the host.
+ */
+
+#ifndef WIFIUPLINK_H
+#define WIFIUPLINK_H
+
+#include "WiFiConnector.h"
+
+class WiFiScanCache;
+
+typedef enum {
+  WFB_UPLINK_OFF = 0,     // Not maintained
+  WFB_UPLINK_WAITING,     // Disconnected, until the next attempt is due
+  WFB_UPLINK_CONNECTING,
+  WFB_UPLINK_CONNECTED,
+} wifi_uplink_t;
+
+class WiFiUplink {
+  public:
+    WiFiUplink(WiFiDriver *driver, WiFiConnector *connector);
+
+    static const uint8_t INDEX_NONE = (uint8_t)-1;
+    static const uint8_t DEFAULT_CHANNEL = 1;
+    static const unsigned long DEFAULT_RETRY_MIN = 5 * 1000;
+    static const unsigned long DEFAULT_RETRY_MAX = 5 * 60 * 1000;
+
+    void configure(unsigned long retryMinMs, unsigned long retryMaxMs,
+                   bool forward);
+
+    /*
+     * Channel for the access point, given the known networks in order of
+     * preference and optionally the results of a recent scan
+     */
+    static uint8_t chooseChannel(struct network *networks, uint8_t count,
+                                 WiFiScanCache *cache = nullptr);
+
+    /* The access point, a channel of 0 uses DEFAULT_CHANNEL */
+    bool startAccessPoint(const char *ssid, const char *passwd,
+                          uint8_t channel);
+    void stopAccessPoint();
+    bool accessPointActive();
+    uint8_t channel();
+
+    /* Start or stop maintaining the station's connection */
+    void begin(unsigned long now);
+    void end();
+
+    /* Note a connection made by other means, such as at startup */
+    void connected(uint8_t index);
+
+    /*
+     * Abandon any attempt in progress without touching the radio, as another
+     * connect has been started, retrying its network once idle again
+     */
+    void defer(unsigned long now);
+
+    /*
+     * Progress the station, returning true when it connected or was lost, or
+     * the access point's channel moved.  The networks may change between
+     * calls, but not while an attempt is in progress.
+     */
+    bool poll(struct network *networks, uint8_t count, unsigned long now);
+
+    wifi_uplink_t state();
+    uint8_t index();
+    bool forwarding();
+
+    /* Time until the next attempt is due, while waiting */
+    unsigned long retryIn(unsigned long now);
+
+    uint32_t attempts();
+    uint32_t channelMoves();
+
+    static const char *stateString(uint8_t state);
+
+  protected:
+    WiFiDriver *_driver;
+    WiFiConnector *_connector;
+
+    unsigned long _retryMin;
+    unsigned long _retryMax;
+    bool _forward;
+
+    bool _apActive;
+    uint8_t _channel;
+    bool _forwarding;
+    bool _forwardFailed;
+
+    wifi_uplink_t _state;
+    uint8_t _index;
+    uint8_t _next;             // Next network to attempt in the round
+    unsigned long _retryAt;    // ms
+    unsigned long _backoff;    // ms
+
+    uint32_t _attempts;
+    uint32_t _channelMoves;
+
+    void _lost(unsigned long now);
+    void _attempt(struct network *networks, uint8_t count, unsigned long now);
+    void _updateForwarding();
+};
+
+#endif // WIFIUPLINK_H
@@ -1,12 +1,6 @@
 
 #include <WiFi.h>          //https://github.com/esp8266/Arduino
 
-//needed for library
-#include <FS.h>
-#include <DNSServer.h>
-#include <WebServer.h>
-#include <WiFiManager.h>          //https://github.com/tzapu/WiFiManager
-
 #ifndef DEBUG_LEVEL
   #define DEBUG_LEVEL DEBUG_HIGH
 #endif
@@ -47,12 +41,44 @@ void setup() {
 #endif
 
 #ifdef CONFIG_PORTAL
-  /* The the WiFiBase to generate an access point hosting a config portal */
+  /*
+   * Have the WiFiBase generate an access point hosting a captive config
+   * portal, which is served along with the rest of the server from
+   * checkServer()
+   */
   wfb->useConfigPortal(true);
 #endif
 
   wfb->configureAccessPoint(CONFIG_SSID, CONFIG_PASSWD);
 
+#ifdef CONCURRENT_AP
+  /* Keep the access point up for local nodes while connecting upstream */
+  wfb->useConcurrentAccessPoint(true);
+#endif
+
+#ifdef SERVICE_TASK
+  /* Serve HTTP from WiFiBase's own task rather than from loop() */
+  wfb->setServiceMode(WFB_SERVICE_TASK);
+#endif
+
+#ifdef USE_UPDATES
+  /* Accept firmware pushed with wfbota.py */
+  wfb->useUpdates(true);
+#endif
+
+#ifdef DISTRIBUTE_UPDATES
+  /* Serve this firmware to nodes that join the access point */
+  wfb->distributeUpdates(true);
+#endif
+
+#ifdef GOSSIP_UPDATES
+  /*
+   * Pass newer firmware between nodes, pushing it to any one of them.  The
+   * version must be raised with each build.
+   */
+  wfb->gossipUpdates(true, GOSSIP_UPDATES);
+#endif
+
   wfb->startup();
 }
 
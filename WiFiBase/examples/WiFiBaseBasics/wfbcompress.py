@@ -0,0 +1,89 @@
+#!/usr/bin/python
+#
+# Compress a firmware image for WiFiBase's LzssDecoder.  Used by
+# wfbota.py --compress, or run alone to write a compressed file.
+#
+# Author: Adam Phelps
+# License: MIT
+# Copyright: 2018
+
+import struct
+import argparse
+
+
+LZSS_MAGIC = 0x5A424657
+
+WINDOW_BITS = 12
+WINDOW = 1 << WINDOW_BITS
+MIN_MATCH = 3
+MAX_MATCH = MIN_MATCH + 15
+CHAIN = 64
+
+
+def compress(image):
+    """Return image compressed with greedy LZSS matching"""
+    out = bytearray(struct.pack("<I", LZSS_MAGIC))
+    chains = {}
+
+    flags_at = 0
+    items = 8
+    i = 0
+    while i < len(image):
+        if items == 8:
+            flags_at = len(out)
+            out.append(0)
+            items = 0
+
+        best = 0
+        distance = 0
+        for candidate in reversed(chains.get(image[i:i + MIN_MATCH], [])):
+            if i - candidate > WINDOW:
+                break
+            n = 0
+            while (n < MAX_MATCH and i + n < len(image) and
+                   image[candidate + n] == image[i + n]):
+                n += 1
+            if n > best:
+                best = n
+                distance = i - candidate
+
+        step = 1
+        if best >= MIN_MATCH:
+            out.extend(struct.pack("<H", (distance - 1) |
+                                   ((best - MIN_MATCH) << WINDOW_BITS)))
+            step = best
+        else:
+            out[flags_at] |= 1 << items
+            out.append(image[i])
+        items += 1
+
+        for j in range(i, i + step):
+            if j + MIN_MATCH <= len(image):
+                chain = chains.setdefault(image[j:j + MIN_MATCH], [])
+                chain.append(j)
+                if len(chain) > CHAIN:
+                    del chain[0]
+        i += step
+
+    return bytes(out)
+
+
+def handle_args():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("image", help="Firmware image")
+    parser.add_argument("compressed", help="Compressed file to write")
+    return parser.parse_args()
+
+
+if __name__ == "__main__":
+    options = handle_args()
+
+    with open(options.image, "rb") as f:
+        image = f.read()
+
+    compressed = compress(image)
+    with open(options.compressed, "wb") as f:
+        f.write(compressed)
+
+    print("%d byte image compressed to %d bytes (%.1f%%)" %
+          (len(image), len(compressed), len(compressed) * 100.0 / len(image)))
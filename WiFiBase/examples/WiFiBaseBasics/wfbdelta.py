@@ -0,0 +1,85 @@
+#!/usr/bin/python
+#
+# Make a delta between two firmware images, as applied by WiFiBase's
+# DeltaDecoder.  Used by wfbota.py --base, or run alone to write a delta file.
+#
+# Author: Adam Phelps
+# License: MIT
+# Copyright: 2018
+
+import struct
+import hashlib
+import argparse
+
+
+DELTA_MAGIC = 0x44424657
+OP_ADD = 0
+OP_COPY = 1
+
+BLOCK = 16
+MIN_COPY = 24
+
+
+def make_delta(base, image):
+    """Return the delta rebuilding image from base"""
+    delta = bytearray(struct.pack("<II", DELTA_MAGIC, len(base)))
+    delta += hashlib.sha256(base).digest()
+
+    index = {}
+    for j in range(0, len(base) - BLOCK + 1, BLOCK):
+        index.setdefault(base[j:j + BLOCK], j)
+
+    def add(start, end):
+        if end > start:
+            delta.extend(struct.pack("<BI", OP_ADD, end - start))
+            delta.extend(image[start:end])
+
+    i = 0
+    added = 0
+    while i + BLOCK <= len(image):
+        j = index.get(image[i:i + BLOCK])
+        if j is not None:
+            back = 0
+            while (i - back > added and j - back > 0 and
+                   image[i - back - 1] == base[j - back - 1]):
+                back += 1
+            forward = BLOCK
+            while (i + forward < len(image) and j + forward < len(base) and
+                   image[i + forward] == base[j + forward]):
+                forward += 1
+
+            if back + forward >= MIN_COPY:
+                add(added, i - back)
+                delta.extend(struct.pack("<BII", OP_COPY, j - back,
+                                         back + forward))
+                i += forward
+                added = i
+                continue
+        i += 1
+    add(added, len(image))
+
+    return bytes(delta)
+
+
+def handle_args():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("base", help="Image running on the nodes")
+    parser.add_argument("image", help="New image")
+    parser.add_argument("delta", help="Delta file to write")
+    return parser.parse_args()
+
+
+if __name__ == "__main__":
+    options = handle_args()
+
+    with open(options.base, "rb") as f:
+        base = f.read()
+    with open(options.image, "rb") as f:
+        image = f.read()
+
+    delta = make_delta(base, image)
+    with open(options.delta, "wb") as f:
+        f.write(delta)
+
+    print("%d byte image as a %d byte delta (%.1f%%)" %
+          (len(image), len(delta), len(delta) * 100.0 / len(image)))
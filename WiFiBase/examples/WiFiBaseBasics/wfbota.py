@@ -0,0 +1,156 @@
+#!/usr/bin/python
+#
+# Push a firmware image to a WiFiBase node with updates enabled
+#
+# Author: Adam Phelps
+# License: MIT
+# Copyright: 2018
+
+import socket
+import struct
+import hashlib
+import argparse
+import sys
+import time
+
+from wfbdelta import make_delta
+from wfbcompress import compress
+
+
+OTA_MAGIC = 0x4F424657
+OTA_VERSION = 1
+OTA_TYPE_FULL = 0
+OTA_TYPE_DELTA = 1
+OTA_TYPE_COMPRESSED = 2
+OTA_FLAG_RESUME = 0x01
+
+HEADER_FORMAT = "<IBBBBII32s"
+REPLY_FORMAT = "<IBBBBI"
+REPLY_LEN = 12
+
+REPLY_STATUS = ["READY", "OK", "BUSY", "ERROR"]
+ERRORS = ["none", "too large", "no memory", "flash", "overrun", "incomplete",
+          "hash mismatch", "activate", "protocol", "timeout", "aborted",
+          "base mismatch"]
+
+DEFAULT_PORT = 3232
+CHUNK_SIZE = 4096
+RETRY_DELAY = 2
+
+
+def handle_args():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("-a", "--address", dest="address", required=True,
+                        help="IP address of the node")
+
+    parser.add_argument("-p", "--port", dest="port", type=int,
+                        help="Port to connect to",
+                        default=DEFAULT_PORT)
+
+    parser.add_argument("-b", "--base", dest="base",
+                        help="Image the node is running, to send a delta "
+                        "against it", default=None)
+
+    parser.add_argument("-z", "--compress", dest="compress",
+                        action="store_true", help="Send the image compressed",
+                        default=False)
+
+    parser.add_argument("-r", "--retries", dest="retries", type=int,
+                        help="Times to reconnect and resume a full image "
+                        "after the connection is lost", default=5)
+
+    parser.add_argument("image", help="Firmware image (.bin) to send")
+
+    return parser.parse_args()
+
+
+def read_reply(sock):
+    data = b""
+    while len(data) < REPLY_LEN:
+        received = sock.recv(REPLY_LEN - len(data))
+        if not received:
+            raise IOError("connection closed")
+        data += received
+
+    (magic, status, error, _, _, offset) = struct.unpack(REPLY_FORMAT, data)
+    if magic != OTA_MAGIC:
+        raise IOError("bad reply")
+    return (status, error, offset)
+
+
+def check_reply(reply, expected):
+    (status, error, offset) = reply
+    if status != expected:
+        name = REPLY_STATUS[status] if status < len(REPLY_STATUS) else status
+        reason = ERRORS[error] if error < len(ERRORS) else error
+        print("Failed: %s (%s) after %d bytes" % (name, reason, offset))
+        sys.exit(1)
+
+
+def send_update(payload, image, ota_type):
+    """Send the payload, from where the node says it got to for a resume"""
+    sock = socket.create_connection((options.address, options.port))
+
+    sock.sendall(struct.pack(HEADER_FORMAT,
+                             OTA_MAGIC,
+                             OTA_VERSION,
+                             ota_type,
+                             OTA_FLAG_RESUME if ota_type == OTA_TYPE_FULL
+                             else 0,
+                             0,                   # Reserved
+                             len(payload),        # Payload size
+                             len(image),          # Image size
+                             hashlib.sha256(image).digest()))
+    reply = read_reply(sock)
+    if reply[0] == REPLY_STATUS.index("BUSY"):
+        # Still handling the connection that was lost
+        raise IOError("node busy")
+    check_reply(reply, REPLY_STATUS.index("READY"))
+
+    start = reply[2]
+    if start:
+        print("Resuming from %d bytes" % start)
+
+    for offset in range(start, len(payload), CHUNK_SIZE):
+        sock.sendall(payload[offset:offset + CHUNK_SIZE])
+        done = min(offset + CHUNK_SIZE, len(payload))
+        sys.stdout.write("\r%d%%" % (done * 100 // len(payload)))
+        sys.stdout.flush()
+    print("")
+
+    check_reply(read_reply(sock), REPLY_STATUS.index("OK"))
+    sock.close()
+
+
+options = handle_args()
+
+with open(options.image, "rb") as f:
+    image = f.read()
+
+payload = image
+ota_type = OTA_TYPE_FULL
+if options.base:
+    with open(options.base, "rb") as f:
+        payload = make_delta(f.read(), image)
+    ota_type = OTA_TYPE_DELTA
+elif options.compress:
+    payload = compress(image)
+    ota_type = OTA_TYPE_COMPRESSED
+
+print("Sending %d bytes for a %d byte image to %s:%d" %
+      (len(payload), len(image), options.address, options.port))
+
+attempt = 0
+while True:
+    try:
+        send_update(payload, image, ota_type)
+        break
+    except (IOError, socket.error) as e:
+        attempt += 1
+        if ota_type != OTA_TYPE_FULL or attempt > options.retries:
+            print("\nFailed: %s" % e)
+            sys.exit(1)
+        print("\nConnection lost (%s), retrying" % e)
+        time.sleep(RETRY_DELAY)
+
+print("Image verified, node is restarting")
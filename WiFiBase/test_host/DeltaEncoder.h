@@ -0,0 +1,109 @@
+/*
+ * Host side generator of deltas for DeltaDecoder, as made by wfbdelta.py.
+ *
+ * The base is indexed by each aligned block, and the new image scanned at
+ * every offset for a block of the base.  Each match found is extended in both
+ * directions and becomes a COPY if long enough to be worth one, with the
+ * bytes between matches sent as ADDs.
+ */
+
+#ifndef DELTAENCODER_H
+#define DELTAENCODER_H
+
+#include <string.h>
+#include <vector>
+
+#include "DeltaDecoder.h"
+
+class DeltaEncoder {
+  public:
+    static const size_t BLOCK = 16;
+    static const size_t MIN_COPY = 24;
+
+    static void encode(const uint8_t *base, size_t baseSize,
+                       const uint8_t *image, size_t size,
+                       std::vector<uint8_t> *delta) {
+      uint8_t sha256[SHA256_DIGEST_SIZE];
+      Sha256 hash;
+      hash.update(base, baseSize);
+      hash.finish(sha256);
+
+      delta->clear();
+      _le32(delta, DELTA_MAGIC);
+      _le32(delta, baseSize);
+      delta->insert(delta->end(), sha256, sha256 + SHA256_DIGEST_SIZE);
+
+      /* Open addressed table of block offsets plus one, 0 when empty */
+      size_t slots = 1;
+      while (slots < 2 * (baseSize / BLOCK + 1)) {
+        slots <<= 1;
+      }
+      std::vector<uint32_t> index(slots, 0);
+      for (size_t i = 0; i + BLOCK <= baseSize; i += BLOCK) {
+        size_t slot = _key(base + i) & (slots - 1);
+        while (index[slot]) {
+          slot = (slot + 1) & (slots - 1);
+        }
+        index[slot] = i + 1;
+      }
+
+      size_t i = 0, added = 0;
+      while (i + BLOCK <= size) {
+        size_t slot = _key(image + i) & (slots - 1);
+        while (index[slot] &&
+               memcmp(base + index[slot] - 1, image + i, BLOCK) != 0) {
+          slot = (slot + 1) & (slots - 1);
+        }
+        if (index[slot]) {
+          size_t j = index[slot] - 1;
+          size_t back = 0, forward = BLOCK;
+          while (i - back > added && j - back > 0 &&
+                 image[i - back - 1] == base[j - back - 1]) {
+            back++;
+          }
+          while (i + forward < size && j + forward < baseSize &&
+                 image[i + forward] == base[j + forward]) {
+            forward++;
+          }
+
+          if (back + forward >= MIN_COPY) {
+            _add(delta, image + added, i - back - added);
+            delta->push_back(DELTA_OP_COPY);
+            _le32(delta, j - back);
+            _le32(delta, back + forward);
+            i += forward;
+            added = i;
+            continue;
+          }
+        }
+        i++;
+      }
+      _add(delta, image + added, size - added);
+    }
+
+  protected:
+    static uint64_t _key(const uint8_t *block) {
+      uint64_t key = 14695981039346656037ULL;
+      for (size_t i = 0; i < BLOCK; i++) {
+        key = (key ^ block[i]) * 1099511628211ULL;
+      }
+      return key;
+    }
+
+    static void _add(std::vector<uint8_t> *delta, const uint8_t *data,
+                     size_t length) {
+      if (length) {
+        delta->push_back(DELTA_OP_ADD);
+        _le32(delta, length);
+        delta->insert(delta->end(), data, data + length);
+      }
+    }
+
+    static void _le32(std::vector<uint8_t> *delta, uint32_t value) {
+      for (int i = 0; i < 4; i++) {
+        delta->push_back((uint8_t)(value >> (8 * i)));
+      }
+    }
+};
+
+#endif // DELTAENCODER_H
@@ -0,0 +1,113 @@
+/*
+ * File backed OTAFlash stand-in for host testing of the OTA receive path.
+ *
+ * Behaves like NOR flash: erasing sets a page to 0xFF and writes can only
+ * clear bits.  An erase can be made to take time like the real thing, so
+ * that overlapping writes with receiving can be measured.
+ */
+
+#ifndef FILEFLASH_H
+#define FILEFLASH_H
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "OTAFlash.h"
+
+class FileFlash : public OTAFlash {
+  public:
+    /* Default page size, a multiple of which may be given */
+    static const size_t PAGE_SIZE = 4096;
+
+    /* Time taken by each page erase */
+    useconds_t eraseUs = 0;
+
+    bool activated = false;
+    unsigned int erases = 0;
+    unsigned int writes = 0;
+
+    FileFlash(size_t size, size_t pageSize = PAGE_SIZE) {
+      _size = size;
+      _pageSize = pageSize;
+      _file = tmpfile();
+
+      uint8_t erased[PAGE_SIZE];
+      memset(erased, 0xFF, sizeof (erased));
+      for (size_t offset = 0; offset < size; offset += PAGE_SIZE) {
+        fwrite(erased, 1, PAGE_SIZE, _file);
+      }
+      fflush(_file);
+    }
+
+    ~FileFlash() {
+      fclose(_file);
+    }
+
+    size_t size() { return _size; }
+    size_t pageSize() { return _pageSize; }
+
+    bool erase(size_t offset, size_t length) {
+      uint8_t erased[PAGE_SIZE];
+
+      if (offset % _pageSize || length % _pageSize ||
+          offset + length > _size) {
+        return false;
+      }
+      memset(erased, 0xFF, sizeof (erased));
+      for (size_t page = 0; page < length; page += _pageSize) {
+        if (eraseUs) {
+          usleep(eraseUs);
+        }
+        for (size_t done = 0; done < _pageSize; done += PAGE_SIZE) {
+          fseek(_file, offset + page + done, SEEK_SET);
+          fwrite(erased, 1, PAGE_SIZE, _file);
+        }
+        erases++;
+      }
+      return true;
+    }
+
+    bool write(size_t offset, const uint8_t *data, size_t length) {
+      uint8_t current[PAGE_SIZE];
+
+      if (offset + length > _size) {
+        return false;
+      }
+      while (length) {
+        size_t n = (length < PAGE_SIZE) ? length : PAGE_SIZE;
+        read(offset, current, n);
+        for (size_t i = 0; i < n; i++) {
+          current[i] &= data[i];
+        }
+        fseek(_file, offset, SEEK_SET);
+        fwrite(current, 1, n, _file);
+        offset += n;
+        data += n;
+        length -= n;
+      }
+      writes++;
+      return true;
+    }
+
+    bool read(size_t offset, uint8_t *data, size_t length) {
+      if (offset + length > _size) {
+        return false;
+      }
+      fflush(_file);
+      fseek(_file, offset, SEEK_SET);
+      return (fread(data, 1, length, _file) == length);
+    }
+
+    bool activate() {
+      activated = true;
+      return true;
+    }
+
+  protected:
+    size_t _size;
+    size_t _pageSize;
+    FILE *_file;
+};
+
+#endif // FILEFLASH_H
@@ -0,0 +1,172 @@
+/*
+ * Single process simulation of a fleet spreading an update with OTAGossip.
+ *
+ * Time advances in TICK_MS steps.  Every node's adverts reach every other
+ * node, as broadcasts across one subnet would, every ADVERT_INTERVAL from a
+ * random start.  Sending a chunk takes a node CHUNK_SIZE at its uplink rate
+ * shared between its MAX_UPLOADS uploads, and a node already sending that
+ * many answers busy, as OTAGossipNode does.  Only each node's own link is
+ * modelled, not the air or access point they share.
+ *
+ * Node 0 starts with the new image.  Without sharing only it advertises, so
+ * that every node pulls from it as from a single server.
+ */
+
+#ifndef GOSSIPSIMULATOR_H
+#define GOSSIPSIMULATOR_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+
+#include "OTAGossip.h"
+#include "OTAGossipNode.h"
+
+class GossipSimulator {
+  public:
+    static const unsigned long TICK_MS = 5;
+    static const unsigned long ADVERT_INTERVAL = OTAGossipNode::ADVERT_INTERVAL;
+    static const uint8_t MAX_UPLOADS = OTAGossipNode::MAX_UPLOADS;
+    static const uint32_t UPDATE_VERSION = 2;
+
+    GossipSimulator(size_t nodes, uint32_t size, uint32_t uplinkRate,
+                    bool share) {
+      uint8_t running[SHA256_DIGEST_SIZE];
+      uint8_t update[SHA256_DIGEST_SIZE];
+      memset(running, 0xA5, sizeof (running));
+      memset(update, 0x5A, sizeof (update));
+
+      _count = nodes;
+      _share = share;
+      _transferMs = (unsigned long)OTAGossip::CHUNK_SIZE * 1000 *
+                    MAX_UPLOADS / uplinkRate;
+      _nodes = (OTAGossip *)malloc(nodes * sizeof (OTAGossip));
+      _uploads = (uint8_t *)calloc(nodes, sizeof (uint8_t));
+      _advertAt = (unsigned long *)malloc(nodes * sizeof (unsigned long));
+      _pending = (pending_t *)malloc(nodes * OTAGossip::MAX_TRANSFERS *
+                                     sizeof (pending_t));
+      _numPending = 0;
+      _busy = 0;
+
+      uint32_t random = 1;
+      for (size_t i = 0; i < nodes; i++) {
+        new (&_nodes[i]) OTAGossip();
+        _nodes[i].seed(i + 1);
+        if (i) {
+          _nodes[i].hold(UPDATE_VERSION - 1, size, running, size);
+        } else {
+          _nodes[i].hold(UPDATE_VERSION, size, update, size);
+        }
+        random = random * 1103515245 + 12345;
+        _advertAt[i] = (random >> 8) % ADVERT_INTERVAL;
+      }
+    }
+
+    ~GossipSimulator() {
+      free(_nodes);
+      free(_uploads);
+      free(_advertAt);
+      free(_pending);
+    }
+
+    /**
+     * @return ms until every node holds the new image, 0 if not by the limit
+     */
+    unsigned long run(unsigned long limitMs) {
+      for (unsigned long now = 0; now <= limitMs; now += TICK_MS) {
+        _deliver(now);
+        _advertise(now);
+        _pull(now);
+
+        size_t done = 0;
+        for (size_t i = 0; i < _count; i++) {
+          if (_nodes[i].version() == UPDATE_VERSION &&
+              _nodes[i].held() == _nodes[i].chunks()) {
+            done++;
+          }
+        }
+        if (done == _count) {
+          return now;
+        }
+      }
+      return 0;
+    }
+
+    /* Requests answered busy */
+    uint32_t busy() { return _busy; }
+
+  protected:
+    typedef struct {
+      size_t        to;
+      size_t        from;
+      uint16_t      chunk;
+      unsigned long done;
+    } pending_t;
+
+    size_t _count;
+    bool _share;
+    unsigned long _transferMs;
+    OTAGossip *_nodes;
+    uint8_t *_uploads;
+    unsigned long *_advertAt;
+    pending_t *_pending;
+    size_t _numPending;
+    uint32_t _busy;
+
+    void _deliver(unsigned long now) {
+      for (size_t p = 0; p < _numPending; ) {
+        pending_t *pending = &_pending[p];
+        if (pending->done > now) {
+          p++;
+          continue;
+        }
+        _nodes[pending->to].received(pending->chunk);
+        _uploads[pending->from]--;
+        *pending = _pending[--_numPending];
+      }
+    }
+
+    void _advertise(unsigned long now) {
+      gossip_advert_t advert;
+
+      for (size_t i = 0; i < _count; i++) {
+        if (_advertAt[i] > now) {
+          continue;
+        }
+        _advertAt[i] += ADVERT_INTERVAL;
+        if (!_share && i != 0) {
+          continue;
+        }
+
+        _nodes[i].advert(&advert, 1);
+        for (size_t j = 0; j < _count; j++) {
+          if (j != i) {
+            _nodes[j].heard(i + 1, &advert, now);
+          }
+        }
+      }
+    }
+
+    void _pull(unsigned long now) {
+      gossip_transfer_t transfer;
+
+      for (size_t i = 0; i < _count; i++) {
+        while (_nodes[i].next(now, &transfer)) {
+          size_t from = transfer.ip - 1;
+          if (_uploads[from] >= MAX_UPLOADS) {
+            _nodes[i].failed(transfer.chunk, true, now);
+            _busy++;
+            continue;
+          }
+          _uploads[from]++;
+          pending_t *pending = &_pending[_numPending++];
+          pending->to = i;
+          pending->from = from;
+          pending->chunk = transfer.chunk;
+          pending->done = now + _transferMs;
+        }
+      }
+    }
+};
+
+#endif // GOSSIPSIMULATOR_H
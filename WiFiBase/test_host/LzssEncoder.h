@@ -0,0 +1,102 @@
+/*
+ * Host side compressor for LzssDecoder, as used by wfbcompress.py.
+ *
+ * Greedy matching, with the window's positions chained by the hash of the
+ * MIN_MATCH bytes at each and the longest match among the most recent
+ * CHAIN of them taken.
+ */
+
+#ifndef LZSSENCODER_H
+#define LZSSENCODER_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "LzssDecoder.h"
+
+class LzssEncoder {
+  public:
+    static const size_t HASH_BITS = 13;
+    static const size_t CHAIN = 64;
+
+    static void encode(const uint8_t *image, size_t size,
+                       std::vector<uint8_t> *out) {
+      const size_t WINDOW = LzssDecoder::WINDOW;
+      int32_t *head = (int32_t *)malloc((1 << HASH_BITS) * sizeof (int32_t));
+      int32_t *prev = (int32_t *)malloc(WINDOW * sizeof (int32_t));
+      memset(head, 0xFF, (1 << HASH_BITS) * sizeof (int32_t));
+      memset(prev, 0xFF, WINDOW * sizeof (int32_t));
+
+      out->clear();
+      for (int i = 0; i < 4; i++) {
+        out->push_back((uint8_t)(LZSS_MAGIC >> (8 * i)));
+      }
+
+      size_t flagsAt = 0;
+      int items = 8;
+      size_t i = 0;
+      while (i < size) {
+        if (items == 8) {
+          flagsAt = out->size();
+          out->push_back(0);
+          items = 0;
+        }
+
+        size_t best = 0, distance = 0;
+        if (i + LzssDecoder::MIN_MATCH <= size) {
+          int32_t candidate = head[_hash(image + i)];
+          for (size_t tries = 0; candidate >= 0 && tries < CHAIN &&
+               i - candidate <= WINDOW; tries++) {
+            size_t n = 0;
+            while (n < LzssDecoder::MAX_MATCH && i + n < size &&
+                   image[candidate + n] == image[i + n]) {
+              n++;
+            }
+            if (n > best) {
+              best = n;
+              distance = i - candidate;
+            }
+            int32_t next = prev[candidate & (WINDOW - 1)];
+            if (next >= candidate) {
+              break;
+            }
+            candidate = next;
+          }
+        }
+
+        size_t step = 1;
+        if (best >= LzssDecoder::MIN_MATCH) {
+          uint16_t match = (uint16_t)(distance - 1) |
+            (uint16_t)((best - LzssDecoder::MIN_MATCH) <<
+                       LzssDecoder::WINDOW_BITS);
+          out->push_back((uint8_t)match);
+          out->push_back((uint8_t)(match >> 8));
+          step = best;
+        } else {
+          (*out)[flagsAt] |= 1 << items;
+          out->push_back(image[i]);
+        }
+        items++;
+
+        for (; step; step--, i++) {
+          if (i + LzssDecoder::MIN_MATCH <= size) {
+            size_t key = _hash(image + i);
+            prev[i & (WINDOW - 1)] = head[key];
+            head[key] = i;
+          }
+        }
+      }
+
+      free(head);
+      free(prev);
+    }
+
+  protected:
+    static size_t _hash(const uint8_t *data) {
+      uint32_t key = data[0] | (data[1] << 8) | (data[2] << 16);
+      return (key * 2654435761U) >> (32 - HASH_BITS);
+    }
+};
+
+#endif // LZSSENCODER_H
@@ -0,0 +1,301 @@
+/*
+ * Scripted WiFiDriver stand-in for host testing of WiFiBase's logic.
+ *
+ * Access points are described by a table of mock_ap_t entries, and time only
+ * advances through delay() or advance() so that connect timings are exact.
+ */
+
+#ifndef MOCKWIFIDRIVER_H
+#define MOCKWIFIDRIVER_H
+
+#include <string.h>
+
+#include "WiFiDriver.h"
+
+typedef struct {
+  const char    *ssid;
+  const char    *passwd;
+  uint8_t       bssid[WFB_BSSID_LEN];
+  uint8_t       channel;
+  bool          present;
+  unsigned long associateMs;  // Time to associate once the AP is found
+  unsigned long dhcpMs;       // Time to obtain a lease
+  uint32_t      ip;
+  int8_t        rssi;
+} mock_ap_t;
+
+/* Record of a begin() call */
+typedef struct {
+  const char *ssid;
+  bool        directed;
+  bool        staticIP;
+  unsigned long at;
+} mock_attempt_t;
+
+class MockWiFiDriver : public WiFiDriver {
+  public:
+    static const int MAX_ATTEMPTS = 64;
+
+    /* Time for a full channel sweep during an undirected connect */
+    unsigned long sweepMs = 1500;
+
+    /* Channels swept by a full scan, and default dwell per channel */
+    uint8_t numChannels = 13;
+    unsigned long dwellMs = 300;
+    int numScans = 0;
+    unsigned long scanTimeMs = 0;
+
+    mock_ap_t *aps;
+    int numAps;
+
+    unsigned long now = 0;
+    mock_attempt_t attempts[MAX_ATTEMPTS];
+    int numAttempts = 0;
+
+    /* Access point, and the time the radio spent sweeping away from it */
+    bool apActive = false;
+    uint8_t apChannel = 0;
+    int apStarts = 0;
+    int apStops = 0;
+    unsigned long apSweepMs = 0;
+    bool napt = true;   // Whether forwarding is supported
+    bool forwarding = false;
+
+    MockWiFiDriver(mock_ap_t *_aps, int _numAps) : aps(_aps), numAps(_numAps) {}
+
+    void begin(const char *ssid, const char *passwd,
+               int32_t channel = 0, const uint8_t *bssid = nullptr) {
+      bool directed = (channel != 0 && bssid != nullptr);
+      if (numAttempts < MAX_ATTEMPTS) {
+        attempts[numAttempts++] = { ssid, directed, _static, now };
+      }
+
+      /*
+       * Like the SDK, the status of the previous attempt stays until an event,
+       * and an earlier association is reported until the new one is made
+       */
+      _previous = _associated();
+      _stale = status();
+      _current = nullptr;
+      _connectAt = 0;
+      _failAt = 0;
+      _reason = WFB_REASON_NONE;
+
+      /* Unless otherwise found the SDK reports no AP after its sweep */
+      _failAt = now + (directed ? 0 : sweepMs);
+      _failStatus = WFB_STATUS_NO_SSID;
+      if (apActive && !directed) {
+        apSweepMs += sweepMs;
+      }
+      _failReason = WFB_REASON_NO_AP_FOUND;
+
+      for (int i = 0; i < numAps; i++) {
+        mock_ap_t *ap = &aps[i];
+        if (!ap->present || strcmp(ap->ssid, ssid) != 0) continue;
+        if (directed && (ap->channel != channel ||
+                         memcmp(ap->bssid, bssid, WFB_BSSID_LEN) != 0)) {
+          continue;
+        }
+        if (strcmp(ap->passwd, passwd) != 0) {
+          /* Rejected during the handshake, the status stays disconnected */
+          _failAt = now + (directed ? 0 : sweepMs) + ap->associateMs;
+          _failStatus = WFB_STATUS_DISCONNECTED;
+          _failReason = WFB_REASON_AUTH_FAIL;
+          break;
+        }
+        _current = ap;
+        _connectAt = now + (directed ? 0 : sweepMs) + ap->associateMs +
+                     (_static ? 0 : ap->dhcpMs);
+        break;
+      }
+    }
+
+    void beginStored() {
+      begin("", "");
+    }
+
+    bool config(const wifi_lease_t *lease) {
+      _static = (lease != nullptr);
+      if (lease) _lease = *lease;
+      return true;
+    }
+
+    uint8_t status() {
+      if (_current) {
+        return (now >= _connectAt) ? WFB_STATUS_CONNECTED : _stale;
+      }
+      if (_failAt && now >= _failAt) {
+        _reason = _failReason;
+        _stale = _failStatus;
+        _previous = nullptr;
+        _failAt = 0;
+      }
+      return _stale;
+    }
+
+    void disconnect() {
+      if (status() == WFB_STATUS_CONNECTED) {
+        _stale = WFB_STATUS_DISCONNECTED;
+      }
+      _current = nullptr;
+      _previous = nullptr;
+      _failAt = 0;
+    }
+
+    uint8_t disconnectReason() {
+      status();
+      return _reason;
+    }
+
+    bool ssid(char *ssid) {
+      mock_ap_t *ap = _associated();
+      if (!ap) return false;
+      strncpy(ssid, ap->ssid, WFB_SSID_LEN);
+      ssid[WFB_SSID_LEN] = '\0';
+      return true;
+    }
+
+    bool bssid(uint8_t *bssid) {
+      mock_ap_t *ap = _associated();
+      if (!ap) return false;
+      memcpy(bssid, ap->bssid, WFB_BSSID_LEN);
+      return true;
+    }
+
+    int32_t channel() {
+      mock_ap_t *ap = _associated();
+      return ap ? ap->channel : 0;
+    }
+
+    bool lease(wifi_lease_t *lease) {
+      mock_ap_t *ap = _associated();
+      if (!ap) return false;
+      if (_static) {
+        *lease = _lease;
+      } else {
+        *lease = { ap->ip, 0x0101a8c0, 0x00ffffff, 0x0101a8c0 };
+      }
+      return true;
+    }
+
+    int32_t rssi() {
+      mock_ap_t *ap = _associated();
+      return ap ? ap->rssi : 0;
+    }
+
+    bool scanStart(bool async, uint8_t channel = 0, bool passive = false,
+                   uint32_t dwell = 0) {
+      unsigned long duration = (channel ? 1 : numChannels) *
+                               (dwell ? dwell : dwellMs);
+      numScans++;
+      scanTimeMs += duration;
+      _scanChannel = channel;
+      _scanDoneAt = now + duration;
+      _scanning = true;
+      if (!async) {
+        now = _scanDoneAt;
+      }
+      return true;
+    }
+
+    int16_t scanComplete() {
+      if (!_scanning) {
+        return WFB_SCAN_FAILED;
+      }
+      if (now < _scanDoneAt) {
+        return WFB_SCAN_RUNNING;
+      }
+      _numResults = 0;
+      for (int i = 0; i < numAps; i++) {
+        if (aps[i].present && _numResults < MAX_RESULTS &&
+            (!_scanChannel || aps[i].channel == _scanChannel)) {
+          _results[_numResults++] = &aps[i];
+        }
+      }
+      return _numResults;
+    }
+
+    bool scanResult(int16_t index, wifi_scan_entry_t *entry) {
+      if (index >= _numResults) return false;
+      mock_ap_t *ap = _results[index];
+      strncpy(entry->ssid, ap->ssid, WFB_SSID_LEN);
+      entry->ssid[WFB_SSID_LEN] = '\0';
+      memcpy(entry->bssid, ap->bssid, WFB_BSSID_LEN);
+      entry->channel = ap->channel;
+      entry->rssi = ap->rssi;
+      entry->open = (ap->passwd[0] == '\0');
+      return true;
+    }
+
+    void scanDelete() {
+      _scanning = false;
+      _numResults = 0;
+    }
+
+    bool softAP(const char *ssid, const char *passwd, uint8_t channel) {
+      apActive = true;
+      apChannel = channel;
+      apStarts++;
+      return true;
+    }
+
+    void softAPdisconnect() {
+      apActive = false;
+      apStops++;
+    }
+
+    uint8_t softAPChannel() {
+      if (!apActive) return 0;
+      /* The access point stays where the station took it */
+      if (_associated()) apChannel = _associated()->channel;
+      return apChannel;
+    }
+
+    bool forward(bool enable) {
+      if (enable && !napt) return false;
+      forwarding = enable;
+      return true;
+    }
+
+    /* Lose the current association, as when the upstream goes away */
+    void drop() {
+      _current = nullptr;
+      _previous = nullptr;
+      _failAt = 0;
+      _stale = WFB_STATUS_DISCONNECTED;
+      _reason = WFB_REASON_BEACON_TIMEOUT;
+    }
+
+    unsigned long millis() { return now; }
+    void delay(unsigned long ms) { now += ms; }
+    void advance(unsigned long ms) { now += ms; }
+
+    void clearAttempts() { numAttempts = 0; }
+
+  protected:
+    mock_ap_t *_current = nullptr;
+    mock_ap_t *_previous = nullptr;  // Associated before the current begin()
+    unsigned long _connectAt = 0;
+    unsigned long _failAt = 0;
+    uint8_t _failStatus = WFB_STATUS_DISCONNECTED;
+    uint8_t _failReason = WFB_REASON_NONE;
+    uint8_t _reason = WFB_REASON_NONE;
+    uint8_t _stale = WFB_STATUS_DISCONNECTED;  // Reported until the next event
+    bool _static = false;
+    wifi_lease_t _lease;
+
+    /* Access point associated with, as the SDK reports it */
+    mock_ap_t *_associated() {
+      if (status() != WFB_STATUS_CONNECTED) return nullptr;
+      return (_current && now >= _connectAt) ? _current : _previous;
+    }
+
+    static const int MAX_RESULTS = 32;
+    bool _scanning = false;
+    uint8_t _scanChannel = 0;
+    unsigned long _scanDoneAt = 0;
+    mock_ap_t *_results[MAX_RESULTS];
+    int16_t _numResults = 0;
+};
+
+#endif // MOCKWIFIDRIVER_H
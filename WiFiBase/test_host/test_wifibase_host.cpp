@@ -0,0 +1,4051 @@
+/**
+ * Host testing of WiFiBase's connection logic against a scripted WiFi driver
+ *
+ * To run tests with platformio:
+ *   platformio test -e native
+ */
+
+#include <unity.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <atomic>
+#include <thread>
+
+#include "WiFiConnector.h"
+#include "WiFiRoamer.h"
+#include "WiFiScanPlanner.h"
+#include "WiFiScanCache.h"
+#include "JsonWriter.h"
+#include "WiFiConnectJobs.h"
+#include "WiFiMetrics.h"
+#include "WiFiServiceScheduler.h"
+#include "WiFiBaseServer.h"
+#include "WiFiEvents.h"
+#include "WiFiPortal.h"
+#include "WiFiUplink.h"
+#include "ResponseCache.h"
+#include "Sha256.h"
+#include "OTAReceiver.h"
+#include "OTAServer.h"
+#include "OTAHub.h"
+#include "DeltaDecoder.h"
+#include "DeltaEncoder.h"
+#include "LzssDecoder.h"
+#include "LzssEncoder.h"
+#include "OTAGossip.h"
+#include "OTAGossipNode.h"
+#include "GossipSimulator.h"
+#include "FileFlash.h"
+#include "MockWiFiDriver.h"
+
+static mock_ap_t testAps[] = {
+  { "home",   "homepw",   {0x10, 0, 0, 0, 0, 1}, 6,  true, 300, 1200, 0x0a01a8c0, -70 },
+  { "office", "officepw", {0x20, 0, 0, 0, 0, 2}, 11, true, 400, 1500, 0x0b01a8c0, -50 },
+};
+#define NUM_TEST_APS (int)(sizeof (testAps) / sizeof (testAps[0]))
+
+static void init_network(struct network *net, const char *ssid,
+                         const char *passwd) {
+  memset(net, 0, sizeof (*net));
+  net->ssid = strdup(ssid);
+  net->passwd = strdup(passwd);
+}
+
+static void free_network(struct network *net) {
+  free(net->ssid);
+  free(net->passwd);
+}
+
+/* A full connect populates the network's cache */
+void test_cache_recorded() {
+  MockWiFiDriver driver(testAps, NUM_TEST_APS);
+  WiFiConnector connector(&driver);
+  struct network net;
+  init_network(&net, "home", "homepw");
+
+  TEST_ASSERT_TRUE(connector.connect(&net));
+  TEST_ASSERT_TRUE(net.cache.valid);
+  TEST_ASSERT_EQUAL(6, net.cache.channel);
+  TEST_ASSERT_EQUAL_MEMORY(testAps[0].bssid, net.cache.bssid, WFB_BSSID_LEN);
+  TEST_ASSERT_EQUAL(testAps[0].ip, net.cache.lease.ip);
+  TEST_ASSERT_EQUAL(1, driver.numAttempts);
+  TEST_ASSERT_FALSE(driver.attempts[0].directed);
+
+  free_network(&net);
+}
+
+/* A reconnect with a valid cache is directed and skips DHCP */
+void test_cache_fast_reconnect() {
+  MockWiFiDriver driver(testAps, NUM_TEST_APS);
+  WiFiConnector connector(&driver);
+  struct network net;
+  init_network(&net, "home", "homepw");
+
+  TEST_ASSERT_TRUE(connector.connect(&net));
+  unsigned long fullMs = driver.now;
+
+  driver.disconnect();
+  driver.clearAttempts();
+  unsigned long start = driver.now;
+  TEST_ASSERT_TRUE(connector.connect(&net));
+  unsigned long fastMs = driver.now - start;
+
+  TEST_ASSERT_EQUAL(1, driver.numAttempts);
+  TEST_ASSERT_TRUE(driver.attempts[0].directed);
+  TEST_ASSERT_TRUE(driver.attempts[0].staticIP);
+  TEST_ASSERT_LESS_THAN(fullMs / 4, fastMs);
+
+  free_network(&net);
+}
+
+/* A stale cache falls back to a full DHCP connect and is refreshed */
+void test_cache_fallback() {
+  mock_ap_t aps[NUM_TEST_APS];
+  memcpy(aps, testAps, sizeof (aps));
+  MockWiFiDriver driver(aps, NUM_TEST_APS);
+  WiFiConnector connector(&driver);
+  connector.setFastTimeoutMs(1000);
+  struct network net;
+  init_network(&net, "home", "homepw");
+
+  TEST_ASSERT_TRUE(connector.connect(&net));
+
+  /* The access point moves to another channel */
+  aps[0].channel = 1;
+  driver.disconnect();
+  driver.clearAttempts();
+  unsigned long start = driver.now;
+  TEST_ASSERT_TRUE(connector.connect(&net));
+
+  TEST_ASSERT_EQUAL(2, driver.numAttempts);
+  TEST_ASSERT_TRUE(driver.attempts[0].directed);
+  TEST_ASSERT_FALSE(driver.attempts[1].directed);
+  TEST_ASSERT_FALSE(driver.attempts[1].staticIP);
+  TEST_ASSERT_LESS_OR_EQUAL(start + 1100, driver.attempts[1].at);
+  TEST_ASSERT_TRUE(net.cache.valid);
+  TEST_ASSERT_EQUAL(1, net.cache.channel);
+
+  free_network(&net);
+}
+
+/* Fast reconnect can be disabled */
+void test_cache_disabled() {
+  MockWiFiDriver driver(testAps, NUM_TEST_APS);
+  WiFiConnector connector(&driver);
+  connector.setFastReconnect(false);
+  struct network net;
+  init_network(&net, "office", "officepw");
+
+  TEST_ASSERT_TRUE(connector.connect(&net));
+  driver.disconnect();
+  TEST_ASSERT_TRUE(connector.connect(&net));
+  TEST_ASSERT_EQUAL(2, driver.numAttempts);
+  TEST_ASSERT_FALSE(driver.attempts[1].directed);
+
+  free_network(&net);
+}
+
+/* Known networks are tried in order, each using its own cache */
+void test_connect_known_order() {
+  MockWiFiDriver driver(testAps, NUM_TEST_APS);
+  WiFiConnector connector(&driver);
+  connector.setTimeoutMs(5000);
+  struct network nets[3];
+  init_network(&nets[0], "absent", "pw");
+  init_network(&nets[1], "office", "officepw");
+  init_network(&nets[2], "home", "homepw");
+
+  TEST_ASSERT_EQUAL(1, connector.connectKnown(nets, 3));
+  TEST_ASSERT_EQUAL(2, driver.numAttempts);
+  TEST_ASSERT_EQUAL_STRING("absent", driver.attempts[0].ssid);
+  TEST_ASSERT_EQUAL_STRING("office", driver.attempts[1].ssid);
+  TEST_ASSERT_FALSE(nets[0].cache.valid);
+  TEST_ASSERT_TRUE(nets[1].cache.valid);
+
+  for (int i = 0; i < 3; i++) {
+    free_network(&nets[i]);
+  }
+}
+
+/* Status and disconnect reasons are classified into failures */
+void test_classify_failures() {
+  TEST_ASSERT_EQUAL(WFB_FAIL_NONE,
+                    WiFiConnector::classify(WFB_STATUS_DISCONNECTED,
+                                            WFB_REASON_NONE));
+  TEST_ASSERT_EQUAL(WFB_FAIL_NONE,
+                    WiFiConnector::classify(WFB_STATUS_DISCONNECTED,
+                                            WFB_REASON_BEACON_TIMEOUT));
+  TEST_ASSERT_EQUAL(WFB_FAIL_NO_SSID,
+                    WiFiConnector::classify(WFB_STATUS_NO_SSID,
+                                            WFB_REASON_NONE));
+  TEST_ASSERT_EQUAL(WFB_FAIL_NO_SSID,
+                    WiFiConnector::classify(WFB_STATUS_DISCONNECTED,
+                                            WFB_REASON_NO_AP_FOUND));
+  TEST_ASSERT_EQUAL(WFB_FAIL_AUTH,
+                    WiFiConnector::classify(WFB_STATUS_DISCONNECTED,
+                                            WFB_REASON_AUTH_FAIL));
+  TEST_ASSERT_EQUAL(WFB_FAIL_AUTH,
+                    WiFiConnector::classify(WFB_STATUS_DISCONNECTED,
+                                            WFB_REASON_4WAY_HANDSHAKE_TIMEOUT));
+  TEST_ASSERT_EQUAL(WFB_FAIL_ASSOC,
+                    WiFiConnector::classify(WFB_STATUS_CONNECT_FAILED,
+                                            WFB_REASON_NONE));
+}
+
+/* Each network records the reason its last attempt failed */
+void test_failure_recorded() {
+  MockWiFiDriver driver(testAps, NUM_TEST_APS);
+  WiFiConnector connector(&driver);
+  struct network nets[3];
+  init_network(&nets[0], "absent", "pw");
+  init_network(&nets[1], "office", "wrongpw");
+  init_network(&nets[2], "home", "homepw");
+
+  TEST_ASSERT_EQUAL(2, connector.connectKnown(nets, 3));
+  TEST_ASSERT_EQUAL(WFB_FAIL_NO_SSID, nets[0].lastFailure);
+  TEST_ASSERT_EQUAL(WFB_FAIL_AUTH, nets[1].lastFailure);
+  TEST_ASSERT_EQUAL(WFB_FAIL_NONE, nets[2].lastFailure);
+
+  /* Without fail-fast the same attempts only end at the timeout */
+  connector.setFailFast(false);
+  connector.setTimeoutMs(5000);
+  TEST_ASSERT_FALSE(connector.connect(&nets[0]));
+  TEST_ASSERT_EQUAL(WFB_FAIL_TIMEOUT, nets[0].lastFailure);
+
+  for (int i = 0; i < 3; i++) {
+    free_network(&nets[i]);
+  }
+}
+
+/* A status left from the previous attempt doesn't fail the next one */
+void test_fail_fast_stale_status() {
+  MockWiFiDriver driver(testAps, NUM_TEST_APS);
+  WiFiConnector connector(&driver);
+  struct network absent, home;
+  init_network(&absent, "absent", "pw");
+  init_network(&home, "home", "homepw");
+
+  TEST_ASSERT_FALSE(connector.connect(&absent));
+  TEST_ASSERT_EQUAL(WFB_FAIL_NO_SSID, connector.lastFailure());
+  TEST_ASSERT_EQUAL(WFB_STATUS_NO_SSID, driver.status());
+
+  /* The SDK still reports no SSID until the next attempt's first event */
+  unsigned long start = driver.now;
+  driver.begin("home", "homepw");
+  TEST_ASSERT_EQUAL(WFB_STATUS_NO_SSID, driver.status());
+
+  TEST_ASSERT_TRUE(connector.connect(&home));
+  TEST_ASSERT_EQUAL(WFB_FAIL_NONE, connector.lastFailure());
+  TEST_ASSERT_GREATER_THAN(driver.sweepMs, driver.now - start);
+
+  /* The non-blocking attempt is judged the same way */
+  driver.disconnect();
+  TEST_ASSERT_FALSE(connector.connect(&absent));
+  connector.startConnect(&home);
+  TEST_ASSERT_EQUAL(WFB_ATTEMPT_PENDING, connector.checkConnect());
+  while (connector.checkConnect() == WFB_ATTEMPT_PENDING) {
+    driver.advance(100);
+  }
+  TEST_ASSERT_EQUAL(WFB_STATUS_CONNECTED, driver.status());
+
+  free_network(&absent);
+  free_network(&home);
+}
+
+/* An association from before an attempt isn't taken as its result */
+void test_connect_while_connected() {
+  mock_ap_t aps[] = {
+    { "home",   "homepw",   {0x10, 0, 0, 0, 0, 1}, 6,  true, 300, 1200, 0x0a01a8c0, -80 },
+    { "home",   "homepw",   {0x10, 0, 0, 0, 0, 2}, 1,  true, 300, 1200, 0x0a01a8c0, -45 },
+    { "office", "officepw", {0x20, 0, 0, 0, 0, 3}, 11, true, 400, 1500, 0x0b01a8c0, -50 },
+  };
+  MockWiFiDriver driver(aps, 3);
+  WiFiConnector connector(&driver);
+  connector.setFastReconnect(false);
+  struct network home, office;
+  init_network(&home, "home", "homepw");
+  init_network(&office, "office", "officepw");
+  uint8_t bssid[WFB_BSSID_LEN];
+
+  TEST_ASSERT_TRUE(connector.connect(&home));
+  TEST_ASSERT_EQUAL(1, home.cache.bssid[5]);
+
+  /* A roam to another access point waits for it to associate */
+  unsigned long start = driver.now;
+  TEST_ASSERT_TRUE(connector.connect(&home, aps[1].bssid, aps[1].channel));
+  TEST_ASSERT_GREATER_OR_EQUAL(aps[1].associateMs + aps[1].dhcpMs,
+                               driver.now - start);
+  TEST_ASSERT_EQUAL(2, home.cache.bssid[5]);
+  TEST_ASSERT_EQUAL(1, home.cache.channel);
+
+  /* As does a connect to another network */
+  start = driver.now;
+  connector.startConnect(&office);
+  driver.advance(100);
+  TEST_ASSERT_EQUAL(WFB_STATUS_CONNECTED, driver.status());
+  TEST_ASSERT_EQUAL(WFB_ATTEMPT_PENDING, connector.checkConnect());
+  TEST_ASSERT_TRUE(driver.bssid(bssid));
+  TEST_ASSERT_EQUAL(2, bssid[5]);
+  while (connector.checkConnect() == WFB_ATTEMPT_PENDING) {
+    driver.advance(100);
+  }
+  TEST_ASSERT_GREATER_OR_EQUAL(driver.sweepMs + aps[2].associateMs +
+                               aps[2].dhcpMs, driver.now - start);
+  TEST_ASSERT_TRUE(office.cache.valid);
+  TEST_ASSERT_EQUAL(3, office.cache.bssid[5]);
+  TEST_ASSERT_EQUAL(0x0b01a8c0, office.cache.lease.ip);
+
+  /* Connecting to the network already associated succeeds at once */
+  start = driver.now;
+  connector.startConnect(&office);
+  TEST_ASSERT_EQUAL(WFB_ATTEMPT_CONNECTED, connector.checkConnect());
+  TEST_ASSERT_EQUAL(start, driver.now);
+
+  free_network(&home);
+  free_network(&office);
+}
+
+/*
+ * Simulate startup against a list of mostly absent networks and compare the
+ * total time to connect with and without fail-fast.
+ */
+static unsigned long simulate_startup(bool failFast) {
+  const int NUM_NETWORKS = 10;
+  MockWiFiDriver driver(testAps, NUM_TEST_APS);
+  WiFiConnector connector(&driver);
+  connector.setFailFast(failFast);
+  struct network nets[NUM_NETWORKS];
+  char ssid[32];
+
+  for (int i = 0; i < NUM_NETWORKS - 2; i++) {
+    snprintf(ssid, sizeof (ssid), "absent_%d", i);
+    init_network(&nets[i], ssid, ssid);
+  }
+  init_network(&nets[NUM_NETWORKS - 2], "office", "stale");
+  init_network(&nets[NUM_NETWORKS - 1], "home", "homepw");
+
+  uint8_t index = connector.connectKnown(nets, NUM_NETWORKS);
+  for (int i = 0; i < NUM_NETWORKS; i++) {
+    free_network(&nets[i]);
+  }
+
+  return (index == NUM_NETWORKS - 1) ? driver.now : 0;
+}
+
+void test_fail_fast_time_saved() {
+  unsigned long slow = simulate_startup(false);
+  unsigned long fast = simulate_startup(true);
+  char msg[80];
+
+  TEST_ASSERT_NOT_EQUAL(0, slow);
+  TEST_ASSERT_NOT_EQUAL(0, fast);
+  snprintf(msg, sizeof (msg), "startup full timeouts:%lums fail-fast:%lums",
+           slow, fast);
+  TEST_MESSAGE(msg);
+
+  /* Each doomed attempt should cost a sweep rather than the full timeout */
+  TEST_ASSERT_LESS_THAN(slow / 3, fast);
+}
+
+/* Timeouts follow the history of each network within the configured bounds */
+void test_adaptive_timeout_learned() {
+  MockWiFiDriver driver(testAps, NUM_TEST_APS);
+  WiFiConnector connector(&driver);
+  connector.setFastReconnect(false);
+  connector.setAdaptiveTimeout(2000, 20000, 150);
+  struct network net;
+  init_network(&net, "home", "homepw");
+
+  /* Without enough history the default is used */
+  TEST_ASSERT_EQUAL(WiFiConnector::DEFAULT_CONNECT_TIMEOUT,
+                    connector.timeoutFor(&net));
+
+  for (int i = 0; i < WFB_HISTORY_MIN; i++) {
+    TEST_ASSERT_TRUE(connector.connect(&net));
+    driver.disconnect();
+  }
+  TEST_ASSERT_EQUAL(WFB_HISTORY_MIN, net.history.count);
+
+  /* 3000ms connects with a 150% margin */
+  TEST_ASSERT_EQUAL(4500, connector.timeoutFor(&net));
+
+  /* A single slow connect dominates the 95th percentile */
+  testAps[0].associateMs += 1000;
+  bool connected = connector.connect(&net);
+  testAps[0].associateMs -= 1000;
+  TEST_ASSERT_TRUE(connected);
+  driver.disconnect();
+  TEST_ASSERT_EQUAL(6000, connector.timeoutFor(&net));
+
+  /* Bounded by the maximum */
+  connector.setAdaptiveTimeout(2000, 5000, 150);
+  TEST_ASSERT_EQUAL(5000, connector.timeoutFor(&net));
+
+  /* Disabling adaptive timeouts restores the default */
+  connector.setAdaptiveTimeout(false);
+  TEST_ASSERT_EQUAL(WiFiConnector::DEFAULT_CONNECT_TIMEOUT,
+                    connector.timeoutFor(&net));
+
+  free_network(&net);
+}
+
+/* A timeout discards the history so a slower network can recover */
+void test_adaptive_timeout_reset() {
+  mock_ap_t aps[NUM_TEST_APS];
+  memcpy(aps, testAps, sizeof (aps));
+  MockWiFiDriver driver(aps, NUM_TEST_APS);
+  WiFiConnector connector(&driver);
+  connector.setFastReconnect(false);
+  struct network net;
+  init_network(&net, "home", "homepw");
+
+  for (int i = 0; i < WFB_HISTORY_LEN; i++) {
+    TEST_ASSERT_TRUE(connector.connect(&net));
+    driver.disconnect();
+  }
+
+  /* The DHCP server becomes slow, the learned timeout is exceeded */
+  aps[0].dhcpMs = 5000;
+  unsigned long start = driver.now;
+  TEST_ASSERT_FALSE(connector.connect(&net));
+  TEST_ASSERT_EQUAL(WFB_FAIL_TIMEOUT, net.lastFailure);
+  TEST_ASSERT_LESS_THAN(5000, driver.now - start);
+  TEST_ASSERT_EQUAL(0, net.history.count);
+
+  /* The next attempt uses the default and succeeds */
+  TEST_ASSERT_TRUE(connector.connect(&net));
+  TEST_ASSERT_EQUAL(1, net.history.count);
+
+  /* Connects directed at an access point, as after a scan, learn the same */
+  aps[0].dhcpMs = testAps[0].dhcpMs;
+  for (int i = 0; i < WFB_HISTORY_LEN; i++) {
+    driver.disconnect();
+    TEST_ASSERT_TRUE(connector.connect(&net, aps[0].bssid, aps[0].channel));
+  }
+  TEST_ASSERT_EQUAL(WFB_HISTORY_LEN, net.history.count);
+  TEST_ASSERT_EQUAL((aps[0].associateMs + aps[0].dhcpMs) * 3 / 2,
+                    connector.timeoutFor(&net));
+
+  driver.disconnect();
+  aps[0].dhcpMs = 5000;
+  TEST_ASSERT_FALSE(connector.connect(&net, aps[0].bssid, aps[0].channel));
+  TEST_ASSERT_EQUAL(WFB_FAIL_TIMEOUT, net.lastFailure);
+  TEST_ASSERT_EQUAL(0, net.history.count);
+
+  free_network(&net);
+}
+
+/*
+ * Virtual clock comparison of the worst case startup budget when every known
+ * network is present but fails to complete its connection.
+ */
+void test_adaptive_startup_budget() {
+  const int NUM_NETWORKS = 2;
+  mock_ap_t aps[NUM_TEST_APS];
+  memcpy(aps, testAps, sizeof (aps));
+  MockWiFiDriver driver(aps, NUM_TEST_APS);
+  WiFiConnector connector(&driver);
+  connector.setFastReconnect(false);
+  struct network nets[NUM_NETWORKS];
+  init_network(&nets[0], "home", "homepw");
+  init_network(&nets[1], "office", "officepw");
+
+  unsigned long budget = 0;
+  for (int i = 0; i < NUM_NETWORKS; i++) {
+    budget += connector.timeoutFor(&nets[i]);
+  }
+  TEST_ASSERT_EQUAL(NUM_NETWORKS * WiFiConnector::DEFAULT_CONNECT_TIMEOUT,
+                    budget);
+
+  for (int n = 0; n < WFB_HISTORY_LEN; n++) {
+    for (int i = 0; i < NUM_NETWORKS; i++) {
+      TEST_ASSERT_TRUE(connector.connect(&nets[i]));
+      driver.disconnect();
+    }
+  }
+
+  /* Both DHCP servers stop answering */
+  aps[0].dhcpMs = aps[1].dhcpMs = 60000;
+  unsigned long start = driver.now;
+  TEST_ASSERT_EQUAL(WiFiConnector::INDEX_NONE,
+                    connector.connectKnown(nets, NUM_NETWORKS));
+  unsigned long elapsed = driver.now - start;
+
+  char msg[80];
+  snprintf(msg, sizeof (msg), "startup budget default:%lums adaptive:%lums",
+           budget, elapsed);
+  TEST_MESSAGE(msg);
+  TEST_ASSERT_LESS_THAN(budget / 2, elapsed);
+
+  for (int i = 0; i < NUM_NETWORKS; i++) {
+    free_network(&nets[i]);
+  }
+}
+
+/* Unless enabled, a lone network that failed is still retried at once */
+void test_penalty_default_off() {
+  mock_ap_t aps[NUM_TEST_APS];
+  memcpy(aps, testAps, sizeof (aps));
+  MockWiFiDriver driver(aps, NUM_TEST_APS);
+  WiFiConnector connector(&driver);
+  struct network net;
+  init_network(&net, "home", "homepw");
+
+  aps[0].present = false;
+  TEST_ASSERT_EQUAL(WiFiConnector::INDEX_NONE, connector.connectKnown(&net, 1));
+  TEST_ASSERT_FALSE(connector.penalized(&net));
+
+  aps[0].present = true;
+  TEST_ASSERT_EQUAL(0, connector.connectKnown(&net, 1));
+
+  free_network(&net);
+}
+
+/* A failed network is skipped until its cooldown expires */
+void test_penalty_skip() {
+  MockWiFiDriver driver(testAps, NUM_TEST_APS);
+  WiFiConnector connector(&driver);
+  connector.setPenalties(true);
+  connector.setPenalties(5000, 60000, 600000);
+  struct network nets[2];
+  init_network(&nets[0], "office", "stale");
+  init_network(&nets[1], "absent", "pw");
+
+  TEST_ASSERT_EQUAL(WiFiConnector::INDEX_NONE, connector.connectKnown(nets, 2));
+  TEST_ASSERT_EQUAL(2, driver.numAttempts);
+  TEST_ASSERT_TRUE(connector.penalized(&nets[0]));
+  TEST_ASSERT_TRUE(connector.penalized(&nets[1]));
+  TEST_ASSERT_EQUAL(1, connector.penaltyScore(&nets[0]));
+
+  /* Retrying within the cooldown makes no attempts and takes no time */
+  driver.clearAttempts();
+  unsigned long start = driver.now;
+  TEST_ASSERT_EQUAL(WiFiConnector::INDEX_NONE, connector.connectKnown(nets, 2));
+  TEST_ASSERT_EQUAL(0, driver.numAttempts);
+  TEST_ASSERT_EQUAL(start, driver.now);
+
+  /* Once the cooldown expires the network is attempted again */
+  driver.advance(5000);
+  TEST_ASSERT_FALSE(connector.penalized(&nets[0]));
+  TEST_ASSERT_EQUAL(WiFiConnector::INDEX_NONE, connector.connectKnown(nets, 2));
+  TEST_ASSERT_EQUAL(2, driver.numAttempts);
+  TEST_ASSERT_EQUAL(2, connector.penaltyScore(&nets[0]));
+
+  for (int i = 0; i < 2; i++) {
+    free_network(&nets[i]);
+  }
+}
+
+/* Cooldowns double with repeated failures, up to the maximum */
+void test_penalty_backoff() {
+  MockWiFiDriver driver(testAps, NUM_TEST_APS);
+  WiFiConnector connector(&driver);
+  connector.setPenalties(true);
+  connector.setPenalties(1000, 16000, 3600000);
+  struct network net;
+  init_network(&net, "absent", "pw");
+
+  unsigned long expected = 1000;
+  for (int i = 0; i < 8; i++) {
+    TEST_ASSERT_EQUAL(WiFiConnector::INDEX_NONE, connector.connectKnown(&net, 1));
+    TEST_ASSERT_EQUAL(expected, net.penalty.retryAt - driver.now);
+
+    driver.advance(net.penalty.retryAt - driver.now);
+    if (expected < 16000) {
+      expected *= 2;
+    }
+  }
+
+  free_network(&net);
+}
+
+/* The score decays over time and is cleared by a success */
+void test_penalty_decay() {
+  mock_ap_t aps[NUM_TEST_APS];
+  memcpy(aps, testAps, sizeof (aps));
+  MockWiFiDriver driver(aps, NUM_TEST_APS);
+  WiFiConnector connector(&driver);
+  connector.setPenalties(true);
+  connector.setPenalties(1000, 60000, 60000);
+  struct network net;
+  init_network(&net, "home", "homepw");
+
+  aps[0].present = false;
+  for (int i = 0; i < 4; i++) {
+    connector.connectKnown(&net, 1);
+    driver.advance(net.penalty.retryAt - driver.now);
+  }
+  TEST_ASSERT_EQUAL(4, connector.penaltyScore(&net));
+
+  /* Two half-lives later the score has fallen to a quarter */
+  driver.advance(120000);
+  TEST_ASSERT_EQUAL(1, connector.penaltyScore(&net));
+  TEST_ASSERT_FALSE(connector.penalized(&net));
+
+  aps[0].present = true;
+  TEST_ASSERT_EQUAL(0, connector.connectKnown(&net, 1));
+  TEST_ASSERT_EQUAL(0, connector.penaltyScore(&net));
+  TEST_ASSERT_FALSE(connector.penalized(&net));
+
+  free_network(&net);
+}
+
+static wifi_scan_entry_t scan_entry(const char *ssid, uint8_t id,
+                                    uint8_t channel, int8_t rssi) {
+  wifi_scan_entry_t entry;
+  memset(&entry, 0, sizeof (entry));
+  strncpy(entry.ssid, ssid, WFB_SSID_LEN);
+  entry.bssid[0] = id;
+  entry.channel = channel;
+  entry.rssi = rssi;
+  return entry;
+}
+
+/*
+ * Feed a scripted RSSI trace sampled once a second, returning the time at
+ * which a scan was first requested or 0 if none was.
+ */
+static unsigned long run_trace(WiFiRoamer *roamer, const int8_t *trace,
+                               int length) {
+  for (int i = 1; i <= length; i++) {
+    unsigned long now = i * 1000;
+    if (roamer->sampleDue(now)) {
+      roamer->sample(trace[i - 1], now);
+    }
+    if (roamer->scanDue(now)) {
+      roamer->scanStarted(now);
+      return now;
+    }
+  }
+  return 0;
+}
+
+/* A strong connection never triggers a scan */
+void test_roam_strong_no_scan() {
+  const uint8_t bssid[WFB_BSSID_LEN] = {1};
+  const int8_t trace[] = {-50, -52, -49, -55, -51, -50, -53, -48, -50, -52};
+  WiFiRoamer roamer;
+  roamer.configure(10, -65, 1000, 2000);
+  roamer.reset(bssid, -50, 0);
+
+  TEST_ASSERT_EQUAL(0, run_trace(&roamer, trace, sizeof (trace)));
+  TEST_ASSERT_GREATER_THAN(-55, roamer.average());
+}
+
+/* A fading connection scans, and a single dip is smoothed over */
+void test_roam_fading_scan() {
+  const uint8_t bssid[WFB_BSSID_LEN] = {1};
+  const int8_t dip[] = {-50, -85, -50, -50, -50, -50};
+  const int8_t fade[] = {-60, -66, -70, -74, -78, -80, -82, -82, -82, -82};
+  WiFiRoamer roamer;
+  roamer.configure(10, -65, 1000, 2000);
+
+  roamer.reset(bssid, -50, 0);
+  TEST_ASSERT_EQUAL(0, run_trace(&roamer, dip, sizeof (dip)));
+
+  roamer.reset(bssid, -55, 0);
+  unsigned long scanAt = run_trace(&roamer, fade, sizeof (fade));
+  TEST_ASSERT_NOT_EQUAL(0, scanAt);
+  TEST_ASSERT_LESS_THAN(-65, roamer.average());
+
+  /* The next scan waits for the scan interval */
+  TEST_ASSERT_FALSE(roamer.scanDue(scanAt + 1000));
+  TEST_ASSERT_TRUE(roamer.scanDue(scanAt + 2000));
+}
+
+/* Only known networks beating the current signal by the hysteresis win */
+void test_roam_candidate_selection() {
+  const uint8_t bssid[WFB_BSSID_LEN] = {1};
+  WiFiRoamer roamer;
+  wifi_scan_entry_t entry, chosen;
+  uint8_t index;
+  roamer.configure(10, -65, 1000, 2000);
+
+  /* Within the hysteresis */
+  roamer.reset(bssid, -75, 0);
+  roamer.scanStarted(0);
+  entry = scan_entry("home", 2, 6, -68);
+  roamer.consider(&entry, 0);
+  TEST_ASSERT_FALSE(roamer.candidate(&chosen, &index));
+
+  /* Unknown networks are ignored, the strongest known one is chosen */
+  roamer.reset(bssid, -75, 0);
+  roamer.scanStarted(0);
+  entry = scan_entry("stranger", 3, 1, -30);
+  roamer.consider(&entry, WiFiRoamer::INDEX_UNKNOWN);
+  entry = scan_entry("home", 4, 6, -60);
+  roamer.consider(&entry, 0);
+  entry = scan_entry("office", 5, 11, -45);
+  roamer.consider(&entry, 1);
+  entry = scan_entry("home", 6, 1, -55);
+  roamer.consider(&entry, 0);
+  TEST_ASSERT_TRUE(roamer.candidate(&chosen, &index));
+  TEST_ASSERT_EQUAL_STRING("office", chosen.ssid);
+  TEST_ASSERT_EQUAL(5, chosen.bssid[0]);
+  TEST_ASSERT_EQUAL(1, index);
+
+  /* The candidate is only returned once per scan */
+  TEST_ASSERT_FALSE(roamer.candidate(&chosen, &index));
+
+  /* The current AP seen in the scan is compared using its fresh signal */
+  roamer.reset(bssid, -75, 0);
+  roamer.scanStarted(0);
+  for (int i = 0; i < 8; i++) {
+    entry = scan_entry("current", 1, 6, -50);
+    roamer.consider(&entry, 0);
+  }
+  entry = scan_entry("office", 5, 11, -45);
+  roamer.consider(&entry, 1);
+  TEST_ASSERT_FALSE(roamer.candidate(&chosen, &index));
+}
+
+/* Roaming within a network reuses its lease with a directed association */
+void test_roam_directed_connect() {
+  mock_ap_t aps[] = {
+    { "home", "homepw", {0x10, 0, 0, 0, 0, 1}, 6, true, 300, 1200, 0x0a01a8c0, -80 },
+    { "home", "homepw", {0x10, 0, 0, 0, 0, 2}, 1, true, 300, 1200, 0x0a01a8c0, -45 },
+  };
+  MockWiFiDriver driver(aps, 2);
+  WiFiConnector connector(&driver);
+  WiFiRoamer roamer;
+  roamer.configure(10, -65, 1000, 5000);
+  struct network net;
+  init_network(&net, "home", "homepw");
+
+  TEST_ASSERT_TRUE(connector.connect(&net));
+  TEST_ASSERT_EQUAL(1, net.cache.bssid[5]);
+  roamer.reset(net.cache.bssid, driver.rssi(), driver.now);
+
+  /* Run the monitor until a scan completes with a candidate */
+  wifi_scan_entry_t entry;
+  uint8_t index = 0;
+  bool found = false;
+  for (int i = 0; i < 30 && !found; i++) {
+    driver.advance(1000);
+    if (roamer.sampleDue(driver.now)) {
+      roamer.sample(driver.rssi(), driver.now);
+    }
+    if (roamer.scanDue(driver.now)) {
+      driver.scanStart(true);
+      roamer.scanStarted(driver.now);
+    }
+    int16_t count = driver.scanComplete();
+    if (count >= 0) {
+      for (int16_t n = 0; n < count; n++) {
+        driver.scanResult(n, &entry);
+        roamer.consider(&entry, 0);
+      }
+      driver.scanDelete();
+      found = roamer.candidate(&entry, &index);
+    }
+  }
+  TEST_ASSERT_TRUE(found);
+  TEST_ASSERT_EQUAL(2, entry.bssid[5]);
+
+  driver.clearAttempts();
+  unsigned long start = driver.now;
+  TEST_ASSERT_TRUE(connector.connect(&net, entry.bssid, entry.channel));
+  TEST_ASSERT_EQUAL(1, driver.numAttempts);
+  TEST_ASSERT_TRUE(driver.attempts[0].directed);
+  TEST_ASSERT_TRUE(driver.attempts[0].staticIP);
+  TEST_ASSERT_LESS_OR_EQUAL(400, driver.now - start);
+  TEST_ASSERT_EQUAL(-45, driver.rssi());
+  TEST_ASSERT_EQUAL(2, net.cache.bssid[5]);
+
+  /* The cache is left alone by an access point that can't be connected */
+  const uint8_t gone[WFB_BSSID_LEN] = {0x10, 0, 0, 0, 0, 3};
+  for (int fast = 1; fast >= 0; fast--) {
+    connector.setFastReconnect(fast);
+    TEST_ASSERT_FALSE(connector.connect(&net, gone, 11));
+    TEST_ASSERT_TRUE(net.cache.valid);
+    TEST_ASSERT_EQUAL(2, net.cache.bssid[5]);
+    TEST_ASSERT_EQUAL(1, net.cache.channel);
+  }
+
+  free_network(&net);
+}
+
+/* A roam is progressed without blocking and bounded by the fast timeout */
+void test_roam_start_connect() {
+  mock_ap_t aps[] = {
+    { "home", "homepw", {0x10, 0, 0, 0, 0, 1}, 6, true, 300, 1200, 0x0a01a8c0, -80 },
+    { "home", "homepw", {0x10, 0, 0, 0, 0, 2}, 1, true, 300, 1200, 0x0a01a8c0, -45 },
+  };
+  MockWiFiDriver driver(aps, 2);
+  WiFiConnector connector(&driver);
+  struct network net;
+  init_network(&net, "home", "homepw");
+
+  TEST_ASSERT_TRUE(connector.connect(&net));
+  TEST_ASSERT_EQUAL(1, net.cache.bssid[5]);
+  uint8_t history = net.history.count;
+
+  driver.clearAttempts();
+  unsigned long start = driver.now;
+  connector.startConnect(&net, aps[1].bssid, aps[1].channel);
+  TEST_ASSERT_EQUAL(start, driver.now);
+  TEST_ASSERT_EQUAL(WFB_ATTEMPT_PENDING, connector.checkConnect());
+  while (connector.checkConnect() == WFB_ATTEMPT_PENDING) {
+    driver.advance(100);
+  }
+  TEST_ASSERT_EQUAL(WFB_STATUS_CONNECTED, driver.status());
+  TEST_ASSERT_EQUAL(1, driver.numAttempts);
+  TEST_ASSERT_TRUE(driver.attempts[0].directed);
+  TEST_ASSERT_TRUE(driver.attempts[0].staticIP);
+  TEST_ASSERT_GREATER_OR_EQUAL(aps[1].associateMs, driver.now - start);
+  TEST_ASSERT_EQUAL(2, net.cache.bssid[5]);
+  TEST_ASSERT_EQUAL(1, net.cache.channel);
+
+  /* One too slow to join fails at the fast timeout, without a full connect */
+  aps[0].associateMs = WiFiConnector::DEFAULT_FAST_TIMEOUT + 1000;
+  driver.clearAttempts();
+  start = driver.now;
+  connector.startConnect(&net, aps[0].bssid, aps[0].channel);
+  wifi_attempt_t result;
+  while ((result = connector.checkConnect()) == WFB_ATTEMPT_PENDING) {
+    driver.advance(100);
+  }
+  TEST_ASSERT_EQUAL(WFB_ATTEMPT_FAILED, result);
+  TEST_ASSERT_EQUAL(WFB_FAIL_TIMEOUT, net.lastFailure);
+  TEST_ASSERT_LESS_OR_EQUAL(WiFiConnector::DEFAULT_FAST_TIMEOUT + 100,
+                            driver.now - start);
+  TEST_ASSERT_EQUAL(1, driver.numAttempts);
+  TEST_ASSERT_TRUE(net.cache.valid);
+  TEST_ASSERT_EQUAL(2, net.cache.bssid[5]);
+  TEST_ASSERT_EQUAL(history, net.history.count);
+  TEST_ASSERT_EQUAL(0, net.stats.failures);
+
+  free_network(&net);
+}
+
+/* Channels are planned by the number of known networks last seen on them */
+void test_scan_plan_order() {
+  const uint8_t channels[] = {11, 6, 0, 6, 1};
+  struct network nets[5];
+  char ssid[32];
+  for (int i = 0; i < 5; i++) {
+    snprintf(ssid, sizeof (ssid), "net_%d", i);
+    init_network(&nets[i], ssid, ssid);
+    nets[i].lastChannel = channels[i];
+  }
+
+  WiFiScanPlanner planner;
+  planner.configure(100, 400, false);
+  planner.plan(nets, 5);
+  TEST_ASSERT_EQUAL(3, planner.numChannels());
+
+  wifi_scan_step_t step;
+  const uint8_t expected[] = {6, 11, 1, 0};
+  for (int i = 0; i < 4; i++) {
+    TEST_ASSERT_TRUE(planner.next(&step));
+    TEST_ASSERT_EQUAL(expected[i], step.channel);
+    TEST_ASSERT_FALSE(step.passive);
+    TEST_ASSERT_EQUAL(100, step.dwellMs);
+  }
+  TEST_ASSERT_FALSE(planner.next(&step));
+
+  /* A passive plan uses the passive dwell, and stops once a match is found */
+  planner.configure(100, 400, true);
+  planner.plan(nets, 5);
+  TEST_ASSERT_TRUE(planner.next(&step));
+  TEST_ASSERT_TRUE(step.passive);
+  TEST_ASSERT_EQUAL(400, step.dwellMs);
+
+  wifi_scan_entry_t entry = scan_entry("net_3", 1, 6, -70);
+  planner.consider(&entry, nets, 5);
+  entry = scan_entry("net_1", 2, 6, -50);
+  planner.consider(&entry, nets, 5);
+  entry = scan_entry("stranger", 3, 6, -40);
+  planner.consider(&entry, nets, 5);
+  entry = scan_entry("net_3", 4, 6, -60);
+  planner.consider(&entry, nets, 5);
+  TEST_ASSERT_TRUE(planner.found());
+  TEST_ASSERT_FALSE(planner.next(&step));
+
+  TEST_ASSERT_EQUAL(2, planner.numMatches());
+  TEST_ASSERT_EQUAL(1, planner.match(0)->index);
+  TEST_ASSERT_EQUAL(3, planner.match(1)->index);
+  TEST_ASSERT_EQUAL(-60, planner.match(1)->entry.rssi);
+
+  for (int i = 0; i < 5; i++) {
+    free_network(&nets[i]);
+  }
+}
+
+/* Connecting after a targeted scan only probes the remembered channel */
+void test_scan_connect_targeted() {
+  mock_ap_t aps[NUM_TEST_APS];
+  memcpy(aps, testAps, sizeof (aps));
+  MockWiFiDriver driver(aps, NUM_TEST_APS);
+  WiFiConnector connector(&driver);
+  WiFiScanPlanner planner;
+  planner.configure(120, 360, false);
+  struct network nets[2];
+  init_network(&nets[0], "office", "officepw");
+  init_network(&nets[1], "home", "homepw");
+
+  /* Nothing remembered, a single full scan finds both */
+  TEST_ASSERT_EQUAL(0, connector.connectScanned(nets, 2, &planner));
+  TEST_ASSERT_EQUAL(1, driver.numScans);
+  TEST_ASSERT_EQUAL(13 * 120, driver.scanTimeMs);
+  TEST_ASSERT_EQUAL(11, nets[0].lastChannel);
+  TEST_ASSERT_EQUAL(6, nets[1].lastChannel);
+  TEST_ASSERT_TRUE(driver.attempts[0].directed);
+
+  /* Next time only channel 11 is probed */
+  driver.disconnect();
+  driver.numScans = 0;
+  driver.scanTimeMs = 0;
+  TEST_ASSERT_EQUAL(0, connector.connectScanned(nets, 2, &planner));
+  TEST_ASSERT_EQUAL(1, driver.numScans);
+  TEST_ASSERT_EQUAL(120, driver.scanTimeMs);
+
+  /* The office AP moves, its old channel is empty and the plan widens */
+  aps[1].channel = 3;
+  aps[0].present = false;
+  driver.disconnect();
+  driver.numScans = 0;
+  TEST_ASSERT_EQUAL(0, connector.connectScanned(nets, 2, &planner));
+  TEST_ASSERT_EQUAL(3, driver.numScans);
+  TEST_ASSERT_EQUAL(3, nets[0].lastChannel);
+
+  /* Nothing visible, no connections are attempted */
+  aps[1].present = false;
+  driver.disconnect();
+  driver.clearAttempts();
+  TEST_ASSERT_EQUAL(WiFiConnector::INDEX_NONE,
+                    connector.connectScanned(nets, 2, &planner));
+  TEST_ASSERT_EQUAL(0, driver.numAttempts);
+
+  for (int i = 0; i < 2; i++) {
+    free_network(&nets[i]);
+  }
+}
+
+/*
+ * A penalized network found on its channel doesn't stop the plan widening,
+ * and the network stored by the SDK is still attempted
+ */
+void test_scan_connect_fallback() {
+  mock_ap_t aps[NUM_TEST_APS];
+  memcpy(aps, testAps, sizeof (aps));
+  MockWiFiDriver driver(aps, NUM_TEST_APS);
+  WiFiConnector connector(&driver);
+  connector.setPenalties(true);
+  WiFiScanPlanner planner;
+  struct network nets[3];
+  init_network(&nets[0], "", "");
+  init_network(&nets[1], "office", "stale");
+  init_network(&nets[2], "home", "homepw");
+  nets[1].lastChannel = 11;
+
+  /* The office fails and cools down, home is found by the wider scan */
+  aps[0].present = false;
+  TEST_ASSERT_EQUAL(WiFiConnector::INDEX_NONE,
+                    connector.connectScanned(nets, 3, &planner));
+  TEST_ASSERT_TRUE(connector.penalized(&nets[1]));
+  aps[0].present = true;
+  driver.numScans = 0;
+  driver.clearAttempts();
+  TEST_ASSERT_EQUAL(2, connector.connectScanned(nets, 3, &planner));
+  TEST_ASSERT_EQUAL(2, driver.numScans);
+  TEST_ASSERT_EQUAL(1, driver.numAttempts);
+  TEST_ASSERT_EQUAL_STRING("home", driver.attempts[0].ssid);
+
+  /* With nothing matched the stored network is attempted last */
+  connector.setPenalties(false);
+  aps[0].present = false;
+  driver.disconnect();
+  driver.clearAttempts();
+  TEST_ASSERT_EQUAL(WiFiConnector::INDEX_NONE,
+                    connector.connectScanned(nets, 3, &planner));
+  TEST_ASSERT_EQUAL_STRING("", driver.attempts[driver.numAttempts - 1].ssid);
+  TEST_ASSERT_EQUAL(WFB_FAIL_NO_SSID, nets[0].lastFailure);
+
+  for (int i = 0; i < 3; i++) {
+    free_network(&nets[i]);
+  }
+}
+
+/*
+ * Simulation benchmark of the time until a known network is first found, for
+ * targeted plans against always scanning every channel.
+ */
+void test_scan_time_to_first_match() {
+  const int SCENARIOS = 200;
+  const int NUM_APS = 20;
+  const int NUM_KNOWN = 4;
+  uint32_t seed = 12345;
+  unsigned long fullTotal = 0;
+  unsigned long plannedTotal = 0;
+
+  for (int n = 0; n < SCENARIOS; n++) {
+    mock_ap_t aps[NUM_APS];
+    char names[NUM_APS][16];
+    struct network nets[NUM_KNOWN];
+
+    for (int i = 0; i < NUM_APS; i++) {
+      seed = seed * 1103515245 + 12345;
+      snprintf(names[i], sizeof (names[i]), "ap_%d", i);
+      aps[i] = { names[i], "pw", {(uint8_t)i}, (uint8_t)(1 + (seed >> 16) % 13),
+                 true, 300, 1000, 0, (int8_t)(-40 - (seed >> 8) % 50) };
+    }
+
+    /* Known networks remember their channel, occasionally a stale one */
+    for (int i = 0; i < NUM_KNOWN; i++) {
+      seed = seed * 1103515245 + 12345;
+      init_network(&nets[i], names[i * 5], "pw");
+      nets[i].lastChannel = ((seed >> 16) % 10 == 0) ?
+                            (uint8_t)(1 + (seed >> 8) % 13) : aps[i * 5].channel;
+    }
+
+    for (int planned = 0; planned < 2; planned++) {
+      MockWiFiDriver driver(aps, NUM_APS);
+      driver.dwellMs = 120;
+      WiFiScanPlanner planner;
+      if (!planned) {
+        for (int i = 0; i < NUM_KNOWN; i++) nets[i].lastChannel = 0;
+      }
+      planner.plan(nets, NUM_KNOWN);
+
+      wifi_scan_step_t step;
+      wifi_scan_entry_t entry;
+      while (planner.next(&step)) {
+        driver.scanStart(false, step.channel, step.passive, step.dwellMs);
+        int16_t count = driver.scanComplete();
+        for (int16_t i = 0; i < count; i++) {
+          driver.scanResult(i, &entry);
+          planner.consider(&entry, nets, NUM_KNOWN);
+        }
+        driver.scanDelete();
+      }
+      TEST_ASSERT_TRUE(planner.found());
+
+      if (planned) {
+        plannedTotal += driver.scanTimeMs;
+      } else {
+        fullTotal += driver.scanTimeMs;
+      }
+    }
+
+    for (int i = 0; i < NUM_KNOWN; i++) {
+      free_network(&nets[i]);
+    }
+  }
+
+  char msg[80];
+  snprintf(msg, sizeof (msg), "time to first match full:%lums targeted:%lums",
+           fullTotal / SCENARIOS, plannedTotal / SCENARIOS);
+  TEST_MESSAGE(msg);
+  TEST_ASSERT_LESS_THAN(fullTotal / 4, plannedTotal);
+}
+
+/* Scans run in the background and their results are kept for the TTL */
+void test_scan_cache_async() {
+  MockWiFiDriver driver(testAps, NUM_TEST_APS);
+  WiFiScanCache cache;
+  cache.setTtlMs(10000);
+
+  TEST_ASSERT_FALSE(cache.ready());
+  TEST_ASSERT_FALSE(cache.fresh(driver.now));
+  TEST_ASSERT_TRUE(cache.start(&driver));
+  TEST_ASSERT_TRUE(cache.scanning());
+
+  /* Requests while scanning don't start another scan */
+  TEST_ASSERT_TRUE(cache.start(&driver));
+  TEST_ASSERT_EQUAL(1, driver.numScans);
+  TEST_ASSERT_FALSE(cache.poll(&driver, driver.now));
+
+  driver.advance(13 * 300);
+  TEST_ASSERT_TRUE(cache.poll(&driver, driver.now));
+  TEST_ASSERT_FALSE(cache.scanning());
+  TEST_ASSERT_TRUE(cache.ready());
+  TEST_ASSERT_EQUAL(1, cache.generation());
+  TEST_ASSERT_EQUAL(NUM_TEST_APS, cache.count());
+  TEST_ASSERT_EQUAL_STRING("office", cache.entry(1)->ssid);
+  TEST_ASSERT_EQUAL(-50, cache.entry(1)->rssi);
+  TEST_ASSERT_NULL(cache.entry(NUM_TEST_APS));
+
+  driver.advance(9000);
+  TEST_ASSERT_TRUE(cache.fresh(driver.now));
+  TEST_ASSERT_EQUAL(9000, cache.age(driver.now));
+  driver.advance(1000);
+  TEST_ASSERT_FALSE(cache.fresh(driver.now));
+
+  /* Stale results stay available while refreshing */
+  TEST_ASSERT_TRUE(cache.start(&driver));
+  TEST_ASSERT_TRUE(cache.ready());
+  TEST_ASSERT_EQUAL(NUM_TEST_APS, cache.count());
+}
+
+/* Scan-before-connect reuses fresh cached results and refreshes stale ones */
+void test_scan_cache_connect() {
+  MockWiFiDriver driver(testAps, NUM_TEST_APS);
+  WiFiConnector connector(&driver);
+  WiFiScanPlanner planner;
+  WiFiScanCache cache;
+  struct network net;
+  init_network(&net, "home", "homepw");
+
+  /* A background scan in progress is waited on and then used */
+  cache.start(&driver);
+  TEST_ASSERT_EQUAL(0, connector.connectScanned(&net, 1, &planner, &cache));
+  TEST_ASSERT_EQUAL(1, driver.numScans);
+  TEST_ASSERT_EQUAL(1, cache.generation());
+
+  /* Fresh results need no scan */
+  driver.disconnect();
+  TEST_ASSERT_EQUAL(0, connector.connectScanned(&net, 1, &planner, &cache));
+  TEST_ASSERT_EQUAL(1, driver.numScans);
+
+  /* Once stale a targeted scan is made, which doesn't replace the cache */
+  driver.advance(WiFiScanCache::DEFAULT_TTL);
+  driver.disconnect();
+  TEST_ASSERT_EQUAL(0, connector.connectScanned(&net, 1, &planner, &cache));
+  TEST_ASSERT_EQUAL(2, driver.numScans);
+  TEST_ASSERT_EQUAL(1, cache.generation());
+
+  /* A full scan made by the plan is stored */
+  net.lastChannel = 0;
+  driver.disconnect();
+  TEST_ASSERT_EQUAL(0, connector.connectScanned(&net, 1, &planner, &cache));
+  TEST_ASSERT_EQUAL(3, driver.numScans);
+  TEST_ASSERT_EQUAL(2, cache.generation());
+  TEST_ASSERT_TRUE(cache.fresh(driver.now));
+
+  free_network(&net);
+}
+
+/*
+ * Poll jobs every 100ms until one finishes, returning it, or null if it
+ * doesn't finish or a poll waits on the radio
+ */
+static wifi_job_t *run_jobs(WiFiConnectJobs *jobs, WiFiConnector *connector,
+                            MockWiFiDriver *driver, unsigned long limitMs) {
+  unsigned long start = driver->now;
+  while (driver->now - start < limitMs) {
+    unsigned long before = driver->now;
+    wifi_job_t *job = jobs->poll(connector, driver->now);
+    if (driver->now != before) {
+      return nullptr;
+    }
+    if (job) {
+      return job;
+    }
+    driver->advance(100);
+  }
+  return nullptr;
+}
+
+/* Connects are queued and progressed without blocking */
+void test_connect_jobs() {
+  MockWiFiDriver driver(testAps, NUM_TEST_APS);
+  WiFiConnector connector(&driver);
+  WiFiConnectJobs jobs;
+
+  TEST_ASSERT_FALSE(jobs.busy());
+  uint16_t id = jobs.add("home", "homepw", driver.now);
+  TEST_ASSERT_NOT_EQUAL(WiFiConnectJobs::JOB_NONE, id);
+  TEST_ASSERT_TRUE(jobs.busy());
+  TEST_ASSERT_EQUAL(WFB_JOB_QUEUED, jobs.find(id)->state);
+  TEST_ASSERT_EQUAL(0, driver.numAttempts);
+
+  TEST_ASSERT_NULL(jobs.poll(&connector, driver.now));
+  TEST_ASSERT_EQUAL(WFB_JOB_CONNECTING, jobs.find(id)->state);
+  TEST_ASSERT_EQUAL(1, driver.numAttempts);
+
+  driver.advance(1000);
+  TEST_ASSERT_EQUAL(1000, WiFiConnectJobs::elapsed(jobs.find(id), driver.now));
+
+  wifi_job_t *job = run_jobs(&jobs, &connector, &driver, 5000);
+  TEST_ASSERT_NOT_NULL(job);
+  TEST_ASSERT_EQUAL(id, job->id);
+  TEST_ASSERT_EQUAL(WFB_JOB_CONNECTED, job->state);
+  TEST_ASSERT_EQUAL(WFB_FAIL_NONE, job->failure);
+  TEST_ASSERT_EQUAL(3000, WiFiConnectJobs::elapsed(job, driver.now + 500));
+  TEST_ASSERT_EQUAL_STRING("homepw", job->passwd);
+  TEST_ASSERT_FALSE(jobs.busy());
+
+  /* The password is forgotten once the job has been handled */
+  TEST_ASSERT_NULL(jobs.poll(&connector, driver.now));
+  TEST_ASSERT_EQUAL_STRING("", jobs.find(id)->passwd);
+  TEST_ASSERT_EQUAL_STRING("connected",
+                           WiFiConnectJobs::stateString(jobs.find(id)->state));
+}
+
+/* Failures are reported, and finished jobs make way for new ones */
+void test_connect_jobs_failure() {
+  MockWiFiDriver driver(testAps, NUM_TEST_APS);
+  WiFiConnector connector(&driver);
+  WiFiConnectJobs jobs;
+  uint16_t ids[WiFiConnectJobs::MAX_JOBS];
+
+  for (uint8_t i = 0; i < WiFiConnectJobs::MAX_JOBS; i++) {
+    ids[i] = jobs.add("home", "wrong", driver.now + i);
+  }
+  TEST_ASSERT_EQUAL(WiFiConnectJobs::JOB_NONE, jobs.add("office", "officepw", 0));
+  TEST_ASSERT_NULL(jobs.find(WiFiConnectJobs::JOB_NONE));
+  TEST_ASSERT_NULL(jobs.find(ids[WiFiConnectJobs::MAX_JOBS - 1] + 1));
+
+  /* Jobs run in the order queued, failing fast on the wrong password */
+  wifi_job_t *job = run_jobs(&jobs, &connector, &driver, 5000);
+  TEST_ASSERT_NOT_NULL(job);
+  TEST_ASSERT_EQUAL(ids[0], job->id);
+  TEST_ASSERT_EQUAL(WFB_JOB_FAILED, job->state);
+  TEST_ASSERT_EQUAL(WFB_FAIL_AUTH, job->failure);
+  TEST_ASSERT_LESS_THAN(2500, WiFiConnectJobs::elapsed(job, driver.now));
+  TEST_ASSERT_TRUE(jobs.busy());
+
+  /* Once handled the finished job's slot is reused */
+  TEST_ASSERT_EQUAL(WiFiConnectJobs::JOB_NONE, jobs.add("office", "officepw", 0));
+  TEST_ASSERT_NULL(jobs.poll(&connector, driver.now));
+  uint16_t office = jobs.add("office", "officepw", driver.now);
+  TEST_ASSERT_NOT_EQUAL(WiFiConnectJobs::JOB_NONE, office);
+  TEST_ASSERT_NULL(jobs.find(ids[0]));
+
+  for (uint8_t i = 1; i < WiFiConnectJobs::MAX_JOBS; i++) {
+    job = run_jobs(&jobs, &connector, &driver, 5000);
+    TEST_ASSERT_NOT_NULL(job);
+    TEST_ASSERT_EQUAL(ids[i], job->id);
+  }
+  job = run_jobs(&jobs, &connector, &driver, 5000);
+  TEST_ASSERT_NOT_NULL(job);
+  TEST_ASSERT_EQUAL(office, job->id);
+  TEST_ASSERT_EQUAL(WFB_JOB_CONNECTED, job->state);
+}
+
+/* A job queued while connected finishes with its own network's association */
+void test_connect_jobs_while_connected() {
+  MockWiFiDriver driver(testAps, NUM_TEST_APS);
+  WiFiConnector connector(&driver);
+  WiFiConnectJobs jobs;
+  struct network home, office;
+  init_network(&home, "home", "homepw");
+  init_network(&office, "office", "officepw");
+
+  TEST_ASSERT_TRUE(connector.connect(&home));
+
+  /* A rejected password isn't hidden by the association still up */
+  uint16_t id = jobs.add("office", "wrong", driver.now);
+  wifi_job_t *job = run_jobs(&jobs, &connector, &driver, 5000);
+  TEST_ASSERT_NOT_NULL(job);
+  TEST_ASSERT_EQUAL(id, job->id);
+  TEST_ASSERT_EQUAL(WFB_JOB_FAILED, job->state);
+  TEST_ASSERT_EQUAL(WFB_FAIL_AUTH, job->failure);
+  TEST_ASSERT_NULL(jobs.poll(&connector, driver.now));
+
+  TEST_ASSERT_TRUE(connector.connect(&home));
+  unsigned long start = driver.now;
+  id = jobs.add("office", "officepw", driver.now);
+  job = run_jobs(&jobs, &connector, &driver, 5000);
+  TEST_ASSERT_NOT_NULL(job);
+  TEST_ASSERT_EQUAL(id, job->id);
+  TEST_ASSERT_EQUAL(WFB_JOB_CONNECTED, job->state);
+  TEST_ASSERT_GREATER_OR_EQUAL(driver.sweepMs + testAps[1].associateMs +
+                               testAps[1].dhcpMs, driver.now - start);
+
+  /* As when WiFiBase adds the network the job connected to */
+  connector.recordConnection(&office);
+  TEST_ASSERT_TRUE(office.cache.valid);
+  TEST_ASSERT_EQUAL(2, office.cache.bssid[5]);
+  TEST_ASSERT_EQUAL(11, office.cache.channel);
+  TEST_ASSERT_EQUAL(0x0b01a8c0, office.cache.lease.ip);
+
+  free_network(&home);
+  free_network(&office);
+}
+
+/* Sink collecting output into a fixed buffer */
+class TestSink : public OutputSink {
+  public:
+    char data[8192];
+    size_t length = 0;
+    int writes = 0;
+
+    void write(const char *d, size_t n) {
+      TEST_ASSERT_TRUE(length + n < sizeof (data));
+      memcpy(&data[length], d, n);
+      length += n;
+      data[length] = 0;
+      writes++;
+    }
+};
+
+void test_json_structure() {
+  TestSink sink;
+  JsonWriter json(&sink);
+
+  json.beginObject();
+  json.key("a").value(1);
+  json.key("b").beginArray().value(-2L).value(3000000000UL).value(true).null().endArray();
+  json.key("c").beginObject().endObject();
+  json.key("d").beginArray().beginArray().endArray().beginObject().key("e").value(false).endObject().endArray();
+  json.key("f").raw("[1]", 3);
+  json.endObject();
+  json.flush();
+
+  TEST_ASSERT_EQUAL_STRING("{\"a\":1,\"b\":[-2,3000000000,true,null],\"c\":{},"
+                           "\"d\":[[],{\"e\":false}],\"f\":[1]}", sink.data);
+  TEST_ASSERT_EQUAL(sink.length, json.bytes());
+}
+
+void test_json_escaping() {
+  TestSink sink;
+  JsonWriter json(&sink);
+
+  json.beginArray();
+  json.value("say \"hi\"\\");
+  json.value("a\nb\tc\r\x01\x1f");
+  json.value("caf\xc3\xa9");
+  json.value((const char *)nullptr);
+  json.value("abc", 2);
+  json.endArray();
+  json.flush();
+
+  TEST_ASSERT_EQUAL_STRING("[\"say \\\"hi\\\"\\\\\",\"a\\nb\\tc\\r\\u0001\\u001f\","
+                           "\"caf\xc3\xa9\",null,\"ab\"]", sink.data);
+}
+
+/* Output larger than the buffer is passed on in buffer sized pieces */
+void test_json_chunked() {
+  TestSink sink;
+  JsonWriter json(&sink);
+  char ssid[40];
+  memset(ssid, 'x', sizeof (ssid) - 1);
+  ssid[sizeof (ssid) - 1] = 0;
+
+  json.beginArray();
+  for (int i = 0; i < 50; i++) {
+    json.value(ssid);
+  }
+  json.endArray();
+  TEST_ASSERT_EQUAL(json.bytes() / JsonWriter::BUFFER_SIZE, sink.writes);
+  json.flush();
+
+  TEST_ASSERT_EQUAL(2 + 50 * 41 + 49, sink.length);
+  TEST_ASSERT_EQUAL(json.bytes(), sink.length);
+  TEST_ASSERT_EQUAL('[', sink.data[0]);
+  TEST_ASSERT_EQUAL(']', sink.data[sink.length - 1]);
+}
+
+/* Preformatted members are joined to written ones, long runs without copying */
+void test_json_raw_members() {
+  TestSink sink;
+  JsonWriter json(&sink);
+  char members[400];
+  size_t n = 0;
+  for (int i = 0; i < 40; i++) {
+    n += snprintf(&members[n], sizeof (members) - n, "%s\"m%d\":%d", i ? "," : "", i, i);
+  }
+
+  json.beginObject();
+  json.raw(members, n);
+  json.key("last").value(1);
+  json.endObject();
+  TEST_ASSERT_EQUAL(2, sink.writes);
+  json.flush();
+
+  TEST_ASSERT_EQUAL(0, strncmp(sink.data, "{\"m0\":0,\"m1\":1", 14));
+  TEST_ASSERT_EQUAL_STRING(",\"m39\":39,\"last\":1}", &sink.data[sink.length - 19]);
+  TEST_ASSERT_EQUAL(json.bytes(), sink.length);
+}
+
+void test_metrics_format() {
+  TestSink sink;
+  MetricsWriter metrics(&sink);
+  metrics_histogram_t histogram;
+  memset(&histogram, 0, sizeof (histogram));
+
+  MetricsWriter::observe(&histogram, &WFB_CONNECT_BUCKETS, 200);
+  MetricsWriter::observe(&histogram, &WFB_CONNECT_BUCKETS, 250);
+  MetricsWriter::observe(&histogram, &WFB_CONNECT_BUCKETS, 1800);
+  MetricsWriter::observe(&histogram, &WFB_CONNECT_BUCKETS, 20000);
+
+  metrics.family("test_rssi_dbm", "gauge", "Signal");
+  metrics.sample("test_rssi_dbm", -67L);
+  metrics.sample("test_total", 42UL, "network", "a\"b\\c\nd");
+  metrics.sampleFixed("test_ratio", 953, 3);
+  metrics.sampleFixed("test_seconds", 12000, 3);
+  metrics.histogram("test_duration_seconds", &histogram, &WFB_CONNECT_BUCKETS,
+                    "network", "home");
+  metrics.flush();
+
+  TEST_ASSERT_EQUAL_STRING(
+          "# HELP test_rssi_dbm Signal\n"
+          "# TYPE test_rssi_dbm gauge\n"
+          "test_rssi_dbm -67\n"
+          "test_total{network=\"a\\\"b\\\\c\\nd\"} 42\n"
+          "test_ratio 0.953\n"
+          "test_seconds 12\n"
+          "test_duration_seconds_bucket{network=\"home\",le=\"0.25\"} 2\n"
+          "test_duration_seconds_bucket{network=\"home\",le=\"0.5\"} 2\n"
+          "test_duration_seconds_bucket{network=\"home\",le=\"1\"} 2\n"
+          "test_duration_seconds_bucket{network=\"home\",le=\"2\"} 3\n"
+          "test_duration_seconds_bucket{network=\"home\",le=\"4\"} 3\n"
+          "test_duration_seconds_bucket{network=\"home\",le=\"8\"} 3\n"
+          "test_duration_seconds_bucket{network=\"home\",le=\"16\"} 3\n"
+          "test_duration_seconds_bucket{network=\"home\",le=\"+Inf\"} 4\n"
+          "test_duration_seconds_sum{network=\"home\"} 22.25\n"
+          "test_duration_seconds_count{network=\"home\"} 4\n",
+          sink.data);
+  TEST_ASSERT_EQUAL(sink.length, metrics.bytes());
+}
+
+/* Connect attempts are counted per network */
+void test_metrics_connect_stats() {
+  MockWiFiDriver driver(testAps, NUM_TEST_APS);
+  WiFiConnector connector(&driver);
+  connector.setPenalties(false);
+  struct network nets[2];
+  init_network(&nets[0], "home", "wrong");
+  init_network(&nets[1], "office", "officepw");
+
+  TEST_ASSERT_EQUAL(1, connector.connectKnown(nets, 2));
+  driver.disconnect();
+  TEST_ASSERT_EQUAL(1, connector.connectKnown(nets, 2));
+
+  TEST_ASSERT_EQUAL(2, nets[0].stats.attempts);
+  TEST_ASSERT_EQUAL(2, nets[0].stats.failures);
+  TEST_ASSERT_EQUAL(0, nets[0].stats.durations.count);
+  TEST_ASSERT_EQUAL(2, nets[1].stats.attempts);
+  TEST_ASSERT_EQUAL(2, nets[1].stats.successes);
+  TEST_ASSERT_EQUAL(2, nets[1].stats.durations.count);
+  /* A full connect within 4s, then a fast reconnect within 500ms */
+  TEST_ASSERT_EQUAL(1, nets[1].stats.durations.buckets[4]);
+  TEST_ASSERT_EQUAL(1, nets[1].stats.durations.buckets[1]);
+
+  for (int i = 0; i < 2; i++) {
+    free_network(&nets[i]);
+  }
+}
+
+void test_metrics_connected_time() {
+  ConnectedTime time;
+
+  TEST_ASSERT_EQUAL(0, time.connectedMs(1000));
+  time.update(true, 1000);
+  TEST_ASSERT_EQUAL(500, time.connectedMs(1500));
+  time.update(true, 1500);
+  time.update(false, 3000);
+  TEST_ASSERT_EQUAL(2000, time.connectedMs(5000));
+  time.update(true, 6000);
+  TEST_ASSERT_EQUAL(3000, time.connectedMs(7000));
+}
+
+/* Idle passes are made at the interval, and sooner after handling requests */
+void test_service_schedule() {
+  WiFiServiceScheduler scheduler;
+  scheduler.configure(20, 2);
+
+  TEST_ASSERT_TRUE(scheduler.due(0));
+  scheduler.serviced(0, 1, false);
+  TEST_ASSERT_FALSE(scheduler.due(19));
+  TEST_ASSERT_EQUAL(19, scheduler.wait(1));
+  TEST_ASSERT_TRUE(scheduler.due(20));
+
+  scheduler.serviced(20, 21, true);
+  TEST_ASSERT_EQUAL(1, scheduler.wait(21));
+  TEST_ASSERT_TRUE(scheduler.due(22));
+
+  /* An overrunning pass delays the next rather than bursting */
+  scheduler.serviced(22, 80, false);
+  TEST_ASSERT_EQUAL(1, scheduler.overruns());
+  TEST_ASSERT_FALSE(scheduler.due(99));
+  TEST_ASSERT_TRUE(scheduler.due(100));
+  TEST_ASSERT_EQUAL(3, scheduler.passes());
+
+  /* The busy interval never exceeds the idle interval */
+  scheduler.configure(5, 10);
+  scheduler.serviced(100, 100, true);
+  TEST_ASSERT_EQUAL(5, scheduler.wait(100));
+}
+
+/*
+ * Simulation of request latency when serviced from an application loop()
+ * against the service task's schedule.  Each request takes 3ms to serve.
+ */
+void test_service_latency() {
+  const int REQUESTS = 500;
+  const unsigned long LOOP_PERIOD = 100;
+  const unsigned long SERVE_MS = 3;
+  unsigned long arrivals[REQUESTS];
+  uint32_t seed = 4321;
+  unsigned long t = 0;
+
+  for (int i = 0; i < REQUESTS; i++) {
+    seed = seed * 1103515245 + 12345;
+    /* Mostly isolated requests, with some back to back */
+    t += ((seed >> 16) % 4 == 0) ? 1 : 50 + (seed >> 8) % 400;
+    arrivals[i] = t;
+  }
+
+  unsigned long total[2] = {0, 0};
+  uint32_t passes[2] = {0, 0};
+  for (int mode = 0; mode < 2; mode++) {
+    WiFiServiceScheduler scheduler;
+    unsigned long now = 0;
+    int next = 0;
+    while (next < REQUESTS) {
+      bool serve = mode ? scheduler.due(now) : (now % LOOP_PERIOD == 0);
+      if (!serve) {
+        now++;
+        continue;
+      }
+
+      /* A pass serves a single pending request, as handleClient() does */
+      unsigned long start = now;
+      bool busy = false;
+      if (arrivals[next] <= now) {
+        now += SERVE_MS;
+        total[mode] += now - arrivals[next];
+        next++;
+        busy = true;
+      }
+      passes[mode]++;
+      scheduler.serviced(start, now, busy);
+      if (now == start) {
+        now++;
+      }
+    }
+  }
+
+  char msg[120];
+  snprintf(msg, sizeof (msg), "mean latency loop():%lums (%u passes) "
+           "task:%lums (%u passes)", total[0] / REQUESTS, (unsigned)passes[0],
+           total[1] / REQUESTS, (unsigned)passes[1]);
+  TEST_MESSAGE(msg);
+  TEST_ASSERT_LESS_THAN(total[0] / 4, total[1]);
+}
+
+/*
+ * Model of the String concatenation the handlers previously used, which
+ * reallocates to the exact length on every append.
+ */
+class StringModel {
+  public:
+    char *buffer = nullptr;
+    size_t length = 0;
+    int allocations = 0;
+    size_t copied = 0;
+
+    ~StringModel() { free(buffer); }
+
+    void append(const char *s) {
+      size_t n = strlen(s);
+      buffer = (char *)realloc(buffer, length + n + 1);
+      allocations++;
+      copied += length;  // Worst case the old contents move
+      memcpy(&buffer[length], s, n + 1);
+      length += n;
+      copied += n;
+    }
+
+    void append(long i) {
+      char number[12];
+      snprintf(number, sizeof (number), "%ld", i);
+      append(number);
+    }
+};
+
+static unsigned long newCount = 0;
+
+void *operator new(size_t size) {
+  newCount++;
+  void *p = malloc(size);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void *p) noexcept {
+  free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+  free(p);
+}
+
+/*
+ * Benchmark of allocations and bytes copied to build a 40 network /scan
+ * response, streamed against concatenated.
+ */
+void test_json_scan_benchmark() {
+  const int NUM_NETWORKS = 40;
+  wifi_scan_entry_t entries[NUM_NETWORKS];
+  for (int i = 0; i < NUM_NETWORKS; i++) {
+    entries[i] = scan_entry("", i, 1 + i % 13, -40 - i);
+    snprintf(entries[i].ssid, sizeof (entries[i].ssid), "network-%02d", i);
+    entries[i].open = (i % 3 == 0);
+  }
+
+  StringModel model;
+  model.append("{\"state\":\"");
+  model.append("ready");
+  model.append("\",\"age\":");
+  model.append(1234L);
+  model.append(",\"count\":");
+  model.append((long)NUM_NETWORKS);
+  model.append(",\"networks\":[");
+  for (int i = 0; i < NUM_NETWORKS; i++) {
+    model.append("[\"");
+    model.append(entries[i].ssid);
+    model.append("\",");
+    model.append((long)entries[i].rssi);
+    model.append(",");
+    model.append(entries[i].open ? "\"\"" : "\"*\"");
+    model.append("]");
+    if (i != NUM_NETWORKS - 1) {
+      model.append(",");
+    }
+  }
+  model.append("]}");
+  model.copied += model.length;  // Copied again into the response
+
+  TestSink sink;
+  unsigned long before = newCount;
+  JsonWriter json(&sink);
+  json.beginObject();
+  json.key("state").value("ready");
+  json.key("age").value(1234UL);
+  json.key("count").value(NUM_NETWORKS);
+  json.key("networks").beginArray();
+  for (int i = 0; i < NUM_NETWORKS; i++) {
+    json.beginArray();
+    json.value(entries[i].ssid);
+    json.value((int)entries[i].rssi);
+    json.value(entries[i].open ? "" : "*");
+    json.endArray();
+  }
+  json.endArray();
+  json.endObject();
+  json.flush();
+  unsigned long allocations = newCount - before;
+
+  TEST_ASSERT_EQUAL_STRING(model.buffer, sink.data);
+
+  char msg[120];
+  snprintf(msg, sizeof (msg),
+           "scan response %u bytes, String: %d allocs %u copied, "
+           "streamed: %lu allocs %u copied",
+           (unsigned)model.length, model.allocations, (unsigned)model.copied,
+           allocations, (unsigned)json.bytes());
+  TEST_MESSAGE(msg);
+  TEST_ASSERT_EQUAL(0, allocations);
+  TEST_ASSERT_LESS_THAN(model.copied / 10, json.bytes());
+}
+
+/*
+ * Connect a client to the server under test, non-blocking so that the server
+ * can be pumped from the same thread.
+ */
+static int http_connect(uint16_t port) {
+  struct sockaddr_in addr;
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+  memset(&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  if (connect(fd, (struct sockaddr *)&addr, sizeof (addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+  return fd;
+}
+
+static void http_write(int fd, const char *request) {
+  size_t length = strlen(request);
+  while (length) {
+    ssize_t result = send(fd, request, length, MSG_NOSIGNAL);
+    if (result > 0) {
+      request += result;
+      length -= result;
+    } else if (errno != EAGAIN) {
+      return;
+    }
+  }
+}
+
+/**
+ * Length of the first complete response in a buffer
+ * @return The length, or 0 if incomplete
+ */
+static size_t http_complete(const char *data, size_t length) {
+  const char *end = strstr(data, "\r\n\r\n");
+  if (!end) {
+    return 0;
+  }
+  size_t head = end - data + 4;
+  const char *cl = strstr(data, "Content-Length: ");
+  if (cl && cl < end) {
+    size_t total = head + strtoul(cl + 16, nullptr, 10);
+    return length >= total ? total : 0;
+  }
+  const char *last = strstr(end, "\r\n0\r\n\r\n");
+  return last ? last - data + 7 : 0;
+}
+
+static char httpResponse[8192];
+
+/* Time allowed for a response before giving up */
+#define HTTP_TIMEOUT_MS 2000
+
+static unsigned long http_ms() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * Pump the server until a number of complete responses have been received
+ * @return The length received, with the server's close reported through closed
+ */
+static size_t http_read(WiFiBaseServer *server, int fd, int responses,
+                        bool *closed = nullptr) {
+  size_t length = 0;
+  int complete = 0;
+  if (closed) *closed = false;
+  httpResponse[0] = '\0';
+
+  unsigned long start = http_ms();
+  while (complete < responses && http_ms() - start < HTTP_TIMEOUT_MS) {
+    server->handleClient();
+    ssize_t result = recv(fd, httpResponse + length,
+                          sizeof (httpResponse) - 1 - length, 0);
+    if (result == 0) {
+      if (closed) *closed = true;
+      break;
+    }
+    if (result > 0) {
+      length += result;
+      httpResponse[length] = '\0';
+      complete = 0;
+      size_t offset = 0, one;
+      while ((one = http_complete(httpResponse + offset, length - offset))) {
+        offset += one;
+        complete++;
+      }
+    }
+  }
+  return length;
+}
+
+static const char *http_body(const char *response) {
+  const char *end = strstr(response, "\r\n\r\n");
+  return end ? end + 4 : "";
+}
+
+static void echo_routes(WiFiBaseServer *server) {
+  server->on("/echo", [server]() {
+    char body[64];
+    snprintf(body, sizeof (body), "%s %s|%s|%s", server->method(),
+             server->arg("name"), server->arg("x"),
+             server->hasArg("missing") ? "yes" : "no");
+    server->send(200, "text/plain", body);
+  });
+  server->on("/agent", [server]() {
+    const char *agent = server->header("user-agent");
+    server->send(200, "text/plain", agent ? agent : "none");
+  });
+  server->on("/empty", []() {});
+}
+
+/* Requests are routed and their arguments decoded in place */
+void test_server_routes() {
+  WiFiBaseServer server(0);
+  echo_routes(&server);
+  TEST_ASSERT_TRUE(server.begin());
+
+  int fd = http_connect(server.port());
+  TEST_ASSERT_TRUE(fd >= 0);
+
+  http_write(fd, "GET /echo?name=a%20b&x=1+2 HTTP/1.1\r\nHost: t\r\n\r\n");
+  http_read(&server, fd, 1);
+  TEST_ASSERT_EQUAL(0, strncmp(httpResponse, "HTTP/1.1 200 OK\r\n", 17));
+  TEST_ASSERT_NOT_NULL(strstr(httpResponse, "Content-Length: 14\r\n"));
+  TEST_ASSERT_EQUAL_STRING("GET a b|1 2|no", http_body(httpResponse));
+
+  /* Form encoded bodies provide arguments too */
+  http_write(fd, "POST /echo HTTP/1.1\r\nContent-Type: "
+             "application/x-www-form-urlencoded\r\nContent-Length: 13\r\n\r\n"
+             "name=c&x=%3D");
+  http_read(&server, fd, 0);
+  TEST_ASSERT_EQUAL(0, httpResponse[0]);
+  http_write(fd, "1");
+  http_read(&server, fd, 1);
+  TEST_ASSERT_EQUAL_STRING("POST c|=1|no", http_body(httpResponse));
+
+  http_write(fd, "GET /agent HTTP/1.1\r\nUser-Agent: tester\r\n\r\n");
+  http_read(&server, fd, 1);
+  TEST_ASSERT_EQUAL_STRING("tester", http_body(httpResponse));
+
+  /* Unknown routes and handlers that don't respond */
+  http_write(fd, "GET /missing HTTP/1.1\r\n\r\n");
+  http_read(&server, fd, 1);
+  TEST_ASSERT_EQUAL(0, strncmp(httpResponse, "HTTP/1.1 404 ", 13));
+  http_write(fd, "GET /empty HTTP/1.1\r\n\r\n");
+  http_read(&server, fd, 1);
+  TEST_ASSERT_EQUAL(0, strncmp(httpResponse, "HTTP/1.1 500 ", 13));
+  TEST_ASSERT_EQUAL(5, server.requests());
+
+  /* Headers that can't fit the buffer are rejected and the connection closed */
+  char big[WiFiBaseServer::BUFFER_SIZE + 64];
+  memset(big, 'a', sizeof (big) - 1);
+  big[sizeof (big) - 1] = '\0';
+  memcpy(big, "GET / HTTP/1.1\r\nX: ", 19);
+  http_write(fd, big);
+  http_read(&server, fd, 1);
+  TEST_ASSERT_EQUAL(0, strncmp(httpResponse, "HTTP/1.1 431 ", 13));
+  TEST_ASSERT_NOT_NULL(strstr(httpResponse, "Connection: close\r\n"));
+
+  /* The rest of the request is drained until the client closes */
+  bool closed;
+  shutdown(fd, SHUT_WR);
+  http_read(&server, fd, 1, &closed);
+  TEST_ASSERT_TRUE(closed);
+  for (int i = 0; i < 100 && server.clients(); i++) {
+    server.handleClient();
+  }
+  TEST_ASSERT_EQUAL(0, server.clients());
+  close(fd);
+
+  /* Routes past the table are refused, replacing one still works */
+  static char paths[WiFiBaseServer::MAX_ROUTES + 1][8];
+  WiFiBaseServer full(0);
+  for (int i = 0; i <= WiFiBaseServer::MAX_ROUTES; i++) {
+    snprintf(paths[i], sizeof (paths[i]), "/r%d", i);
+    TEST_ASSERT_EQUAL(i < WiFiBaseServer::MAX_ROUTES, full.on(paths[i], []() {}));
+  }
+  TEST_ASSERT_TRUE(full.on(paths[0], []() {}));
+}
+
+/* Connections are reused, pipelined requests answered in order */
+void test_server_keepalive() {
+  WiFiBaseServer server(0);
+  echo_routes(&server);
+  TEST_ASSERT_TRUE(server.begin());
+
+  int fd = http_connect(server.port());
+  for (int i = 0; i < 3; i++) {
+    http_write(fd, "GET /echo?name=k HTTP/1.1\r\n\r\n");
+    http_read(&server, fd, 1);
+    TEST_ASSERT_NOT_NULL(strstr(httpResponse, "Connection: keep-alive\r\n"));
+    TEST_ASSERT_EQUAL_STRING("GET k||no", http_body(httpResponse));
+  }
+  TEST_ASSERT_EQUAL(1, server.clients());
+
+  http_write(fd, "GET /echo?name=1 HTTP/1.1\r\n\r\n"
+                 "GET /echo?name=2 HTTP/1.1\r\n\r\n");
+  http_read(&server, fd, 2);
+  const char *second = strstr(httpResponse, "GET 1||no") + 9;
+  TEST_ASSERT_EQUAL_STRING("GET 2||no", http_body(second));
+
+  /* Closed when asked, and by default for HTTP/1.0 */
+  bool closed;
+  http_write(fd, "GET /echo HTTP/1.1\r\nConnection: close\r\n\r\n");
+  http_read(&server, fd, 2, &closed);
+  TEST_ASSERT_NOT_NULL(strstr(httpResponse, "Connection: close\r\n"));
+  TEST_ASSERT_TRUE(closed);
+  close(fd);
+
+  fd = http_connect(server.port());
+  http_write(fd, "GET /echo HTTP/1.0\r\n\r\n");
+  http_read(&server, fd, 2, &closed);
+  TEST_ASSERT_TRUE(closed);
+  close(fd);
+  server.handleClient();
+  TEST_ASSERT_EQUAL(0, server.clients());
+}
+
+/* Several clients are served concurrently, each with its own buffer */
+void test_server_clients() {
+  WiFiBaseServer server(0);
+  echo_routes(&server);
+  TEST_ASSERT_TRUE(server.begin());
+
+  int fds[WiFiBaseServer::MAX_CLIENTS];
+  for (int i = 0; i < WiFiBaseServer::MAX_CLIENTS; i++) {
+    fds[i] = http_connect(server.port());
+    /* Send only part of each request before moving on */
+    http_write(fds[i], "GET /echo?na");
+    server.handleClient();
+  }
+  TEST_ASSERT_EQUAL(WiFiBaseServer::MAX_CLIENTS, server.clients());
+
+  for (int i = WiFiBaseServer::MAX_CLIENTS - 1; i >= 0; i--) {
+    char rest[48];
+    snprintf(rest, sizeof (rest), "me=%d HTTP/1.1\r\n\r\n", i);
+    http_write(fds[i], rest);
+    http_read(&server, fds[i], 1);
+
+    char expected[16];
+    snprintf(expected, sizeof (expected), "GET %d||no", i);
+    TEST_ASSERT_EQUAL_STRING(expected, http_body(httpResponse));
+  }
+
+  for (int i = 0; i < WiFiBaseServer::MAX_CLIENTS; i++) {
+    close(fds[i]);
+  }
+}
+
+/* Streamed responses are chunked, with large chunks bypassing the buffer */
+void test_server_chunked() {
+  static char large[2000];
+  memset(large, 'x', sizeof (large));
+
+  WiFiBaseServer server(0);
+  server.on("/stream", [&server]() {
+    server.sendHeader("Cache-Control", "no-cache");
+    server.beginChunked(200, "application/json");
+    server.sendChunk("hello", 5);
+    server.sendChunk(large, sizeof (large));
+    server.sendChunk(" world", 6);
+    /* Left for the server to terminate */
+  });
+  TEST_ASSERT_TRUE(server.begin());
+
+  int fd = http_connect(server.port());
+  http_write(fd, "GET /stream HTTP/1.1\r\n\r\n");
+  size_t length = http_read(&server, fd, 1);
+
+  TEST_ASSERT_NOT_NULL(strstr(httpResponse, "Transfer-Encoding: chunked\r\n"));
+  TEST_ASSERT_NOT_NULL(strstr(httpResponse, "Cache-Control: no-cache\r\n"));
+  const char *body = http_body(httpResponse);
+  TEST_ASSERT_EQUAL(0, strncmp(body, "5\r\nhello\r\n7d0\r\nxxx", 18));
+  TEST_ASSERT_EQUAL_STRING("\r\n6\r\n world\r\n0\r\n\r\n", body + 15 + 2000);
+  TEST_ASSERT_EQUAL(length, (body - httpResponse) + 15 + 2000 + 18);
+
+  /* The extra header applies only to the response it was added for */
+  server.on("/plain", [&server]() { server.send(200, "text/plain", "p"); });
+  http_write(fd, "GET /plain HTTP/1.1\r\n\r\n");
+  http_read(&server, fd, 1);
+  TEST_ASSERT_NULL(strstr(httpResponse, "Cache-Control"));
+  close(fd);
+}
+
+static double elapsed_ms(struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000.0 +
+         (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+/*
+ * Load benchmark of requests per second over a kept alive connection against
+ * a new connection per request, as WebServer required, along with the heap
+ * allocations made per request.
+ */
+void test_server_benchmark() {
+  const int REQUESTS = 500;
+  WiFiBaseServer server(0);
+  echo_routes(&server);
+  TEST_ASSERT_TRUE(server.begin());
+
+  struct timespec start;
+  int fd = http_connect(server.port());
+  unsigned long before = newCount;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < REQUESTS; i++) {
+    http_write(fd, "GET /echo?name=bench&x=1 HTTP/1.1\r\n\r\n");
+    http_read(&server, fd, 1);
+  }
+  double keepAlive = elapsed_ms(&start);
+  unsigned long allocations = newCount - before;
+  close(fd);
+  TEST_ASSERT_EQUAL_STRING("GET bench|1|no", http_body(httpResponse));
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < REQUESTS; i++) {
+    bool closed;
+    fd = http_connect(server.port());
+    http_write(fd, "GET /echo?name=bench&x=1 HTTP/1.1\r\n"
+                   "Connection: close\r\n\r\n");
+    http_read(&server, fd, 2, &closed);
+    close(fd);
+  }
+  double perConnection = elapsed_ms(&start);
+  TEST_ASSERT_EQUAL_STRING("GET bench|1|no", http_body(httpResponse));
+
+  char msg[160];
+  snprintf(msg, sizeof (msg), "%d requests, keep-alive: %.0f req/s, "
+           "connection per request: %.0f req/s, %lu allocations",
+           REQUESTS, REQUESTS * 1000.0 / keepAlive,
+           REQUESTS * 1000.0 / perConnection, allocations);
+  TEST_MESSAGE(msg);
+  TEST_ASSERT_EQUAL(0, allocations);
+  TEST_ASSERT_TRUE(keepAlive < perConnection);
+}
+
+/**
+ * Pump the server until text is received, for responses without a length
+ * @return true if it was received
+ */
+static bool http_wait(WiFiBaseServer *server, int fd, const char *text) {
+  size_t length = 0;
+  httpResponse[0] = '\0';
+
+  unsigned long start = http_ms();
+  while (http_ms() - start < HTTP_TIMEOUT_MS) {
+    server->handleClient();
+    ssize_t result = recv(fd, httpResponse + length,
+                          sizeof (httpResponse) - 1 - length, 0);
+    if (result == 0) {
+      return false;
+    }
+    if (result > 0) {
+      length += result;
+      httpResponse[length] = '\0';
+      if (strstr(httpResponse, text)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+/* Subscribers are held open and share each broadcast */
+void test_server_subscribe() {
+  WiFiBaseServer server(0);
+  echo_routes(&server);
+  server.on("/events", [&server]() {
+    if (!server.subscribe("text/event-stream")) {
+      server.send(503, "text/plain", "busy");
+      return;
+    }
+    server.sendChunk("event: hello\n\n", 14);
+  });
+  TEST_ASSERT_TRUE(server.begin());
+
+  int fds[WiFiBaseServer::MAX_SUBSCRIBERS];
+  for (int i = 0; i < WiFiBaseServer::MAX_SUBSCRIBERS; i++) {
+    fds[i] = http_connect(server.port());
+    http_write(fds[i], "GET /events HTTP/1.1\r\n\r\n");
+    TEST_ASSERT_TRUE(http_wait(&server, fds[i], "event: hello\n\n"));
+  }
+  TEST_ASSERT_NOT_NULL(strstr(httpResponse, "Content-Type: text/event-stream\r\n"));
+  TEST_ASSERT_NOT_NULL(strstr(httpResponse, "Cache-Control: no-cache\r\n"));
+  TEST_ASSERT_NULL(strstr(httpResponse, "Content-Length"));
+  TEST_ASSERT_EQUAL(WiFiBaseServer::MAX_SUBSCRIBERS, server.subscribers());
+
+  /* Requests are still served, but no more subscribers are taken */
+  int fd = http_connect(server.port());
+  http_write(fd, "GET /echo?name=s HTTP/1.1\r\n\r\n");
+  http_read(&server, fd, 1);
+  TEST_ASSERT_EQUAL_STRING("GET s||no", http_body(httpResponse));
+  http_write(fd, "GET /events HTTP/1.1\r\n\r\n");
+  http_read(&server, fd, 1);
+  TEST_ASSERT_EQUAL(0, strncmp(httpResponse, "HTTP/1.1 503 ", 13));
+  close(fd);
+
+  server.broadcast("event: a\ndata: 1\n\n", 18);
+  for (int i = 0; i < WiFiBaseServer::MAX_SUBSCRIBERS; i++) {
+    TEST_ASSERT_TRUE(http_wait(&server, fds[i], "event: a\ndata: 1\n\n"));
+  }
+
+  /* A subscriber closing frees its slot */
+  close(fds[0]);
+  for (int i = 0; i < 1000 && server.subscribers() == WiFiBaseServer::MAX_SUBSCRIBERS; i++) {
+    server.handleClient();
+  }
+  TEST_ASSERT_EQUAL(WiFiBaseServer::MAX_SUBSCRIBERS - 1, server.subscribers());
+  server.broadcast("event: b\n\n", 10);
+  TEST_ASSERT_TRUE(http_wait(&server, fds[1], "event: b\n\n"));
+
+  /* Subscribers that stop reading are dropped rather than waited on */
+  static char event[16 * 1024];
+  memset(event, 'x', sizeof (event));
+  unsigned long slowest = 0;
+  for (int i = 0; i < 4000 && server.subscribers(); i++) {
+    unsigned long start = http_ms();
+    server.broadcast(event, sizeof (event));
+    if (http_ms() - start > slowest) {
+      slowest = http_ms() - start;
+    }
+  }
+  TEST_ASSERT_EQUAL(0, server.subscribers());
+  TEST_ASSERT_LESS_THAN(100, slowest);
+
+  for (int i = 1; i < WiFiBaseServer::MAX_SUBSCRIBERS; i++) {
+    close(fds[i]);
+  }
+}
+
+/* Events are written only for what changed */
+void test_events_deltas() {
+  MockWiFiDriver driver(testAps, NUM_TEST_APS);
+  WiFiScanCache cache;
+  WiFiEvents events;
+  TestSink sink;
+  wifi_event_state_t state;
+
+  memset(&state, 0, sizeof (state));
+  state.apActive = true;
+  state.apIP = 0x0104a8c0;
+  TEST_ASSERT_EQUAL(2, events.update(&state, &cache, &sink));
+  TEST_ASSERT_EQUAL_STRING("event: wifi\ndata: {\"connected\":false}\n\n"
+                           "event: ap\ndata: {\"active\":true,"
+                           "\"AP_IP\":\"192.168.4.1\"}\n\n", sink.data);
+
+  sink.length = 0;
+  TEST_ASSERT_EQUAL(0, events.update(&state, &cache, &sink));
+  TEST_ASSERT_EQUAL(0, sink.length);
+
+  /* Connecting changes the station, access point and RSSI */
+  state.connected = true;
+  strcpy(state.ssid, "office");
+  state.localIP = 0x0b01a8c0;
+  state.rssi = -60;
+  state.apActive = false;
+  TEST_ASSERT_EQUAL(3, events.update(&state, &cache, &sink));
+  TEST_ASSERT_NOT_NULL(strstr(sink.data, "event: wifi\ndata: {\"connected\":true,"
+                              "\"ssid\":\"office\",\"local_IP\":\"192.168.1.11\"}"));
+  TEST_ASSERT_NOT_NULL(strstr(sink.data, "event: ap\ndata: {\"active\":false}"));
+  TEST_ASSERT_NOT_NULL(strstr(sink.data, "event: rssi\ndata: {\"bucket\":3,\"rssi\":-60}"));
+
+  /* Within a bucket, or just past a boundary, nothing is written */
+  sink.length = 0;
+  state.rssi = -66;
+  TEST_ASSERT_EQUAL(0, events.update(&state, &cache, &sink));
+  state.rssi = -68;
+  TEST_ASSERT_EQUAL(0, events.update(&state, &cache, &sink));
+  state.rssi = -70;
+  TEST_ASSERT_EQUAL(1, events.update(&state, &cache, &sink));
+  TEST_ASSERT_EQUAL_STRING("event: rssi\ndata: {\"bucket\":2,\"rssi\":-70}\n\n", sink.data);
+  state.rssi = -64;
+  TEST_ASSERT_EQUAL(1, events.update(&state, &cache, &sink));
+
+  /* Completed scans are pushed */
+  sink.length = 0;
+  cache.start(&driver);
+  TEST_ASSERT_EQUAL(0, events.update(&state, &cache, &sink));
+  driver.advance(13 * 300);
+  cache.poll(&driver, driver.now);
+  TEST_ASSERT_EQUAL(1, events.update(&state, &cache, &sink));
+  TEST_ASSERT_EQUAL(0, strncmp(sink.data, "event: scan\ndata: {\"count\":2,"
+                               "\"networks\":[[\"home\",-70,", 47));
+
+  /* A new subscriber is sent the state last pushed */
+  TestSink snapshot;
+  events.snapshot(&cache, &snapshot);
+  TEST_ASSERT_NOT_NULL(strstr(snapshot.data, "\"ssid\":\"office\""));
+  TEST_ASSERT_NOT_NULL(strstr(snapshot.data, "{\"bucket\":3,\"rssi\":-64}"));
+  TEST_ASSERT_NOT_NULL(strstr(snapshot.data, "event: scan\n"));
+
+  /* Disconnecting reports just the station */
+  sink.length = 0;
+  state.connected = false;
+  TEST_ASSERT_EQUAL(1, events.update(&state, &cache, &sink));
+  TEST_ASSERT_EQUAL_STRING("event: wifi\ndata: {\"connected\":false}\n\n", sink.data);
+
+  /* Without a sink the state is only recorded */
+  state.connected = true;
+  TEST_ASSERT_EQUAL(0, events.update(&state, &cache, nullptr));
+  TEST_ASSERT_EQUAL(0, events.update(&state, &cache, &sink));
+}
+
+/*
+ * Comparison of the bytes sent over ten minutes by polling /info every second
+ * against the event stream, with a fluctuating signal and a reconnect.
+ */
+void test_events_bandwidth() {
+  const unsigned long DURATION = 10 * 60 * 1000;
+  WiFiEvents events;
+  TestSink sink;
+  wifi_event_state_t state;
+  uint32_t seed = 99;
+
+  memset(&state, 0, sizeof (state));
+  state.connected = true;
+  strcpy(state.ssid, "office");
+  state.localIP = 0x0b01a8c0;
+
+  unsigned long polled = 0;
+  unsigned long streamed = 0;
+  unsigned int pushed = 0;
+  for (unsigned long t = 0; t < DURATION; t += WiFiEvents::CHECK_INTERVAL) {
+    seed = seed * 1103515245 + 12345;
+    state.rssi = -62 + (int)((seed >> 16) % 7) - 3;
+    state.connected = (t < 300 * 1000 || t > 305 * 1000);
+
+    sink.length = 0;
+    pushed += events.update(&state, nullptr, &sink);
+    streamed += sink.length;
+
+    if (t % 1000 == 0) {
+      /* A poll returns the whole state each time */
+      TestSink poll;
+      events.snapshot(nullptr, &poll);
+      polled += poll.length;
+    }
+  }
+
+  char msg[120];
+  snprintf(msg, sizeof (msg), "10 minutes: polling %lu bytes in %lu responses, "
+           "events %lu bytes in %u events", polled, DURATION / 1000, streamed,
+           pushed);
+  TEST_MESSAGE(msg);
+  TEST_ASSERT_LESS_THAN(polled / 20, streamed);
+}
+
+/* Responses are held for a key, with an ETag derived from it */
+void test_response_cache() {
+  ResponseCache cache;
+
+  TEST_ASSERT_FALSE(cache.valid(7));
+  cache.begin(7);
+  cache.write("{\"a\":", 5);
+  cache.write("1}", 2);
+  TEST_ASSERT_TRUE(cache.end());
+  TEST_ASSERT_TRUE(cache.valid(7));
+  TEST_ASSERT_FALSE(cache.valid(8));
+  TEST_ASSERT_EQUAL(7, cache.length());
+  TEST_ASSERT_EQUAL(0, memcmp("{\"a\":1}", cache.data(), 7));
+  TEST_ASSERT_EQUAL_STRING("\"00000007\"", cache.etag());
+
+  TEST_ASSERT_TRUE(cache.matches("\"00000007\""));
+  TEST_ASSERT_TRUE(cache.matches("\"1\", W/\"00000007\""));
+  TEST_ASSERT_TRUE(cache.matches("*"));
+  TEST_ASSERT_FALSE(cache.matches("\"00000008\""));
+  TEST_ASSERT_FALSE(cache.matches(nullptr));
+
+  /* Growing past the initial allocation, then past the limit */
+  char block[1000];
+  memset(block, 'x', sizeof (block));
+  cache.begin(9);
+  for (int i = 0; i < 4; i++) {
+    cache.write(block, sizeof (block));
+  }
+  TEST_ASSERT_TRUE(cache.end());
+  TEST_ASSERT_EQUAL(4000, cache.length());
+  cache.write(block, sizeof (block));
+  TEST_ASSERT_FALSE(cache.end());
+  TEST_ASSERT_FALSE(cache.valid(9));
+
+  cache.clear();
+  TEST_ASSERT_NULL(cache.data());
+}
+
+/*
+ * Conditional requests against a cached response, counting the bytes rendered
+ * and sent for repeated polls.
+ */
+void test_server_etag() {
+  const int POLLS = 50;
+  WiFiBaseServer server(0);
+  ResponseCache cache;
+  uint32_t generation = 0x1000;
+  unsigned long rendered = 0;
+
+  server.on("/info", [&]() {
+    if (!cache.valid(generation)) {
+      cache.begin(generation);
+      JsonWriter json(&cache);
+      json.beginObject();
+      json.key("generation").value((unsigned long)generation);
+      json.key("networks").beginArray();
+      for (int i = 0; i < 10; i++) {
+        json.beginObject().key("ssid").value("network").endObject();
+      }
+      json.endArray().endObject();
+      json.flush();
+      cache.end();
+      rendered += cache.length();
+    }
+    cache.send(&server, "application/json");
+  });
+  TEST_ASSERT_TRUE(server.begin());
+
+  int fd = http_connect(server.port());
+  http_write(fd, "GET /info HTTP/1.1\r\n\r\n");
+  http_read(&server, fd, 1);
+  TEST_ASSERT_EQUAL(0, strncmp(httpResponse, "HTTP/1.1 200 ", 13));
+  TEST_ASSERT_NOT_NULL(strstr(httpResponse, "ETag: \"00001000\"\r\n"));
+  TEST_ASSERT_NOT_NULL(strstr(httpResponse, "Cache-Control: no-cache\r\n"));
+  size_t full = strlen(httpResponse);
+
+  /* Repeated polls with the ETag are answered without a body */
+  unsigned long sent = 0;
+  for (int i = 0; i < POLLS; i++) {
+    http_write(fd, "GET /info HTTP/1.1\r\nIf-None-Match: \"00001000\"\r\n\r\n");
+    sent += http_read(&server, fd, 1);
+    TEST_ASSERT_EQUAL(0, strncmp(httpResponse, "HTTP/1.1 304 ", 13));
+    TEST_ASSERT_NULL(strstr(httpResponse, "Content-Length"));
+    TEST_ASSERT_NOT_NULL(strstr(httpResponse, "ETag: \"00001000\"\r\n"));
+  }
+  TEST_ASSERT_EQUAL(POLLS, cache.notModified());
+
+  /* A change in state is sent in full with a new ETag */
+  generation++;
+  http_write(fd, "GET /info HTTP/1.1\r\nIf-None-Match: \"00001000\"\r\n\r\n");
+  http_read(&server, fd, 1);
+  TEST_ASSERT_EQUAL(0, strncmp(httpResponse, "HTTP/1.1 200 ", 13));
+  TEST_ASSERT_NOT_NULL(strstr(httpResponse, "ETag: \"00001001\"\r\n"));
+  TEST_ASSERT_NOT_NULL(strstr(http_body(httpResponse), "4097"));
+  close(fd);
+
+  char msg[120];
+  snprintf(msg, sizeof (msg), "%d polls: %lu bytes sent with ETag, %lu without, "
+           "%lu bytes rendered", POLLS, sent, (unsigned long)(full * POLLS),
+           rendered);
+  TEST_MESSAGE(msg);
+  TEST_ASSERT_EQUAL(2 * cache.length(), rendered);
+  TEST_ASSERT_LESS_THAN(full * POLLS / 2, sent);
+}
+
+static void hex_digest(Sha256 *hash, char *hex) {
+  uint8_t digest[SHA256_DIGEST_SIZE];
+  hash->finish(digest);
+  for (int i = 0; i < SHA256_DIGEST_SIZE; i++) {
+    sprintf(hex + i * 2, "%02x", digest[i]);
+  }
+}
+
+/* Published SHA-256 test vectors, fed in uneven pieces */
+void test_sha256_vectors() {
+  Sha256 hash;
+  char hex[SHA256_DIGEST_SIZE * 2 + 1];
+
+  hex_digest(&hash, hex);
+  TEST_ASSERT_EQUAL_STRING(
+    "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855", hex);
+
+  hash.reset();
+  hash.update("abc", 3);
+  hex_digest(&hash, hex);
+  TEST_ASSERT_EQUAL_STRING(
+    "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad", hex);
+
+  const char *twoBlocks =
+    "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+  hash.reset();
+  hash.update(twoBlocks, 5);
+  hash.update(twoBlocks + 5, strlen(twoBlocks) - 5);
+  hex_digest(&hash, hex);
+  TEST_ASSERT_EQUAL_STRING(
+    "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1", hex);
+
+  char a[997];
+  memset(a, 'a', sizeof (a));
+  hash.reset();
+  for (size_t done = 0; done < 1000000; ) {
+    size_t n = 1000000 - done;
+    if (n > sizeof (a)) n = sizeof (a);
+    hash.update(a, n);
+    done += n;
+  }
+  hex_digest(&hash, hex);
+  TEST_ASSERT_EQUAL_STRING(
+    "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0", hex);
+}
+
+/* A hash continued from a saved state matches one made in one go */
+void test_sha256_restore() {
+  Sha256 whole, first, second;
+  char expected[SHA256_DIGEST_SIZE * 2 + 1], hex[SHA256_DIGEST_SIZE * 2 + 1];
+  uint8_t data[300];
+  for (size_t i = 0; i < sizeof (data); i++) {
+    data[i] = (uint8_t)(i * 7);
+  }
+
+  whole.update(data, sizeof (data));
+  hex_digest(&whole, expected);
+
+  first.update(data, 100);
+  sha256_state_t saved;
+  memcpy(&saved, first.state(), sizeof (saved));
+  second.restore(&saved);
+  second.update(data + 100, sizeof (data) - 100);
+  hex_digest(&second, hex);
+  TEST_ASSERT_EQUAL_STRING(expected, hex);
+}
+
+static uint8_t *ota_image(size_t size, uint8_t *sha256) {
+  uint8_t *image = (uint8_t *)malloc(size);
+  srand(41);
+  for (size_t i = 0; i < size; i++) {
+    image[i] = (uint8_t)rand();
+  }
+  Sha256 hash;
+  hash.update(image, size);
+  hash.finish(sha256);
+  return image;
+}
+
+static bool flash_matches(FileFlash *flash, const uint8_t *image, size_t size) {
+  uint8_t *contents = (uint8_t *)malloc(size);
+  bool matches = flash->read(0, contents, size) &&
+                 memcmp(contents, image, size) == 0;
+  free(contents);
+  return matches;
+}
+
+static bool flash_erased(FileFlash *flash, size_t offset, size_t length) {
+  uint8_t contents[OTAReceiver::HEADER_HOLD];
+  flash->read(offset, contents, length);
+  for (size_t i = 0; i < length; i++) {
+    if (contents[i] != 0xFF) return false;
+  }
+  return true;
+}
+
+/* Images are written whole and activated, with or without the writer */
+void test_ota_receive() {
+  const size_t SIZE = 3 * FileFlash::PAGE_SIZE + 1234;
+  uint8_t sha256[SHA256_DIGEST_SIZE];
+  uint8_t *image = ota_image(SIZE, sha256);
+
+  for (int writer = 0; writer < 2; writer++) {
+    FileFlash flash(8 * FileFlash::PAGE_SIZE);
+    OTAReceiver receiver(&flash);
+    TEST_ASSERT_TRUE(receiver.useWriter(writer));
+
+    TEST_ASSERT_TRUE(receiver.begin(SIZE, sha256));
+    for (size_t offset = 0; offset < SIZE; offset += 700) {
+      size_t n = (SIZE - offset < 700) ? SIZE - offset : 700;
+      TEST_ASSERT_TRUE(receiver.write(image + offset, n));
+    }
+    TEST_ASSERT_TRUE(receiver.finish());
+    TEST_ASSERT_EQUAL(OTA_COMPLETE, receiver.state());
+    TEST_ASSERT_TRUE(flash.activated);
+    TEST_ASSERT_TRUE(flash_matches(&flash, image, SIZE));
+    TEST_ASSERT_EQUAL(4, flash.erases);
+  }
+
+  free(image);
+}
+
+/* Nothing bootable is left by a corrupt, short or oversized image */
+void test_ota_refuse_partial() {
+  const size_t SIZE = 2 * FileFlash::PAGE_SIZE + 100;
+  uint8_t sha256[SHA256_DIGEST_SIZE];
+  uint8_t *image = ota_image(SIZE, sha256);
+  FileFlash flash(4 * FileFlash::PAGE_SIZE);
+  OTAReceiver receiver(&flash);
+
+  /* Corrupted in transit, all but the header is written */
+  image[5000] ^= 1;
+  TEST_ASSERT_TRUE(receiver.begin(SIZE, sha256));
+  TEST_ASSERT_TRUE(receiver.write(image, SIZE));
+  TEST_ASSERT_FALSE(receiver.finish());
+  TEST_ASSERT_EQUAL(OTA_FAILED, receiver.state());
+  TEST_ASSERT_EQUAL(OTA_ERR_HASH, receiver.error());
+  TEST_ASSERT_FALSE(flash.activated);
+  TEST_ASSERT_TRUE(flash_erased(&flash, 0, OTAReceiver::HEADER_HOLD));
+  image[5000] ^= 1;
+
+  TEST_ASSERT_TRUE(receiver.begin(SIZE, sha256));
+  TEST_ASSERT_TRUE(receiver.write(image, SIZE / 2));
+  TEST_ASSERT_FALSE(receiver.finish());
+  TEST_ASSERT_EQUAL(OTA_ERR_INCOMPLETE, receiver.error());
+
+  TEST_ASSERT_TRUE(receiver.begin(SIZE - 1, sha256));
+  TEST_ASSERT_FALSE(receiver.write(image, SIZE));
+  TEST_ASSERT_EQUAL(OTA_ERR_OVERRUN, receiver.error());
+  TEST_ASSERT_FALSE(receiver.write(image, 1));
+
+  TEST_ASSERT_FALSE(receiver.begin(5 * FileFlash::PAGE_SIZE, sha256));
+  TEST_ASSERT_EQUAL(OTA_ERR_TOO_LARGE, receiver.error());
+  TEST_ASSERT_EQUAL_STRING("too large",
+                           OTAReceiver::errorString(receiver.error()));
+
+  TEST_ASSERT_FALSE(flash.activated);
+  TEST_ASSERT_TRUE(flash_erased(&flash, 0, OTAReceiver::HEADER_HOLD));
+  free(image);
+}
+
+static int ota_connect(uint16_t port, int sendBuffer = 0) {
+  struct sockaddr_in addr;
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+  if (sendBuffer) {
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sendBuffer, sizeof (sendBuffer));
+  }
+  memset(&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  if (connect(fd, (struct sockaddr *)&addr, sizeof (addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* Send the header for an image, as is unless a payload size is given */
+static void ota_send_header(int fd, uint32_t size, const uint8_t *sha256,
+                            uint8_t type = OTA_TYPE_FULL,
+                            uint32_t payloadSize = 0) {
+  ota_header_t header;
+  memset(&header, 0, sizeof (header));
+  header.magic = OTA_MAGIC;
+  header.version = OTA_VERSION;
+  header.type = type;
+  header.payloadSize = payloadSize ? payloadSize : size;
+  header.imageSize = size;
+  memcpy(header.sha256, sha256, SHA256_DIGEST_SIZE);
+  send(fd, &header, sizeof (header), MSG_NOSIGNAL);
+}
+
+/**
+ * Pump the server until a reply is received
+ * @return false if none arrived
+ */
+static bool ota_reply(OTAServer *server, int fd, ota_reply_t *reply) {
+  size_t length = 0;
+  unsigned long start = http_ms();
+  while (length < sizeof (*reply) && http_ms() - start < HTTP_TIMEOUT_MS) {
+    server->handle();
+    ssize_t result = recv(fd, (uint8_t *)reply + length,
+                          sizeof (*reply) - length, MSG_DONTWAIT);
+    if (result == 0) {
+      break;
+    }
+    if (result > 0) {
+      length += result;
+    }
+  }
+  return (length == sizeof (*reply) && reply->magic == OTA_MAGIC);
+}
+
+/* Images pushed over TCP, with a second sender turned away */
+void test_ota_server() {
+  const size_t SIZE = 5 * FileFlash::PAGE_SIZE + 321;
+  uint8_t sha256[SHA256_DIGEST_SIZE];
+  uint8_t *image = ota_image(SIZE, sha256);
+  FileFlash flash(8 * FileFlash::PAGE_SIZE);
+  OTAReceiver receiver(&flash);
+  OTAServer server(&receiver, 0);
+  ota_reply_t reply;
+  TEST_ASSERT_TRUE(server.begin());
+
+  int fd = ota_connect(server.port());
+  ota_send_header(fd, SIZE, sha256);
+  TEST_ASSERT_TRUE(ota_reply(&server, fd, &reply));
+  TEST_ASSERT_EQUAL(OTA_REPLY_READY, reply.status);
+  TEST_ASSERT_TRUE(server.active());
+
+  int other = ota_connect(server.port());
+  TEST_ASSERT_TRUE(ota_reply(&server, other, &reply));
+  TEST_ASSERT_EQUAL(OTA_REPLY_BUSY, reply.status);
+  close(other);
+
+  send(fd, image, SIZE, MSG_NOSIGNAL);
+  TEST_ASSERT_TRUE(ota_reply(&server, fd, &reply));
+  TEST_ASSERT_EQUAL(OTA_REPLY_OK, reply.status);
+  TEST_ASSERT_EQUAL(SIZE, reply.offset);
+  close(fd);
+  TEST_ASSERT_TRUE(server.complete());
+  TEST_ASSERT_EQUAL(1, server.updates());
+  TEST_ASSERT_TRUE(flash.activated);
+  TEST_ASSERT_TRUE(flash_matches(&flash, image, SIZE));
+
+  /* A corrupt image is reported and never activated */
+  flash.activated = false;
+  image[100] ^= 0x80;
+  fd = ota_connect(server.port());
+  ota_send_header(fd, SIZE, sha256);
+  TEST_ASSERT_TRUE(ota_reply(&server, fd, &reply));
+  send(fd, image, SIZE, MSG_NOSIGNAL);
+  TEST_ASSERT_TRUE(ota_reply(&server, fd, &reply));
+  TEST_ASSERT_EQUAL(OTA_REPLY_ERROR, reply.status);
+  TEST_ASSERT_EQUAL(OTA_ERR_HASH, reply.error);
+  close(fd);
+  TEST_ASSERT_FALSE(flash.activated);
+
+  /* As is a sender that goes away part way */
+  fd = ota_connect(server.port());
+  ota_send_header(fd, SIZE, sha256);
+  TEST_ASSERT_TRUE(ota_reply(&server, fd, &reply));
+  send(fd, image, SIZE / 2, MSG_NOSIGNAL);
+  close(fd);
+  unsigned long start = http_ms();
+  while (server.active() && http_ms() - start < HTTP_TIMEOUT_MS) {
+    server.handle();
+  }
+  TEST_ASSERT_FALSE(server.active());
+  TEST_ASSERT_EQUAL(OTA_ERR_INCOMPLETE, receiver.error());
+  TEST_ASSERT_EQUAL(2, server.failures());
+  TEST_ASSERT_FALSE(flash.activated);
+
+  free(image);
+}
+
+/* A receive window about the size of lwIP's on the ESP32 */
+class SmallWindowOTAServer : public OTAServer {
+  public:
+    static const int WINDOW = 4096;
+
+    SmallWindowOTAServer(OTAReceiver *receiver) : OTAServer(receiver, 0) {}
+
+    bool begin() {
+      if (!OTAServer::begin()) {
+        return false;
+      }
+      int size = WINDOW;
+      setsockopt(_listenFd, SOL_SOCKET, SO_RCVBUF, &size, sizeof (size));
+      return true;
+    }
+};
+
+typedef struct {
+  uint16_t port;
+  uint8_t type;
+  const uint8_t *payload;
+  size_t payloadSize;
+  size_t size;
+  const uint8_t *sha256;
+  unsigned long bytesPerSec;
+  ota_reply_t result;
+  std::atomic<bool> done;
+} ota_sender_t;
+
+/* Push a payload at a limited rate, as a sender over WiFi would */
+static void ota_sender(ota_sender_t *sender) {
+  int fd = ota_connect(sender->port, SmallWindowOTAServer::WINDOW);
+  ota_send_header(fd, sender->size, sender->sha256, sender->type,
+                  sender->payloadSize);
+  recv(fd, &sender->result, sizeof (sender->result), MSG_WAITALL);
+
+  /* The link never runs faster than the rate, even after a stall */
+  for (size_t offset = 0; offset < sender->payloadSize; offset += 1024) {
+    size_t n = sender->payloadSize - offset;
+    if (n > 1024) {
+      n = 1024;
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    send(fd, sender->payload + offset, n, MSG_NOSIGNAL);
+
+    double due = n * 1000.0 / sender->bytesPerSec;
+    double now = elapsed_ms(&start);
+    if (due > now) {
+      usleep((useconds_t)((due - now) * 1000));
+    }
+  }
+
+  recv(fd, &sender->result, sizeof (sender->result), MSG_WAITALL);
+  close(fd);
+  sender->done = true;
+}
+
+/**
+ * Time to receive an image with flash erases as slow as the link.  Pages are
+ * large compared to the socket buffers, as a sector is to lwIP's window.
+ * @return The time taken in ms
+ */
+static double ota_transfer_ms(bool writer, const uint8_t *image, size_t size,
+                              const uint8_t *sha256, uint8_t *status) {
+  const unsigned long RATE = 2 * 1024 * 1024;
+  const size_t PAGE = 4 * FileFlash::PAGE_SIZE;
+  FileFlash flash(size + PAGE, PAGE);
+  flash.eraseUs = PAGE * 1000000ULL / RATE;
+  OTAReceiver receiver(&flash);
+  receiver.useWriter(writer);
+  SmallWindowOTAServer server(&receiver);
+  server.begin();
+
+  ota_sender_t sender;
+  sender.port = server.port();
+  sender.type = OTA_TYPE_FULL;
+  sender.payload = image;
+  sender.payloadSize = size;
+  sender.size = size;
+  sender.sha256 = sha256;
+  sender.bytesPerSec = RATE;
+  sender.done = false;
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  std::thread thread(ota_sender, &sender);
+  while (!sender.done && elapsed_ms(&start) < 10 * HTTP_TIMEOUT_MS) {
+    server.handle();
+    usleep(50);
+  }
+  double ms = elapsed_ms(&start);
+  thread.join();
+
+  *status = sender.result.status;
+  if (!flash_matches(&flash, image, size)) {
+    *status = OTA_REPLY_ERROR;
+  }
+  return ms;
+}
+
+/* Writing in the background overlaps flash erases with receiving */
+void test_ota_throughput() {
+  const size_t SIZE = 64 * FileFlash::PAGE_SIZE;
+  uint8_t sha256[SHA256_DIGEST_SIZE];
+  uint8_t *image = ota_image(SIZE, sha256);
+  uint8_t status;
+
+  double synchronous = ota_transfer_ms(false, image, SIZE, sha256, &status);
+  TEST_ASSERT_EQUAL(OTA_REPLY_OK, status);
+  double background = ota_transfer_ms(true, image, SIZE, sha256, &status);
+  TEST_ASSERT_EQUAL(OTA_REPLY_OK, status);
+
+  char msg[160];
+  snprintf(msg, sizeof (msg), "%u KB at 2048 KB/s with 2048 KB/s erases: "
+           "synchronous %.0f KB/s, background writer %.0f KB/s",
+           (unsigned)(SIZE / 1024), SIZE / 1.024 / synchronous,
+           SIZE / 1.024 / background);
+  TEST_MESSAGE(msg);
+  TEST_ASSERT_TRUE(background < synchronous * 0.8);
+  free(image);
+}
+
+typedef struct {
+  int          fd;
+  size_t       received;   // Including the header
+  ota_header_t header;
+  Sha256       hash;
+  bool         done;
+} hub_downloader_t;
+
+static void hub_connect(OTAHub *hub, hub_downloader_t *downloader) {
+  downloader->fd = ota_connect(hub->port());
+  fcntl(downloader->fd, F_SETFL,
+        fcntl(downloader->fd, F_GETFL, 0) | O_NONBLOCK);
+  downloader->received = 0;
+  downloader->hash.reset();
+  downloader->done = false;
+}
+
+/* Read whatever has arrived, hashing the image */
+static void hub_receive(hub_downloader_t *downloader) {
+  uint8_t buffer[2048];
+
+  while (!downloader->done) {
+    ssize_t result;
+    if (downloader->received < sizeof (downloader->header)) {
+      result = recv(downloader->fd,
+                    (uint8_t *)&downloader->header + downloader->received,
+                    sizeof (downloader->header) - downloader->received, 0);
+    } else {
+      result = recv(downloader->fd, buffer, sizeof (buffer), 0);
+      if (result > 0) {
+        downloader->hash.update(buffer, result);
+      }
+    }
+    if (result == 0) {
+      downloader->done = true;
+      close(downloader->fd);
+    }
+    if (result <= 0) {
+      return;
+    }
+    downloader->received += result;
+  }
+}
+
+/**
+ * Pump the hub until all the downloaders have finished
+ * @return false if they didn't finish in time
+ */
+static bool hub_run(OTAHub *hub, hub_downloader_t *downloaders, int count) {
+  unsigned long start = http_ms();
+  int done = 0;
+  while (done < count && http_ms() - start < 10 * HTTP_TIMEOUT_MS) {
+    hub->handle();
+    done = 0;
+    for (int i = 0; i < count; i++) {
+      hub_receive(&downloaders[i]);
+      done += downloaders[i].done;
+    }
+    usleep(100);
+  }
+  return (done == count);
+}
+
+static bool hub_verified(hub_downloader_t *downloader, uint32_t size,
+                         const uint8_t *sha256) {
+  uint8_t digest[SHA256_DIGEST_SIZE];
+  downloader->hash.finish(digest);
+  return downloader->header.magic == OTA_MAGIC &&
+         downloader->header.imageSize == size &&
+         memcmp(downloader->header.sha256, sha256, SHA256_DIGEST_SIZE) == 0 &&
+         memcmp(digest, sha256, SHA256_DIGEST_SIZE) == 0 &&
+         downloader->received == sizeof (ota_header_t) + size;
+}
+
+/*
+ * Simulated hub serving every client it can hold at once, each rate limited,
+ * with the image read from flash only once.
+ */
+void test_ota_hub_fanout() {
+  const int CLIENTS = OTAHub::MAX_CLIENTS;
+  const uint32_t SIZE = 128 * 1024 + 100;
+  const uint32_t RATE = 1024 * 1024;
+  const uint32_t CHUNKS = (SIZE + OTAHub::CHUNK_SIZE - 1) / OTAHub::CHUNK_SIZE;
+  uint8_t sha256[SHA256_DIGEST_SIZE];
+  uint8_t *image = ota_image(SIZE, sha256);
+
+  FileFlash flash(SIZE + FileFlash::PAGE_SIZE);
+  flash.write(0, image, SIZE);
+  OTAHub hub(&flash, 0);
+  unsigned long before = newCount;
+  TEST_ASSERT_TRUE(hub.begin(SIZE));
+  hub.setRateLimit(RATE);
+
+  hub_downloader_t downloaders[CLIENTS];
+  for (int i = 0; i < CLIENTS; i++) {
+    hub_connect(&hub, &downloaders[i]);
+  }
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  hub.handle();
+  TEST_ASSERT_EQUAL(CLIENTS, hub.clients());
+  ota_hub_progress_t progress;
+  TEST_ASSERT_TRUE(hub.progress(CLIENTS - 1, &progress));
+  TEST_ASSERT_EQUAL(SIZE, progress.size);
+  TEST_ASSERT_EQUAL(0x0100007f, progress.ip);
+  TEST_ASSERT_FALSE(hub.progress(CLIENTS, &progress));
+
+  TEST_ASSERT_TRUE(hub_run(&hub, downloaders, CLIENTS));
+  double ms = elapsed_ms(&start);
+  unsigned long allocations = newCount - before;
+
+  for (int i = 0; i < CLIENTS; i++) {
+    TEST_ASSERT_TRUE(hub_verified(&downloaders[i], SIZE, sha256));
+  }
+  TEST_ASSERT_EQUAL(CLIENTS, hub.completed());
+  TEST_ASSERT_EQUAL(0, hub.clients());
+
+  char msg[200];
+  snprintf(msg, sizeof (msg), "%d clients at %u KB/s each: aggregate %.0f KB/s, "
+           "%u chunk reads for %u chunks, hub memory %u bytes with "
+           "%lu allocations", CLIENTS, (unsigned)(RATE / 1024),
+           CLIENTS * SIZE / 1.024 / ms, (unsigned)hub.chunkReads(),
+           (unsigned)CHUNKS, (unsigned)sizeof (OTAHub), allocations);
+  TEST_MESSAGE(msg);
+
+  TEST_ASSERT_EQUAL(CHUNKS, hub.chunkReads());
+  TEST_ASSERT_EQUAL(0, allocations);
+  /* No client is sent faster than the limit */
+  TEST_ASSERT_TRUE(ms > SIZE * 1000.0 / RATE * 0.9);
+
+  free(image);
+}
+
+/* A client joining late is served its own reads without delaying the rest */
+void test_ota_hub_late_join() {
+  const uint32_t SIZE = 64 * 1024;
+  const uint32_t RATE = 1024 * 1024;
+  const uint32_t CHUNKS = SIZE / OTAHub::CHUNK_SIZE;
+  uint8_t sha256[SHA256_DIGEST_SIZE];
+  uint8_t *image = ota_image(SIZE, sha256);
+
+  FileFlash flash(SIZE);
+  flash.write(0, image, SIZE);
+  OTAHub hub(&flash, 0);
+  TEST_ASSERT_TRUE(hub.begin(SIZE));
+  hub.setRateLimit(RATE);
+
+  hub_downloader_t downloaders[4];
+  for (int i = 0; i < 3; i++) {
+    hub_connect(&hub, &downloaders[i]);
+  }
+
+  /* Join once the others are halfway */
+  ota_hub_progress_t progress;
+  unsigned long start = http_ms();
+  do {
+    hub.handle();
+    for (int i = 0; i < 3; i++) {
+      hub_receive(&downloaders[i]);
+    }
+    usleep(100);
+  } while (hub.progress(0, &progress) && progress.sent < SIZE / 2 &&
+           http_ms() - start < HTTP_TIMEOUT_MS);
+  hub_connect(&hub, &downloaders[3]);
+
+  TEST_ASSERT_TRUE(hub_run(&hub, downloaders, 4));
+  for (int i = 0; i < 4; i++) {
+    TEST_ASSERT_TRUE(hub_verified(&downloaders[i], SIZE, sha256));
+  }
+  TEST_ASSERT_TRUE(hub.chunkReads() > CHUNKS);
+  TEST_ASSERT_TRUE(hub.chunkReads() <= 2 * CHUNKS);
+
+  /* A client can stop early, such as on finding it has the image */
+  hub_connect(&hub, &downloaders[0]);
+  hub.handle();
+  TEST_ASSERT_EQUAL(1, hub.clients());
+  close(downloaders[0].fd);
+  start = http_ms();
+  while (hub.clients() && http_ms() - start < HTTP_TIMEOUT_MS) {
+    hub.handle();
+  }
+  TEST_ASSERT_EQUAL(0, hub.clients());
+  TEST_ASSERT_EQUAL(4, hub.completed());
+
+  free(image);
+}
+
+/* A new release: a patch, an insertion, a deletion and an addition */
+static uint8_t *delta_release(const uint8_t *base, size_t baseSize,
+                              size_t *size) {
+  uint8_t *image = (uint8_t *)malloc(baseSize + 2000);
+  size_t used = 0;
+
+  memcpy(image, base, 50000);
+  memset(image + 5000, 0x5A, 100);
+  used = 50000;
+  for (int i = 0; i < 2000; i++) {
+    image[used++] = (uint8_t)(i * 13);
+  }
+  memcpy(image + used, base + 50000, 70000);
+  used += 70000;
+  memcpy(image + used, base + 123000, baseSize - 123000);
+  used += baseSize - 123000;
+  memset(image + used, 0xA5, 500);
+  used += 500;
+
+  *size = used;
+  return image;
+}
+
+/**
+ * Feed a payload to the decoder in small pieces, producing its held back
+ * output a bounded amount at a time, and finish the image
+ * @return Whether the image was verified
+ */
+static bool ota_decode(OTADecoder *decoder, OTAReceiver *receiver,
+                       const std::vector<uint8_t> &payload, size_t piece) {
+  size_t offset = 0;
+  while (offset < payload.size() && receiver->state() == OTA_RECEIVING) {
+    if (decoder->busy()) {
+      decoder->pump(1000);
+      continue;
+    }
+    size_t n = payload.size() - offset;
+    if (n > piece) {
+      n = piece;
+    }
+    offset += decoder->write(&payload[offset], n);
+  }
+  while (decoder->busy()) {
+    decoder->pump(1000);
+  }
+  return decoder->finish() && receiver->finish();
+}
+
+/* A delta against the running image rebuilds the release exactly */
+void test_ota_delta() {
+  const size_t BASE_SIZE = 200 * 1024;
+  uint8_t baseSha[SHA256_DIGEST_SIZE], sha256[SHA256_DIGEST_SIZE];
+  uint8_t *base = ota_image(BASE_SIZE, baseSha);
+  size_t size;
+  uint8_t *image = delta_release(base, BASE_SIZE, &size);
+  Sha256 hash;
+  hash.update(image, size);
+  hash.finish(sha256);
+
+  std::vector<uint8_t> delta;
+  DeltaEncoder::encode(base, BASE_SIZE, image, size, &delta);
+
+  FileFlash running(BASE_SIZE + FileFlash::PAGE_SIZE);
+  running.write(0, base, BASE_SIZE);
+  FileFlash flash(BASE_SIZE + 2 * FileFlash::PAGE_SIZE);
+  OTAReceiver receiver(&flash);
+  receiver.useWriter(true);
+  DeltaDecoder decoder(&running);
+
+  TEST_ASSERT_TRUE(receiver.begin(size, sha256));
+  TEST_ASSERT_TRUE(decoder.begin(&receiver));
+  TEST_ASSERT_TRUE(ota_decode(&decoder, &receiver, delta, 7));
+  TEST_ASSERT_TRUE(flash.activated);
+  TEST_ASSERT_TRUE(flash_matches(&flash, image, size));
+
+  char msg[160];
+  snprintf(msg, sizeof (msg), "%u byte image as a %u byte delta (%.1f%%), "
+           "decoder uses %u bytes", (unsigned)size, (unsigned)delta.size(),
+           delta.size() * 100.0 / size, (unsigned)sizeof (DeltaDecoder));
+  TEST_MESSAGE(msg);
+  TEST_ASSERT_TRUE(delta.size() < size / 20);
+
+  free(image);
+  free(base);
+}
+
+/* Deltas against another image, cut short or corrupt are refused */
+void test_ota_delta_refused() {
+  const size_t BASE_SIZE = 200 * 1024;
+  uint8_t baseSha[SHA256_DIGEST_SIZE], sha256[SHA256_DIGEST_SIZE];
+  uint8_t *base = ota_image(BASE_SIZE, baseSha);
+  size_t size;
+  uint8_t *image = delta_release(base, BASE_SIZE, &size);
+  Sha256 hash;
+  hash.update(image, size);
+  hash.finish(sha256);
+
+  std::vector<uint8_t> delta;
+  DeltaEncoder::encode(base, BASE_SIZE, image, size, &delta);
+
+  FileFlash running(BASE_SIZE + FileFlash::PAGE_SIZE);
+  running.write(0, base, BASE_SIZE);
+  running.write(100, (const uint8_t *)"\0", 1);
+  FileFlash flash(BASE_SIZE + 2 * FileFlash::PAGE_SIZE);
+  OTAReceiver receiver(&flash);
+  DeltaDecoder decoder(&running);
+
+  /* The running image differs from the one the delta was made against */
+  receiver.begin(size, sha256);
+  decoder.begin(&receiver);
+  TEST_ASSERT_FALSE(ota_decode(&decoder, &receiver, delta, 1024));
+  TEST_ASSERT_EQUAL(OTA_ERR_BASE, receiver.error());
+  TEST_ASSERT_EQUAL(0, receiver.received());
+
+  FileFlash matching(BASE_SIZE + FileFlash::PAGE_SIZE);
+  matching.write(0, base, BASE_SIZE);
+  DeltaDecoder good(&matching);
+
+  std::vector<uint8_t> truncated(delta.begin(), delta.end() - 3);
+  receiver.begin(size, sha256);
+  good.begin(&receiver);
+  TEST_ASSERT_FALSE(ota_decode(&good, &receiver, truncated, 1024));
+  TEST_ASSERT_EQUAL(OTA_ERR_PROTOCOL, receiver.error());
+
+  /* A COPY from beyond the base */
+  std::vector<uint8_t> corrupt(delta.begin(),
+                               delta.begin() + DeltaDecoder::PREAMBLE_SIZE);
+  const uint8_t copy[] = { DELTA_OP_COPY, 0, 0xF0, 0x03, 0, 0x00, 0x10, 0, 0 };
+  corrupt.insert(corrupt.end(), copy, copy + sizeof (copy));
+  receiver.begin(size, sha256);
+  good.begin(&receiver);
+  TEST_ASSERT_FALSE(ota_decode(&good, &receiver, corrupt, 1024));
+  TEST_ASSERT_EQUAL(OTA_ERR_PROTOCOL, receiver.error());
+
+  TEST_ASSERT_FALSE(flash.activated);
+  free(image);
+  free(base);
+}
+
+/* Deltas pushed over TCP */
+void test_ota_delta_server() {
+  const size_t BASE_SIZE = 200 * 1024;
+  uint8_t baseSha[SHA256_DIGEST_SIZE], sha256[SHA256_DIGEST_SIZE];
+  uint8_t *base = ota_image(BASE_SIZE, baseSha);
+  size_t size;
+  uint8_t *image = delta_release(base, BASE_SIZE, &size);
+  Sha256 hash;
+  hash.update(image, size);
+  hash.finish(sha256);
+
+  std::vector<uint8_t> delta;
+  DeltaEncoder::encode(base, BASE_SIZE, image, size, &delta);
+
+  FileFlash running(BASE_SIZE + FileFlash::PAGE_SIZE);
+  running.write(0, base, BASE_SIZE);
+  FileFlash flash(BASE_SIZE + 2 * FileFlash::PAGE_SIZE);
+  OTAReceiver receiver(&flash);
+  DeltaDecoder decoder(&running);
+  OTAServer server(&receiver, 0);
+  TEST_ASSERT_FALSE(server.setDecoder(OTA_TYPE_FULL, &decoder));
+  TEST_ASSERT_TRUE(server.setDecoder(OTA_TYPE_DELTA, &decoder));
+  TEST_ASSERT_TRUE(server.begin());
+
+  ota_header_t header;
+  ota_reply_t reply;
+  memset(&header, 0, sizeof (header));
+  header.magic = OTA_MAGIC;
+  header.version = OTA_VERSION;
+  header.type = OTA_TYPE_DELTA;
+  header.payloadSize = delta.size();
+  header.imageSize = size;
+  memcpy(header.sha256, sha256, SHA256_DIGEST_SIZE);
+
+  int fd = ota_connect(server.port());
+  send(fd, &header, sizeof (header), MSG_NOSIGNAL);
+  TEST_ASSERT_TRUE(ota_reply(&server, fd, &reply));
+  TEST_ASSERT_EQUAL(OTA_REPLY_READY, reply.status);
+  send(fd, &delta[0], delta.size(), MSG_NOSIGNAL);
+  TEST_ASSERT_TRUE(ota_reply(&server, fd, &reply));
+  TEST_ASSERT_EQUAL(OTA_REPLY_OK, reply.status);
+  TEST_ASSERT_EQUAL(delta.size(), reply.offset);
+  close(fd);
+
+  TEST_ASSERT_TRUE(flash.activated);
+  TEST_ASSERT_TRUE(flash_matches(&flash, image, size));
+  free(image);
+  free(base);
+}
+
+/*
+ * An image with the redundancy of real firmware: code made of recurring
+ * sequences with their addresses and immediates varied, strings and tables
+ */
+static uint8_t *firmware_image(size_t size, uint8_t *sha256) {
+  static const char *words[] = {
+    "WFB: ", "connect", "connected to ", "failed", "timeout", "network ",
+    "station", "access point", "update", "%d", "%s", "\n", "error ",
+    "scan", "config", "/info", "{\"", "\":", "\",", "}",
+  };
+  uint8_t sequences[64][48];
+  uint8_t *image = (uint8_t *)malloc(size);
+
+  srand(44);
+  for (int i = 0; i < 64; i++) {
+    for (int j = 0; j < 48; j++) {
+      sequences[i][j] = rand();
+    }
+  }
+
+  size_t used = 0;
+  while (used + 64 < size) {
+    int kind = rand() % 10;
+    if (kind < 7) {
+      int r = rand() % 64;
+      size_t length = 12 + rand() % 37;
+      memcpy(image + used, sequences[r * r / 64], length);
+      for (size_t i = 0; i < length; i += 1 + rand() % 12) {
+        image[used + i] = rand();
+      }
+      used += length;
+    } else if (kind < 9) {
+      for (int n = 2 + rand() % 6; n; n--) {
+        const char *word = words[rand() % 20];
+        size_t length = strlen(word);
+        if (used + length > size) {
+          break;
+        }
+        memcpy(image + used, word, length);
+        used += length;
+      }
+    } else {
+      for (int n = 4 + rand() % 12; n && used + 4 <= size; n--) {
+        uint32_t value = rand() % 1024;
+        memcpy(image + used, &value, 4);
+        used += 4;
+      }
+    }
+  }
+  memset(image + used, 0, size - used);
+
+  Sha256 hash;
+  hash.update(image, size);
+  hash.finish(sha256);
+  return image;
+}
+
+/* Compressed images are rebuilt exactly within the window's RAM */
+void test_ota_lzss() {
+  const size_t SIZE = 200 * 1024;
+  uint8_t sha256[SHA256_DIGEST_SIZE];
+  uint8_t *image = firmware_image(SIZE, sha256);
+
+  std::vector<uint8_t> compressed;
+  LzssEncoder::encode(image, SIZE, &compressed);
+
+  FileFlash flash(SIZE + FileFlash::PAGE_SIZE);
+  OTAReceiver receiver(&flash);
+  receiver.useWriter(true);
+  LzssDecoder decoder;
+
+  TEST_ASSERT_TRUE(receiver.begin(SIZE, sha256));
+  TEST_ASSERT_TRUE(decoder.begin(&receiver));
+  TEST_ASSERT_TRUE(ota_decode(&decoder, &receiver, compressed, 7));
+  TEST_ASSERT_TRUE(flash.activated);
+  TEST_ASSERT_TRUE(flash_matches(&flash, image, SIZE));
+
+  /* Once more in pieces as the server receives them */
+  flash.activated = false;
+  TEST_ASSERT_TRUE(receiver.begin(SIZE, sha256));
+  TEST_ASSERT_TRUE(decoder.begin(&receiver));
+  TEST_ASSERT_TRUE(ota_decode(&decoder, &receiver, compressed,
+                              OTAServer::RECEIVE_SIZE));
+  TEST_ASSERT_TRUE(flash.activated);
+
+  char msg[160];
+  snprintf(msg, sizeof (msg), "%u byte image compressed to %u bytes (%.1f%%), "
+           "decoder uses %u bytes plus a %u byte window", (unsigned)SIZE,
+           (unsigned)compressed.size(), compressed.size() * 100.0 / SIZE,
+           (unsigned)sizeof (LzssDecoder), (unsigned)LzssDecoder::WINDOW);
+  TEST_MESSAGE(msg);
+  TEST_ASSERT_TRUE(compressed.size() < SIZE * 3 / 4);
+
+  free(image);
+}
+
+/* Compressed payloads cut short or reaching before the image are refused */
+void test_ota_lzss_refused() {
+  const size_t SIZE = 20 * 1024;
+  uint8_t sha256[SHA256_DIGEST_SIZE];
+  uint8_t *image = firmware_image(SIZE, sha256);
+
+  std::vector<uint8_t> compressed;
+  LzssEncoder::encode(image, SIZE, &compressed);
+
+  FileFlash flash(SIZE + FileFlash::PAGE_SIZE);
+  OTAReceiver receiver(&flash);
+  LzssDecoder decoder;
+
+  std::vector<uint8_t> wrong(compressed);
+  wrong[0] ^= 1;
+  receiver.begin(SIZE, sha256);
+  decoder.begin(&receiver);
+  TEST_ASSERT_FALSE(ota_decode(&decoder, &receiver, wrong, 1024));
+  TEST_ASSERT_EQUAL(OTA_ERR_PROTOCOL, receiver.error());
+
+  /* Ending within a match */
+  const uint8_t partial[] = { 0x57, 0x46, 0x42, 0x5A, 0x01, 'a', 0x00 };
+  std::vector<uint8_t> truncated(partial, partial + sizeof (partial));
+  receiver.begin(SIZE, sha256);
+  decoder.begin(&receiver);
+  TEST_ASSERT_FALSE(ota_decode(&decoder, &receiver, truncated, 1024));
+  TEST_ASSERT_EQUAL(OTA_ERR_PROTOCOL, receiver.error());
+
+  /* A match from 2 bytes back with only 1 produced */
+  const uint8_t before[] = { 0x57, 0x46, 0x42, 0x5A, 0x01, 'a', 0x01, 0x00 };
+  std::vector<uint8_t> corrupt(before, before + sizeof (before));
+  receiver.begin(SIZE, sha256);
+  decoder.begin(&receiver);
+  TEST_ASSERT_FALSE(ota_decode(&decoder, &receiver, corrupt, 1024));
+  TEST_ASSERT_EQUAL(OTA_ERR_PROTOCOL, receiver.error());
+
+  /* Too much for the image */
+  receiver.begin(SIZE - 1, sha256);
+  decoder.begin(&receiver);
+  TEST_ASSERT_FALSE(ota_decode(&decoder, &receiver, compressed, 1024));
+  TEST_ASSERT_EQUAL(OTA_ERR_OVERRUN, receiver.error());
+
+  TEST_ASSERT_FALSE(flash.activated);
+  free(image);
+}
+
+/**
+ * Time to push a payload over a link slower than the flash
+ * @return The time taken in ms
+ */
+static double ota_link_ms(uint8_t type, OTADecoder *decoder,
+                          const uint8_t *payload, size_t payloadSize,
+                          const uint8_t *image, size_t size,
+                          const uint8_t *sha256, uint8_t *status) {
+  const unsigned long RATE = 256 * 1024;
+  const size_t PAGE = 4 * FileFlash::PAGE_SIZE;
+  FileFlash flash(size + PAGE, PAGE);
+  flash.eraseUs = PAGE * 1000000ULL / (4 * RATE);
+  OTAReceiver receiver(&flash);
+  receiver.useWriter(true);
+  SmallWindowOTAServer server(&receiver);
+  if (decoder) {
+    server.setDecoder(type, decoder);
+  }
+  server.begin();
+
+  ota_sender_t sender;
+  sender.port = server.port();
+  sender.type = type;
+  sender.payload = payload;
+  sender.payloadSize = payloadSize;
+  sender.size = size;
+  sender.sha256 = sha256;
+  sender.bytesPerSec = RATE;
+  sender.done = false;
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  std::thread thread(ota_sender, &sender);
+  while (!sender.done && elapsed_ms(&start) < 10 * HTTP_TIMEOUT_MS) {
+    server.handle();
+    usleep(50);
+  }
+  double ms = elapsed_ms(&start);
+  thread.join();
+
+  *status = sender.result.status;
+  if (!flash_matches(&flash, image, size)) {
+    *status = OTA_REPLY_ERROR;
+  }
+  return ms;
+}
+
+/* Compressed images take less of a slow link, decompressed as they arrive */
+void test_ota_lzss_benchmark() {
+  const size_t SIZE = 256 * 1024;
+  uint8_t sha256[SHA256_DIGEST_SIZE];
+  uint8_t *image = firmware_image(SIZE, sha256);
+  uint8_t status;
+
+  std::vector<uint8_t> compressed;
+  LzssEncoder::encode(image, SIZE, &compressed);
+  LzssDecoder decoder;
+
+  double rawMs = ota_link_ms(OTA_TYPE_FULL, nullptr, image, SIZE, image, SIZE,
+                             sha256, &status);
+  TEST_ASSERT_EQUAL(OTA_REPLY_OK, status);
+  double compressedMs = ota_link_ms(OTA_TYPE_COMPRESSED, &decoder,
+                                    &compressed[0], compressed.size(),
+                                    image, SIZE, sha256, &status);
+  TEST_ASSERT_EQUAL(OTA_REPLY_OK, status);
+
+  char msg[200];
+  snprintf(msg, sizeof (msg), "%u KB over a 256 KB/s link with 1024 KB/s "
+           "erases: raw %u bytes in %.0f ms, compressed %u bytes in %.0f ms",
+           (unsigned)(SIZE / 1024), (unsigned)SIZE, rawMs,
+           (unsigned)compressed.size(), compressedMs);
+  TEST_MESSAGE(msg);
+  TEST_ASSERT_TRUE(compressedMs < rawMs * 0.85);
+  free(image);
+}
+
+/* Progress kept in memory, as NVS would keep it across a restart */
+class MemoryProgress : public OTAProgress {
+  public:
+    bool valid = false;
+    unsigned int saves = 0;
+    ota_progress_t record;
+
+    bool load(ota_progress_t *progress) {
+      if (valid) {
+        *progress = record;
+      }
+      return valid;
+    }
+
+    bool save(const ota_progress_t *progress) {
+      record = *progress;
+      valid = true;
+      saves++;
+      return true;
+    }
+
+    void clear() {
+      valid = false;
+    }
+};
+
+static void ota_write_from(OTAReceiver *receiver, const uint8_t *image,
+                           size_t from, size_t to) {
+  for (size_t offset = from; offset < to; offset += 1000) {
+    receiver->write(image + offset, (to - offset < 1000) ? to - offset : 1000);
+  }
+}
+
+/* A restart part way resumes from the progress last recorded */
+void test_ota_resume_restart() {
+  const size_t SIZE = 40 * FileFlash::PAGE_SIZE + 100;
+  uint8_t sha256[SHA256_DIGEST_SIZE], otherSha[SHA256_DIGEST_SIZE];
+  uint8_t *image = ota_image(SIZE, sha256);
+  FileFlash flash(SIZE + FileFlash::PAGE_SIZE);
+  MemoryProgress progress;
+
+  {
+    OTAReceiver receiver(&flash);
+    receiver.useWriter(true);
+    receiver.useProgress(&progress);
+    TEST_ASSERT_TRUE(receiver.begin(SIZE, sha256, true));
+    TEST_ASSERT_EQUAL(0, receiver.received());
+    ota_write_from(&receiver, image, 0, SIZE * 7 / 10);
+    /* Power lost, with no chance to record more */
+  }
+  TEST_ASSERT_TRUE(progress.valid);
+  TEST_ASSERT_TRUE(progress.saves > 0);
+  uint32_t committed = progress.record.committed;
+  TEST_ASSERT_TRUE(committed > SIZE * 7 / 10 - OTAReceiver::PROGRESS_INTERVAL -
+                   FileFlash::PAGE_SIZE);
+  TEST_ASSERT_TRUE(committed <= SIZE * 7 / 10);
+
+  OTAReceiver receiver(&flash);
+  receiver.useWriter(true);
+  receiver.useProgress(&progress);
+  TEST_ASSERT_TRUE(receiver.begin(SIZE, sha256, true));
+  TEST_ASSERT_EQUAL(committed, receiver.received());
+  ota_write_from(&receiver, image, committed, SIZE);
+  TEST_ASSERT_TRUE(receiver.finish());
+  TEST_ASSERT_TRUE(flash.activated);
+  TEST_ASSERT_TRUE(flash_matches(&flash, image, SIZE));
+  TEST_ASSERT_FALSE(progress.valid);
+
+  /* Progress is only for the same image, and only when asked to resume */
+  receiver.begin(SIZE, sha256, true);
+  ota_write_from(&receiver, image, 0, SIZE / 2);
+  receiver.abort(OTA_ERR_INCOMPLETE);
+  TEST_ASSERT_TRUE(progress.valid);
+  memcpy(otherSha, sha256, SHA256_DIGEST_SIZE);
+  otherSha[0] ^= 1;
+  TEST_ASSERT_TRUE(receiver.begin(SIZE, otherSha, true));
+  TEST_ASSERT_EQUAL(0, receiver.received());
+  TEST_ASSERT_FALSE(progress.valid);
+
+  ota_write_from(&receiver, image, 0, SIZE / 2);
+  receiver.abort(OTA_ERR_TIMEOUT);
+  TEST_ASSERT_TRUE(progress.valid);
+  TEST_ASSERT_TRUE(receiver.begin(SIZE, sha256, false));
+  TEST_ASSERT_EQUAL(0, receiver.received());
+  TEST_ASSERT_FALSE(progress.valid);
+
+  /* Nor kept once the image is found to be bad */
+  ota_write_from(&receiver, image, 0, SIZE / 2);
+  receiver.abort(OTA_ERR_PROTOCOL);
+  TEST_ASSERT_FALSE(progress.valid);
+  free(image);
+}
+
+static void ota_send_resume_header(int fd, uint32_t size,
+                                   const uint8_t *sha256) {
+  ota_header_t header;
+  memset(&header, 0, sizeof (header));
+  header.magic = OTA_MAGIC;
+  header.version = OTA_VERSION;
+  header.type = OTA_TYPE_FULL;
+  header.flags = OTA_FLAG_RESUME;
+  header.payloadSize = size;
+  header.imageSize = size;
+  memcpy(header.sha256, sha256, SHA256_DIGEST_SIZE);
+  send(fd, &header, sizeof (header), MSG_NOSIGNAL);
+}
+
+/* A sender killed part way reconnects and sends only the rest */
+void test_ota_resume_server() {
+  const size_t SIZE = 48 * FileFlash::PAGE_SIZE + 777;
+  uint8_t sha256[SHA256_DIGEST_SIZE];
+  uint8_t *image = ota_image(SIZE, sha256);
+  FileFlash flash(SIZE + FileFlash::PAGE_SIZE);
+  MemoryProgress progress;
+  OTAReceiver receiver(&flash);
+  receiver.useWriter(true);
+  receiver.useProgress(&progress);
+  OTAServer server(&receiver, 0);
+  TEST_ASSERT_TRUE(server.begin());
+
+  ota_reply_t reply;
+  int fd = ota_connect(server.port());
+  ota_send_resume_header(fd, SIZE, sha256);
+  TEST_ASSERT_TRUE(ota_reply(&server, fd, &reply));
+  TEST_ASSERT_EQUAL(OTA_REPLY_READY, reply.status);
+  TEST_ASSERT_EQUAL(0, reply.offset);
+
+  const size_t KILLED_AT = SIZE * 9 / 10;
+  for (size_t offset = 0; offset < KILLED_AT; offset += 1024) {
+    size_t n = (KILLED_AT - offset < 1024) ? KILLED_AT - offset : 1024;
+    send(fd, image + offset, n, MSG_NOSIGNAL);
+    server.handle();
+  }
+  unsigned long start = http_ms();
+  while (receiver.received() < KILLED_AT &&
+         http_ms() - start < HTTP_TIMEOUT_MS) {
+    server.handle();
+  }
+
+  /* Killed, so the connection is reset rather than closed */
+  struct linger linger = { 1, 0 };
+  setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof (linger));
+  close(fd);
+  start = http_ms();
+  while (server.active() && http_ms() - start < HTTP_TIMEOUT_MS) {
+    server.handle();
+  }
+  TEST_ASSERT_FALSE(server.active());
+  TEST_ASSERT_EQUAL(1, server.failures());
+  TEST_ASSERT_EQUAL(OTA_ERR_INCOMPLETE, receiver.error());
+  TEST_ASSERT_FALSE(flash.activated);
+
+  fd = ota_connect(server.port());
+  ota_send_resume_header(fd, SIZE, sha256);
+  TEST_ASSERT_TRUE(ota_reply(&server, fd, &reply));
+  TEST_ASSERT_EQUAL(OTA_REPLY_READY, reply.status);
+  uint32_t resumed = reply.offset;
+  TEST_ASSERT_TRUE(resumed > KILLED_AT - 2 * FileFlash::PAGE_SIZE);
+  TEST_ASSERT_TRUE(resumed <= KILLED_AT);
+  TEST_ASSERT_EQUAL(0, resumed % FileFlash::PAGE_SIZE);
+
+  send(fd, image + resumed, SIZE - resumed, MSG_NOSIGNAL);
+  TEST_ASSERT_TRUE(ota_reply(&server, fd, &reply));
+  TEST_ASSERT_EQUAL(OTA_REPLY_OK, reply.status);
+  TEST_ASSERT_EQUAL(SIZE, reply.offset);
+  close(fd);
+
+  TEST_ASSERT_TRUE(flash.activated);
+  TEST_ASSERT_TRUE(flash_matches(&flash, image, SIZE));
+  TEST_ASSERT_FALSE(progress.valid);
+
+  char msg[120];
+  snprintf(msg, sizeof (msg), "Killed at %u of %u bytes, resumed from %u",
+           (unsigned)KILLED_AT, (unsigned)SIZE, (unsigned)resumed);
+  TEST_MESSAGE(msg);
+  free(image);
+}
+
+static void gossip_advert(gossip_advert_t *advert, uint32_t version,
+                          uint32_t size, uint8_t fill, uint32_t chunks) {
+  memset(advert, 0, sizeof (*advert));
+  advert->magic = GOSSIP_MAGIC;
+  advert->version = version;
+  advert->size = size;
+  memset(advert->sha256, fill, SHA256_DIGEST_SIZE);
+  advert->port = 1;
+  for (int chunk = 0; chunk < 32; chunk++) {
+    if (chunks & (1 << chunk)) {
+      advert->bitmap[chunk / 8] |= 1 << (chunk % 8);
+      advert->held++;
+    }
+  }
+}
+
+/* The rarest chunks are pulled first, from different peers, two at once */
+void test_ota_gossip_rarest() {
+  const uint32_t SIZE = 4 * OTAGossip::CHUNK_SIZE;
+  uint8_t running[SHA256_DIGEST_SIZE];
+  memset(running, 1, sizeof (running));
+  OTAGossip gossip;
+  TEST_ASSERT_TRUE(gossip.hold(1, SIZE, running, 16 * SIZE));
+  TEST_ASSERT_FALSE(gossip.downloading());
+
+  /* Peer 1 holds chunks 0-2, peer 2 chunks 0-1 and peer 3 chunk 0 */
+  gossip_advert_t advert;
+  gossip_advert(&advert, 2, SIZE, 2, 0x7);
+  TEST_ASSERT_TRUE(gossip.heard(1, &advert, 0));
+  gossip_advert(&advert, 2, SIZE, 2, 0x3);
+  TEST_ASSERT_FALSE(gossip.heard(2, &advert, 0));
+  gossip_advert(&advert, 2, SIZE, 2, 0x1);
+  TEST_ASSERT_FALSE(gossip.heard(3, &advert, 0));
+  TEST_ASSERT_TRUE(gossip.downloading());
+  TEST_ASSERT_EQUAL(3, gossip.peers());
+
+  gossip_transfer_t transfer;
+  TEST_ASSERT_TRUE(gossip.next(0, &transfer));
+  TEST_ASSERT_EQUAL(2, transfer.chunk);
+  TEST_ASSERT_EQUAL(1, transfer.ip);
+  /* Peer 1 is already sending, so chunk 1 comes from peer 2 */
+  TEST_ASSERT_TRUE(gossip.next(0, &transfer));
+  TEST_ASSERT_EQUAL(1, transfer.chunk);
+  TEST_ASSERT_EQUAL(2, transfer.ip);
+  TEST_ASSERT_FALSE(gossip.next(0, &transfer));
+  TEST_ASSERT_EQUAL(OTAGossip::MAX_TRANSFERS, gossip.transfers());
+
+  gossip.received(2);
+  TEST_ASSERT_TRUE(gossip.next(0, &transfer));
+  TEST_ASSERT_EQUAL(0, transfer.chunk);
+  TEST_ASSERT_TRUE(transfer.ip == 1 || transfer.ip == 3);
+
+  /* A busy peer is left alone for a while, one that fails is dropped */
+  uint32_t busy = transfer.ip;
+  gossip.failed(0, true, 0);
+  TEST_ASSERT_TRUE(gossip.next(0, &transfer));
+  TEST_ASSERT_EQUAL(0, transfer.chunk);
+  TEST_ASSERT_TRUE(transfer.ip != busy);
+  gossip.failed(0, false, 0);
+  TEST_ASSERT_EQUAL(2, gossip.peers());
+  TEST_ASSERT_FALSE(gossip.next(0, &transfer));
+  TEST_ASSERT_TRUE(gossip.next(OTAGossip::BUSY_BACKOFF, &transfer));
+  TEST_ASSERT_EQUAL(0, transfer.chunk);
+  TEST_ASSERT_EQUAL(busy, transfer.ip);
+
+  /* Nobody has chunk 3 until peer 1 advertises it */
+  gossip.received(0);
+  gossip.received(1);
+  TEST_ASSERT_FALSE(gossip.next(2 * OTAGossip::BUSY_BACKOFF, &transfer));
+  gossip_advert(&advert, 2, SIZE, 2, 0xF);
+  gossip.heard(1, &advert, 2 * OTAGossip::BUSY_BACKOFF);
+  TEST_ASSERT_TRUE(gossip.next(3 * OTAGossip::BUSY_BACKOFF, &transfer));
+  TEST_ASSERT_EQUAL(3, transfer.chunk);
+  gossip.received(3);
+  TEST_ASSERT_TRUE(gossip.complete());
+
+  /* Older images are ignored, and newer ones replace the one pulled */
+  gossip_advert(&advert, 1, SIZE, 3, 0xF);
+  TEST_ASSERT_FALSE(gossip.heard(4, &advert, 0));
+  TEST_ASSERT_EQUAL(2, gossip.version());
+  gossip_advert(&advert, 3, SIZE, 3, 0x1);
+  TEST_ASSERT_TRUE(gossip.heard(4, &advert, 0));
+  TEST_ASSERT_EQUAL(3, gossip.version());
+  TEST_ASSERT_EQUAL(0, gossip.held());
+  TEST_ASSERT_EQUAL(1, gossip.peers());
+
+  /* Too large to pull */
+  gossip_advert(&advert, 4, 32 * SIZE, 4, 0x1);
+  TEST_ASSERT_FALSE(gossip.heard(5, &advert, 0));
+  TEST_ASSERT_EQUAL(3, gossip.version());
+}
+
+/*
+ * Nodes pull a newer image over loopback and boot it once verified, the
+ * last from a node that pulled it rather than the seed
+ */
+static bool gossip_run(OTAGossipNode **nodes, int count, OTAGossipNode *done) {
+  const unsigned long TIMEOUT = 2 * OTAGossipNode::ADVERT_INTERVAL +
+                                HTTP_TIMEOUT_MS;
+  unsigned long start = http_ms();
+  while (!done->complete() && http_ms() - start < TIMEOUT) {
+    for (int i = 0; i < count; i++) {
+      nodes[i]->handle();
+    }
+  }
+  return done->complete();
+}
+
+void test_ota_gossip_nodes() {
+  const uint32_t SIZE = 20 * OTAGossip::CHUNK_SIZE + 100;
+  const uint32_t OLD_SIZE = SIZE - 5000;
+  const size_t CAPACITY = 24 * FileFlash::PAGE_SIZE;
+  const uint32_t LOOPBACK = htonl(INADDR_LOOPBACK);
+  uint8_t sha256[SHA256_DIGEST_SIZE];
+  uint8_t oldSha256[SHA256_DIGEST_SIZE];
+  uint8_t *image = ota_image(SIZE, sha256);
+  uint8_t *old = firmware_image(OLD_SIZE, oldSha256);
+
+  FileFlash running0(CAPACITY), running1(CAPACITY), running2(CAPACITY);
+  FileFlash update0(CAPACITY), update1(CAPACITY), update2(CAPACITY);
+  running0.write(0, image, SIZE);
+  running1.write(0, old, OLD_SIZE);
+  running2.write(0, old, OLD_SIZE);
+  OTAGossipNode seed(&running0, &update0, 0);
+  OTAGossipNode first(&running1, &update1, 0);
+  OTAGossipNode last(&running2, &update2, 0);
+  TEST_ASSERT_TRUE(seed.begin(2, SIZE, 1));
+  TEST_ASSERT_TRUE(first.begin(1, OLD_SIZE, 2));
+  TEST_ASSERT_TRUE(last.begin(1, OLD_SIZE, 3));
+  TEST_ASSERT_EQUAL(2, seed.gossip()->version());
+  TEST_ASSERT_FALSE(first.gossip()->downloading());
+
+  /* The seed and the last node only hear of each other through the first */
+  seed.setBroadcast(false);
+  first.setBroadcast(false);
+  last.setBroadcast(false);
+  seed.addPeer(LOOPBACK, first.port());
+  first.addPeer(LOOPBACK, seed.port());
+  first.addPeer(LOOPBACK, last.port());
+  last.addPeer(LOOPBACK, first.port());
+
+  OTAGossipNode *pair[] = { &seed, &first };
+  TEST_ASSERT_TRUE(gossip_run(pair, 2, &first));
+  TEST_ASSERT_FALSE(seed.complete());
+  TEST_ASSERT_FALSE(update0.activated);
+  seed.stop();
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  OTAGossipNode *rest[] = { &first, &last };
+  TEST_ASSERT_TRUE(gossip_run(rest, 2, &last));
+  double ms = elapsed_ms(&start);
+
+  OTAGossipNode *pulled[] = { &first, &last };
+  FileFlash *updates[] = { &update1, &update2 };
+  for (int i = 0; i < 2; i++) {
+    TEST_ASSERT_TRUE(updates[i]->activated);
+    TEST_ASSERT_TRUE(flash_matches(updates[i], image, SIZE));
+    TEST_ASSERT_EQUAL(2, pulled[i]->gossip()->version());
+    TEST_ASSERT_EQUAL(21, pulled[i]->chunksReceived());
+    TEST_ASSERT_EQUAL(0, pulled[i]->failures());
+  }
+  TEST_ASSERT_EQUAL(21, seed.chunksSent());
+  TEST_ASSERT_EQUAL(21, first.chunksSent());
+
+  char msg[120];
+  snprintf(msg, sizeof (msg), "%u byte image passed on by the first node "
+           "in %.0f ms", (unsigned)SIZE, ms);
+  TEST_MESSAGE(msg);
+  free(image);
+  free(old);
+}
+
+/* Fleet-wide completion time against one server as the fleet grows */
+void test_ota_gossip_simulated() {
+  const uint32_t SIZE = 256 * 1024;
+  const uint32_t RATE = 256 * 1024;
+  const unsigned long LIMIT = 1000 * 1000;
+  const size_t COUNTS[] = { 10, 30, 100, 300 };
+  const int RUNS = sizeof (COUNTS) / sizeof (COUNTS[0]);
+  unsigned long central[RUNS];
+  unsigned long gossip[RUNS];
+
+  for (int i = 0; i < RUNS; i++) {
+    GossipSimulator server(COUNTS[i], SIZE, RATE, false);
+    central[i] = server.run(LIMIT);
+    GossipSimulator fleet(COUNTS[i], SIZE, RATE, true);
+    gossip[i] = fleet.run(LIMIT);
+    TEST_ASSERT_TRUE(central[i] > 0);
+    TEST_ASSERT_TRUE(gossip[i] > 0);
+
+    char msg[120];
+    snprintf(msg, sizeof (msg), "%3u nodes, %u KB at %u KB/s: one server "
+             "%6.1f s, gossip %5.1f s (%u busy)", (unsigned)COUNTS[i],
+             (unsigned)(SIZE / 1024), (unsigned)(RATE / 1024),
+             central[i] / 1000.0, gossip[i] / 1000.0,
+             (unsigned)fleet.busy());
+    TEST_MESSAGE(msg);
+  }
+
+  /* One server grows linearly with the fleet, gossip far more slowly */
+  TEST_ASSERT_TRUE(gossip[RUNS - 1] * 10 < central[RUNS - 1]);
+  TEST_ASSERT_TRUE(gossip[RUNS - 1] < 5 * gossip[1]);
+}
+
+/* Build a query for the name, returning its length */
+static size_t dns_query(uint8_t *packet, uint16_t id, const char *name,
+                        uint16_t type) {
+  size_t offset = 12;
+  memset(packet, 0, offset);
+  packet[0] = id >> 8;
+  packet[1] = id;
+  packet[2] = 0x01;  // Recursion desired
+  packet[5] = 1;     // One question
+
+  while (*name) {
+    const char *dot = strchr(name, '.');
+    size_t length = dot ? (size_t)(dot - name) : strlen(name);
+    packet[offset++] = length;
+    memcpy(&packet[offset], name, length);
+    offset += length;
+    name += length + (dot ? 1 : 0);
+  }
+  packet[offset++] = 0;
+  packet[offset++] = type >> 8;
+  packet[offset++] = type;
+  packet[offset++] = 0;
+  packet[offset++] = 1;  // IN
+  return offset;
+}
+
+/* Send a query to the portal and let it answer, returning the answer length */
+static int dns_exchange(WiFiPortal *portal, int fd, const uint8_t *query,
+                        size_t length, uint8_t *answer) {
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(portal->port());
+  sendto(fd, query, length, 0, (struct sockaddr *)&addr, sizeof (addr));
+
+  for (int i = 0; i < 100; i++) {
+    portal->handle();
+    int result = recv(fd, answer, WiFiPortal::MAX_PACKET, MSG_DONTWAIT);
+    if (result > 0) {
+      return result;
+    }
+    usleep(1000);
+  }
+  return 0;
+}
+
+/* Every A query is answered with the access point's address */
+void test_portal_dns() {
+  const uint8_t AP_IP[4] = { 192, 168, 4, 1 };
+  uint32_t ip;
+  memcpy(&ip, AP_IP, sizeof (ip));
+
+  WiFiPortal portal(0);
+  TEST_ASSERT_FALSE(portal.active());
+  TEST_ASSERT_TRUE(portal.begin(ip));
+  TEST_ASSERT_TRUE(portal.active());
+
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  uint8_t query[WiFiPortal::MAX_PACKET], answer[WiFiPortal::MAX_PACKET];
+
+  size_t length = dns_query(query, 0x1234, "connectivitycheck.gstatic.com", 1);
+  int result = dns_exchange(&portal, fd, query, length, answer);
+  TEST_ASSERT_EQUAL(length + 16, result);
+  TEST_ASSERT_EQUAL_MEMORY(query, answer, 2);       // ID
+  TEST_ASSERT_EQUAL(0x85, answer[2]);               // Answer, authoritative, RD
+  TEST_ASSERT_EQUAL(0, answer[3] & 0x0F);           // No error
+  TEST_ASSERT_EQUAL(1, answer[5]);
+  TEST_ASSERT_EQUAL(1, answer[7]);
+  TEST_ASSERT_EQUAL_MEMORY(query + 12, answer + 12, length - 12);
+  TEST_ASSERT_EQUAL(0xC0, answer[length]);          // Pointer to the name
+  TEST_ASSERT_EQUAL(12, answer[length + 1]);
+  TEST_ASSERT_EQUAL(1, answer[length + 3]);         // A
+  TEST_ASSERT_EQUAL(4, answer[length + 11]);
+  TEST_ASSERT_EQUAL_MEMORY(AP_IP, answer + length + 12, 4);
+
+  /* Others are answered without an address, so IPv4 is used */
+  length = dns_query(query, 0x5678, "captive.apple.com", 28);
+  result = dns_exchange(&portal, fd, query, length, answer);
+  TEST_ASSERT_EQUAL(length, result);
+  TEST_ASSERT_EQUAL(0, answer[3] & 0x0F);
+  TEST_ASSERT_EQUAL(0, answer[7]);
+
+  /* Answers, truncated names and other opcodes are dropped */
+  length = dns_query(query, 1, "example.com", 1);
+  query[2] |= 0x80;
+  TEST_ASSERT_EQUAL(0, dns_exchange(&portal, fd, query, length, answer));
+  query[2] = 0x01;
+  TEST_ASSERT_EQUAL(0, dns_exchange(&portal, fd, query, 16, answer));
+  query[2] = 0x01 | (2 << 3);
+  TEST_ASSERT_EQUAL(0, dns_exchange(&portal, fd, query, length, answer));
+  TEST_ASSERT_EQUAL(2, portal.queries());
+
+  /* Requests for any other host are captured */
+  TEST_ASSERT_EQUAL_STRING("http://192.168.4.1/", portal.location());
+  TEST_ASSERT_TRUE(portal.captures("connectivitycheck.gstatic.com"));
+  TEST_ASSERT_TRUE(portal.captures("192.168.4.10"));
+  TEST_ASSERT_FALSE(portal.captures("192.168.4.1"));
+  TEST_ASSERT_FALSE(portal.captures("192.168.4.1:80"));
+  TEST_ASSERT_FALSE(portal.captures(""));
+  TEST_ASSERT_FALSE(portal.captures(nullptr));
+
+  portal.stop();
+  TEST_ASSERT_FALSE(portal.active());
+  TEST_ASSERT_FALSE(portal.captures("example.com"));
+  close(fd);
+
+  char msg[80];
+  snprintf(msg, sizeof (msg), "portal state %u bytes, %u byte packet on "
+           "the stack", (unsigned)sizeof (WiFiPortal),
+           (unsigned)WiFiPortal::MAX_PACKET);
+  TEST_MESSAGE(msg);
+}
+
+/* Poll the uplink every 100ms until it reports a change, or the time is up */
+static bool run_uplink(WiFiUplink *uplink, MockWiFiDriver *driver,
+                       struct network *nets, uint8_t count, unsigned long ms) {
+  for (unsigned long end = driver->now + ms; driver->now < end;
+       driver->advance(100)) {
+    if (uplink->poll(nets, count, driver->now)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* The access point starts where the upstream is expected, so it isn't moved */
+void test_uplink_channel() {
+  mock_ap_t aps[NUM_TEST_APS];
+  memcpy(aps, testAps, sizeof (aps));
+  MockWiFiDriver driver(aps, NUM_TEST_APS);
+  WiFiConnector connector(&driver);
+  connector.setPenalties(true);
+  WiFiUplink uplink(&driver, &connector);
+  WiFiScanCache cache;
+  struct network nets[2];
+  init_network(&nets[0], "office", "officepw");
+  init_network(&nets[1], "home", "homepw");
+
+  TEST_ASSERT_EQUAL(WiFiUplink::DEFAULT_CHANNEL,
+                    WiFiUplink::chooseChannel(nets, 2));
+  nets[1].lastChannel = 6;
+  TEST_ASSERT_EQUAL(6, WiFiUplink::chooseChannel(nets, 2));
+  TEST_ASSERT_EQUAL(6, WiFiUplink::chooseChannel(nets, 2, &cache));
+
+  /* A network seen by a scan wins over one remembered */
+  TEST_ASSERT_TRUE(cache.start(&driver));
+  driver.advance(13 * 300);
+  TEST_ASSERT_TRUE(cache.poll(&driver, driver.now));
+  uint8_t channel = WiFiUplink::chooseChannel(nets, 2, &cache);
+  TEST_ASSERT_EQUAL(11, channel);
+
+  TEST_ASSERT_TRUE(uplink.startAccessPoint("hub", "hubpw", channel));
+  TEST_ASSERT_TRUE(uplink.accessPointActive());
+  TEST_ASSERT_EQUAL(11, uplink.channel());
+  TEST_ASSERT_EQUAL(WFB_UPLINK_OFF, uplink.state());
+  TEST_ASSERT_FALSE(uplink.poll(nets, 2, driver.now));
+  TEST_ASSERT_EQUAL(0, driver.numAttempts);
+
+  uplink.begin(driver.now);
+  TEST_ASSERT_EQUAL(WFB_UPLINK_WAITING, uplink.state());
+  TEST_ASSERT_TRUE(run_uplink(&uplink, &driver, nets, 2, 10000));
+  TEST_ASSERT_EQUAL(WFB_UPLINK_CONNECTED, uplink.state());
+  TEST_ASSERT_EQUAL(0, uplink.index());
+  TEST_ASSERT_EQUAL(11, uplink.channel());
+  TEST_ASSERT_EQUAL(0, uplink.channelMoves());
+
+  /* The attempt is recorded against the network as a blocking connect is */
+  TEST_ASSERT_TRUE(nets[0].cache.valid);
+  TEST_ASSERT_EQUAL(1, nets[0].stats.successes);
+  TEST_ASSERT_EQUAL(1, nets[0].history.count);
+
+  /* Joining an upstream elsewhere takes the access point with it */
+  aps[1].present = false;
+  driver.drop();
+  TEST_ASSERT_TRUE(run_uplink(&uplink, &driver, nets, 2, 1000));
+  TEST_ASSERT_EQUAL(WFB_UPLINK_WAITING, uplink.state());
+  TEST_ASSERT_TRUE(run_uplink(&uplink, &driver, nets, 2, 10000));
+  TEST_ASSERT_EQUAL(WFB_UPLINK_CONNECTED, uplink.state());
+  TEST_ASSERT_EQUAL(1, uplink.index());
+  TEST_ASSERT_EQUAL(6, uplink.channel());
+  TEST_ASSERT_EQUAL(1, uplink.channelMoves());
+  TEST_ASSERT_EQUAL(WFB_FAIL_NO_SSID, nets[0].lastFailure);
+  TEST_ASSERT_TRUE(connector.penalized(&nets[0]));
+  TEST_ASSERT_EQUAL(1, driver.apStarts);
+  TEST_ASSERT_EQUAL(0, driver.apStops);
+
+  free_network(&nets[0]);
+  free_network(&nets[1]);
+}
+
+/* The station is maintained in the background without dropping the AP */
+void test_uplink_reconnect() {
+  mock_ap_t aps[NUM_TEST_APS];
+  memcpy(aps, testAps, sizeof (aps));
+  aps[0].present = false;
+  aps[1].present = false;
+  MockWiFiDriver driver(aps, NUM_TEST_APS);
+  WiFiConnector connector(&driver);
+  WiFiUplink uplink(&driver, &connector);
+  struct network net;
+  init_network(&net, "home", "homepw");
+
+  TEST_ASSERT_TRUE(uplink.startAccessPoint("hub", "hubpw", 0));
+  TEST_ASSERT_EQUAL(WiFiUplink::DEFAULT_CHANNEL, uplink.channel());
+  uplink.begin(driver.now);
+
+  /* With nothing upstream attempts back off, keeping sweeps rare */
+  unsigned long start = driver.now;
+  TEST_ASSERT_FALSE(run_uplink(&uplink, &driver, &net, 1, 30 * 60 * 1000UL));
+  unsigned long elapsed = driver.now - start;
+  TEST_ASSERT_GREATER_OR_EQUAL(5, uplink.attempts());
+  TEST_ASSERT_LESS_OR_EQUAL(16, uplink.attempts());
+  TEST_ASSERT_LESS_THAN(elapsed / 100, driver.apSweepMs);
+  TEST_ASSERT_FALSE(uplink.forwarding());
+  TEST_ASSERT_TRUE(driver.apActive);
+  TEST_ASSERT_EQUAL(1, driver.apStarts);
+  TEST_ASSERT_EQUAL(0, driver.apStops);
+
+  char msg[96];
+  snprintf(msg, sizeof (msg), "%u attempts in %lu min, radio away from the "
+           "AP %.2f%% of the time", (unsigned)uplink.attempts(),
+           elapsed / 60000, driver.apSweepMs * 100.0 / elapsed);
+  TEST_MESSAGE(msg);
+
+  /* The upstream is joined once it returns, forwarding from the AP */
+  aps[0].present = true;
+  TEST_ASSERT_TRUE(run_uplink(&uplink, &driver, &net, 1,
+                              2 * WiFiConnector::DEFAULT_PENALTY_MAX));
+  TEST_ASSERT_EQUAL(WFB_UPLINK_CONNECTED, uplink.state());
+  TEST_ASSERT_TRUE(uplink.forwarding());
+  TEST_ASSERT_TRUE(driver.forwarding);
+  TEST_ASSERT_EQUAL(6, uplink.channel());
+
+  /* A lost upstream is retried at once, and the AP is left alone */
+  driver.drop();
+  TEST_ASSERT_TRUE(run_uplink(&uplink, &driver, &net, 1, 1000));
+  TEST_ASSERT_EQUAL(WFB_UPLINK_WAITING, uplink.state());
+  TEST_ASSERT_FALSE(driver.forwarding);
+  unsigned long lost = driver.now;
+  TEST_ASSERT_TRUE(run_uplink(&uplink, &driver, &net, 1, 10000));
+  TEST_ASSERT_EQUAL(WFB_UPLINK_CONNECTED, uplink.state());
+  TEST_ASSERT_LESS_OR_EQUAL(3100, driver.now - lost);
+  TEST_ASSERT_TRUE(driver.forwarding);
+  TEST_ASSERT_EQUAL(1, driver.apStarts);
+  TEST_ASSERT_EQUAL(0, driver.apStops);
+
+  /* An attempt abandoned for another connect is retried after it */
+  driver.drop();
+  TEST_ASSERT_TRUE(run_uplink(&uplink, &driver, &net, 1, 1000));
+  uplink.poll(&net, 1, driver.now);
+  TEST_ASSERT_EQUAL(WFB_UPLINK_CONNECTING, uplink.state());
+  uint32_t attempts = uplink.attempts();
+  uplink.defer(driver.now);
+  TEST_ASSERT_EQUAL(WFB_UPLINK_WAITING, uplink.state());
+  TEST_ASSERT_EQUAL(WiFiUplink::INDEX_NONE, uplink.index());
+  TEST_ASSERT_EQUAL(0, uplink.retryIn(driver.now));
+  uplink.poll(&net, 1, driver.now);
+  TEST_ASSERT_EQUAL(WFB_UPLINK_CONNECTING, uplink.state());
+  TEST_ASSERT_EQUAL(attempts + 1, uplink.attempts());
+  TEST_ASSERT_TRUE(run_uplink(&uplink, &driver, &net, 1, 10000));
+
+  /* Stopping the AP stops forwarding, and the station carries on */
+  uplink.stopAccessPoint();
+  TEST_ASSERT_FALSE(uplink.accessPointActive());
+  TEST_ASSERT_FALSE(uplink.forwarding());
+  TEST_ASSERT_FALSE(driver.forwarding);
+  TEST_ASSERT_EQUAL(1, driver.apStops);
+  TEST_ASSERT_EQUAL(0, uplink.channel());
+  TEST_ASSERT_EQUAL(WFB_UPLINK_CONNECTED, uplink.state());
+  uplink.end();
+  TEST_ASSERT_EQUAL(WFB_UPLINK_OFF, uplink.state());
+  TEST_ASSERT_FALSE(uplink.poll(&net, 1, driver.now));
+  TEST_ASSERT_EQUAL_STRING("off", WiFiUplink::stateString(uplink.state()));
+
+  /* Without NAPT support the station is still maintained */
+  driver.napt = false;
+  TEST_ASSERT_TRUE(uplink.startAccessPoint("hub", "hubpw", 0));
+  uplink.begin(driver.now);
+  TEST_ASSERT_EQUAL(WFB_UPLINK_CONNECTED, uplink.state());
+  TEST_ASSERT_FALSE(uplink.forwarding());
+  driver.drop();
+  TEST_ASSERT_TRUE(run_uplink(&uplink, &driver, &net, 1, 1000));
+  TEST_ASSERT_TRUE(run_uplink(&uplink, &driver, &net, 1, 10000));
+  TEST_ASSERT_EQUAL(WFB_UPLINK_CONNECTED, uplink.state());
+  TEST_ASSERT_FALSE(uplink.forwarding());
+
+  free_network(&net);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+
+  RUN_TEST(test_cache_recorded);
+  RUN_TEST(test_cache_fast_reconnect);
+  RUN_TEST(test_cache_fallback);
+  RUN_TEST(test_cache_disabled);
+  RUN_TEST(test_connect_known_order);
+  RUN_TEST(test_classify_failures);
+  RUN_TEST(test_failure_recorded);
+  RUN_TEST(test_fail_fast_stale_status);
+  RUN_TEST(test_connect_while_connected);
+  RUN_TEST(test_fail_fast_time_saved);
+  RUN_TEST(test_adaptive_timeout_learned);
+  RUN_TEST(test_adaptive_timeout_reset);
+  RUN_TEST(test_adaptive_startup_budget);
+  RUN_TEST(test_penalty_default_off);
+  RUN_TEST(test_penalty_skip);
+  RUN_TEST(test_penalty_backoff);
+  RUN_TEST(test_penalty_decay);
+  RUN_TEST(test_roam_strong_no_scan);
+  RUN_TEST(test_roam_fading_scan);
+  RUN_TEST(test_roam_candidate_selection);
+  RUN_TEST(test_roam_directed_connect);
+  RUN_TEST(test_roam_start_connect);
+  RUN_TEST(test_scan_plan_order);
+  RUN_TEST(test_scan_connect_targeted);
+  RUN_TEST(test_scan_connect_fallback);
+  RUN_TEST(test_scan_time_to_first_match);
+  RUN_TEST(test_scan_cache_async);
+  RUN_TEST(test_scan_cache_connect);
+  RUN_TEST(test_connect_jobs);
+  RUN_TEST(test_connect_jobs_failure);
+  RUN_TEST(test_connect_jobs_while_connected);
+  RUN_TEST(test_json_structure);
+  RUN_TEST(test_json_escaping);
+  RUN_TEST(test_json_chunked);
+  RUN_TEST(test_json_raw_members);
+  RUN_TEST(test_metrics_format);
+  RUN_TEST(test_metrics_connect_stats);
+  RUN_TEST(test_metrics_connected_time);
+  RUN_TEST(test_service_schedule);
+  RUN_TEST(test_service_latency);
+  RUN_TEST(test_json_scan_benchmark);
+  RUN_TEST(test_server_routes);
+  RUN_TEST(test_server_keepalive);
+  RUN_TEST(test_server_clients);
+  RUN_TEST(test_server_chunked);
+  RUN_TEST(test_server_benchmark);
+  RUN_TEST(test_server_subscribe);
+  RUN_TEST(test_events_deltas);
+  RUN_TEST(test_events_bandwidth);
+  RUN_TEST(test_response_cache);
+  RUN_TEST(test_server_etag);
+  RUN_TEST(test_sha256_vectors);
+  RUN_TEST(test_sha256_restore);
+  RUN_TEST(test_ota_receive);
+  RUN_TEST(test_ota_refuse_partial);
+  RUN_TEST(test_ota_server);
+  RUN_TEST(test_ota_throughput);
+  RUN_TEST(test_ota_hub_fanout);
+  RUN_TEST(test_ota_hub_late_join);
+  RUN_TEST(test_ota_delta);
+  RUN_TEST(test_ota_delta_refused);
+  RUN_TEST(test_ota_delta_server);
+  RUN_TEST(test_ota_lzss);
+  RUN_TEST(test_ota_lzss_refused);
+  RUN_TEST(test_ota_lzss_benchmark);
+  RUN_TEST(test_ota_resume_restart);
+  RUN_TEST(test_ota_resume_server);
+  RUN_TEST(test_ota_gossip_rarest);
+  RUN_TEST(test_ota_gossip_nodes);
+  RUN_TEST(test_ota_gossip_simulated);
+  RUN_TEST(test_portal_dns);
+  RUN_TEST(test_uplink_channel);
+  RUN_TEST(test_uplink_reconnect);
+
+  return UNITY_END();
+}